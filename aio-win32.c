@@ -31,6 +31,14 @@ struct AioHandler {
     QLIST_ENTRY(AioHandler) node;
 };
 
+void aio_context_setup(AioContext *ctx)
+{
+}
+
+void aio_context_cleanup(AioContext *ctx)
+{
+}
+
 void aio_set_fd_handler(AioContext *ctx,
                         int fd,
                         IOHandler *io_read,
@@ -21,9 +21,16 @@
 #include "block/blockjob.h"
 #include "qemu/ratelimit.h"
 
-#define BACKUP_CLUSTER_BITS 16
-#define BACKUP_CLUSTER_SIZE (1 << BACKUP_CLUSTER_BITS)
-#define BACKUP_SECTORS_PER_CLUSTER (BACKUP_CLUSTER_SIZE / BDRV_SECTOR_SIZE)
+/* The job copies whole clusters, which are at least this large and no
+ * smaller than the clusters of the target.
+ */
+#define BACKUP_CLUSTER_SIZE_DEFAULT (1 << 16)
+
+/* Adjacent clusters are read and written together up to this size */
+#define BACKUP_MAX_COPY_BYTES (1 << 20)
+
+/* Number of coroutines copying data in the background */
+#define BACKUP_MAX_WORKERS 8
 
 #define SLICE_TIME 100000000ULL /* ns */
 
@@ -40,6 +47,8 @@ typedef struct BackupBlockJob {
     /* bitmap for sync=dirty-bitmap */
     BdrvDirtyBitmap *sync_bitmap;
     MirrorSyncMode sync_mode;
+    /* true if the target was created for this job and reads as zeroes */
+    bool target_is_new;
     RateLimit limit;
     BlockdevOnError on_source_error;
     BlockdevOnError on_target_error;
@@ -47,8 +56,25 @@ typedef struct BackupBlockJob {
     uint64_t sectors_read;
     HBitmap *bitmap;
     QLIST_HEAD(, CowRequest) inflight_reqs;
+
+    int64_t cluster_size;
+    int sectors_per_cluster;
+    int max_copy_clusters;
+
+    /* Background copy workers */
+    int workers_in_flight;
+    bool waiting_for_worker;
+    int worker_ret;
+    bool worker_error_is_read;
+    int64_t worker_error_cluster;
 } BackupBlockJob;
 
+typedef struct BackupWorker {
+    BackupBlockJob *job;
+    int64_t cluster;
+    int nb_clusters;
+} BackupWorker;
+
 /* See if in-flight requests overlap and wait for them to complete */
 static void coroutine_fn wait_for_overlapping_requests(BackupBlockJob *job,
                                                        int64_t start,
@@ -86,87 +112,132 @@ static void cow_request_end(CowRequest *req)
     qemu_co_queue_restart_all(&req->wait_queue);
 }
 
+/* Copy @nb_clusters clusters starting at @cluster with a single read.
+ * Runs of clusters that read as zeroes are written with write_zeroes.
+ */
+static int coroutine_fn backup_copy_clusters(BackupBlockJob *job,
+                                             int64_t cluster, int nb_clusters,
+                                             void *bounce_buffer,
+                                             bool *error_is_read)
+{
+    BlockDriverState *bs = job->common.bs;
+    int64_t sector_num = cluster * job->sectors_per_cluster;
+    int64_t total_sectors = job->common.len / BDRV_SECTOR_SIZE;
+    struct iovec iov;
+    QEMUIOVector qiov;
+    int nb_sectors, i, n;
+    int ret;
+
+    nb_sectors = MIN(nb_clusters * job->sectors_per_cluster,
+                     total_sectors - sector_num);
+
+    iov.iov_base = bounce_buffer;
+    iov.iov_len = nb_sectors * BDRV_SECTOR_SIZE;
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    ret = bdrv_co_readv(bs, sector_num, nb_sectors, &qiov);
+    if (ret < 0) {
+        trace_backup_do_cow_read_fail(job, cluster, ret);
+        if (error_is_read) {
+            *error_is_read = true;
+        }
+        return ret;
+    }
+
+    for (i = 0; i < nb_sectors; i += n) {
+        uint8_t *buf = (uint8_t *)bounce_buffer + i * BDRV_SECTOR_SIZE;
+        bool zero;
+
+        /* Find the run of clusters with the same zero-ness as this one */
+        n = MIN(job->sectors_per_cluster, nb_sectors - i);
+        zero = buffer_is_zero(buf, n * BDRV_SECTOR_SIZE);
+        while (i + n < nb_sectors) {
+            int next = MIN(job->sectors_per_cluster, nb_sectors - i - n);
+
+            if (buffer_is_zero(buf + n * BDRV_SECTOR_SIZE,
+                               next * BDRV_SECTOR_SIZE) != zero) {
+                break;
+            }
+            n += next;
+        }
+
+        if (zero) {
+            ret = bdrv_co_write_zeroes(job->target, sector_num + i, n,
+                                       BDRV_REQ_MAY_UNMAP);
+        } else {
+            QEMUIOVector write_qiov;
+
+            iov.iov_base = buf;
+            iov.iov_len = n * BDRV_SECTOR_SIZE;
+            qemu_iovec_init_external(&write_qiov, &iov, 1);
+            ret = bdrv_co_writev(job->target, sector_num + i, n, &write_qiov);
+        }
+        if (ret < 0) {
+            trace_backup_do_cow_write_fail(job, cluster, ret);
+            if (error_is_read) {
+                *error_is_read = false;
+            }
+            return ret;
+        }
+    }
+
+    hbitmap_set(job->bitmap, cluster, nb_clusters);
+
+    /* Publish progress, guest I/O counts as progress too.  Note that the
+     * offset field is an opaque progress value, it is not a disk offset.
+     */
+    job->sectors_read += nb_sectors;
+    job->common.offset += nb_sectors * BDRV_SECTOR_SIZE;
+    return 0;
+}
+
 static int coroutine_fn backup_do_cow(BlockDriverState *bs,
                                       int64_t sector_num, int nb_sectors,
                                       bool *error_is_read)
 {
     BackupBlockJob *job = (BackupBlockJob *)bs->job;
     CowRequest cow_request;
-    struct iovec iov;
-    QEMUIOVector bounce_qiov;
-    void *bounce_buffer = NULL;
+    void *bounce_buffer;
     int ret = 0;
     int64_t start, end;
     int n;
 
     qemu_co_rwlock_rdlock(&job->flush_rwlock);
 
-    start = sector_num / BACKUP_SECTORS_PER_CLUSTER;
-    end = DIV_ROUND_UP(sector_num + nb_sectors, BACKUP_SECTORS_PER_CLUSTER);
+    start = sector_num / job->sectors_per_cluster;
+    end = DIV_ROUND_UP(sector_num + nb_sectors, job->sectors_per_cluster);
 
     trace_backup_do_cow_enter(job, start, sector_num, nb_sectors);
 
     wait_for_overlapping_requests(job, start, end);
     cow_request_begin(&cow_request, job, start, end);
 
-    for (; start < end; start++) {
+    for (; start < end; start += n) {
         if (hbitmap_get(job->bitmap, start)) {
             trace_backup_do_cow_skip(job, start);
+            n = 1;
             continue; /* already copied */
         }
 
-        trace_backup_do_cow_process(job, start);
-
-        n = MIN(BACKUP_SECTORS_PER_CLUSTER,
-                job->common.len / BDRV_SECTOR_SIZE -
-                start * BACKUP_SECTORS_PER_CLUSTER);
-
-        if (!bounce_buffer) {
-            bounce_buffer = qemu_blockalign(bs, BACKUP_CLUSTER_SIZE);
-        }
-        iov.iov_base = bounce_buffer;
-        iov.iov_len = n * BDRV_SECTOR_SIZE;
-        qemu_iovec_init_external(&bounce_qiov, &iov, 1);
-
-        ret = bdrv_co_readv(bs, start * BACKUP_SECTORS_PER_CLUSTER, n,
-                            &bounce_qiov);
-        if (ret < 0) {
-            trace_backup_do_cow_read_fail(job, start, ret);
-            if (error_is_read) {
-                *error_is_read = true;
-            }
-            goto out;
-        }
-
-        if (buffer_is_zero(iov.iov_base, iov.iov_len)) {
-            ret = bdrv_co_write_zeroes(job->target,
-                                       start * BACKUP_SECTORS_PER_CLUSTER,
-                                       n, BDRV_REQ_MAY_UNMAP);
-        } else {
-            ret = bdrv_co_writev(job->target,
-                                 start * BACKUP_SECTORS_PER_CLUSTER, n,
-                                 &bounce_qiov);
-        }
-        if (ret < 0) {
-            trace_backup_do_cow_write_fail(job, start, ret);
-            if (error_is_read) {
-                *error_is_read = false;
+        /* Batch the adjacent clusters that have not been copied yet */
+        for (n = 1; n < job->max_copy_clusters && start + n < end; n++) {
+            if (hbitmap_get(job->bitmap, start + n)) {
+                break;
             }
-            goto out;
         }
 
-        hbitmap_set(job->bitmap, start, 1);
+        trace_backup_do_cow_process(job, start, n);
 
-        /* Publish progress, guest I/O counts as progress too.  Note that the
-         * offset field is an opaque progress value, it is not a disk offset.
+        /* Most guest writes only touch a cluster or two, so do not pay for
+         * a max_copy_clusters buffer on every copy-on-write.
          */
-        job->sectors_read += n;
-        job->common.offset += n * BDRV_SECTOR_SIZE;
-    }
-
-out:
-    if (bounce_buffer) {
+        bounce_buffer = qemu_blockalign(bs, n * job->cluster_size);
+        ret = backup_copy_clusters(job, start, n, bounce_buffer,
+                                   error_is_read);
         qemu_vfree(bounce_buffer);
+        if (ret < 0) {
+            break;
+        }
     }
 
     cow_request_end(&cow_request);
@@ -283,52 +354,222 @@ static int coroutine_fn backup_run_incremental(BackupBlockJob *job)
     HBitmapIter hbi;
 
     granularity = bdrv_dirty_bitmap_granularity(job->sync_bitmap);
-    clusters_per_iter = MAX((granularity / BACKUP_CLUSTER_SIZE), 1);
+    clusters_per_iter = MAX((granularity / job->cluster_size), 1);
     bdrv_dirty_iter_init(job->sync_bitmap, &hbi);
 
     /* Find the next dirty sector(s) */
     while ((sector = hbitmap_iter_next(&hbi)) != -1) {
-        cluster = sector / BACKUP_SECTORS_PER_CLUSTER;
+        cluster = sector / job->sectors_per_cluster;
 
         /* Fake progress updates for any clusters we skipped */
         if (cluster != last_cluster + 1) {
             job->common.offset += ((cluster - last_cluster - 1) *
-                                   BACKUP_CLUSTER_SIZE);
+                                   job->cluster_size);
         }
 
-        for (end = cluster + clusters_per_iter; cluster < end; cluster++) {
-            do {
-                if (yield_and_check(job)) {
-                    return ret;
-                }
-                ret = backup_do_cow(bs, cluster * BACKUP_SECTORS_PER_CLUSTER,
-                                    BACKUP_SECTORS_PER_CLUSTER, &error_is_read);
-                if ((ret < 0) &&
-                    backup_error_action(job, error_is_read, -ret) ==
-                    BLOCK_ERROR_ACTION_REPORT) {
-                    return ret;
-                }
-            } while (ret < 0);
-        }
+        do {
+            if (yield_and_check(job)) {
+                return ret;
+            }
+            ret = backup_do_cow(bs, cluster * job->sectors_per_cluster,
+                                clusters_per_iter * job->sectors_per_cluster,
+                                &error_is_read);
+            if ((ret < 0) &&
+                backup_error_action(job, error_is_read, -ret) ==
+                BLOCK_ERROR_ACTION_REPORT) {
+                return ret;
+            }
+        } while (ret < 0);
+        cluster += clusters_per_iter;
 
         /* If the bitmap granularity is smaller than the backup granularity,
          * we need to advance the iterator pointer to the next cluster. */
-        if (granularity < BACKUP_CLUSTER_SIZE) {
-            bdrv_set_dirty_iter(&hbi, cluster * BACKUP_SECTORS_PER_CLUSTER);
+        if (granularity < job->cluster_size) {
+            bdrv_set_dirty_iter(&hbi, cluster * job->sectors_per_cluster);
         }
 
         last_cluster = cluster - 1;
     }
 
     /* Play some final catchup with the progress meter */
-    end = DIV_ROUND_UP(job->common.len, BACKUP_CLUSTER_SIZE);
+    end = DIV_ROUND_UP(job->common.len, job->cluster_size);
     if (last_cluster + 1 < end) {
-        job->common.offset += ((end - last_cluster - 1) * BACKUP_CLUSTER_SIZE);
+        job->common.offset += ((end - last_cluster - 1) * job->cluster_size);
     }
 
     return ret;
 }
 
+static void coroutine_fn backup_worker_entry(void *opaque)
+{
+    BackupWorker *worker = opaque;
+    BackupBlockJob *job = worker->job;
+    bool error_is_read;
+    int ret;
+
+    ret = backup_do_cow(job->common.bs,
+                        worker->cluster * job->sectors_per_cluster,
+                        worker->nb_clusters * job->sectors_per_cluster,
+                        &error_is_read);
+
+    /* Remember the first failed cluster, the job retries from there */
+    if (ret < 0 && (job->worker_ret == 0 ||
+                    worker->cluster < job->worker_error_cluster)) {
+        job->worker_ret = ret;
+        job->worker_error_is_read = error_is_read;
+        job->worker_error_cluster = worker->cluster;
+    }
+
+    job->workers_in_flight--;
+    g_free(worker);
+
+    if (job->waiting_for_worker) {
+        qemu_coroutine_enter(job->common.co, NULL);
+    }
+}
+
+static void coroutine_fn backup_wait_for_worker(BackupBlockJob *job)
+{
+    assert(!job->waiting_for_worker);
+    job->waiting_for_worker = true;
+    qemu_coroutine_yield();
+    job->waiting_for_worker = false;
+}
+
+static void coroutine_fn backup_drain_workers(BackupBlockJob *job)
+{
+    while (job->workers_in_flight > 0) {
+        backup_wait_for_worker(job);
+    }
+}
+
+static void coroutine_fn backup_start_worker(BackupBlockJob *job,
+                                             int64_t cluster, int nb_clusters)
+{
+    BackupWorker *worker;
+    Coroutine *co;
+
+    while (job->workers_in_flight >= BACKUP_MAX_WORKERS) {
+        backup_wait_for_worker(job);
+    }
+
+    worker = g_new(BackupWorker, 1);
+    worker->job = job;
+    worker->cluster = cluster;
+    worker->nb_clusters = nb_clusters;
+
+    job->workers_in_flight++;
+    co = qemu_coroutine_create(backup_worker_entry);
+    qemu_coroutine_enter(co, worker);
+}
+
+/* Copy the whole disk (sync=full) or the parts that are allocated in the
+ * topmost image (sync=top) with up to BACKUP_MAX_WORKERS coroutines.
+ */
+static int coroutine_fn backup_run_full(BackupBlockJob *job)
+{
+    BlockDriverState *bs = job->common.bs;
+    int64_t total_sectors = job->common.len / BDRV_SECTOR_SIZE;
+    int64_t cluster, end;
+    bool skip_zeroes;
+    int ret = 0;
+
+    /* If the target is known to read as zeroes, zeroed parts of the
+     * source need not be copied at all.  A pre-existing target may hold
+     * stale data even if its format has zero_init, so only do this for
+     * images created for the job.
+     */
+    skip_zeroes = job->sync_mode == MIRROR_SYNC_MODE_FULL &&
+                  job->target_is_new &&
+                  !job->target->backing_hd &&
+                  !job->target->backing_file[0] &&
+                  bdrv_has_zero_init(job->target);
+
+    end = DIV_ROUND_UP(job->common.len, job->cluster_size);
+    cluster = 0;
+    for (;;) {
+        int64_t sector_num, status;
+        int nb_clusters, nb_sectors, n;
+        bool skip;
+
+        if (job->worker_ret < 0 || cluster >= end) {
+            backup_drain_workers(job);
+            if (job->worker_ret == 0) {
+                break;
+            }
+
+            /* Depending on error action, fail now or retry cluster */
+            if (backup_error_action(job, job->worker_error_is_read,
+                                    -job->worker_ret) ==
+                BLOCK_ERROR_ACTION_REPORT) {
+                ret = job->worker_ret;
+                break;
+            }
+            cluster = job->worker_error_cluster;
+            job->worker_ret = 0;
+        }
+
+        if (yield_and_check(job)) {
+            break;
+        }
+
+        nb_clusters = MIN(job->max_copy_clusters, end - cluster);
+        sector_num = cluster * job->sectors_per_cluster;
+        nb_sectors = MIN(nb_clusters * job->sectors_per_cluster,
+                         total_sectors - sector_num);
+
+        if (job->sync_mode == MIRROR_SYNC_MODE_TOP) {
+            /* Check to see if these blocks are already in the
+             * backing file. */
+            status = bdrv_is_allocated(bs, sector_num, nb_sectors, &n);
+            skip = status == 0;
+        } else if (skip_zeroes) {
+            status = bdrv_get_block_status_above(bs, NULL, sector_num,
+                                                 nb_sectors, &n);
+            skip = status >= 0 && (status & BDRV_BLOCK_ZERO);
+        } else {
+            status = 0;
+            skip = false;
+            n = nb_sectors;
+        }
+        if (status < 0 || n == 0) {
+            skip = false;
+            n = nb_sectors;
+        }
+
+        if (skip) {
+            /* Skip the clusters that lie entirely in the range */
+            int skipped = sector_num + n >= total_sectors ?
+                          DIV_ROUND_UP(n, job->sectors_per_cluster) :
+                          n / job->sectors_per_cluster;
+
+            if (skipped > 0) {
+                if (job->sync_mode == MIRROR_SYNC_MODE_FULL) {
+                    /* The target already has these zeroes */
+                    hbitmap_set(job->bitmap, cluster, skipped);
+                    job->common.offset +=
+                        MIN((int64_t)skipped * job->sectors_per_cluster,
+                            total_sectors - sector_num) * BDRV_SECTOR_SIZE;
+                }
+                cluster += skipped;
+                continue;
+            }
+            /* Part of the first cluster is not zero or is allocated, so
+             * copy it entirely. */
+            nb_clusters = 1;
+        } else {
+            nb_clusters = MIN(nb_clusters,
+                              DIV_ROUND_UP(n, job->sectors_per_cluster));
+        }
+
+        backup_start_worker(job, cluster, nb_clusters);
+        cluster += nb_clusters;
+    }
+
+    backup_drain_workers(job);
+    return ret;
+}
+
 static void coroutine_fn backup_run(void *opaque)
 {
     BackupBlockJob *job = opaque;
@@ -339,14 +580,13 @@ static void coroutine_fn backup_run(void *opaque)
     NotifierWithReturn before_write = {
         .notify = backup_before_write_notify,
     };
-    int64_t start, end;
+    int64_t end;
     int ret = 0;
 
     QLIST_INIT(&job->inflight_reqs);
     qemu_co_rwlock_init(&job->flush_rwlock);
 
-    start = 0;
-    end = DIV_ROUND_UP(job->common.len, BACKUP_CLUSTER_SIZE);
+    end = DIV_ROUND_UP(job->common.len, job->cluster_size);
 
     job->bitmap = hbitmap_alloc(end, 0);
 
@@ -368,58 +608,7 @@ static void coroutine_fn backup_run(void *opaque)
         ret = backup_run_incremental(job);
     } else {
         /* Both FULL and TOP SYNC_MODE's require copying.. */
-        for (; start < end; start++) {
-            bool error_is_read;
-            if (yield_and_check(job)) {
-                break;
-            }
-
-            if (job->sync_mode == MIRROR_SYNC_MODE_TOP) {
-                int i, n;
-                int alloced = 0;
-
-                /* Check to see if these blocks are already in the
-                 * backing file. */
-
-                for (i = 0; i < BACKUP_SECTORS_PER_CLUSTER;) {
-                    /* bdrv_is_allocated() only returns true/false based
-                     * on the first set of sectors it comes across that
-                     * are are all in the same state.
-                     * For that reason we must verify each sector in the
-                     * backup cluster length.  We end up copying more than
-                     * needed but at some point that is always the case. */
-                    alloced =
-                        bdrv_is_allocated(bs,
-                                start * BACKUP_SECTORS_PER_CLUSTER + i,
-                                BACKUP_SECTORS_PER_CLUSTER - i, &n);
-                    i += n;
-
-                    if (alloced == 1 || n == 0) {
-                        break;
-                    }
-                }
-
-                /* If the above loop never found any sectors that are in
-                 * the topmost image, skip this backup. */
-                if (alloced == 0) {
-                    continue;
-                }
-            }
-            /* FULL sync mode we copy the whole drive. */
-            ret = backup_do_cow(bs, start * BACKUP_SECTORS_PER_CLUSTER,
-                    BACKUP_SECTORS_PER_CLUSTER, &error_is_read);
-            if (ret < 0) {
-                /* Depending on error action, fail now or retry cluster */
-                BlockErrorAction action =
-                    backup_error_action(job, error_is_read, -ret);
-                if (action == BLOCK_ERROR_ACTION_REPORT) {
-                    break;
-                } else {
-                    start--;
-                    continue;
-                }
-            }
-        }
+        ret = backup_run_full(job);
     }
 
     notifier_with_return_remove(&before_write);
@@ -452,12 +641,13 @@ static void coroutine_fn backup_run(void *opaque)
 
 void backup_start(BlockDriverState *bs, BlockDriverState *target,
                   int64_t speed, MirrorSyncMode sync_mode,
-                  BdrvDirtyBitmap *sync_bitmap,
+                  BdrvDirtyBitmap *sync_bitmap, bool target_is_new,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   BlockCompletionFunc *cb, void *opaque,
                   Error **errp)
 {
+    BlockDriverInfo bdi;
     int64_t len;
 
     assert(bs);
@@ -528,12 +718,23 @@ void backup_start(BlockDriverState *bs, BlockDriverState *target,
         goto error;
     }
 
+    /* Copy whole target clusters, so that the target does not have to do
+     * copy-on-write or read-modify-write for each of them.
+     */
+    job->cluster_size = BACKUP_CLUSTER_SIZE_DEFAULT;
+    if (bdrv_get_info(target, &bdi) >= 0 && bdi.cluster_size > 0) {
+        job->cluster_size = MAX(job->cluster_size, bdi.cluster_size);
+    }
+    job->sectors_per_cluster = job->cluster_size / BDRV_SECTOR_SIZE;
+    job->max_copy_clusters = MAX(BACKUP_MAX_COPY_BYTES / job->cluster_size, 1);
+
     bdrv_op_block_all(target, job->common.blocker);
 
     job->on_source_error = on_source_error;
     job->on_target_error = on_target_error;
     job->target = target;
     job->sync_mode = sync_mode;
+    job->target_is_new = target_is_new;
     job->sync_bitmap = sync_mode == MIRROR_SYNC_MODE_DIRTY_BITMAP ?
                        sync_bitmap : NULL;
     job->common.len = len;
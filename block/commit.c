@@ -19,15 +19,20 @@
 
 enum {
     /*
-     * Size of data buffer for populating the image file.  This should be large
-     * enough to process multiple clusters in a single call, so that populating
-     * contiguous regions of the image is efficient.
+     * Default size of data buffer for populating the image file.  This should
+     * be large enough to process multiple clusters in a single call, so that
+     * populating contiguous regions of the image is efficient.
      */
     COMMIT_BUFFER_SIZE = 512 * 1024, /* in bytes */
+
+    /* Default number of chunks copied in parallel */
+    COMMIT_DEFAULT_IN_FLIGHT = 4,
 };
 
 #define SLICE_TIME 100000000ULL /* ns */
 
+typedef struct CommitChunk CommitChunk;
+
 typedef struct CommitBlockJob {
     BlockJob common;
     RateLimit limit;
@@ -38,8 +43,22 @@ typedef struct CommitBlockJob {
     int base_flags;
     int orig_overlay_flags;
     char *backing_file_str;
+
+    int chunk_sectors;
+    int max_in_flight;
+    int in_flight;
+    bool waiting_for_io;
+    QSIMPLEQ_HEAD(, CommitChunk) failed_chunks;
 } CommitBlockJob;
 
+struct CommitChunk {
+    CommitBlockJob *s;
+    int64_t sector_num;
+    int nb_sectors;
+    int ret;
+    QSIMPLEQ_ENTRY(CommitChunk) next;
+};
+
 static int coroutine_fn commit_populate(BlockDriverState *bs,
                                         BlockDriverState *base,
                                         int64_t sector_num, int nb_sectors,
@@ -60,6 +79,99 @@ static int coroutine_fn commit_populate(BlockDriverState *bs,
     return 0;
 }
 
+static void coroutine_fn commit_chunk_entry(void *opaque)
+{
+    CommitChunk *chunk = opaque;
+    CommitBlockJob *s = chunk->s;
+    void *buf;
+
+    buf = qemu_blockalign(s->top, chunk->nb_sectors * BDRV_SECTOR_SIZE);
+    chunk->ret = commit_populate(s->top, s->base, chunk->sector_num,
+                                 chunk->nb_sectors, buf);
+    qemu_vfree(buf);
+
+    if (chunk->ret < 0) {
+        /* The error action is taken by the job coroutine */
+        QSIMPLEQ_INSERT_TAIL(&s->failed_chunks, chunk, next);
+    } else {
+        s->common.offset += chunk->nb_sectors * BDRV_SECTOR_SIZE;
+        g_free(chunk);
+    }
+
+    s->in_flight--;
+    if (s->waiting_for_io) {
+        qemu_coroutine_enter(s->common.co, NULL);
+    }
+}
+
+static void coroutine_fn commit_wait_for_io(CommitBlockJob *s)
+{
+    assert(!s->waiting_for_io);
+    s->waiting_for_io = true;
+    qemu_coroutine_yield();
+    s->waiting_for_io = false;
+}
+
+static void coroutine_fn commit_drain(CommitBlockJob *s)
+{
+    while (s->in_flight > 0) {
+        commit_wait_for_io(s);
+    }
+}
+
+/* Copy a chunk in a separate coroutine, once fewer than max_in_flight chunks
+ * are being copied.
+ */
+static void coroutine_fn commit_start_chunk(CommitBlockJob *s,
+                                            int64_t sector_num, int nb_sectors)
+{
+    CommitChunk *chunk;
+    Coroutine *co;
+
+    while (s->in_flight >= s->max_in_flight) {
+        commit_wait_for_io(s);
+    }
+
+    chunk = g_new0(CommitChunk, 1);
+    chunk->s = s;
+    chunk->sector_num = sector_num;
+    chunk->nb_sectors = nb_sectors;
+
+    s->in_flight++;
+    co = qemu_coroutine_create(commit_chunk_entry);
+    qemu_coroutine_enter(co, chunk);
+}
+
+/* Retry chunks that failed to copy, unless the error action says to give
+ * up.  Returns the error that terminates the job, or 0.
+ */
+static int coroutine_fn commit_handle_failed_chunks(CommitBlockJob *s)
+{
+    CommitChunk *chunk;
+    int ret = 0;
+
+    while (!QSIMPLEQ_EMPTY(&s->failed_chunks)) {
+        commit_drain(s);
+
+        chunk = QSIMPLEQ_FIRST(&s->failed_chunks);
+        QSIMPLEQ_REMOVE_HEAD(&s->failed_chunks, next);
+
+        if (ret == 0) {
+            if (s->on_error == BLOCKDEV_ON_ERROR_STOP ||
+                s->on_error == BLOCKDEV_ON_ERROR_REPORT ||
+                (s->on_error == BLOCKDEV_ON_ERROR_ENOSPC &&
+                 chunk->ret == -ENOSPC)) {
+                ret = chunk->ret;
+            } else {
+                commit_start_chunk(s, chunk->sector_num, chunk->nb_sectors);
+            }
+        }
+        g_free(chunk);
+    }
+
+    return ret;
+}
+
 typedef struct {
     int ret;
 } CommitCompleteData;
@@ -103,8 +215,6 @@ static void coroutine_fn commit_run(void *opaque)
     int64_t sector_num, end;
     int ret = 0;
     int n = 0;
-    void *buf = NULL;
-    int bytes_written = 0;
     int64_t base_len;
 
     ret = s->common.len = bdrv_getlength(top);
@@ -127,7 +237,6 @@ static void coroutine_fn commit_run(void *opaque)
     }
 
     end = s->common.len >> BDRV_SECTOR_BITS;
-    buf = qemu_blockalign(top, COMMIT_BUFFER_SIZE);
 
     for (sector_num = 0; sector_num < end; sector_num += n) {
         uint64_t delay_ns = 0;
@@ -135,16 +244,22 @@ static void coroutine_fn commit_run(void *opaque)
 
 wait:
         /* Note that even when no rate limit is applied we need to yield
-         * with no pending I/O here so that bdrv_drain_all() returns.
+         * here so that bdrv_drain_all() returns.  Chunks still in flight
+         * complete without the job coroutine.
          */
         block_job_sleep_ns(&s->common, QEMU_CLOCK_REALTIME, delay_ns);
         if (block_job_is_cancelled(&s->common)) {
             break;
         }
+
+        ret = commit_handle_failed_chunks(s);
+        if (ret < 0) {
+            goto out;
+        }
+
         /* Copy if allocated above the base */
         ret = bdrv_is_allocated_above(top, base, sector_num,
-                                      COMMIT_BUFFER_SIZE / BDRV_SECTOR_SIZE,
-                                      &n);
+                                      s->chunk_sectors, &n);
         copy = (ret == 1);
         trace_commit_one_iteration(s, sector_num, n, ret);
         if (copy) {
@@ -154,8 +269,8 @@ wait:
                     goto wait;
                 }
             }
-            ret = commit_populate(top, base, sector_num, n, buf);
-            bytes_written += n * BDRV_SECTOR_SIZE;
+            commit_start_chunk(s, sector_num, n);
+            continue;
         }
         if (ret < 0) {
             if (s->on_error == BLOCKDEV_ON_ERROR_STOP ||
@@ -171,10 +286,24 @@ wait:
         s->common.offset += n * BDRV_SECTOR_SIZE;
     }
 
-    ret = 0;
+    /* Retry failed chunks until everything is copied */
+    do {
+        commit_drain(s);
+        ret = block_job_is_cancelled(&s->common) ? 0 :
+              commit_handle_failed_chunks(s);
+    } while (ret == 0 && s->in_flight > 0);
 
 out:
-    qemu_vfree(buf);
+    commit_drain(s);
+    while (!QSIMPLEQ_EMPTY(&s->failed_chunks)) {
+        CommitChunk *chunk = QSIMPLEQ_FIRST(&s->failed_chunks);
+
+        QSIMPLEQ_REMOVE_HEAD(&s->failed_chunks, next);
+        if (ret == 0 && !block_job_is_cancelled(&s->common)) {
+            ret = chunk->ret;
+        }
+        g_free(chunk);
+    }
 
     data = g_malloc(sizeof(*data));
     data->ret = ret;
@@ -200,6 +329,7 @@ static const BlockJobDriver commit_job_driver = {
 
 void commit_start(BlockDriverState *bs, BlockDriverState *base,
                   BlockDriverState *top, int64_t speed,
+                  int64_t chunk_size, int max_in_flight,
                   BlockdevOnError on_error, BlockCompletionFunc *cb,
                   void *opaque, const char *backing_file_str, Error **errp)
 {
@@ -223,6 +353,14 @@ void commit_start(BlockDriverState *bs, BlockDriverState *base,
         return;
     }
 
+    if (chunk_size == 0) {
+        chunk_size = COMMIT_BUFFER_SIZE;
+    }
+    if (max_in_flight == 0) {
+        max_in_flight = COMMIT_DEFAULT_IN_FLIGHT;
+    }
+    assert(chunk_size % BDRV_SECTOR_SIZE == 0 && max_in_flight > 0);
+
     overlay_bs = bdrv_find_overlay(bs, top);
 
     if (overlay_bs == NULL) {
@@ -265,6 +403,10 @@ void commit_start(BlockDriverState *bs, BlockDriverState *base,
 
     s->backing_file_str = g_strdup(backing_file_str);
 
+    s->chunk_sectors = chunk_size >> BDRV_SECTOR_BITS;
+    s->max_in_flight = max_in_flight;
+    QSIMPLEQ_INIT(&s->failed_chunks);
+
     s->on_error = on_error;
     s->common.co = qemu_coroutine_create(commit_run);
 
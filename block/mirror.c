@@ -18,7 +18,22 @@
 #include "qemu/bitmap.h"
 
 #define SLICE_TIME    100000000ULL /* ns */
-#define MAX_IN_FLIGHT 16
+
+/* The number of operations in flight is adjusted at run time: it grows
+ * by one while requests complete within MIRROR_TARGET_LATENCY_NS and the
+ * job is limited by the in-flight cap, and it is halved when a request
+ * takes longer than that.
+ */
+#define MIRROR_MIN_IN_FLIGHT        2
+#define MIRROR_INITIAL_IN_FLIGHT    16
+#define MIRROR_MAX_IN_FLIGHT        256
+#define MIRROR_TARGET_LATENCY_NS    30000000LL
+
+/* Upper bound for a single zero write, and for the range of dirty chunks
+ * that one iteration looks at.  Data copies are additionally limited by
+ * the size of the buffer.
+ */
+#define MIRROR_MAX_IO_BYTES         (64 * 1024 * 1024)
 
 /* The mirroring buffer is a list of granularity-sized chunks.
  * Free chunks are organized in a list.
@@ -39,6 +54,7 @@ typedef struct MirrorBlockJob {
     /* Used to block operations on the drive-mirror-replace target */
     Error *replace_blocker;
     bool is_none_mode;
+    MirrorCopyMode copy_mode;
     BlockdevOnError on_source_error, on_target_error;
     bool synced;
     bool should_complete;
@@ -46,6 +62,10 @@ typedef struct MirrorBlockJob {
     int64_t granularity;
     size_t buf_size;
     int64_t bdev_length;
+    /* The target's backing file is not open yet, so the job must do COW
+     * itself; cow_bitmap tracks it if clusters are larger than chunks.
+     */
+    bool manual_cow;
     unsigned long *cow_bitmap;
     BdrvDirtyBitmap *dirty_bitmap;
     HBitmapIter hbi;
@@ -55,8 +75,20 @@ typedef struct MirrorBlockJob {
 
     unsigned long *in_flight_bitmap;
     int in_flight;
+    int max_in_flight;
+    int64_t last_throttle_ns;
     int sectors_in_flight;
     int ret;
+    bool waiting_for_io;
+
+    /* Write-blocking mode: guest writes are copied to the target by
+     * after_write, and wait on active_write_queue for overlapping
+     * operations to complete.
+     */
+    Notifier after_write;
+    bool active_writes_enabled;
+    CoQueue active_write_queue;
+    int active_write_waiters;
 } MirrorBlockJob;
 
 typedef struct MirrorOp {
@@ -64,6 +96,7 @@ typedef struct MirrorOp {
     QEMUIOVector qiov;
     int64_t sector_num;
     int nb_sectors;
+    int64_t start_ns;
 } MirrorOp;
 
 static BlockErrorAction mirror_error_action(MirrorBlockJob *s, bool read,
@@ -79,6 +112,44 @@ static BlockErrorAction mirror_error_action(MirrorBlockJob *s, bool read,
     }
 }
 
+/* Grow or shrink the in-flight limit based on the latency of a request
+ * that has just completed.
+ */
+static void mirror_adjust_in_flight(MirrorBlockJob *s, MirrorOp *op)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int64_t latency = now - op->start_ns;
+
+    if (latency > MIRROR_TARGET_LATENCY_NS) {
+        /* Only shrink once for all the requests that were already
+         * submitted when the limit was last lowered.
+         */
+        if (op->start_ns > s->last_throttle_ns &&
+            s->max_in_flight > MIRROR_MIN_IN_FLIGHT) {
+            s->max_in_flight = MAX(s->max_in_flight / 2,
+                                   MIRROR_MIN_IN_FLIGHT);
+            s->last_throttle_ns = now;
+            trace_mirror_adjust_in_flight(s, s->max_in_flight, latency);
+        }
+    } else if (s->in_flight >= s->max_in_flight &&
+               s->max_in_flight < MIRROR_MAX_IN_FLIGHT) {
+        s->max_in_flight++;
+        trace_mirror_adjust_in_flight(s, s->max_in_flight, latency);
+    }
+}
+
+/* Restart the guest writes that wait for overlapping operations.  Those
+ * that still find an overlap queue up again behind the ones counted here.
+ */
+static void mirror_wake_active_writes(MirrorBlockJob *s)
+{
+    int n = s->active_write_waiters;
+
+    while (n-- > 0 && qemu_co_enter_next(&s->active_write_queue)) {
+        /* nothing */
+    }
+}
+
 static void mirror_iteration_done(MirrorOp *op, int ret)
 {
     MirrorBlockJob *s = op->s;
@@ -88,6 +159,10 @@ static void mirror_iteration_done(MirrorOp *op, int ret)
 
     trace_mirror_iteration_done(s, op->sector_num, op->nb_sectors, ret);
 
+    if (ret >= 0) {
+        mirror_adjust_in_flight(s, op);
+    }
+
     s->in_flight--;
     s->sectors_in_flight -= op->nb_sectors;
     iov = op->qiov.iov;
@@ -99,7 +174,7 @@ static void mirror_iteration_done(MirrorOp *op, int ret)
 
     sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
     chunk_num = op->sector_num / sectors_per_chunk;
-    nb_chunks = op->nb_sectors / sectors_per_chunk;
+    nb_chunks = DIV_ROUND_UP(op->nb_sectors, sectors_per_chunk);
     bitmap_clear(s->in_flight_bitmap, chunk_num, nb_chunks);
     if (ret >= 0) {
         if (s->cow_bitmap) {
@@ -111,11 +186,13 @@ static void mirror_iteration_done(MirrorOp *op, int ret)
     qemu_iovec_destroy(&op->qiov);
     g_slice_free(MirrorOp, op);
 
-    /* Enter coroutine when it is not sleeping.  The coroutine sleeps to
-     * rate-limit itself.  The coroutine will eventually resume since there is
-     * a sleep timeout so don't wake it early.
+    mirror_wake_active_writes(s);
+
+    /* Enter the coroutine only if it is waiting for I/O.  The coroutine
+     * sleeps to rate-limit itself, and it may also be blocked in a block
+     * status query; in both cases it will resume on its own.
      */
-    if (s->common.busy) {
+    if (s->waiting_for_io) {
         qemu_coroutine_enter(s->common.co, NULL);
     }
 }
@@ -156,141 +233,368 @@ static void mirror_read_complete(void *opaque, int ret)
                     mirror_write_complete, op);
 }
 
-static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
+static inline void mirror_wait_for_io(MirrorBlockJob *s)
+{
+    assert(!s->waiting_for_io);
+    s->waiting_for_io = true;
+    qemu_coroutine_yield();
+    s->waiting_for_io = false;
+}
+
+static MirrorOp *mirror_op_new(MirrorBlockJob *s, int64_t sector_num,
+                               int nb_sectors)
+{
+    MirrorOp *op = g_slice_new(MirrorOp);
+
+    op->s = s;
+    op->sector_num = sector_num;
+    op->nb_sectors = nb_sectors;
+    op->start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    s->in_flight++;
+    s->sectors_in_flight += nb_sectors;
+    return op;
+}
+
+/* Copy [sector_num, sector_num + nb_sectors) from the source to the target.
+ * When the target needs copy-on-write to be done by the job, the range is
+ * first extended to whole target clusters.  Returns the number of sectors
+ * processed past @sector_num, which can be less than @nb_sectors if the
+ * buffer is too small or more than it if the range was extended.
+ */
+static int mirror_do_read(MirrorBlockJob *s, int64_t sector_num,
+                          int nb_sectors)
 {
     BlockDriverState *source = s->common.bs;
-    int nb_sectors, sectors_per_chunk, nb_chunks;
-    int64_t end, sector_num, next_chunk, next_sector, hbitmap_next_sector;
-    uint64_t delay_ns = 0;
+    int sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
+    int64_t end = s->bdev_length / BDRV_SECTOR_SIZE;
+    int64_t orig_sector_num = sector_num;
+    int max_chunks, nb_chunks;
     MirrorOp *op;
 
-    s->sector_num = hbitmap_iter_next(&s->hbi);
-    if (s->sector_num < 0) {
-        bdrv_dirty_iter_init(s->dirty_bitmap, &s->hbi);
-        s->sector_num = hbitmap_iter_next(&s->hbi);
-        trace_mirror_restart_iter(s, bdrv_get_dirty_count(s->dirty_bitmap));
-        assert(s->sector_num >= 0);
-    }
+    max_chunks = s->buf_size / s->granularity;
+    nb_sectors = MIN(nb_sectors, max_chunks * sectors_per_chunk);
 
-    hbitmap_next_sector = s->sector_num;
-    sector_num = s->sector_num;
-    sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
-    end = s->bdev_length / BDRV_SECTOR_SIZE;
-
-    /* Extend the QEMUIOVector to include all adjacent blocks that will
-     * be copied in this operation.
-     *
-     * We have to do this if we have no backing file yet in the destination,
-     * and the cluster size is very large.  Then we need to do COW ourselves.
+    /* We have to do COW ourselves if we have no backing file yet in the
+     * destination and the cluster size is larger than the granularity.
      * The first time a cluster is copied, copy it entirely.  Note that,
      * because both the granularity and the cluster size are powers of two,
-     * the number of sectors to copy cannot exceed one cluster.
-     *
-     * We also want to extend the QEMUIOVector to include more adjacent
-     * dirty blocks if possible, to limit the number of I/O operations and
-     * run efficiently even with a small granularity.
+     * the rounding does not cross more than one cluster on each side.
      */
-    nb_chunks = 0;
-    nb_sectors = 0;
-    next_sector = sector_num;
-    next_chunk = sector_num / sectors_per_chunk;
+    if (s->cow_bitmap &&
+        (!test_bit(sector_num / sectors_per_chunk, s->cow_bitmap) ||
+         !test_bit((sector_num + nb_sectors - 1) / sectors_per_chunk,
+                   s->cow_bitmap))) {
+        int64_t cow_sector_num;
+        int cow_nb_sectors;
+
+        bdrv_round_to_clusters(s->target, sector_num, nb_sectors,
+                               &cow_sector_num, &cow_nb_sectors);
+        if (cow_nb_sectors <= max_chunks * sectors_per_chunk) {
+            sector_num = cow_sector_num;
+            nb_sectors = cow_nb_sectors;
+        }
+    }
+    nb_sectors = MIN(nb_sectors, end - sector_num);
+    nb_chunks = DIV_ROUND_UP(nb_sectors, sectors_per_chunk);
 
-    /* Wait for I/O to this cluster (from a previous iteration) to be done.  */
-    while (test_bit(next_chunk, s->in_flight_bitmap)) {
-        trace_mirror_yield_in_flight(s, sector_num, s->in_flight);
-        qemu_coroutine_yield();
+    /* Wait until there is enough space in the buffer.  */
+    while (s->buf_free_count < nb_chunks) {
+        trace_mirror_yield_buf_busy(s, nb_chunks, s->in_flight);
+        mirror_wait_for_io(s);
     }
 
-    do {
-        int added_sectors, added_chunks;
+    bitmap_set(s->in_flight_bitmap, sector_num / sectors_per_chunk, nb_chunks);
+    op = mirror_op_new(s, sector_num, nb_sectors);
 
-        if (!bdrv_get_dirty(source, s->dirty_bitmap, next_sector) ||
-            test_bit(next_chunk, s->in_flight_bitmap)) {
-            assert(nb_sectors > 0);
-            break;
-        }
+    /* Now make a QEMUIOVector taking enough granularity-sized chunks
+     * from s->buf_free.
+     */
+    qemu_iovec_init(&op->qiov, nb_chunks);
+    while (nb_chunks-- > 0) {
+        MirrorBuffer *buf = QSIMPLEQ_FIRST(&s->buf_free);
+        size_t remaining = (nb_sectors * BDRV_SECTOR_SIZE) - op->qiov.size;
 
-        added_sectors = sectors_per_chunk;
-        if (s->cow_bitmap && !test_bit(next_chunk, s->cow_bitmap)) {
-            bdrv_round_to_clusters(s->target,
-                                   next_sector, added_sectors,
-                                   &next_sector, &added_sectors);
+        QSIMPLEQ_REMOVE_HEAD(&s->buf_free, next);
+        s->buf_free_count--;
+        qemu_iovec_add(&op->qiov, buf, MIN(s->granularity, remaining));
+    }
 
-            /* On the first iteration, the rounding may make us copy
-             * sectors before the first dirty one.
-             */
-            if (next_sector < sector_num) {
-                assert(nb_sectors == 0);
-                sector_num = next_sector;
-                next_chunk = next_sector / sectors_per_chunk;
+    /* Copy the dirty cluster.  */
+    trace_mirror_one_iteration(s, sector_num, nb_sectors);
+    bdrv_aio_readv(source, sector_num, &op->qiov, nb_sectors,
+                   mirror_read_complete, op);
+    return sector_num + nb_sectors - orig_sector_num;
+}
+
+/* Write zeroes to [sector_num, sector_num + nb_sectors) in the target,
+ * allowing it to unmap the range if it was opened with discard=unmap.
+ */
+static void mirror_do_zero(MirrorBlockJob *s, int64_t sector_num,
+                           int nb_sectors)
+{
+    int sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
+    MirrorOp *op;
+
+    bitmap_set(s->in_flight_bitmap, sector_num / sectors_per_chunk,
+               DIV_ROUND_UP(nb_sectors, sectors_per_chunk));
+    op = mirror_op_new(s, sector_num, nb_sectors);
+    qemu_iovec_init(&op->qiov, 0);
+
+    trace_mirror_one_zero_iteration(s, sector_num, nb_sectors);
+    bdrv_aio_write_zeroes(s->target, sector_num, nb_sectors,
+                          BDRV_REQ_MAY_UNMAP, mirror_write_complete, op);
+}
+
+/* Copy a guest write to the target in write-blocking mode.  This runs in
+ * the coroutine of the guest request, after the data has been written to
+ * the source.
+ *
+ * The mirror's dirty bitmap is disabled in this mode, so guest writes do
+ * not add to it: a chunk that was in sync stays in sync, and a chunk that
+ * is entirely overwritten becomes in sync.  On errors the range is marked
+ * dirty so that the job copies it again.
+ *
+ * Without a backing file, the target fills the rest of a newly allocated
+ * cluster with zeroes.  So if the job does COW itself, partially written
+ * chunks, and partially written clusters that were not copied yet, are
+ * marked dirty so that the job copies them in full from the source.
+ */
+static void coroutine_fn mirror_active_write(Notifier *notifier, void *opaque)
+{
+    MirrorBlockJob *s = container_of(notifier, MirrorBlockJob, after_write);
+    BdrvCompletedWrite *write = opaque;
+    int sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
+    int64_t sector_num = write->sector_num;
+    int nb_sectors = write->nb_sectors;
+    int64_t first_chunk, end_chunk, sync_start, sync_end;
+    int64_t dirty_start, dirty_end, cluster_sector_num;
+    int cluster_nb_sectors;
+    int ret;
+
+    if (write->ret < 0) {
+        /* The contents of the source are unknown, copy them later */
+        bdrv_set_dirty_bitmap(s->dirty_bitmap, sector_num, nb_sectors);
+        return;
+    }
+
+    /* A copy of these chunks that is still in flight may have read the
+     * old data, and would overwrite the new data in the target when it
+     * completes.  Wait for it, as well as for other guest writes to the
+     * same chunks.
+     */
+    first_chunk = sector_num / sectors_per_chunk;
+    end_chunk = DIV_ROUND_UP(sector_num + nb_sectors, sectors_per_chunk);
+    while (find_next_bit(s->in_flight_bitmap, end_chunk, first_chunk) <
+           end_chunk) {
+        s->active_write_waiters++;
+        qemu_co_queue_wait(&s->active_write_queue);
+        s->active_write_waiters--;
+    }
+
+    bitmap_set(s->in_flight_bitmap, first_chunk, end_chunk - first_chunk);
+    s->in_flight++;
+
+    trace_mirror_active_write(s, sector_num, nb_sectors);
+    if (write->flags & BDRV_REQ_ZERO_WRITE) {
+        ret = bdrv_co_write_zeroes(s->target, sector_num, nb_sectors,
+                                   write->flags & BDRV_REQ_MAY_UNMAP);
+    } else {
+        ret = bdrv_co_writev(s->target, sector_num, nb_sectors, write->qiov);
+    }
+
+    if (ret < 0) {
+        bdrv_set_dirty_bitmap(s->dirty_bitmap, sector_num, nb_sectors);
+        if (mirror_error_action(s, false, -ret) == BLOCK_ERROR_ACTION_REPORT &&
+            s->ret >= 0) {
+            s->ret = ret;
+        }
+    } else {
+        sync_start = QEMU_ALIGN_UP(sector_num, sectors_per_chunk);
+        sync_end = QEMU_ALIGN_DOWN(sector_num + nb_sectors, sectors_per_chunk);
+        dirty_start = first_chunk * sectors_per_chunk;
+        dirty_end = end_chunk * sectors_per_chunk;
+
+        if (s->manual_cow && s->cow_bitmap) {
+            bdrv_round_to_clusters(s->target, sector_num, 1,
+                                   &cluster_sector_num, &cluster_nb_sectors);
+            if (cluster_sector_num < sector_num &&
+                !test_bit(first_chunk, s->cow_bitmap)) {
+                dirty_start = cluster_sector_num;
+                sync_start = MAX(sync_start,
+                                 cluster_sector_num + cluster_nb_sectors);
+            }
+            bdrv_round_to_clusters(s->target, sector_num + nb_sectors - 1, 1,
+                                   &cluster_sector_num, &cluster_nb_sectors);
+            if (cluster_sector_num + cluster_nb_sectors >
+                sector_num + nb_sectors &&
+                !test_bit(end_chunk - 1, s->cow_bitmap)) {
+                dirty_end = cluster_sector_num + cluster_nb_sectors;
+                sync_end = MIN(sync_end, cluster_sector_num);
             }
         }
 
-        added_sectors = MIN(added_sectors, end - (sector_num + nb_sectors));
-        added_chunks = (added_sectors + sectors_per_chunk - 1) / sectors_per_chunk;
-
-        /* When doing COW, it may happen that there is not enough space for
-         * a full cluster.  Wait if that is the case.
-         */
-        while (nb_chunks == 0 && s->buf_free_count < added_chunks) {
-            trace_mirror_yield_buf_busy(s, nb_chunks, s->in_flight);
-            qemu_coroutine_yield();
+        if (s->manual_cow) {
+            dirty_end = MIN(dirty_end, s->bdev_length >> BDRV_SECTOR_BITS);
+            if (sync_end <= sync_start) {
+                bdrv_set_dirty_bitmap(s->dirty_bitmap, dirty_start,
+                                      dirty_end - dirty_start);
+            } else {
+                if (dirty_start < sync_start) {
+                    bdrv_set_dirty_bitmap(s->dirty_bitmap, dirty_start,
+                                          sync_start - dirty_start);
+                }
+                if (sync_end < dirty_end) {
+                    bdrv_set_dirty_bitmap(s->dirty_bitmap, sync_end,
+                                          dirty_end - sync_end);
+                }
+            }
         }
-        if (s->buf_free_count < nb_chunks + added_chunks) {
-            trace_mirror_break_buf_busy(s, nb_chunks, s->in_flight);
-            break;
+
+        if (sync_end > sync_start) {
+            bdrv_reset_dirty_bitmap(s->dirty_bitmap, sync_start,
+                                    sync_end - sync_start);
+            if (s->cow_bitmap) {
+                bitmap_set(s->cow_bitmap, sync_start / sectors_per_chunk,
+                           (sync_end - sync_start) / sectors_per_chunk);
+            }
         }
+    }
+
+    bitmap_clear(s->in_flight_bitmap, first_chunk, end_chunk - first_chunk);
+    s->in_flight--;
+
+    mirror_wake_active_writes(s);
+    if (s->waiting_for_io) {
+        qemu_coroutine_enter(s->common.co, NULL);
+    }
+}
+
+static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
+{
+    BlockDriverState *source = s->common.bs;
+    int sectors_per_chunk, nb_sectors, max_sectors;
+    int64_t end, sector_num, next_sector;
+    uint64_t delay_ns = 0;
 
-        /* We have enough free space to copy these sectors.  */
-        bitmap_set(s->in_flight_bitmap, next_chunk, added_chunks);
+    sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
+    end = s->bdev_length / BDRV_SECTOR_SIZE;
 
-        nb_sectors += added_sectors;
-        nb_chunks += added_chunks;
-        next_sector += added_sectors;
-        next_chunk += added_chunks;
-        if (!s->synced && s->common.speed) {
-            delay_ns = ratelimit_calculate_delay(&s->limit, added_sectors);
+    for (;;) {
+        s->sector_num = hbitmap_iter_next(&s->hbi);
+        if (s->sector_num < 0) {
+            bdrv_dirty_iter_init(s->dirty_bitmap, &s->hbi);
+            s->sector_num = hbitmap_iter_next(&s->hbi);
+            trace_mirror_restart_iter(s,
+                                      bdrv_get_dirty_count(s->dirty_bitmap));
+            if (s->sector_num < 0) {
+                /* Guest writes synced the remaining chunks meanwhile */
+                return 0;
+            }
         }
-    } while (delay_ns == 0 && next_sector < end);
+        sector_num = s->sector_num;
 
-    /* Allocate a MirrorOp that is used as an AIO callback.  */
-    op = g_slice_new(MirrorOp);
-    op->s = s;
-    op->sector_num = sector_num;
-    op->nb_sectors = nb_sectors;
+        /* Wait for I/O to this cluster (from a previous iteration) to be
+         * done.
+         */
+        while (test_bit(sector_num / sectors_per_chunk, s->in_flight_bitmap)) {
+            trace_mirror_yield_in_flight(s, sector_num, s->in_flight);
+            mirror_wait_for_io(s);
+        }
 
-    /* Now make a QEMUIOVector taking enough granularity-sized chunks
-     * from s->buf_free.
+        /* In write-blocking mode, guest writes clear dirty bits ahead of
+         * the iterator, which can then return chunks that are clean by
+         * now (see hbitmap_iter_init).  Skip them.
+         */
+        if (bdrv_get_dirty(source, s->dirty_bitmap, sector_num)) {
+            break;
+        }
+    }
+
+    /* Find the run of adjacent dirty chunks that are not being copied by
+     * an earlier iteration, to limit the number of I/O operations and run
+     * efficiently even with a small granularity.
      */
-    qemu_iovec_init(&op->qiov, nb_chunks);
+    max_sectors = MAX(s->buf_size, MIRROR_MAX_IO_BYTES) >> BDRV_SECTOR_BITS;
+    nb_sectors = 0;
     next_sector = sector_num;
-    while (nb_chunks-- > 0) {
-        MirrorBuffer *buf = QSIMPLEQ_FIRST(&s->buf_free);
-        size_t remaining = (nb_sectors * BDRV_SECTOR_SIZE) - op->qiov.size;
+    do {
+        int64_t next_chunk = next_sector / sectors_per_chunk;
 
-        QSIMPLEQ_REMOVE_HEAD(&s->buf_free, next);
-        s->buf_free_count--;
-        qemu_iovec_add(&op->qiov, buf, MIN(s->granularity, remaining));
+        if (!bdrv_get_dirty(source, s->dirty_bitmap, next_sector) ||
+            test_bit(next_chunk, s->in_flight_bitmap)) {
+            break;
+        }
 
         /* Advance the HBitmapIter in parallel, so that we do not examine
          * the same sector twice.
          */
-        if (next_sector > hbitmap_next_sector
-            && bdrv_get_dirty(source, s->dirty_bitmap, next_sector)) {
-            hbitmap_next_sector = hbitmap_iter_next(&s->hbi);
+        if (next_sector > sector_num) {
+            hbitmap_iter_next(&s->hbi);
         }
 
         next_sector += sectors_per_chunk;
-    }
+        nb_sectors = MIN(next_sector, end) - sector_num;
+    } while (nb_sectors < max_sectors && next_sector < end);
+    assert(nb_sectors > 0);
 
+    /* Clear dirty bits before querying the block status, because
+     * bdrv_get_block_status_above() can yield.  Writes that come in
+     * meanwhile set the bits again.
+     */
     bdrv_reset_dirty_bitmap(s->dirty_bitmap, sector_num, nb_sectors);
+    bitmap_set(s->in_flight_bitmap, sector_num / sectors_per_chunk,
+               DIV_ROUND_UP(nb_sectors, sectors_per_chunk));
+
+    while (nb_sectors > 0) {
+        int64_t ret;
+        int io_sectors;
+
+        /* Zeroed areas are written as zeroes (or unmapped) in the target
+         * instead of being read and copied.  Partial chunks are always
+         * copied.
+         */
+        ret = bdrv_get_block_status_above(source, NULL, sector_num,
+                                          nb_sectors, &io_sectors);
+        if (ret < 0) {
+            io_sectors = nb_sectors;
+        }
+        if (io_sectors < nb_sectors) {
+            io_sectors = QEMU_ALIGN_DOWN(io_sectors, sectors_per_chunk);
+        }
+
+        if (io_sectors > 0 && ret >= 0 && (ret & BDRV_BLOCK_ZERO)) {
+            mirror_do_zero(s, sector_num, io_sectors);
+        } else {
+            io_sectors = mirror_do_read(s, sector_num,
+                                        MAX(io_sectors, MIN(sectors_per_chunk,
+                                                            nb_sectors)));
+        }
+
+        /* A COW-extended read may have gone past the end of the run.  */
+        io_sectors = MIN(io_sectors, nb_sectors);
+        sector_num += io_sectors;
+        nb_sectors -= io_sectors;
+
+        /* Only copied data counts against the speed limit.  */
+        if (!(ret >= 0 && (ret & BDRV_BLOCK_ZERO)) &&
+            !s->synced && s->common.speed) {
+            delay_ns = ratelimit_calculate_delay(&s->limit, io_sectors);
+        }
+
+        /* Leave the rest of the run for a later iteration if we have to
+         * sleep or if there are too many requests in flight.
+         */
+        if (nb_sectors > 0 &&
+            (delay_ns > 0 || s->in_flight >= s->max_in_flight)) {
+            bitmap_clear(s->in_flight_bitmap, sector_num / sectors_per_chunk,
+                         DIV_ROUND_UP(nb_sectors, sectors_per_chunk));
+            bdrv_set_dirty_bitmap(s->dirty_bitmap, sector_num, nb_sectors);
+            mirror_wake_active_writes(s);
+            break;
+        }
+    }
 
-    /* Copy the dirty cluster.  */
-    s->in_flight++;
-    s->sectors_in_flight += nb_sectors;
-    trace_mirror_one_iteration(s, sector_num, nb_sectors);
-    bdrv_aio_readv(source, sector_num, &op->qiov, nb_sectors,
-                   mirror_read_complete, op);
     return delay_ns;
 }
 
@@ -314,7 +618,7 @@ static void mirror_free_init(MirrorBlockJob *s)
 static void mirror_drain(MirrorBlockJob *s)
 {
     while (s->in_flight > 0) {
-        qemu_coroutine_yield();
+        mirror_wait_for_io(s);
     }
 }
 
@@ -374,6 +678,7 @@ static void coroutine_fn mirror_run(void *opaque)
     BlockDriverInfo bdi;
     char backing_filename[2]; /* we only need 2 characters because we are only
                                  checking for a NULL string */
+    bool skip_zeroes;
     int ret = 0;
     int n;
 
@@ -406,6 +711,7 @@ static void coroutine_fn mirror_run(void *opaque)
     bdrv_get_backing_filename(s->target, backing_filename,
                               sizeof(backing_filename));
     if (backing_filename[0] && !s->target->backing_hd) {
+        s->manual_cow = true;
         ret = bdrv_get_info(s->target, &bdi);
         if (ret < 0) {
             goto immediate_exit;
@@ -416,6 +722,17 @@ static void coroutine_fn mirror_run(void *opaque)
         }
     }
 
+    if (s->copy_mode == MIRROR_COPY_MODE_WRITE_BLOCKING) {
+        /* From now on guest writes go to the target directly.  Writes
+         * that came before are already in the dirty bitmap.
+         */
+        bdrv_disable_dirty_bitmap(s->dirty_bitmap);
+        qemu_co_queue_init(&s->active_write_queue);
+        s->after_write.notify = mirror_active_write;
+        bdrv_add_after_write_notifier(bs, &s->after_write);
+        s->active_writes_enabled = true;
+    }
+
     end = s->bdev_length / BDRV_SECTOR_SIZE;
     s->buf = qemu_try_blockalign(bs, s->buf_size);
     if (s->buf == NULL) {
@@ -426,22 +743,33 @@ static void coroutine_fn mirror_run(void *opaque)
     sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
     mirror_free_init(s);
 
+    /* A fresh target without a backing file already reads as zeroes,
+     * so allocated areas of the source that read as zeroes need not be
+     * copied at all.
+     */
+    skip_zeroes = !s->base && !backing_filename[0] &&
+                  bdrv_has_zero_init(s->target);
+
     if (!s->is_none_mode) {
         /* First part, loop on the sectors and initialize the dirty bitmap.  */
         BlockDriverState *base = s->base;
         for (sector_num = 0; sector_num < end; ) {
             int64_t next = (sector_num | (sectors_per_chunk - 1)) + 1;
-            ret = bdrv_is_allocated_above(bs, base,
-                                          sector_num, next - sector_num, &n);
+            int64_t len = skip_zeroes ? end - sector_num : next - sector_num;
+            int64_t status;
 
-            if (ret < 0) {
+            status = bdrv_get_block_status_above(bs, base, sector_num,
+                                                 MIN(len, INT_MAX), &n);
+            if (status < 0) {
+                ret = status;
                 goto immediate_exit;
             }
 
             assert(n > 0);
-            if (ret == 1) {
+            if ((status & BDRV_BLOCK_ALLOCATED) &&
+                !(skip_zeroes && (status & BDRV_BLOCK_ZERO))) {
                 bdrv_set_dirty_bitmap(s->dirty_bitmap, sector_num, n);
-                sector_num = next;
+                sector_num = QEMU_ALIGN_UP(sector_num + n, sectors_per_chunk);
             } else {
                 sector_num += n;
             }
@@ -475,10 +803,10 @@ static void coroutine_fn mirror_run(void *opaque)
          */
         if (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - last_pause_ns < SLICE_TIME &&
             s->common.iostatus == BLOCK_DEVICE_IO_STATUS_OK) {
-            if (s->in_flight == MAX_IN_FLIGHT || s->buf_free_count == 0 ||
+            if (s->in_flight >= s->max_in_flight || s->buf_free_count == 0 ||
                 (cnt == 0 && s->in_flight > 0)) {
                 trace_mirror_yield(s, s->in_flight, s->buf_free_count, cnt);
-                qemu_coroutine_yield();
+                mirror_wait_for_io(s);
                 continue;
             } else if (cnt != 0) {
                 delay_ns = mirror_iteration(s);
@@ -547,6 +875,11 @@ static void coroutine_fn mirror_run(void *opaque)
     }
 
 immediate_exit:
+    if (s->active_writes_enabled) {
+        notifier_remove(&s->after_write);
+        s->active_writes_enabled = false;
+    }
+
     if (s->in_flight > 0) {
         /* We get here only if something went wrong.  Either the job failed,
          * or it was cancelled prematurely so that we do not guarantee that
@@ -649,6 +982,7 @@ static void mirror_start_job(BlockDriverState *bs, BlockDriverState *target,
                              const char *replaces,
                              int64_t speed, uint32_t granularity,
                              int64_t buf_size,
+                             MirrorCopyMode copy_mode,
                              BlockdevOnError on_source_error,
                              BlockdevOnError on_target_error,
                              BlockCompletionFunc *cb,
@@ -682,9 +1016,11 @@ static void mirror_start_job(BlockDriverState *bs, BlockDriverState *target,
     s->on_target_error = on_target_error;
     s->target = target;
     s->is_none_mode = is_none_mode;
+    s->copy_mode = copy_mode;
     s->base = base;
     s->granularity = granularity;
     s->buf_size = MAX(buf_size, granularity);
+    s->max_in_flight = MIRROR_INITIAL_IN_FLIGHT;
 
     s->dirty_bitmap = bdrv_create_dirty_bitmap(bs, granularity, NULL, errp);
     if (!s->dirty_bitmap) {
@@ -701,7 +1037,8 @@ static void mirror_start_job(BlockDriverState *bs, BlockDriverState *target,
 void mirror_start(BlockDriverState *bs, BlockDriverState *target,
                   const char *replaces,
                   int64_t speed, uint32_t granularity, int64_t buf_size,
-                  MirrorSyncMode mode, BlockdevOnError on_source_error,
+                  MirrorSyncMode mode, MirrorCopyMode copy_mode,
+                  BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   BlockCompletionFunc *cb,
                   void *opaque, Error **errp)
@@ -716,7 +1053,7 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
     is_none_mode = mode == MIRROR_SYNC_MODE_NONE;
     base = mode == MIRROR_SYNC_MODE_TOP ? bs->backing_hd : NULL;
     mirror_start_job(bs, target, replaces,
-                     speed, granularity, buf_size,
+                     speed, granularity, buf_size, copy_mode,
                      on_source_error, on_target_error, cb, opaque, errp,
                      &mirror_job_driver, is_none_mode, base);
 }
@@ -764,7 +1101,7 @@ void commit_active_start(BlockDriverState *bs, BlockDriverState *base,
     }
 
     bdrv_ref(base);
-    mirror_start_job(bs, base, NULL, speed, 0, 0,
+    mirror_start_job(bs, base, NULL, speed, 0, 0, MIRROR_COPY_MODE_BACKGROUND,
                      on_error, on_error, cb, opaque, &local_err,
                      &commit_active_job_driver, false, base);
     if (local_err) {
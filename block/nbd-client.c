@@ -32,48 +32,55 @@
 #define HANDLE_TO_INDEX(bs, handle) ((handle) ^ ((uint64_t)(intptr_t)bs))
 #define INDEX_TO_HANDLE(bs, index)  ((index)  ^ ((uint64_t)(intptr_t)bs))
 
-static void nbd_recv_coroutines_enter_all(NbdClientSession *s)
+/* Largest range that a single NBD_CMD_BLOCK_STATUS can describe */
+#define NBD_MAX_STATUS_SECTORS  ((UINT32_MAX >> BDRV_SECTOR_BITS) & ~7)
+
+typedef struct NbdExtent {
+    uint32_t length;
+    uint32_t flags;
+} NbdExtent;
+
+static void nbd_recv_coroutines_enter_all(NbdClientConnection *c)
 {
     int i;
 
     for (i = 0; i < MAX_NBD_REQUESTS; i++) {
-        if (s->recv_coroutine[i]) {
-            qemu_coroutine_enter(s->recv_coroutine[i], NULL);
+        if (c->recv_coroutine[i]) {
+            qemu_coroutine_enter(c->recv_coroutine[i], NULL);
         }
     }
 }
 
-static void nbd_teardown_connection(BlockDriverState *bs)
+static void nbd_teardown_connection(NbdClientConnection *c)
 {
-    NbdClientSession *client = nbd_get_client_session(bs);
-
     /* finish any pending coroutines */
-    shutdown(client->sock, 2);
-    nbd_recv_coroutines_enter_all(client);
+    shutdown(c->sock, 2);
+    nbd_recv_coroutines_enter_all(c);
 
-    nbd_client_detach_aio_context(bs);
-    closesocket(client->sock);
-    client->sock = -1;
+    aio_set_fd_handler(bdrv_get_aio_context(c->bs), c->sock,
+                       NULL, NULL, NULL);
+    closesocket(c->sock);
+    c->sock = -1;
 }
 
 static void nbd_reply_ready(void *opaque)
 {
-    BlockDriverState *bs = opaque;
-    NbdClientSession *s = nbd_get_client_session(bs);
+    NbdClientConnection *c = opaque;
     uint64_t i;
     int ret;
 
-    if (s->reply.handle == 0) {
+    if (c->reply.handle == 0) {
         /* No reply already in flight.  Fetch a header.  It is possible
          * that another thread has done the same thing in parallel, so
-         * the socket is not readable anymore.
+         * the socket is not readable anymore, or that only part of the
+         * header has arrived; the rest is read on the next call.
          */
-        ret = nbd_receive_reply(s->sock, &s->reply);
+        ret = nbd_receive_reply(c->sock, &c->reply, &c->reply_hdr);
         if (ret == -EAGAIN) {
             return;
         }
         if (ret < 0) {
-            s->reply.handle = 0;
+            c->reply.handle = 0;
             goto fail;
         }
     }
@@ -81,122 +88,274 @@ static void nbd_reply_ready(void *opaque)
     /* There's no need for a mutex on the receive side, because the
      * handler acts as a synchronization point and ensures that only
      * one coroutine is called until the reply finishes.  */
-    i = HANDLE_TO_INDEX(s, s->reply.handle);
+    i = HANDLE_TO_INDEX(c, c->reply.handle);
     if (i >= MAX_NBD_REQUESTS) {
         goto fail;
     }
 
-    if (s->recv_coroutine[i]) {
-        qemu_coroutine_enter(s->recv_coroutine[i], NULL);
+    if (c->recv_coroutine[i]) {
+        qemu_coroutine_enter(c->recv_coroutine[i], NULL);
         return;
     }
 
 fail:
-    nbd_teardown_connection(bs);
+    nbd_teardown_connection(c);
 }
 
 static void nbd_restart_write(void *opaque)
 {
-    BlockDriverState *bs = opaque;
+    NbdClientConnection *c = opaque;
 
-    qemu_coroutine_enter(nbd_get_client_session(bs)->send_coroutine, NULL);
+    qemu_coroutine_enter(c->send_coroutine, NULL);
 }
 
-static int nbd_co_send_request(BlockDriverState *bs,
+/* Pick the connection with the fewest requests in flight, rotating the
+ * starting point so that ties are spread over all sockets.
+ */
+static NbdClientConnection *nbd_client_select(NbdClientSession *s)
+{
+    NbdClientConnection *best = NULL;
+    int i;
+
+    for (i = 0; i < s->num_conns; i++) {
+        NbdClientConnection *c = &s->conns[(s->next_conn + i) % s->num_conns];
+
+        if (c->sock == -1) {
+            continue;
+        }
+        if (!best || c->in_flight < best->in_flight) {
+            best = c;
+        }
+    }
+    s->next_conn++;
+
+    /* If every connection is gone, the request fails on the first one */
+    return best ? best : &s->conns[0];
+}
+
+static int nbd_co_send_request(NbdClientConnection *c,
                                struct nbd_request *request,
                                QEMUIOVector *qiov, int offset)
 {
-    NbdClientSession *s = nbd_get_client_session(bs);
+    NbdClientSession *s = nbd_get_client_session(c->bs);
     AioContext *aio_context;
     int rc, ret, i;
 
-    qemu_co_mutex_lock(&s->send_mutex);
+    qemu_co_mutex_lock(&c->send_mutex);
 
     for (i = 0; i < MAX_NBD_REQUESTS; i++) {
-        if (s->recv_coroutine[i] == NULL) {
-            s->recv_coroutine[i] = qemu_coroutine_self();
+        if (c->recv_coroutine[i] == NULL) {
+            c->recv_coroutine[i] = qemu_coroutine_self();
             break;
         }
     }
 
     assert(i < MAX_NBD_REQUESTS);
-    request->handle = INDEX_TO_HANDLE(s, i);
-    s->send_coroutine = qemu_coroutine_self();
-    aio_context = bdrv_get_aio_context(bs);
+    request->handle = INDEX_TO_HANDLE(c, i);
+
+    if (c->sock == -1) {
+        qemu_co_mutex_unlock(&c->send_mutex);
+        return -EIO;
+    }
 
-    aio_set_fd_handler(aio_context, s->sock,
-                       nbd_reply_ready, nbd_restart_write, bs);
+    c->send_coroutine = qemu_coroutine_self();
+    aio_context = bdrv_get_aio_context(c->bs);
+
+    aio_set_fd_handler(aio_context, c->sock,
+                       nbd_reply_ready, nbd_restart_write, c);
     if (qiov) {
         if (!s->is_unix) {
-            socket_set_cork(s->sock, 1);
+            socket_set_cork(c->sock, 1);
         }
-        rc = nbd_send_request(s->sock, request);
+        rc = nbd_send_request(c->sock, request);
         if (rc >= 0) {
-            ret = qemu_co_sendv(s->sock, qiov->iov, qiov->niov,
+            ret = qemu_co_sendv(c->sock, qiov->iov, qiov->niov,
                                 offset, request->len);
             if (ret != request->len) {
                 rc = -EIO;
             }
         }
         if (!s->is_unix) {
-            socket_set_cork(s->sock, 0);
+            socket_set_cork(c->sock, 0);
         }
     } else {
-        rc = nbd_send_request(s->sock, request);
+        rc = nbd_send_request(c->sock, request);
     }
-    aio_set_fd_handler(aio_context, s->sock, nbd_reply_ready, NULL, bs);
-    s->send_coroutine = NULL;
-    qemu_co_mutex_unlock(&s->send_mutex);
+    aio_set_fd_handler(aio_context, c->sock, nbd_reply_ready, NULL, c);
+    c->send_coroutine = NULL;
+    qemu_co_mutex_unlock(&c->send_mutex);
     return rc;
 }
 
-static void nbd_co_receive_reply(NbdClientSession *s,
+static int nbd_co_drop(int sock, uint32_t size)
+{
+    uint8_t buf[512];
+
+    while (size > 0) {
+        uint32_t n = MIN(size, sizeof(buf));
+
+        if (qemu_co_recv(sock, buf, n) != n) {
+            return -EIO;
+        }
+        size -= n;
+    }
+    return 0;
+}
+
+/* Consume the payload of one structured reply chunk.  Returns a negative
+ * errno if the chunk reports an error or does not match the request.
+ */
+static int nbd_co_receive_chunk(NbdClientConnection *c,
     struct nbd_request *request, struct nbd_reply *reply,
-    QEMUIOVector *qiov, int offset)
+    QEMUIOVector *qiov, int offset, NbdExtent *extent)
 {
+    uint8_t buf[8 + 4];
+    uint64_t from;
+    uint32_t len, hdr_len, error;
     int ret;
 
-    /* Wait until we're woken up by the read handler.  TODO: perhaps
-     * peek at the next reply and avoid yielding if it's ours?  */
-    qemu_coroutine_yield();
-    *reply = s->reply;
-    if (reply->handle != request->handle) {
-        reply->error = EIO;
-    } else {
-        if (qiov && reply->error == 0) {
-            ret = qemu_co_recvv(s->sock, qiov->iov, qiov->niov,
-                                offset, request->len);
-            if (ret != request->len) {
-                reply->error = EIO;
+    switch (reply->type) {
+    case NBD_REPLY_TYPE_NONE:
+        if (reply->length) {
+            break;
+        }
+        return 0;
+
+    case NBD_REPLY_TYPE_OFFSET_DATA:
+    case NBD_REPLY_TYPE_OFFSET_HOLE:
+        if (!qiov || reply->length < 8 ||
+            (reply->type == NBD_REPLY_TYPE_OFFSET_HOLE &&
+             reply->length != 8 + 4)) {
+            break;
+        }
+        hdr_len = reply->type == NBD_REPLY_TYPE_OFFSET_HOLE ? 8 + 4 : 8;
+        if (qemu_co_recv(c->sock, buf, hdr_len) != hdr_len) {
+            return -EIO;
+        }
+        from = be64_to_cpup((uint64_t *)buf);
+        if (reply->type == NBD_REPLY_TYPE_OFFSET_HOLE) {
+            len = be32_to_cpup((uint32_t *)(buf + 8));
+        } else {
+            len = reply->length - 8;
+        }
+        if (from < request->from ||
+            from + len > request->from + request->len) {
+            if (reply->type == NBD_REPLY_TYPE_OFFSET_DATA) {
+                nbd_co_drop(c->sock, len);
             }
+            return -EIO;
+        }
+        if (reply->type == NBD_REPLY_TYPE_OFFSET_HOLE) {
+            qemu_iovec_memset(qiov, offset + (from - request->from), 0, len);
+            return 0;
+        }
+        ret = qemu_co_recvv(c->sock, qiov->iov, qiov->niov,
+                            offset + (from - request->from), len);
+        return ret == len ? 0 : -EIO;
+
+    case NBD_REPLY_TYPE_BLOCK_STATUS:
+        if (!extent || reply->length < 4 + 8 || (reply->length - 4) % 8) {
+            break;
+        }
+        if (qemu_co_recv(c->sock, buf, sizeof(buf)) != sizeof(buf)) {
+            return -EIO;
+        }
+        /* Only the first extent is needed, see NBD_CMD_FLAG_REQ_ONE */
+        extent->length = be32_to_cpup((uint32_t *)(buf + 4));
+        extent->flags = be32_to_cpup((uint32_t *)(buf + 8));
+        if (nbd_co_drop(c->sock, reply->length - sizeof(buf)) < 0) {
+            return -EIO;
+        }
+        if (be32_to_cpup((uint32_t *)buf) !=
+            nbd_get_client_session(c->bs)->ext.context_id) {
+            return -EIO;
+        }
+        return 0;
+
+    case NBD_REPLY_TYPE_ERROR:
+    case NBD_REPLY_TYPE_ERROR_OFFSET:
+        if (reply->length < 4 + 2) {
+            break;
+        }
+        if (qemu_co_recv(c->sock, buf, 4) != 4 ||
+            nbd_co_drop(c->sock, reply->length - 4) < 0) {
+            return -EIO;
+        }
+        error = nbd_errno_to_system_errno(be32_to_cpup((uint32_t *)buf));
+        return error ? -error : -EIO;
+    }
+
+    /* Unknown or malformed chunk */
+    nbd_co_drop(c->sock, reply->length);
+    return -EIO;
+}
+
+static void nbd_co_receive_reply(NbdClientConnection *c,
+    struct nbd_request *request, struct nbd_reply *reply,
+    QEMUIOVector *qiov, int offset, NbdExtent *extent)
+{
+    int ret, error = 0;
+
+    for (;;) {
+        /* Wait until we're woken up by the read handler.  TODO: perhaps
+         * peek at the next reply and avoid yielding if it's ours?  */
+        qemu_coroutine_yield();
+        *reply = c->reply;
+        if (reply->handle != request->handle) {
+            reply->error = EIO;
+            return;
+        }
+
+        if (reply->magic == NBD_REPLY_MAGIC) {
+            if (qiov && reply->error == 0) {
+                ret = qemu_co_recvv(c->sock, qiov->iov, qiov->niov,
+                                    offset, request->len);
+                if (ret != request->len) {
+                    reply->error = EIO;
+                }
+            }
+        } else {
+            /* A structured reply may be split into several chunks; the
+             * first error wins but all of them must be consumed.
+             */
+            ret = nbd_co_receive_chunk(c, request, reply, qiov, offset,
+                                       extent);
+            if (ret < 0 && !error) {
+                error = -ret;
+            }
+            reply->error = error;
         }
 
         /* Tell the read handler to read another header.  */
-        s->reply.handle = 0;
+        c->reply.handle = 0;
+
+        if (reply->flags & NBD_REPLY_FLAG_DONE) {
+            return;
+        }
     }
 }
 
-static void nbd_coroutine_start(NbdClientSession *s,
+static void nbd_coroutine_start(NbdClientConnection *c,
    struct nbd_request *request)
 {
     /* Poor man semaphore.  The free_sema is locked when no other request
      * can be accepted, and unlocked after receiving one reply.  */
-    if (s->in_flight >= MAX_NBD_REQUESTS - 1) {
-        qemu_co_mutex_lock(&s->free_sema);
-        assert(s->in_flight < MAX_NBD_REQUESTS);
+    if (c->in_flight >= MAX_NBD_REQUESTS - 1) {
+        qemu_co_mutex_lock(&c->free_sema);
+        assert(c->in_flight < MAX_NBD_REQUESTS);
     }
-    s->in_flight++;
+    c->in_flight++;
 
-    /* s->recv_coroutine[i] is set as soon as we get the send_lock.  */
+    /* c->recv_coroutine[i] is set as soon as we get the send_lock.  */
 }
 
-static void nbd_coroutine_end(NbdClientSession *s,
+static void nbd_coroutine_end(NbdClientConnection *c,
     struct nbd_request *request)
 {
-    int i = HANDLE_TO_INDEX(s, request->handle);
-    s->recv_coroutine[i] = NULL;
-    if (s->in_flight-- == MAX_NBD_REQUESTS) {
-        qemu_co_mutex_unlock(&s->free_sema);
+    int i = HANDLE_TO_INDEX(c, request->handle);
+    c->recv_coroutine[i] = NULL;
+    if (c->in_flight-- == MAX_NBD_REQUESTS) {
+        qemu_co_mutex_unlock(&c->free_sema);
     }
 }
 
@@ -205,6 +364,7 @@ static int nbd_co_readv_1(BlockDriverState *bs, int64_t sector_num,
                           int offset)
 {
     NbdClientSession *client = nbd_get_client_session(bs);
+    NbdClientConnection *conn = nbd_client_select(client);
     struct nbd_request request = { .type = NBD_CMD_READ };
     struct nbd_reply reply;
     ssize_t ret;
@@ -212,14 +372,14 @@ static int nbd_co_readv_1(BlockDriverState *bs, int64_t sector_num,
     request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL, 0);
+    nbd_coroutine_start(conn, &request);
+    ret = nbd_co_send_request(conn, &request, NULL, 0);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, qiov, offset);
+        nbd_co_receive_reply(conn, &request, &reply, qiov, offset, NULL);
     }
-    nbd_coroutine_end(client, &request);
+    nbd_coroutine_end(conn, &request);
     return -reply.error;
 
 }
@@ -229,6 +389,7 @@ static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
                            int offset)
 {
     NbdClientSession *client = nbd_get_client_session(bs);
+    NbdClientConnection *conn = nbd_client_select(client);
     struct nbd_request request = { .type = NBD_CMD_WRITE };
     struct nbd_reply reply;
     ssize_t ret;
@@ -241,14 +402,14 @@ static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
     request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, qiov, offset);
+    nbd_coroutine_start(conn, &request);
+    ret = nbd_co_send_request(conn, &request, qiov, offset);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL, 0);
+        nbd_co_receive_reply(conn, &request, &reply, NULL, 0, NULL);
     }
-    nbd_coroutine_end(client, &request);
+    nbd_coroutine_end(conn, &request);
     return -reply.error;
 }
 
@@ -290,9 +451,65 @@ int nbd_client_co_writev(BlockDriverState *bs, int64_t sector_num,
     return nbd_co_writev_1(bs, sector_num, nb_sectors, qiov, offset);
 }
 
+int64_t nbd_client_co_get_block_status(BlockDriverState *bs,
+                                       int64_t sector_num,
+                                       int nb_sectors, int *pnum)
+{
+    NbdClientSession *client = nbd_get_client_session(bs);
+    NbdClientConnection *conn;
+    struct nbd_request request = {
+        .type = NBD_CMD_BLOCK_STATUS | NBD_CMD_FLAG_REQ_ONE,
+    };
+    struct nbd_reply reply;
+    NbdExtent extent = { 0, 0 };
+    int64_t status;
+    ssize_t ret;
+
+    if (!client->ext.base_allocation) {
+        *pnum = nb_sectors;
+        return BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID |
+               (sector_num * BDRV_SECTOR_SIZE);
+    }
+
+    nb_sectors = MIN(nb_sectors, NBD_MAX_STATUS_SECTORS);
+    request.from = sector_num * 512;
+    request.len = nb_sectors * 512;
+
+    conn = nbd_client_select(client);
+    nbd_coroutine_start(conn, &request);
+    ret = nbd_co_send_request(conn, &request, NULL, 0);
+    if (ret < 0) {
+        reply.error = -ret;
+    } else {
+        nbd_co_receive_reply(conn, &request, &reply, NULL, 0, &extent);
+    }
+    nbd_coroutine_end(conn, &request);
+    if (reply.error) {
+        return -reply.error;
+    }
+
+    if (extent.length < 512) {
+        /* Sub-sector extent: we cannot describe it, so call it data */
+        extent.length = 512;
+        extent.flags = 0;
+    }
+
+    *pnum = MIN(extent.length / 512, nb_sectors);
+    status = 0;
+    if (!(extent.flags & NBD_STATE_HOLE)) {
+        status |= BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID |
+                  (sector_num * BDRV_SECTOR_SIZE);
+    }
+    if (extent.flags & NBD_STATE_ZERO) {
+        status |= BDRV_BLOCK_ZERO;
+    }
+    return status;
+}
+
 int nbd_client_co_flush(BlockDriverState *bs)
 {
     NbdClientSession *client = nbd_get_client_session(bs);
+    NbdClientConnection *conn;
     struct nbd_request request = { .type = NBD_CMD_FLUSH };
     struct nbd_reply reply;
     ssize_t ret;
@@ -308,14 +525,19 @@ int nbd_client_co_flush(BlockDriverState *bs)
     request.from = 0;
     request.len = 0;
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL, 0);
+    /* Multiple connections are only opened if the server sets
+     * NBD_FLAG_CAN_MULTI_CONN, which guarantees that a flush on one of
+     * them covers every write completed on the others.
+     */
+    conn = nbd_client_select(client);
+    nbd_coroutine_start(conn, &request);
+    ret = nbd_co_send_request(conn, &request, NULL, 0);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL, 0);
+        nbd_co_receive_reply(conn, &request, &reply, NULL, 0, NULL);
     }
-    nbd_coroutine_end(client, &request);
+    nbd_coroutine_end(conn, &request);
     return -reply.error;
 }
 
@@ -323,6 +545,7 @@ int nbd_client_co_discard(BlockDriverState *bs, int64_t sector_num,
                           int nb_sectors)
 {
     NbdClientSession *client = nbd_get_client_session(bs);
+    NbdClientConnection *conn;
     struct nbd_request request = { .type = NBD_CMD_TRIM };
     struct nbd_reply reply;
     ssize_t ret;
@@ -333,29 +556,44 @@ int nbd_client_co_discard(BlockDriverState *bs, int64_t sector_num,
     request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL, 0);
+    conn = nbd_client_select(client);
+    nbd_coroutine_start(conn, &request);
+    ret = nbd_co_send_request(conn, &request, NULL, 0);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL, 0);
+        nbd_co_receive_reply(conn, &request, &reply, NULL, 0, NULL);
     }
-    nbd_coroutine_end(client, &request);
+    nbd_coroutine_end(conn, &request);
     return -reply.error;
 
 }
 
 void nbd_client_detach_aio_context(BlockDriverState *bs)
 {
-    aio_set_fd_handler(bdrv_get_aio_context(bs),
-                       nbd_get_client_session(bs)->sock, NULL, NULL, NULL);
+    NbdClientSession *client = nbd_get_client_session(bs);
+    int i;
+
+    for (i = 0; i < client->num_conns; i++) {
+        if (client->conns[i].sock != -1) {
+            aio_set_fd_handler(bdrv_get_aio_context(bs),
+                               client->conns[i].sock, NULL, NULL, NULL);
+        }
+    }
 }
 
 void nbd_client_attach_aio_context(BlockDriverState *bs,
                                    AioContext *new_context)
 {
-    aio_set_fd_handler(new_context, nbd_get_client_session(bs)->sock,
-                       nbd_reply_ready, NULL, bs);
+    NbdClientSession *client = nbd_get_client_session(bs);
+    int i;
+
+    for (i = 0; i < client->num_conns; i++) {
+        if (client->conns[i].sock != -1) {
+            aio_set_fd_handler(new_context, client->conns[i].sock,
+                               nbd_reply_ready, NULL, &client->conns[i]);
+        }
+    }
 }
 
 void nbd_client_close(BlockDriverState *bs)
@@ -366,14 +604,34 @@ void nbd_client_close(BlockDriverState *bs)
         .from = 0,
         .len = 0
     };
+    int i;
 
-    if (client->sock == -1) {
-        return;
+    for (i = 0; i < client->num_conns; i++) {
+        NbdClientConnection *c = &client->conns[i];
+
+        if (c->sock == -1) {
+            continue;
+        }
+
+        nbd_send_request(c->sock, &request);
+
+        nbd_teardown_connection(c);
     }
+}
 
-    nbd_send_request(client->sock, &request);
+static void nbd_client_connection_start(BlockDriverState *bs,
+                                        NbdClientConnection *c, int sock)
+{
+    c->bs = bs;
+    qemu_co_mutex_init(&c->send_mutex);
+    qemu_co_mutex_init(&c->free_sema);
+    c->sock = sock;
 
-    nbd_teardown_connection(bs);
+    /* Now that we're connected, set the socket to be non-blocking and
+     * kick the reply mechanism.  */
+    qemu_set_nonblock(sock);
+    aio_set_fd_handler(bdrv_get_aio_context(bs), sock,
+                       nbd_reply_ready, NULL, c);
 }
 
 int nbd_client_init(BlockDriverState *bs, int sock, const char *export,
@@ -385,23 +643,62 @@ int nbd_client_init(BlockDriverState *bs, int sock, const char *export,
     /* NBD handshake */
     logout("session init %s\n", export);
     qemu_set_block(sock);
+    memset(&client->ext, 0, sizeof(client->ext));
     ret = nbd_receive_negotiate(sock, export,
-                                &client->nbdflags, &client->size, errp);
+                                &client->nbdflags, &client->size,
+                                client->no_extensions ? NULL : &client->ext,
+                                errp);
     if (ret < 0) {
         logout("Failed to negotiate with the NBD server\n");
         closesocket(sock);
         return ret;
     }
 
-    qemu_co_mutex_init(&client->send_mutex);
-    qemu_co_mutex_init(&client->free_sema);
-    client->sock = sock;
-
-    /* Now that we're connected, set the socket to be non-blocking and
-     * kick the reply mechanism.  */
-    qemu_set_nonblock(sock);
-    nbd_client_attach_aio_context(bs, bdrv_get_aio_context(bs));
+    client->num_conns = 1;
+    nbd_client_connection_start(bs, &client->conns[0], sock);
 
     logout("Established connection with NBD server\n");
     return 0;
 }
+
+/* Open one more socket to the export that nbd_client_init() connected
+ * to.  The caller must check NBD_FLAG_CAN_MULTI_CONN first.
+ */
+int nbd_client_add_connection(BlockDriverState *bs, int sock,
+                              const char *export, Error **errp)
+{
+    NbdClientSession *client = nbd_get_client_session(bs);
+    uint32_t nbdflags;
+    off_t size;
+    NBDExtensions ext;
+    int ret;
+
+    assert(client->num_conns > 0 && client->num_conns < NBD_MAX_CONNECTIONS);
+    assert(client->nbdflags & NBD_FLAG_CAN_MULTI_CONN);
+
+    qemu_set_block(sock);
+    memset(&ext, 0, sizeof(ext));
+    ret = nbd_receive_negotiate(sock, export, &nbdflags, &size,
+                                client->no_extensions ? NULL : &ext, errp);
+    if (ret < 0) {
+        logout("Failed to negotiate with the NBD server\n");
+        closesocket(sock);
+        return ret;
+    }
+
+    if (nbdflags != client->nbdflags || size != client->size ||
+        ext.structured_reply != client->ext.structured_reply ||
+        ext.base_allocation != client->ext.base_allocation ||
+        ext.context_id != client->ext.context_id) {
+        error_setg(errp, "NBD export changed while opening connection %d",
+                   client->num_conns + 1);
+        closesocket(sock);
+        return -EIO;
+    }
+
+    nbd_client_connection_start(bs, &client->conns[client->num_conns++],
+                                sock);
+
+    logout("Established connection %d with NBD server\n", client->num_conns);
+    return 0;
+}
@@ -44,8 +44,22 @@
 typedef struct BDRVNBDState {
     NbdClientSession client;
     QemuOpts *socket_opts;
+    int connections;
 } BDRVNBDState;
 
+static QemuOptsList nbd_runtime_opts = {
+    .name = "nbd",
+    .head = QTAILQ_HEAD_INITIALIZER(nbd_runtime_opts.head),
+    .desc = {
+        {
+            .name = "connections",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of sockets to open to the export",
+        },
+        { /* end of list */ }
+    },
+};
+
 static int nbd_parse_uri(const char *filename, QDict *options)
 {
     URI *uri;
@@ -194,6 +208,7 @@ static void nbd_config(BDRVNBDState *s, QDict *options, char **export,
                        Error **errp)
 {
     Error *local_err = NULL;
+    QemuOpts *opts;
 
     if (qdict_haskey(options, "path") == qdict_haskey(options, "host")) {
         if (qdict_haskey(options, "path")) {
@@ -223,6 +238,22 @@ static void nbd_config(BDRVNBDState *s, QDict *options, char **export,
     if (*export) {
         qdict_del(options, "export");
     }
+
+    opts = qemu_opts_create(&nbd_runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        goto out;
+    }
+
+    s->connections = qemu_opt_get_number(opts, "connections", 1);
+    if (s->connections < 1 || s->connections > NBD_MAX_CONNECTIONS) {
+        error_setg(errp, "connections must be between 1 and %d",
+                   NBD_MAX_CONNECTIONS);
+    }
+
+out:
+    qemu_opts_del(opts);
 }
 
 NbdClientSession *nbd_get_client_session(BlockDriverState *bs)
@@ -259,13 +290,14 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
 {
     BDRVNBDState *s = bs->opaque;
     char *export = NULL;
-    int result, sock;
+    int result, sock, i;
     Error *local_err = NULL;
 
     /* Pop the config into our state object. Exit if invalid. */
     nbd_config(s, options, &export, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
+        g_free(export);
         return -EINVAL;
     }
 
@@ -279,7 +311,49 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     /* NBD handshake */
-    result = nbd_client_init(bs, sock, export, errp);
+    result = nbd_client_init(bs, sock, export, &local_err);
+    if (result == -ENOTSUP) {
+        error_free(local_err);
+        local_err = NULL;
+        s->client.no_extensions = true;
+        sock = nbd_establish_connection(bs, errp);
+        if (sock < 0) {
+            g_free(export);
+            return sock;
+        }
+        result = nbd_client_init(bs, sock, export, &local_err);
+    }
+    if (result < 0) {
+        error_propagate(errp, local_err);
+        goto out;
+    }
+
+    /* Additional connections are only safe if the server promises that
+     * a flush on one of them covers writes completed on all others.
+     */
+    if (s->connections > 1 &&
+        !(s->client.nbdflags & NBD_FLAG_CAN_MULTI_CONN)) {
+        error_report("warning: NBD server does not support multiple "
+                     "connections, using a single one");
+        goto out;
+    }
+
+    for (i = 1; i < s->connections; i++) {
+        sock = nbd_establish_connection(bs, errp);
+        if (sock < 0) {
+            result = sock;
+            break;
+        }
+        result = nbd_client_add_connection(bs, sock, export, errp);
+        if (result < 0) {
+            break;
+        }
+    }
+    if (result < 0) {
+        nbd_client_close(bs);
+    }
+
+out:
     g_free(export);
     return result;
 }
@@ -301,6 +375,13 @@ static int nbd_co_flush(BlockDriverState *bs)
     return nbd_client_co_flush(bs);
 }
 
+static int64_t coroutine_fn nbd_co_get_block_status(BlockDriverState *bs,
+                                                   int64_t sector_num,
+                                                   int nb_sectors, int *pnum)
+{
+    return nbd_client_co_get_block_status(bs, sector_num, nb_sectors, pnum);
+}
+
 static void nbd_refresh_limits(BlockDriverState *bs, Error **errp)
 {
     bs->bl.max_discard = UINT32_MAX >> BDRV_SECTOR_BITS;
@@ -346,6 +427,7 @@ static void nbd_refresh_filename(BlockDriverState *bs)
     const char *host   = qdict_get_try_str(bs->options, "host");
     const char *port   = qdict_get_try_str(bs->options, "port");
     const char *export = qdict_get_try_str(bs->options, "export");
+    const char *connections = qdict_get_try_str(bs->options, "connections");
 
     qdict_put_obj(opts, "driver", QOBJECT(qstring_from_str("nbd")));
 
@@ -380,6 +462,10 @@ static void nbd_refresh_filename(BlockDriverState *bs)
     if (export) {
         qdict_put_obj(opts, "export", QOBJECT(qstring_from_str(export)));
     }
+    if (connections) {
+        qdict_put_obj(opts, "connections",
+                      QOBJECT(qstring_from_str(connections)));
+    }
 
     bs->full_open_options = opts;
 }
@@ -395,6 +481,7 @@ static BlockDriver bdrv_nbd = {
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_discard            = nbd_co_discard,
+    .bdrv_co_get_block_status   = nbd_co_get_block_status,
     .bdrv_refresh_limits        = nbd_refresh_limits,
     .bdrv_getlength             = nbd_getlength,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
@@ -413,6 +500,7 @@ static BlockDriver bdrv_nbd_tcp = {
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_discard            = nbd_co_discard,
+    .bdrv_co_get_block_status   = nbd_co_get_block_status,
     .bdrv_refresh_limits        = nbd_refresh_limits,
     .bdrv_getlength             = nbd_getlength,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
@@ -431,6 +519,7 @@ static BlockDriver bdrv_nbd_unix = {
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_discard            = nbd_co_discard,
+    .bdrv_co_get_block_status   = nbd_co_get_block_status,
     .bdrv_refresh_limits        = nbd_refresh_limits,
     .bdrv_getlength             = nbd_getlength,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
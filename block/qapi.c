@@ -24,6 +24,7 @@
 
 #include "block/qapi.h"
 #include "block/block_int.h"
+#include "block/throttle-groups.h"
 #include "block/write-threshold.h"
 #include "qmp-commands.h"
 #include "qapi-visit.h"
@@ -63,9 +64,11 @@ BlockDeviceInfo *bdrv_block_device_info(BlockDriverState *bs, Error **errp)
     info->backing_file_depth = bdrv_get_backing_file_depth(bs);
     info->detect_zeroes = bs->detect_zeroes;
 
-    if (bs->io_limits_enabled) {
+    if (bs->throttle_state) {
         ThrottleConfig cfg;
-        throttle_get_config(&bs->throttle_state, &cfg);
+
+        throttle_group_get_config(bs, &cfg);
+
         info->bps     = cfg.buckets[THROTTLE_BPS_TOTAL].avg;
         info->bps_rd  = cfg.buckets[THROTTLE_BPS_READ].avg;
         info->bps_wr  = cfg.buckets[THROTTLE_BPS_WRITE].avg;
@@ -90,6 +93,9 @@ BlockDeviceInfo *bdrv_block_device_info(BlockDriverState *bs, Error **errp)
 
         info->has_iops_size = cfg.op_size;
         info->iops_size = cfg.op_size;
+
+        info->has_group = true;
+        info->group = g_strdup(throttle_group_get_name(bs));
     }
 
     info->write_threshold = bdrv_write_threshold_get(bs);
@@ -320,10 +326,38 @@ static void bdrv_query_info(BlockBackend *blk, BlockInfo **p_info,
     qapi_free_BlockInfo(info);
 }
 
-static BlockStats *bdrv_query_stats(const BlockDriverState *bs,
+static BlockLatencyHistogramInfo *
+bdrv_latency_histogram_stats(BlockLatencyHistogram *hist)
+{
+    BlockLatencyHistogramInfo *info;
+    uint64List **boundaries, **bins;
+    int i;
+
+    info = g_new0(BlockLatencyHistogramInfo, 1);
+    boundaries = &info->boundaries;
+    bins = &info->bins;
+
+    for (i = 0; i < hist->nbins; i++) {
+        if (i < hist->nbins - 1) {
+            *boundaries = g_new0(uint64List, 1);
+            (*boundaries)->value = hist->boundaries[i];
+            boundaries = &(*boundaries)->next;
+        }
+        *bins = g_new0(uint64List, 1);
+        (*bins)->value = hist->bins[i];
+        bins = &(*bins)->next;
+    }
+
+    return info;
+}
+
+static BlockStats *bdrv_query_stats(BlockDriverState *bs,
                                     bool query_backing)
 {
     BlockStats *s;
+    BlockAcctStats *stats = &bs->stats;
+    BlockAcctTimedStats *ts = NULL;
+    BlockLatencyHistogram *hist;
 
     s = g_malloc0(sizeof(*s));
 
@@ -351,6 +385,73 @@ static BlockStats *bdrv_query_stats(const BlockDriverState *bs,
     s->stats->rd_total_time_ns = bs->stats.total_time_ns[BLOCK_ACCT_READ];
     s->stats->flush_total_time_ns = bs->stats.total_time_ns[BLOCK_ACCT_FLUSH];
 
+    s->stats->failed_rd_operations = stats->failed_ops[BLOCK_ACCT_READ];
+    s->stats->failed_wr_operations = stats->failed_ops[BLOCK_ACCT_WRITE];
+    s->stats->failed_flush_operations = stats->failed_ops[BLOCK_ACCT_FLUSH];
+    s->stats->invalid_rd_operations = stats->invalid_ops[BLOCK_ACCT_READ];
+    s->stats->invalid_wr_operations = stats->invalid_ops[BLOCK_ACCT_WRITE];
+    s->stats->invalid_flush_operations = stats->invalid_ops[BLOCK_ACCT_FLUSH];
+    s->stats->account_invalid = stats->account_invalid;
+    s->stats->account_failed = stats->account_failed;
+
+    s->stats->has_idle_time_ns = stats->last_access_time_ns > 0;
+    if (s->stats->has_idle_time_ns) {
+        s->stats->idle_time_ns = block_acct_idle_time_ns(stats);
+    }
+
+    while ((ts = block_acct_interval_next(stats, ts))) {
+        BlockDeviceTimedStatsList *timed_stats =
+            g_malloc0(sizeof(*timed_stats));
+        BlockDeviceTimedStats *dev_stats = g_malloc0(sizeof(*dev_stats));
+        TimedAverage *rd = &ts->latency[BLOCK_ACCT_READ];
+        TimedAverage *wr = &ts->latency[BLOCK_ACCT_WRITE];
+        TimedAverage *fl = &ts->latency[BLOCK_ACCT_FLUSH];
+
+        timed_stats->next = s->stats->timed_stats;
+        timed_stats->value = dev_stats;
+        s->stats->timed_stats = timed_stats;
+
+        dev_stats->interval_length = ts->interval_length;
+
+        dev_stats->min_rd_latency_ns = timed_average_min(rd);
+        dev_stats->max_rd_latency_ns = timed_average_max(rd);
+        dev_stats->avg_rd_latency_ns = timed_average_avg(rd);
+
+        dev_stats->min_wr_latency_ns = timed_average_min(wr);
+        dev_stats->max_wr_latency_ns = timed_average_max(wr);
+        dev_stats->avg_wr_latency_ns = timed_average_avg(wr);
+
+        dev_stats->min_flush_latency_ns = timed_average_min(fl);
+        dev_stats->max_flush_latency_ns = timed_average_max(fl);
+        dev_stats->avg_flush_latency_ns = timed_average_avg(fl);
+
+        dev_stats->avg_rd_queue_depth =
+            block_acct_queue_depth(ts, BLOCK_ACCT_READ);
+        dev_stats->avg_wr_queue_depth =
+            block_acct_queue_depth(ts, BLOCK_ACCT_WRITE);
+
+        dev_stats->rd_iops = block_acct_iops(ts, BLOCK_ACCT_READ);
+        dev_stats->wr_iops = block_acct_iops(ts, BLOCK_ACCT_WRITE);
+        dev_stats->flush_iops = block_acct_iops(ts, BLOCK_ACCT_FLUSH);
+    }
+
+    hist = stats->latency_histogram;
+    s->stats->has_rd_latency_histogram = hist[BLOCK_ACCT_READ].nbins > 0;
+    if (s->stats->has_rd_latency_histogram) {
+        s->stats->rd_latency_histogram =
+            bdrv_latency_histogram_stats(&hist[BLOCK_ACCT_READ]);
+    }
+    s->stats->has_wr_latency_histogram = hist[BLOCK_ACCT_WRITE].nbins > 0;
+    if (s->stats->has_wr_latency_histogram) {
+        s->stats->wr_latency_histogram =
+            bdrv_latency_histogram_stats(&hist[BLOCK_ACCT_WRITE]);
+    }
+    s->stats->has_flush_latency_histogram = hist[BLOCK_ACCT_FLUSH].nbins > 0;
+    if (s->stats->has_flush_latency_histogram) {
+        s->stats->flush_latency_histogram =
+            bdrv_latency_histogram_stats(&hist[BLOCK_ACCT_FLUSH]);
+    }
+
     if (bs->file) {
         s->has_parent = true;
         s->parent = bdrv_query_stats(bs->file, query_backing);
@@ -0,0 +1,704 @@
+/*
+ * Persistent dirty bitmaps for the QCOW version 2 format
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Bitmaps are described by a directory pointed to by the bitmaps header
+ * extension.  Each directory entry points to a bitmap table with one entry
+ * per cluster of bitmap data; an entry of 0 stands for a cluster of zeroes.
+ * Bitmap data is stored little endian, one bit per granularity unit.
+ *
+ * The extension is only valid while the bitmaps autoclear bit is set, so an
+ * older qemu that modifies the image implicitly invalidates the bitmaps.
+ * Bitmaps that are loaded by a writable qemu are flagged as in use on disk
+ * until they are saved again on close or when the image is handed over to
+ * another qemu by migration; a bitmap that is still flagged when
+ * the image is opened has missed writes and is discarded.
+ */
+
+#include "qemu-common.h"
+#include "qemu/error-report.h"
+#include "qemu/hbitmap.h"
+#include "block/block_int.h"
+#include "block/qcow2.h"
+
+typedef struct Qcow2BitmapDirEntry {
+    uint64_t bitmap_table_offset;
+    uint32_t bitmap_table_size;
+    uint32_t flags;
+    uint8_t type;
+    uint8_t granularity_bits;
+    uint16_t name_size;
+    uint32_t extra_data_size;
+    /* extra data and name follow, padded to a multiple of 8 bytes */
+} QEMU_PACKED Qcow2BitmapDirEntry;
+
+/* Number of sectors covered by one cluster of bitmap data */
+static uint64_t bitmap_sectors_per_cluster(BDRVQcowState *s,
+                                           int granularity_bits)
+{
+    return ((uint64_t)s->cluster_size * 8) <<
+           (granularity_bits - BDRV_SECTOR_BITS);
+}
+
+static uint32_t bitmap_table_size(BDRVQcowState *s, int64_t nb_sectors,
+                                  int granularity_bits)
+{
+    return DIV_ROUND_UP(nb_sectors,
+                        bitmap_sectors_per_cluster(s, granularity_bits));
+}
+
+static size_t dir_entry_size(size_t name_size, size_t extra_data_size)
+{
+    return align_offset(sizeof(Qcow2BitmapDirEntry) + name_size +
+                        extra_data_size, 8);
+}
+
+static void free_bitmap_list(Qcow2Bitmap *bitmaps, uint32_t nb_bitmaps)
+{
+    uint32_t i;
+
+    if (bitmaps == NULL) {
+        return;
+    }
+    for (i = 0; i < nb_bitmaps; i++) {
+        g_free(bitmaps[i].name);
+    }
+    g_free(bitmaps);
+}
+
+void qcow2_free_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    free_bitmap_list(s->bitmaps, s->nb_bitmaps);
+    s->bitmaps = NULL;
+    s->nb_bitmaps = 0;
+}
+
+int qcow2_read_bitmaps(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2BitmapDirEntry e;
+    uint8_t *dir;
+    uint64_t pos;
+    uint32_t i;
+    size_t entry_size;
+    int ret;
+
+    if (!s->nb_bitmaps) {
+        s->bitmaps = NULL;
+        return 0;
+    }
+
+    if (s->nb_bitmaps > QCOW2_MAX_BITMAPS) {
+        error_setg(errp, "Too many persistent bitmaps");
+        s->nb_bitmaps = 0;
+        return -EFBIG;
+    }
+    if (s->bitmap_directory_size > QCOW2_MAX_BITMAP_DIRECTORY_SIZE) {
+        error_setg(errp, "Bitmap directory too large");
+        s->nb_bitmaps = 0;
+        return -EFBIG;
+    }
+    if (offset_into_cluster(s, s->bitmap_directory_offset)) {
+        error_setg(errp, "Invalid bitmap directory offset");
+        s->nb_bitmaps = 0;
+        return -EINVAL;
+    }
+
+    dir = g_try_malloc(s->bitmap_directory_size);
+    s->bitmaps = g_try_new0(Qcow2Bitmap, s->nb_bitmaps);
+    if (dir == NULL || s->bitmaps == NULL) {
+        error_setg(errp, "Could not allocate bitmap directory");
+        ret = -ENOMEM;
+        goto fail;
+    }
+
+    ret = bdrv_pread(bs->file, s->bitmap_directory_offset, dir,
+                     s->bitmap_directory_size);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read bitmap directory");
+        goto fail;
+    }
+
+    pos = 0;
+    for (i = 0; i < s->nb_bitmaps; i++) {
+        Qcow2Bitmap *bm = &s->bitmaps[i];
+
+        if (pos + sizeof(e) > s->bitmap_directory_size) {
+            goto invalid;
+        }
+        memcpy(&e, dir + pos, sizeof(e));
+        be64_to_cpus(&e.bitmap_table_offset);
+        be32_to_cpus(&e.bitmap_table_size);
+        be32_to_cpus(&e.flags);
+        be16_to_cpus(&e.name_size);
+        be32_to_cpus(&e.extra_data_size);
+
+        entry_size = dir_entry_size(e.name_size, e.extra_data_size);
+        if (pos + entry_size > s->bitmap_directory_size ||
+            e.type != QCOW2_BITMAP_TYPE_DIRTY_TRACKING ||
+            e.granularity_bits < QCOW2_MIN_BITMAP_GRANULARITY_BITS ||
+            e.granularity_bits > QCOW2_MAX_BITMAP_GRANULARITY_BITS ||
+            e.name_size == 0 || e.name_size > QCOW2_MAX_BITMAP_NAME_SIZE ||
+            (e.flags & ~QCOW2_BITMAP_FLAGS_MASK) ||
+            offset_into_cluster(s, e.bitmap_table_offset))
+        {
+            goto invalid;
+        }
+
+        /* Extra data is reserved for future extensions and ignored */
+        bm->name = g_strndup((char *)dir + pos + sizeof(e) +
+                             e.extra_data_size, e.name_size);
+        bm->table_offset = e.bitmap_table_offset;
+        bm->table_size = e.bitmap_table_size;
+        bm->flags = e.flags;
+        bm->granularity_bits = e.granularity_bits;
+        bm->entry_offset = pos;
+
+        pos += entry_size;
+    }
+
+    g_free(dir);
+    return 0;
+
+invalid:
+    error_setg(errp, "Invalid entry in bitmap directory");
+    ret = -EINVAL;
+fail:
+    g_free(dir);
+    qcow2_free_bitmaps(bs);
+    return ret;
+}
+
+/* Serialize the bitmap list into a directory buffer */
+static uint8_t *build_bitmap_directory(Qcow2Bitmap *bitmaps,
+                                       uint32_t nb_bitmaps, uint64_t *size)
+{
+    Qcow2BitmapDirEntry e;
+    uint8_t *dir;
+    uint64_t pos;
+    uint32_t i;
+
+    *size = 0;
+    for (i = 0; i < nb_bitmaps; i++) {
+        *size += dir_entry_size(strlen(bitmaps[i].name), 0);
+    }
+
+    dir = g_malloc0(*size);
+    pos = 0;
+    for (i = 0; i < nb_bitmaps; i++) {
+        Qcow2Bitmap *bm = &bitmaps[i];
+        size_t name_size = strlen(bm->name);
+
+        memset(&e, 0, sizeof(e));
+        e.bitmap_table_offset = cpu_to_be64(bm->table_offset);
+        e.bitmap_table_size = cpu_to_be32(bm->table_size);
+        e.flags = cpu_to_be32(bm->flags);
+        e.type = QCOW2_BITMAP_TYPE_DIRTY_TRACKING;
+        e.granularity_bits = bm->granularity_bits;
+        e.name_size = cpu_to_be16(name_size);
+
+        memcpy(dir + pos, &e, sizeof(e));
+        memcpy(dir + pos + sizeof(e), bm->name, name_size);
+        bm->entry_offset = pos;
+        pos += dir_entry_size(name_size, 0);
+    }
+
+    return dir;
+}
+
+int qcow2_read_bitmap_table(BlockDriverState *bs, Qcow2Bitmap *bm,
+                            uint64_t **table)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint32_t i;
+    int ret;
+
+    if (bm->table_size > QCOW_MAX_L1_SIZE / sizeof(uint64_t)) {
+        return -EFBIG;
+    }
+
+    *table = g_try_new(uint64_t, bm->table_size);
+    if (bm->table_size && *table == NULL) {
+        return -ENOMEM;
+    }
+
+    ret = bdrv_pread(bs->file, bm->table_offset, *table,
+                     bm->table_size * sizeof(uint64_t));
+    if (ret < 0) {
+        goto fail;
+    }
+
+    for (i = 0; i < bm->table_size; i++) {
+        be64_to_cpus(&(*table)[i]);
+        if (offset_into_cluster(s, (*table)[i])) {
+            ret = -EINVAL;
+            goto fail;
+        }
+    }
+
+    return 0;
+
+fail:
+    g_free(*table);
+    *table = NULL;
+    return ret;
+}
+
+static int load_bitmap_data(BlockDriverState *bs, Qcow2Bitmap *bm,
+                            BdrvDirtyBitmap *bitmap)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t sectors_per_cluster;
+    uint64_t *table;
+    uint8_t *buf;
+    int64_t size = bdrv_dirty_bitmap_size(bitmap);
+    uint32_t i;
+    int ret;
+
+    ret = qcow2_read_bitmap_table(bs, bm, &table);
+    if (ret < 0) {
+        return ret;
+    }
+
+    sectors_per_cluster = bitmap_sectors_per_cluster(s, bm->granularity_bits);
+    buf = g_malloc(s->cluster_size);
+
+    for (i = 0; i < bm->table_size; i++) {
+        uint64_t start = i * sectors_per_cluster;
+        uint64_t count = MIN(size - start, sectors_per_cluster);
+
+        if (table[i] == 0) {
+            memset(buf, 0, s->cluster_size);
+        } else {
+            ret = bdrv_pread(bs->file, table[i], buf, s->cluster_size);
+            if (ret < 0) {
+                goto out;
+            }
+        }
+        bdrv_dirty_bitmap_deserialize_part(bitmap, buf, start, count, false);
+    }
+    bdrv_dirty_bitmap_deserialize_finish(bitmap);
+    ret = 0;
+
+out:
+    g_free(buf);
+    g_free(table);
+    return ret;
+}
+
+int qcow2_load_bitmaps(BlockDriverState *bs, bool writable, Error **errp)
+{
+    BDRVQcowState *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap;
+    uint32_t flags;
+    bool mark_in_use = false;
+    uint32_t i;
+    int ret;
+
+    if (!s->nb_bitmaps) {
+        return 0;
+    }
+
+    for (i = 0; i < s->nb_bitmaps; i++) {
+        Qcow2Bitmap *bm = &s->bitmaps[i];
+
+        if (bm->flags & QCOW2_BITMAP_IN_USE) {
+            /* Read-only users might just race with a running qemu that owns
+             * the bitmap, so only complain when it is going to be dropped */
+            if (writable) {
+                error_report("qcow2: Dirty bitmap '%s' was not saved "
+                             "cleanly and is discarded", bm->name);
+            }
+            continue;
+        }
+
+        /* Still in memory if the image is being reopened */
+        if (!bdrv_find_dirty_bitmap(bs, bm->name)) {
+            if (bm->table_size != bitmap_table_size(s, bs->total_sectors,
+                                                    bm->granularity_bits)) {
+                error_report("qcow2: Dirty bitmap '%s' does not match the "
+                             "image size and is discarded", bm->name);
+                continue;
+            }
+
+            bitmap = bdrv_create_dirty_bitmap(bs, 1U << bm->granularity_bits,
+                                              bm->name, errp);
+            if (bitmap == NULL) {
+                ret = -EINVAL;
+                goto fail;
+            }
+
+            ret = load_bitmap_data(bs, bm, bitmap);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "Could not read dirty bitmap "
+                                 "'%s'", bm->name);
+                bdrv_release_dirty_bitmap(bs, bitmap);
+                goto fail;
+            }
+
+            bdrv_dirty_bitmap_set_persistence(bitmap, true);
+            if (!(bm->flags & QCOW2_BITMAP_AUTO)) {
+                bdrv_disable_dirty_bitmap(bitmap);
+            }
+        }
+
+        /* Only the flags change, so the entry can be updated in place */
+        if (writable) {
+            bm->flags |= QCOW2_BITMAP_IN_USE;
+            flags = cpu_to_be32(bm->flags);
+            ret = bdrv_pwrite(bs->file, s->bitmap_directory_offset +
+                              bm->entry_offset +
+                              offsetof(Qcow2BitmapDirEntry, flags),
+                              &flags, sizeof(flags));
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "Could not update bitmap "
+                                 "directory");
+                goto fail;
+            }
+            mark_in_use = true;
+        }
+    }
+
+    if (mark_in_use) {
+        ret = bdrv_flush(bs->file);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not update bitmap directory");
+            goto fail;
+        }
+    }
+
+    return 0;
+
+fail:
+    bitmap = NULL;
+    while ((bitmap = bdrv_dirty_bitmap_next(bs, bitmap)) != NULL) {
+        if (bdrv_dirty_bitmap_get_persistence(bitmap)) {
+            bdrv_release_dirty_bitmap(bs, bitmap);
+            bitmap = NULL;
+        }
+    }
+    return ret;
+}
+
+static void free_bitmap_clusters(BlockDriverState *bs, Qcow2Bitmap *bm,
+                                 uint64_t *table)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint32_t i;
+
+    for (i = 0; i < bm->table_size; i++) {
+        if (table[i]) {
+            qcow2_free_clusters(bs, table[i], s->cluster_size,
+                                QCOW2_DISCARD_OTHER);
+        }
+    }
+    if (bm->table_offset) {
+        qcow2_free_clusters(bs, bm->table_offset,
+                            bm->table_size * sizeof(uint64_t),
+                            QCOW2_DISCARD_OTHER);
+    }
+}
+
+/* Returns true if any sector in [start, start + count) is dirty */
+static bool bitmap_range_dirty(BdrvDirtyBitmap *bitmap,
+                               uint64_t start, uint64_t count)
+{
+    HBitmapIter hbi;
+    int64_t next;
+
+    bdrv_dirty_iter_init(bitmap, &hbi);
+    bdrv_set_dirty_iter(&hbi, start);
+    next = hbitmap_iter_next(&hbi);
+
+    return next >= 0 && (uint64_t)next < start + count;
+}
+
+static int store_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                        Qcow2Bitmap *bm, uint64_t **ptable)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t sectors_per_cluster;
+    int64_t size = bdrv_dirty_bitmap_size(bitmap);
+    int64_t offset;
+    uint64_t *table, *be_table;
+    uint8_t *buf;
+    uint32_t i;
+    int ret;
+
+    bm->name = g_strdup(bdrv_dirty_bitmap_name(bitmap));
+    bm->granularity_bits = ctz32(bdrv_dirty_bitmap_granularity(bitmap));
+    bm->flags = bdrv_dirty_bitmap_enabled(bitmap) ? QCOW2_BITMAP_AUTO : 0;
+    bm->table_size = bitmap_table_size(s, size, bm->granularity_bits);
+    bm->table_offset = 0;
+    if (bm->table_size == 0) {
+        *ptable = NULL;
+        return 0;
+    }
+
+    table = g_try_new0(uint64_t, bm->table_size);
+    if (bm->table_size && table == NULL) {
+        return -ENOMEM;
+    }
+    *ptable = table;
+
+    sectors_per_cluster = bitmap_sectors_per_cluster(s, bm->granularity_bits);
+    buf = qemu_blockalign(bs->file, s->cluster_size);
+
+    for (i = 0; i < bm->table_size; i++) {
+        uint64_t start = i * sectors_per_cluster;
+        uint64_t count = MIN(size - start, sectors_per_cluster);
+
+        /* All-zero clusters are not allocated */
+        if (!bitmap_range_dirty(bitmap, start, count)) {
+            continue;
+        }
+
+        memset(buf, 0, s->cluster_size);
+        bdrv_dirty_bitmap_serialize_part(bitmap, buf, start, count);
+
+        offset = qcow2_alloc_clusters(bs, s->cluster_size);
+        if (offset < 0) {
+            ret = offset;
+            goto out;
+        }
+        table[i] = offset;
+
+        ret = qcow2_pre_write_overlap_check(bs, 0, offset, s->cluster_size);
+        if (ret < 0) {
+            goto out;
+        }
+        ret = bdrv_pwrite(bs->file, offset, buf, s->cluster_size);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
+    offset = qcow2_alloc_clusters(bs, bm->table_size * sizeof(uint64_t));
+    if (offset < 0) {
+        ret = offset;
+        goto out;
+    }
+    bm->table_offset = offset;
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, offset,
+                                        bm->table_size * sizeof(uint64_t));
+    if (ret < 0) {
+        goto out;
+    }
+
+    be_table = g_new(uint64_t, bm->table_size);
+    for (i = 0; i < bm->table_size; i++) {
+        be_table[i] = cpu_to_be64(table[i]);
+    }
+    ret = bdrv_pwrite(bs->file, offset, be_table,
+                      bm->table_size * sizeof(uint64_t));
+    g_free(be_table);
+
+out:
+    qemu_vfree(buf);
+    return ret < 0 ? ret : 0;
+}
+
+/*
+ * Write all persistent bitmaps of @bs to newly allocated clusters, point the
+ * header to the new directory and then free the old bitmaps.  The bitmaps
+ * are written without the in-use flag, which marks them as consistent.
+ */
+int qcow2_store_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap = NULL;
+    Qcow2Bitmap *bitmaps = NULL, *old_bitmaps;
+    uint64_t **tables = NULL;
+    uint64_t *table;
+    uint32_t nb_bitmaps = 0, old_nb_bitmaps, i;
+    uint64_t dir_size = 0, old_dir_offset, old_dir_size;
+    uint64_t old_autoclear_features;
+    int64_t dir_offset = 0;
+    uint8_t *dir = NULL;
+    int ret = 0;
+
+    while ((bitmap = bdrv_dirty_bitmap_next(bs, bitmap)) != NULL) {
+        if (bdrv_dirty_bitmap_get_persistence(bitmap)) {
+            nb_bitmaps++;
+        }
+    }
+    if (nb_bitmaps == 0 && s->nb_bitmaps == 0) {
+        return 0;
+    }
+    if (s->qcow_version < 3) {
+        return -ENOTSUP;
+    }
+
+    bitmaps = g_new0(Qcow2Bitmap, nb_bitmaps);
+    tables = g_new0(uint64_t *, nb_bitmaps);
+
+    i = 0;
+    while ((bitmap = bdrv_dirty_bitmap_next(bs, bitmap)) != NULL) {
+        if (!bdrv_dirty_bitmap_get_persistence(bitmap)) {
+            continue;
+        }
+        ret = store_bitmap(bs, bitmap, &bitmaps[i], &tables[i]);
+        i++;
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    if (nb_bitmaps > 0) {
+        dir = build_bitmap_directory(bitmaps, nb_bitmaps, &dir_size);
+        if (dir_size > QCOW2_MAX_BITMAP_DIRECTORY_SIZE) {
+            ret = -EFBIG;
+            goto fail;
+        }
+
+        dir_offset = qcow2_alloc_clusters(bs, dir_size);
+        if (dir_offset < 0) {
+            ret = dir_offset;
+            dir_offset = 0;
+            goto fail;
+        }
+
+        ret = qcow2_pre_write_overlap_check(bs, 0, dir_offset, dir_size);
+        if (ret < 0) {
+            goto fail;
+        }
+        ret = bdrv_pwrite(bs->file, dir_offset, dir, dir_size);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    /* The new bitmaps and their refcounts must be stable on disk before the
+     * header points to them */
+    ret = bdrv_flush(bs);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    old_bitmaps = s->bitmaps;
+    old_nb_bitmaps = s->nb_bitmaps;
+    old_dir_offset = s->bitmap_directory_offset;
+    old_dir_size = s->bitmap_directory_size;
+    old_autoclear_features = s->autoclear_features;
+
+    s->bitmaps = bitmaps;
+    s->nb_bitmaps = nb_bitmaps;
+    s->bitmap_directory_offset = dir_offset;
+    s->bitmap_directory_size = dir_size;
+    if (nb_bitmaps > 0) {
+        s->autoclear_features |= QCOW2_AUTOCLEAR_BITMAPS;
+    } else {
+        s->autoclear_features &= ~QCOW2_AUTOCLEAR_BITMAPS;
+    }
+
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        s->bitmaps = old_bitmaps;
+        s->nb_bitmaps = old_nb_bitmaps;
+        s->bitmap_directory_offset = old_dir_offset;
+        s->bitmap_directory_size = old_dir_size;
+        s->autoclear_features = old_autoclear_features;
+        goto fail;
+    }
+
+    /* Free the old bitmaps, including those that were discarded on load */
+    for (i = 0; i < old_nb_bitmaps; i++) {
+        if (qcow2_read_bitmap_table(bs, &old_bitmaps[i], &table) < 0) {
+            /* Leaks the data clusters, which is harmless */
+            continue;
+        }
+        free_bitmap_clusters(bs, &old_bitmaps[i], table);
+        g_free(table);
+    }
+    if (old_nb_bitmaps > 0) {
+        qcow2_free_clusters(bs, old_dir_offset, old_dir_size,
+                            QCOW2_DISCARD_OTHER);
+    }
+    free_bitmap_list(old_bitmaps, old_nb_bitmaps);
+
+    for (i = 0; i < nb_bitmaps; i++) {
+        g_free(tables[i]);
+    }
+    g_free(tables);
+    g_free(dir);
+    return 0;
+
+fail:
+    for (i = 0; i < nb_bitmaps; i++) {
+        if (tables[i]) {
+            free_bitmap_clusters(bs, &bitmaps[i], tables[i]);
+            g_free(tables[i]);
+        }
+    }
+    if (dir_offset > 0) {
+        qcow2_free_clusters(bs, dir_offset, dir_size, QCOW2_DISCARD_OTHER);
+    }
+    free_bitmap_list(bitmaps, nb_bitmaps);
+    g_free(tables);
+    g_free(dir);
+    return ret;
+}
+
+bool qcow2_can_store_dirty_bitmap(BlockDriverState *bs, const char *name,
+                                  uint32_t granularity, Error **errp)
+{
+    BDRVQcowState *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap = NULL;
+    uint32_t nb_bitmaps = 0;
+    int granularity_bits = ctz32(granularity);
+
+    if (s->qcow_version < 3) {
+        error_setg(errp, "Persistent dirty bitmaps require a qcow2 image with "
+                   "at least qemu 1.1 compatibility level");
+        return false;
+    }
+    if (bs->read_only) {
+        error_setg(errp, "Cannot store dirty bitmaps in a read-only image");
+        return false;
+    }
+    if (strlen(name) > QCOW2_MAX_BITMAP_NAME_SIZE) {
+        error_setg(errp, "Bitmap name is too long for a persistent bitmap");
+        return false;
+    }
+    if (granularity_bits < QCOW2_MIN_BITMAP_GRANULARITY_BITS ||
+        granularity_bits > QCOW2_MAX_BITMAP_GRANULARITY_BITS) {
+        error_setg(errp, "Granularity of a persistent bitmap must be between "
+                   "%u and %u bytes", 1U << QCOW2_MIN_BITMAP_GRANULARITY_BITS,
+                   1U << QCOW2_MAX_BITMAP_GRANULARITY_BITS);
+        return false;
+    }
+
+    while ((bitmap = bdrv_dirty_bitmap_next(bs, bitmap)) != NULL) {
+        if (bdrv_dirty_bitmap_get_persistence(bitmap)) {
+            nb_bitmaps++;
+        }
+    }
+    if (nb_bitmaps >= QCOW2_MAX_BITMAPS) {
+        error_setg(errp, "Too many persistent bitmaps");
+        return false;
+    }
+
+    return true;
+}
@@ -1779,6 +1779,64 @@ resize_fail:
     return 0;
 }
 
+/*
+ * Increases the refcount for the bitmap directory and for the tables and data
+ * clusters of all persistent dirty bitmaps.
+ */
+static int check_refcounts_bitmaps(BlockDriverState *bs, BdrvCheckResult *res,
+                                   void **refcount_table,
+                                   int64_t *refcount_table_size)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t *table;
+    uint32_t i, j;
+    int ret;
+
+    if (!s->nb_bitmaps) {
+        return 0;
+    }
+
+    ret = inc_refcounts(bs, res, refcount_table, refcount_table_size,
+                        s->bitmap_directory_offset, s->bitmap_directory_size);
+    if (ret < 0) {
+        return ret;
+    }
+
+    for (i = 0; i < s->nb_bitmaps; i++) {
+        Qcow2Bitmap *bm = &s->bitmaps[i];
+
+        ret = inc_refcounts(bs, res, refcount_table, refcount_table_size,
+                            bm->table_offset,
+                            bm->table_size * sizeof(uint64_t));
+        if (ret < 0) {
+            return ret;
+        }
+
+        ret = qcow2_read_bitmap_table(bs, bm, &table);
+        if (ret < 0) {
+            fprintf(stderr, "ERROR: Could not read table of bitmap '%s': "
+                    "%s\n", bm->name, strerror(-ret));
+            res->corruptions++;
+            continue;
+        }
+
+        for (j = 0; j < bm->table_size; j++) {
+            if (table[j]) {
+                ret = inc_refcounts(bs, res, refcount_table,
+                                    refcount_table_size, table[j],
+                                    s->cluster_size);
+                if (ret < 0) {
+                    g_free(table);
+                    return ret;
+                }
+            }
+        }
+        g_free(table);
+    }
+
+    return 0;
+}
+
 /*
  * Calculates an in-memory refcount table.
  */
@@ -1830,6 +1888,12 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         return ret;
     }
 
+    /* persistent dirty bitmaps */
+    ret = check_refcounts_bitmaps(bs, res, refcount_table, nb_clusters);
+    if (ret < 0) {
+        return ret;
+    }
+
     /* refcount data */
     ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
                         s->refcount_table_offset,
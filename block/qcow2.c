@@ -61,6 +61,7 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_END 0
 #define  QCOW2_EXT_MAGIC_BACKING_FORMAT 0xE2792ACA
 #define  QCOW2_EXT_MAGIC_FEATURE_TABLE 0x6803f857
+#define  QCOW2_EXT_MAGIC_BITMAPS 0x23852875
 
 static int qcow2_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
@@ -160,6 +161,37 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             }
             break;
 
+        case QCOW2_EXT_MAGIC_BITMAPS:
+        {
+            Qcow2BitmapHeaderExt bitmaps_ext;
+
+            /* A QEMU without bitmap support has rewritten the image and
+             * cleared the autoclear bit, so the directory may be stale */
+            if (!(s->autoclear_features & QCOW2_AUTOCLEAR_BITMAPS)) {
+                break;
+            }
+
+            if (ext.len != sizeof(bitmaps_ext)) {
+                error_setg(errp, "ERROR: ext_bitmaps: Invalid extension "
+                           "length");
+                return -EINVAL;
+            }
+
+            ret = bdrv_pread(bs->file, offset, &bitmaps_ext, ext.len);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "ERROR: ext_bitmaps: "
+                                 "Could not read ext_bitmaps");
+                return ret;
+            }
+
+            s->nb_bitmaps = be32_to_cpu(bitmaps_ext.nb_bitmaps);
+            s->bitmap_directory_size =
+                be64_to_cpu(bitmaps_ext.bitmap_directory_size);
+            s->bitmap_directory_offset =
+                be64_to_cpu(bitmaps_ext.bitmap_directory_offset);
+            break;
+        }
+
         default:
             /* unknown magic - save it in case we need to rewrite the header */
             {
@@ -898,9 +930,23 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
+    /* Persistent dirty bitmaps; only the directory is read here, the bitmaps
+     * themselves are loaded once the image is fully set up */
+    if (!s->nb_bitmaps) {
+        s->autoclear_features &= ~QCOW2_AUTOCLEAR_BITMAPS;
+    }
+    ret = qcow2_read_bitmaps(bs, &local_err);
+    if (ret < 0) {
+        error_propagate(errp, local_err);
+        goto fail;
+    }
+
     /* Clear unknown autoclear feature bits */
-    if (!bs->read_only && !(flags & BDRV_O_INCOMING) && s->autoclear_features) {
-        s->autoclear_features = 0;
+    if (!bs->read_only && !(flags & BDRV_O_INCOMING) &&
+        (s->autoclear_features & ~QCOW2_AUTOCLEAR_MASK ||
+         s->autoclear_features != header.autoclear_features))
+    {
+        s->autoclear_features &= QCOW2_AUTOCLEAR_MASK;
         ret = qcow2_update_header(bs);
         if (ret < 0) {
             error_setg_errno(errp, -ret, "Could not update qcow2 header");
@@ -987,6 +1033,14 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
+    /* Must come last so that the bitmaps are not leaked if opening fails */
+    ret = qcow2_load_bitmaps(bs, !bs->read_only && !(flags & BDRV_O_INCOMING),
+                             &local_err);
+    if (ret < 0) {
+        error_propagate(errp, local_err);
+        goto fail;
+    }
+
 #ifdef DEBUG_ALLOC
     {
         BdrvCheckResult result = {0};
@@ -1000,6 +1054,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
     qcow2_free_snapshots(bs);
+    qcow2_free_bitmaps(bs);
     qcow2_refcount_close(bs);
     qemu_vfree(s->l1_table);
     /* else pre-write overlap checks in cache_destroy may crash */
@@ -1426,33 +1481,56 @@ fail:
     return ret;
 }
 
-static void qcow2_close(BlockDriverState *bs)
+/* Write back everything that is only held in memory, so that another qemu
+ * can take over the image.  No metadata is written after this. */
+static int qcow2_inactivate(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
-    qemu_vfree(s->l1_table);
-    /* else pre-write overlap checks in cache_destroy may crash */
-    s->l1_table = NULL;
+    int ret, result = 0;
+
+    if (!bs->read_only) {
+        ret = qcow2_store_bitmaps(bs);
+        if (ret < 0) {
+            result = ret;
+            error_report("Failed to save dirty bitmaps: %s", strerror(-ret));
+        }
+    }
+
+    ret = qcow2_cache_flush(bs, s->l2_table_cache);
+    if (ret) {
+        result = ret;
+        error_report("Failed to flush the L2 table cache: %s",
+                     strerror(-ret));
+    }
 
-    if (!(bs->open_flags & BDRV_O_INCOMING)) {
-        int ret1, ret2;
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret) {
+        result = ret;
+        error_report("Failed to flush the refcount block cache: %s",
+                     strerror(-ret));
+    }
 
-        ret1 = qcow2_cache_flush(bs, s->l2_table_cache);
-        ret2 = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (result == 0) {
+        qcow2_mark_clean(bs);
+        s->flags |= BDRV_O_INCOMING;
+    }
 
-        if (ret1) {
-            error_report("Failed to flush the L2 table cache: %s",
-                         strerror(-ret1));
-        }
-        if (ret2) {
-            error_report("Failed to flush the refcount block cache: %s",
-                         strerror(-ret2));
-        }
+    return result;
+}
 
-        if (!ret1 && !ret2) {
-            qcow2_mark_clean(bs);
-        }
+static void qcow2_close(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    /* An incoming or handed-over image belongs to another qemu */
+    if (!(s->flags & BDRV_O_INCOMING)) {
+        qcow2_inactivate(bs);
     }
 
+    qemu_vfree(s->l1_table);
+    /* else pre-write overlap checks in cache_destroy may crash */
+    s->l1_table = NULL;
+
     qcow2_cache_destroy(bs, s->l2_table_cache);
     qcow2_cache_destroy(bs, s->refcount_block_cache);
 
@@ -1466,12 +1544,14 @@ static void qcow2_close(BlockDriverState *bs)
     qemu_vfree(s->cluster_data);
     qcow2_refcount_close(bs);
     qcow2_free_snapshots(bs);
+    qcow2_free_bitmaps(bs);
 }
 
 static void qcow2_invalidate_cache(BlockDriverState *bs, Error **errp)
 {
     BDRVQcowState *s = bs->opaque;
-    int flags = s->flags;
+    int flags = s->flags & ~BDRV_O_INCOMING;
+    BdrvDirtyBitmap *bitmap, *next;
     AES_KEY aes_encrypt_key;
     AES_KEY aes_decrypt_key;
     uint32_t crypt_method = 0;
@@ -1492,6 +1572,17 @@ static void qcow2_invalidate_cache(BlockDriverState *bs, Error **errp)
 
     qcow2_close(bs);
 
+    /* The bitmaps on disk may have been updated by the qemu that owned the
+     * image, so load them again.  Bitmaps that are frozen by a job cannot be
+     * dropped and stay as they are. */
+    for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap; bitmap = next) {
+        next = bdrv_dirty_bitmap_next(bs, bitmap);
+        if (bdrv_dirty_bitmap_get_persistence(bitmap) &&
+            !bdrv_dirty_bitmap_frozen(bitmap)) {
+            bdrv_release_dirty_bitmap(bs, bitmap);
+        }
+    }
+
     bdrv_invalidate_cache(bs->file, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
@@ -1640,6 +1731,26 @@ int qcow2_update_header(BlockDriverState *bs)
         buflen -= ret;
     }
 
+    /* Bitmaps header extension */
+    if (s->nb_bitmaps > 0) {
+        Qcow2BitmapHeaderExt bitmaps_header = {
+            .nb_bitmaps = cpu_to_be32(s->nb_bitmaps),
+            .bitmap_directory_size = cpu_to_be64(s->bitmap_directory_size),
+            .bitmap_directory_offset =
+                cpu_to_be64(s->bitmap_directory_offset),
+        };
+
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_BITMAPS,
+                             &bitmaps_header, sizeof(bitmaps_header),
+                             buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        buf += ret;
+        buflen -= ret;
+    }
+
     /* Feature table */
     Qcow2Feature features[] = {
         {
@@ -1657,6 +1768,11 @@ int qcow2_update_header(BlockDriverState *bs)
             .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
             .name = "lazy refcounts",
         },
+        {
+            .type = QCOW2_FEAT_TYPE_AUTOCLEAR,
+            .bit  = QCOW2_AUTOCLEAR_BITMAPS_BITNR,
+            .name = "bitmaps",
+        },
     };
 
     ret = header_ext_add(buf, QCOW2_EXT_MAGIC_FEATURE_TABLE,
@@ -2636,6 +2752,14 @@ static int qcow2_downgrade(BlockDriverState *bs, int target_version,
         return -ENOTSUP;
     }
 
+    if (s->nb_bitmaps > 0) {
+        /* version 2 images have no autoclear bits to protect the bitmap
+         * directory from being rewritten by an older qemu */
+        error_report("qcow2_downgrade: Images with persistent dirty bitmaps "
+                     "cannot be downgraded.");
+        return -ENOTSUP;
+    }
+
     /* clear incompatible features */
     if (s->incompatible_features & QCOW2_INCOMPAT_DIRTY) {
         ret = qcow2_mark_clean(bs);
@@ -2950,6 +3074,7 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_snapshot_list     = qcow2_snapshot_list,
     .bdrv_snapshot_load_tmp = qcow2_snapshot_load_tmp,
     .bdrv_get_info          = qcow2_get_info,
+    .bdrv_can_store_dirty_bitmap = qcow2_can_store_dirty_bitmap,
     .bdrv_get_specific_info = qcow2_get_specific_info,
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
@@ -2960,6 +3085,7 @@ BlockDriver bdrv_qcow2 = {
 
     .bdrv_refresh_limits        = qcow2_refresh_limits,
     .bdrv_invalidate_cache      = qcow2_invalidate_cache,
+    .bdrv_inactivate            = qcow2_inactivate,
 
     .create_opts         = &qcow2_create_opts,
     .bdrv_check          = qcow2_check,
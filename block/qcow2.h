@@ -52,6 +52,13 @@
  * space for snapshot names and IDs */
 #define QCOW_MAX_SNAPSHOTS_SIZE (1024 * QCOW_MAX_SNAPSHOTS)
 
+/* Persistent dirty bitmaps */
+#define QCOW2_MAX_BITMAPS 65535
+#define QCOW2_MAX_BITMAP_DIRECTORY_SIZE (1024 * QCOW2_MAX_BITMAPS)
+#define QCOW2_MAX_BITMAP_NAME_SIZE 1023
+#define QCOW2_MIN_BITMAP_GRANULARITY_BITS 9
+#define QCOW2_MAX_BITMAP_GRANULARITY_BITS 31
+
 /* indicate that the refcount of the referenced cluster is exactly one. */
 #define QCOW_OFLAG_COPIED     (1ULL << 63)
 /* indicate that the cluster is compressed (they never have the copied flag) */
@@ -191,6 +198,41 @@ enum {
     QCOW2_COMPAT_FEAT_MASK            = QCOW2_COMPAT_LAZY_REFCOUNTS,
 };
 
+/* Autoclear feature bits */
+enum {
+    QCOW2_AUTOCLEAR_BITMAPS_BITNR = 0,
+    QCOW2_AUTOCLEAR_BITMAPS       = 1 << QCOW2_AUTOCLEAR_BITMAPS_BITNR,
+
+    QCOW2_AUTOCLEAR_MASK          = QCOW2_AUTOCLEAR_BITMAPS,
+};
+
+/* Bitmap directory entry flags */
+enum {
+    QCOW2_BITMAP_IN_USE = 1 << 0,   /* not saved cleanly, contents invalid */
+    QCOW2_BITMAP_AUTO   = 1 << 1,   /* tracks writes to the image */
+
+    QCOW2_BITMAP_FLAGS_MASK = QCOW2_BITMAP_IN_USE | QCOW2_BITMAP_AUTO,
+};
+
+#define QCOW2_BITMAP_TYPE_DIRTY_TRACKING 1
+
+/* Header extension data pointing to the bitmap directory */
+typedef struct Qcow2BitmapHeaderExt {
+    uint32_t nb_bitmaps;
+    uint32_t reserved32;
+    uint64_t bitmap_directory_size;
+    uint64_t bitmap_directory_offset;
+} QEMU_PACKED Qcow2BitmapHeaderExt;
+
+typedef struct Qcow2Bitmap {
+    char *name;
+    uint64_t table_offset;
+    uint32_t table_size;        /* number of entries in the bitmap table */
+    uint32_t flags;
+    uint8_t granularity_bits;
+    uint64_t entry_offset;      /* position of the entry in the directory */
+} Qcow2Bitmap;
+
 enum qcow2_discard_type {
     QCOW2_DISCARD_NEVER = 0,
     QCOW2_DISCARD_ALWAYS,
@@ -259,6 +301,11 @@ typedef struct BDRVQcowState {
     unsigned int nb_snapshots;
     QCowSnapshot *snapshots;
 
+    uint64_t bitmap_directory_offset;
+    uint64_t bitmap_directory_size;
+    uint32_t nb_bitmaps;
+    Qcow2Bitmap *bitmaps;
+
     int flags;
     int qcow_version;
     bool use_lazy_refcounts;
@@ -570,6 +617,16 @@ int qcow2_snapshot_load_tmp(BlockDriverState *bs,
 void qcow2_free_snapshots(BlockDriverState *bs);
 int qcow2_read_snapshots(BlockDriverState *bs);
 
+/* qcow2-bitmap.c functions */
+int qcow2_read_bitmaps(BlockDriverState *bs, Error **errp);
+void qcow2_free_bitmaps(BlockDriverState *bs);
+int qcow2_load_bitmaps(BlockDriverState *bs, bool writable, Error **errp);
+int qcow2_store_bitmaps(BlockDriverState *bs);
+int qcow2_read_bitmap_table(BlockDriverState *bs, Qcow2Bitmap *bm,
+                            uint64_t **table);
+bool qcow2_can_store_dirty_bitmap(BlockDriverState *bs, const char *name,
+                                  uint32_t granularity, Error **errp);
+
 /* qcow2-cache.c functions */
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables);
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c);
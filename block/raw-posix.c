@@ -31,6 +31,7 @@
 #include "qemu/iov.h"
 #include "raw-aio.h"
 #include "qapi/util.h"
+#include <sys/mman.h>
 
 #if defined(__APPLE__) && (__MACH__)
 #include <paths.h>
@@ -153,6 +154,12 @@ typedef struct BDRVRawState {
     bool discard_zeroes:1;
     bool has_fallocate;
     bool needs_alignment;
+
+    /* Read-only mapping of the whole file, used to serve reads without
+     * going through the thread pool (mmap=on) */
+    bool use_mmap;
+    void *mmap_buf;
+    size_t mmap_size;
 } BDRVRawState;
 
 typedef struct BDRVRawReopenState {
@@ -432,6 +439,66 @@ error:
 }
 #endif
 
+static void raw_mmap_release(BDRVRawState *s)
+{
+    if (s->mmap_buf) {
+        munmap(s->mmap_buf, s->mmap_size);
+        s->mmap_buf = NULL;
+        s->mmap_size = 0;
+    }
+}
+
+/* Map the whole image for reading.  Only read-only regular files opened
+ * without O_DIRECT qualify: the mapping goes through the page cache and is
+ * never resized, so a writer or a cache.direct=on user would see stale
+ * data. */
+static int raw_mmap_setup(BlockDriverState *bs, int bdrv_flags, Error **errp)
+{
+    BDRVRawState *s = bs->opaque;
+    struct stat st;
+    void *buf;
+    int ret;
+
+    assert(!s->mmap_buf);
+
+    if (bdrv_flags & BDRV_O_RDWR) {
+        error_setg(errp, "mmap=on requires a read-only image");
+        return -EINVAL;
+    }
+    if (bdrv_flags & BDRV_O_NOCACHE) {
+        error_setg(errp, "mmap=on is incompatible with cache.direct=on");
+        return -EINVAL;
+    }
+    if (fstat(s->fd, &st) < 0) {
+        ret = -errno;
+        error_setg_errno(errp, -ret, "Could not stat file");
+        return ret;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        error_setg(errp, "mmap=on is only supported for regular files");
+        return -ENOTSUP;
+    }
+    if (st.st_size == 0) {
+        /* Nothing to map, every read is past the end of the file */
+        return 0;
+    }
+    if ((uint64_t)st.st_size > SIZE_MAX) {
+        error_setg(errp, "Image is too large to be mapped");
+        return -EFBIG;
+    }
+
+    buf = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, s->fd, 0);
+    if (buf == MAP_FAILED) {
+        ret = -errno;
+        error_setg_errno(errp, -ret, "Could not map image");
+        return ret;
+    }
+
+    s->mmap_buf = buf;
+    s->mmap_size = st.st_size;
+    return 0;
+}
+
 static void raw_parse_filename(const char *filename, QDict *options,
                                Error **errp)
 {
@@ -452,6 +519,13 @@ static QemuOptsList raw_runtime_opts = {
             .type = QEMU_OPT_STRING,
             .help = "File name of the image",
         },
+        {
+            .name = "mmap",
+            .type = QEMU_OPT_BOOL,
+            .help = "Serve reads from a shared mapping of the image "
+                    "(read-only regular files only; a read error or "
+                    "truncation of the file terminates QEMU)",
+        },
         { /* end of list */ }
     },
 };
@@ -564,6 +638,14 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     }
 #endif
 
+    s->use_mmap = qemu_opt_get_bool(opts, "mmap", false);
+    if (s->use_mmap) {
+        ret = raw_mmap_setup(bs, bdrv_flags, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
     raw_attach_aio_context(bs, bdrv_get_aio_context(bs));
 
     ret = 0;
@@ -698,6 +780,20 @@ static void raw_reopen_commit(BDRVReopenState *state)
     s->use_aio = raw_s->use_aio;
 #endif
 
+    /* The mapping is only valid for read-only, cached opens; drop it while
+     * the image is writable (e.g. a backing file reopened for block-commit)
+     * and map again when it goes back to read-only. */
+    raw_mmap_release(s);
+    if (s->use_mmap && !(state->flags & (BDRV_O_RDWR | BDRV_O_NOCACHE))) {
+        Error *local_err = NULL;
+
+        if (raw_mmap_setup(state->bs, state->flags, &local_err) < 0) {
+            error_report("%s: %s; reads will use the thread pool",
+                         state->bs->filename, error_get_pretty(local_err));
+            error_free(local_err);
+        }
+    }
+
     g_free(state->opaque);
     state->opaque = NULL;
 }
@@ -1294,6 +1390,59 @@ static BlockAIOCB *paio_submit(BlockDriverState *bs, int fd,
     return thread_pool_submit_aio(pool, aio_worker, acb, cb, opaque);
 }
 
+typedef struct RawMmapAIOCB {
+    BlockAIOCB common;
+    QEMUBH *bh;
+} RawMmapAIOCB;
+
+static const AIOCBInfo raw_mmap_aiocb_info = {
+    .aiocb_size = sizeof(RawMmapAIOCB),
+};
+
+static void raw_mmap_bh_cb(void *opaque)
+{
+    RawMmapAIOCB *acb = opaque;
+
+    acb->common.cb(acb->common.opaque, 0);
+    qemu_bh_delete(acb->bh);
+    qemu_aio_unref(acb);
+}
+
+/* Serve a read by copying from the mapping in the calling AioContext.
+ * Like handle_aiocb_rw(), reads past the end of the file return zeroes.
+ *
+ * A page that cannot be read, or that is no longer backed by the file
+ * because it was truncated, raises SIGBUS during the copy.  This is not
+ * caught: SIGBUS is blocked in all QEMU threads and used by KVM for machine
+ * check handling, and a synchronous fault with the signal blocked kills
+ * the process.  The option documentation warns about this. */
+static BlockAIOCB *raw_mmap_readv(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockCompletionFunc *cb, void *opaque)
+{
+    BDRVRawState *s = bs->opaque;
+    RawMmapAIOCB *acb;
+    uint64_t offset = sector_num * BDRV_SECTOR_SIZE;
+    size_t bytes = nb_sectors * BDRV_SECTOR_SIZE;
+    size_t avail = 0;
+
+    assert(qiov->size == bytes);
+
+    if (offset < s->mmap_size) {
+        avail = MIN(bytes, s->mmap_size - offset);
+        qemu_iovec_from_buf(qiov, 0, (uint8_t *)s->mmap_buf + offset, avail);
+    }
+    if (avail < bytes) {
+        qemu_iovec_memset(qiov, avail, 0, bytes - avail);
+    }
+
+    acb = qemu_aio_get(&raw_mmap_aiocb_info, bs, cb, opaque);
+    trace_raw_mmap_readv(acb, opaque, sector_num, nb_sectors);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), raw_mmap_bh_cb, acb);
+    qemu_bh_schedule(acb->bh);
+    return &acb->common;
+}
+
 static BlockAIOCB *raw_aio_submit(BlockDriverState *bs,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockCompletionFunc *cb, void *opaque, int type)
@@ -1303,6 +1452,10 @@ static BlockAIOCB *raw_aio_submit(BlockDriverState *bs,
     if (fd_open(bs) < 0)
         return NULL;
 
+    if (s->mmap_buf && type == QEMU_AIO_READ) {
+        return raw_mmap_readv(bs, sector_num, qiov, nb_sectors, cb, opaque);
+    }
+
     /*
      * Check if the underlying device requires requests to be aligned,
      * and if the request we are trying to submit is aligned or not.
@@ -1392,6 +1545,7 @@ static void raw_close(BlockDriverState *bs)
         laio_cleanup(s->aio_ctx);
     }
 #endif
+    raw_mmap_release(s);
     if (s->fd >= 0) {
         qemu_close(s->fd);
         s->fd = -1;
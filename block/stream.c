@@ -18,23 +18,42 @@
 
 enum {
     /*
-     * Size of data buffer for populating the image file.  This should be large
-     * enough to process multiple clusters in a single call, so that populating
-     * contiguous regions of the image is efficient.
+     * Default size of data buffer for populating the image file.  This should
+     * be large enough to process multiple clusters in a single call, so that
+     * populating contiguous regions of the image is efficient.
      */
     STREAM_BUFFER_SIZE = 512 * 1024, /* in bytes */
+
+    /* Default number of chunks copied in parallel */
+    STREAM_DEFAULT_IN_FLIGHT = 4,
 };
 
 #define SLICE_TIME 100000000ULL /* ns */
 
+typedef struct StreamChunk StreamChunk;
+
 typedef struct StreamBlockJob {
     BlockJob common;
     RateLimit limit;
     BlockDriverState *base;
     BlockdevOnError on_error;
     char *backing_file_str;
+
+    int chunk_sectors;
+    int max_in_flight;
+    int in_flight;
+    bool waiting_for_io;
+    QSIMPLEQ_HEAD(, StreamChunk) failed_chunks;
 } StreamBlockJob;
 
+struct StreamChunk {
+    StreamBlockJob *s;
+    int64_t sector_num;
+    int nb_sectors;
+    int ret;
+    QSIMPLEQ_ENTRY(StreamChunk) next;
+};
+
 static int coroutine_fn stream_populate(BlockDriverState *bs,
                                         int64_t sector_num, int nb_sectors,
                                         void *buf)
@@ -51,6 +70,118 @@ static int coroutine_fn stream_populate(BlockDriverState *bs,
     return bdrv_co_copy_on_readv(bs, sector_num, nb_sectors, &qiov);
 }
 
+static void coroutine_fn stream_chunk_entry(void *opaque)
+{
+    StreamChunk *chunk = opaque;
+    StreamBlockJob *s = chunk->s;
+    BlockDriverState *bs = s->common.bs;
+    void *buf;
+
+    buf = qemu_blockalign(bs, chunk->nb_sectors * BDRV_SECTOR_SIZE);
+    chunk->ret = stream_populate(bs, chunk->sector_num, chunk->nb_sectors,
+                                 buf);
+    qemu_vfree(buf);
+
+    if (chunk->ret < 0) {
+        /* The error action is taken by the job coroutine */
+        QSIMPLEQ_INSERT_TAIL(&s->failed_chunks, chunk, next);
+    } else {
+        s->common.offset += chunk->nb_sectors * BDRV_SECTOR_SIZE;
+        g_free(chunk);
+    }
+
+    s->in_flight--;
+    if (s->waiting_for_io) {
+        qemu_coroutine_enter(s->common.co, NULL);
+    }
+}
+
+static void coroutine_fn stream_wait_for_io(StreamBlockJob *s)
+{
+    assert(!s->waiting_for_io);
+    s->waiting_for_io = true;
+    qemu_coroutine_yield();
+    s->waiting_for_io = false;
+}
+
+static void coroutine_fn stream_drain(StreamBlockJob *s)
+{
+    while (s->in_flight > 0) {
+        stream_wait_for_io(s);
+    }
+}
+
+/* Copy a chunk in a separate coroutine, once fewer than max_in_flight chunks
+ * are being copied.
+ */
+static void coroutine_fn stream_start_chunk(StreamBlockJob *s,
+                                            int64_t sector_num, int nb_sectors)
+{
+    StreamChunk *chunk;
+    Coroutine *co;
+
+    while (s->in_flight >= s->max_in_flight) {
+        stream_wait_for_io(s);
+    }
+
+    chunk = g_new0(StreamChunk, 1);
+    chunk->s = s;
+    chunk->sector_num = sector_num;
+    chunk->nb_sectors = nb_sectors;
+
+    s->in_flight++;
+    co = qemu_coroutine_create(stream_chunk_entry);
+    qemu_coroutine_enter(co, chunk);
+}
+
+/* Apply the error action to chunks that failed to copy.  Chunks are retried
+ * after a stop, so the job only moves on once they are copied or the error
+ * is ignored.  Returns false if the job must terminate.
+ */
+static bool coroutine_fn stream_handle_failed_chunks(StreamBlockJob *s,
+                                                     int *error)
+{
+    StreamChunk *chunk;
+    BlockErrorAction action;
+    bool ok = true;
+
+    while (!QSIMPLEQ_EMPTY(&s->failed_chunks)) {
+        stream_drain(s);
+
+        chunk = QSIMPLEQ_FIRST(&s->failed_chunks);
+        QSIMPLEQ_REMOVE_HEAD(&s->failed_chunks, next);
+
+        if (!ok) {
+            g_free(chunk);
+            continue;
+        }
+
+        action = block_job_error_action(&s->common, s->common.bs, s->on_error,
+                                        true, -chunk->ret);
+        if (action == BLOCK_ERROR_ACTION_STOP) {
+            /* Wait until the job is resumed, then try again */
+            block_job_sleep_ns(&s->common, QEMU_CLOCK_REALTIME, 0);
+            if (block_job_is_cancelled(&s->common)) {
+                ok = false;
+            } else {
+                stream_start_chunk(s, chunk->sector_num, chunk->nb_sectors);
+            }
+        } else {
+            if (*error == 0) {
+                *error = chunk->ret;
+            }
+            if (action == BLOCK_ERROR_ACTION_REPORT) {
+                ok = false;
+            } else {
+                s->common.offset += chunk->nb_sectors * BDRV_SECTOR_SIZE;
+            }
+        }
+        g_free(chunk);
+    }
+
+    return ok;
+}
+
 static void close_unused_images(BlockDriverState *top, BlockDriverState *base,
                                 const char *base_id)
 {
@@ -115,10 +246,10 @@ static void coroutine_fn stream_run(void *opaque)
     BlockDriverState *bs = s->common.bs;
     BlockDriverState *base = s->base;
     int64_t sector_num, end;
+    bool reached_end;
     int error = 0;
     int ret = 0;
     int n = 0;
-    void *buf;
 
     if (!bs->backing_hd) {
         block_job_completed(&s->common, 0);
@@ -132,7 +263,6 @@ static void coroutine_fn stream_run(void *opaque)
     }
 
     end = s->common.len >> BDRV_SECTOR_BITS;
-    buf = qemu_blockalign(bs, STREAM_BUFFER_SIZE);
 
     /* Turn on copy-on-read for the whole block device so that guest read
      * requests help us make progress.  Only do this when copying the entire
@@ -149,17 +279,21 @@ static void coroutine_fn stream_run(void *opaque)
 
 wait:
         /* Note that even when no rate limit is applied we need to yield
-         * with no pending I/O here so that bdrv_drain_all() returns.
+         * here so that bdrv_drain_all() returns.  Chunks still in flight
+         * complete without the job coroutine.
          */
         block_job_sleep_ns(&s->common, QEMU_CLOCK_REALTIME, delay_ns);
         if (block_job_is_cancelled(&s->common)) {
             break;
         }
 
+        if (!stream_handle_failed_chunks(s, &error)) {
+            break;
+        }
+
         copy = false;
 
-        ret = bdrv_is_allocated(bs, sector_num,
-                                STREAM_BUFFER_SIZE / BDRV_SECTOR_SIZE, &n);
+        ret = bdrv_is_allocated(bs, sector_num, s->chunk_sectors, &n);
         if (ret == 1) {
             /* Allocated in the top, no need to copy.  */
         } else if (ret >= 0) {
@@ -183,7 +317,8 @@ wait:
                     goto wait;
                 }
             }
-            ret = stream_populate(bs, sector_num, n, buf);
+            stream_start_chunk(s, sector_num, n);
+            continue;
         }
         if (ret < 0) {
             BlockErrorAction action =
@@ -206,6 +341,28 @@ wait:
         s->common.offset += n * BDRV_SECTOR_SIZE;
     }
 
+    /* Wait for the remaining chunks; failed ones still go through the error
+     * action, unless the job is already terminating.
+     */
+    reached_end = sector_num == end;
+    stream_drain(s);
+    while (reached_end && !QSIMPLEQ_EMPTY(&s->failed_chunks)) {
+        if (block_job_is_cancelled(&s->common) ||
+            !stream_handle_failed_chunks(s, &error)) {
+            reached_end = false;
+        }
+        stream_drain(s);
+    }
+    while (!QSIMPLEQ_EMPTY(&s->failed_chunks)) {
+        StreamChunk *chunk = QSIMPLEQ_FIRST(&s->failed_chunks);
+
+        QSIMPLEQ_REMOVE_HEAD(&s->failed_chunks, next);
+        if (error == 0) {
+            error = chunk->ret;
+        }
+        g_free(chunk);
+    }
+
     if (!base) {
         bdrv_disable_copy_on_read(bs);
     }
@@ -213,12 +370,10 @@ wait:
     /* Do not remove the backing file if an error was there but ignored.  */
     ret = error;
 
-    qemu_vfree(buf);
-
     /* Modify backing chain and close BDSes in main loop */
     data = g_malloc(sizeof(*data));
     data->ret = ret;
-    data->reached_end = sector_num == end;
+    data->reached_end = reached_end;
     block_job_defer_to_main_loop(&s->common, stream_complete, data);
 }
 
@@ -241,6 +396,7 @@ static const BlockJobDriver stream_job_driver = {
 
 void stream_start(BlockDriverState *bs, BlockDriverState *base,
                   const char *backing_file_str, int64_t speed,
+                  int64_t chunk_size, int max_in_flight,
                   BlockdevOnError on_error,
                   BlockCompletionFunc *cb,
                   void *opaque, Error **errp)
@@ -254,6 +410,14 @@ void stream_start(BlockDriverState *bs, BlockDriverState *base,
         return;
     }
 
+    if (chunk_size == 0) {
+        chunk_size = STREAM_BUFFER_SIZE;
+    }
+    if (max_in_flight == 0) {
+        max_in_flight = STREAM_DEFAULT_IN_FLIGHT;
+    }
+    assert(chunk_size % BDRV_SECTOR_SIZE == 0 && max_in_flight > 0);
+
     s = block_job_create(&stream_job_driver, bs, speed, cb, opaque, errp);
     if (!s) {
         return;
@@ -261,6 +425,9 @@ void stream_start(BlockDriverState *bs, BlockDriverState *base,
 
     s->base = base;
     s->backing_file_str = g_strdup(backing_file_str);
+    s->chunk_sectors = chunk_size >> BDRV_SECTOR_BITS;
+    s->max_in_flight = max_in_flight;
+    QSIMPLEQ_INIT(&s->failed_chunks);
 
     s->on_error = on_error;
     s->common.co = qemu_coroutine_create(stream_run);
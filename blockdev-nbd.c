@@ -106,8 +106,14 @@ void qmp_nbd_server_add(const char *device, bool has_writable, bool writable,
         writable = false;
     }
 
-    exp = nbd_export_new(blk, 0, -1, writable ? 0 : NBD_FLAG_READ_ONLY, NULL,
-                         errp);
+    /* Read-only exports are consistent across connections by definition.
+     * Writable ones are too as long as every connection flushes the same
+     * image, which holds because they all share the device's BlockBackend.
+     */
+    exp = nbd_export_new(blk, 0, -1,
+                         (writable ? 0 : NBD_FLAG_READ_ONLY) |
+                         NBD_FLAG_CAN_MULTI_CONN,
+                         NULL, errp);
     if (!exp) {
         return;
     }
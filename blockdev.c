@@ -350,13 +350,19 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
     BlockBackend *blk;
     BlockDriverState *bs;
     ThrottleConfig cfg;
+    const char *throttling_group;
     int snapshot = 0;
+    int i;
     bool copy_on_read;
     Error *error = NULL;
     QemuOpts *opts;
     const char *id;
     bool has_driver_specific_opts;
     BlockdevDetectZeroesOptions detect_zeroes;
+    bool account_invalid, account_failed;
+    const char *stats_intervals;
+    unsigned *intervals = NULL;
+    int nr_intervals = 0;
 
     /* Check common options by copying from bs_opts to opts, all other options
      * stay in bs_opts for processing by bdrv_open(). */
@@ -384,6 +390,34 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
     ro = qemu_opt_get_bool(opts, "read-only", 0);
     copy_on_read = qemu_opt_get_bool(opts, "copy-on-read", false);
 
+    account_invalid = qemu_opt_get_bool(opts, "stats-account-invalid", true);
+    account_failed = qemu_opt_get_bool(opts, "stats-account-failed", true);
+
+    stats_intervals = qemu_opt_get(opts, "stats-intervals");
+    if (stats_intervals) {
+        char **intervals_str = g_strsplit(stats_intervals, ":", 0);
+        int i;
+
+        nr_intervals = g_strv_length(intervals_str);
+        intervals = g_new(unsigned, nr_intervals);
+        for (i = 0; i < nr_intervals; i++) {
+            unsigned long long length;
+            char *end;
+
+            errno = 0;
+            length = strtoull(intervals_str[i], &end, 10);
+            if (errno || *end || !intervals_str[i][0] || length == 0 ||
+                length > UINT_MAX) {
+                error_setg(errp, "Invalid interval length: '%s'",
+                           intervals_str[i]);
+                g_strfreev(intervals_str);
+                goto early_err;
+            }
+            intervals[i] = length;
+        }
+        g_strfreev(intervals_str);
+    }
+
     if ((buf = qemu_opt_get(opts, "discard")) != NULL) {
         if (bdrv_parse_discard_flags(buf, &bdrv_flags) != 0) {
             error_setg(errp, "invalid discard option");
@@ -459,6 +493,8 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
 
     cfg.op_size = qemu_opt_get_number(opts, "throttling.iops-size", 0);
 
+    throttling_group = qemu_opt_get(opts, "throttling.group");
+
     if (!check_throttle_config(&cfg, &error)) {
         error_propagate(errp, error);
         goto early_err;
@@ -543,11 +579,19 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
 
     bs->detect_zeroes = detect_zeroes;
 
+    block_acct_init(blk_get_stats(blk), account_invalid, account_failed);
+    for (i = 0; i < nr_intervals; i++) {
+        block_acct_add_interval(blk_get_stats(blk), intervals[i]);
+    }
+
     bdrv_set_on_error(bs, on_read_error, on_write_error);
 
     /* disk I/O throttling */
     if (throttle_enabled(&cfg)) {
-        bdrv_io_limits_enable(bs);
+        if (!throttling_group) {
+            throttling_group = blk_name(blk);
+        }
+        bdrv_io_limits_enable(bs, throttling_group);
         bdrv_set_io_limits(bs, &cfg);
     }
 
@@ -557,10 +601,12 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
 
 err_no_bs_opts:
     qemu_opts_del(opts);
+    g_free(intervals);
     return blk;
 
 early_err:
     qemu_opts_del(opts);
+    g_free(intervals);
 err_no_opts:
     QDECREF(bs_opts);
     return NULL;
@@ -711,6 +757,8 @@ DriveInfo *drive_new(QemuOpts *all_opts, BlockInterfaceType block_default_type)
 
         { "iops_size",      "throttling.iops-size" },
 
+        { "group",          "throttling.group" },
+
         { "readonly",       "read-only" },
     };
 
@@ -1951,7 +1999,9 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
                                bool has_iops_wr_max,
                                int64_t iops_wr_max,
                                bool has_iops_size,
-                               int64_t iops_size, Error **errp)
+                               int64_t iops_size,
+                               bool has_group,
+                               const char *group, Error **errp)
 {
     ThrottleConfig cfg;
     BlockDriverState *bs;
@@ -2004,25 +2054,97 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
     aio_context = bdrv_get_aio_context(bs);
     aio_context_acquire(aio_context);
 
-    if (!bs->io_limits_enabled && throttle_enabled(&cfg)) {
-        bdrv_io_limits_enable(bs);
-    } else if (bs->io_limits_enabled && !throttle_enabled(&cfg)) {
+    if (throttle_enabled(&cfg)) {
+        /* Enable I/O limits if they're not enabled yet, otherwise
+         * just update the throttling group. */
+        if (!bs->throttle_state) {
+            bdrv_io_limits_enable(bs, has_group ? group : device);
+        } else if (has_group) {
+            bdrv_io_limits_update_group(bs, group);
+        }
+        /* Set the new throttling configuration */
+        bdrv_set_io_limits(bs, &cfg);
+    } else if (bs->throttle_state) {
+        /* If all throttling settings are set to 0, disable I/O limits */
         bdrv_io_limits_disable(bs);
     }
 
-    if (bs->io_limits_enabled) {
-        bdrv_set_io_limits(bs, &cfg);
+    aio_context_release(aio_context);
+}
+
+void qmp_block_latency_histogram_set(const char *device,
+                                     bool has_boundaries,
+                                     uint64List *boundaries,
+                                     bool has_boundaries_read,
+                                     uint64List *boundaries_read,
+                                     bool has_boundaries_write,
+                                     uint64List *boundaries_write,
+                                     bool has_boundaries_flush,
+                                     uint64List *boundaries_flush,
+                                     Error **errp)
+{
+    static const char *names[BLOCK_MAX_IOTYPE] = {
+        [BLOCK_ACCT_READ]  = "read",
+        [BLOCK_ACCT_WRITE] = "write",
+        [BLOCK_ACCT_FLUSH] = "flush",
+    };
+    bool has[BLOCK_MAX_IOTYPE] = {
+        [BLOCK_ACCT_READ]  = has_boundaries_read,
+        [BLOCK_ACCT_WRITE] = has_boundaries_write,
+        [BLOCK_ACCT_FLUSH] = has_boundaries_flush,
+    };
+    uint64List *lists[BLOCK_MAX_IOTYPE] = {
+        [BLOCK_ACCT_READ]  = boundaries_read,
+        [BLOCK_ACCT_WRITE] = boundaries_write,
+        [BLOCK_ACCT_FLUSH] = boundaries_flush,
+    };
+    BlockBackend *blk;
+    BlockAcctStats *stats;
+    AioContext *aio_context;
+    int i, ret;
+
+    blk = blk_by_name(device);
+    if (!blk) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+    stats = blk_get_stats(blk);
+
+    aio_context = blk_get_aio_context(blk);
+    aio_context_acquire(aio_context);
+
+    if (!has_boundaries && !has_boundaries_read && !has_boundaries_write &&
+        !has_boundaries_flush) {
+        block_latency_histograms_clear(stats);
+        goto out;
+    }
+
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        if (!has[i] && !has_boundaries) {
+            continue;
+        }
+        ret = block_latency_histogram_set(stats, i,
+                                          has[i] ? lists[i] : boundaries);
+        if (ret) {
+            error_setg(errp, "Invalid %s latency histogram boundaries for "
+                       "device '%s': values must be positive and in strictly "
+                       "ascending order", names[i], device);
+            goto out;
+        }
     }
 
+out:
     aio_context_release(aio_context);
 }
 
 void qmp_block_dirty_bitmap_add(const char *node, const char *name,
                                 bool has_granularity, uint32_t granularity,
+                                bool has_persistent, bool persistent,
                                 Error **errp)
 {
     AioContext *aio_context;
     BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
 
     if (!name || name[0] == '\0') {
         error_setg(errp, "Bitmap name cannot be empty");
@@ -2048,7 +2170,15 @@ void qmp_block_dirty_bitmap_add(const char *node, const char *name,
         granularity = bdrv_get_default_bitmap_granularity(bs);
     }
 
-    bdrv_create_dirty_bitmap(bs, granularity, name, errp);
+    if (has_persistent && persistent &&
+        !bdrv_can_store_dirty_bitmap(bs, name, granularity, errp)) {
+        goto out;
+    }
+
+    bitmap = bdrv_create_dirty_bitmap(bs, granularity, name, errp);
+    if (bitmap && has_persistent) {
+        bdrv_dirty_bitmap_set_persistence(bitmap, persistent);
+    }
 
  out:
     aio_context_release(aio_context);
@@ -2256,10 +2386,37 @@ static void block_job_cb(void *opaque, int ret)
     bdrv_put_ref_bh_schedule(bs);
 }
 
+/* Limits for the chunk-size and max-in-flight options of block-stream and
+ * block-commit */
+#define MAX_JOB_CHUNK_SIZE      (64 << 20)
+#define MAX_JOB_IN_FLIGHT       64
+
+static bool check_job_chunk_options(bool has_chunk_size, int64_t chunk_size,
+                                    bool has_max_in_flight,
+                                    int64_t max_in_flight, Error **errp)
+{
+    if (has_chunk_size &&
+        (chunk_size < BDRV_SECTOR_SIZE || chunk_size > MAX_JOB_CHUNK_SIZE ||
+         chunk_size % BDRV_SECTOR_SIZE)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "chunk-size",
+                  "a multiple of 512 no larger than 64M");
+        return false;
+    }
+    if (has_max_in_flight &&
+        (max_in_flight < 1 || max_in_flight > MAX_JOB_IN_FLIGHT)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "max-in-flight",
+                  "a value between 1 and 64");
+        return false;
+    }
+    return true;
+}
+
 void qmp_block_stream(const char *device,
                       bool has_base, const char *base,
                       bool has_backing_file, const char *backing_file,
                       bool has_speed, int64_t speed,
+                      bool has_chunk_size, int64_t chunk_size,
+                      bool has_max_in_flight, int64_t max_in_flight,
                       bool has_on_error, BlockdevOnError on_error,
                       Error **errp)
 {
@@ -2281,6 +2438,11 @@ void qmp_block_stream(const char *device,
     }
     bs = blk_bs(blk);
 
+    if (!check_job_chunk_options(has_chunk_size, chunk_size,
+                                 has_max_in_flight, max_in_flight, errp)) {
+        return;
+    }
+
     aio_context = bdrv_get_aio_context(bs);
     aio_context_acquire(aio_context);
 
@@ -2310,6 +2472,8 @@ void qmp_block_stream(const char *device,
     base_name = has_backing_file ? backing_file : base_name;
 
     stream_start(bs, base_bs, base_name, has_speed ? speed : 0,
+                 has_chunk_size ? chunk_size : 0,
+                 has_max_in_flight ? max_in_flight : 0,
                  on_error, block_job_cb, bs, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
@@ -2327,6 +2491,8 @@ void qmp_block_commit(const char *device,
                       bool has_top, const char *top,
                       bool has_backing_file, const char *backing_file,
                       bool has_speed, int64_t speed,
+                      bool has_chunk_size, int64_t chunk_size,
+                      bool has_max_in_flight, int64_t max_in_flight,
                       Error **errp)
 {
     BlockBackend *blk;
@@ -2355,6 +2521,11 @@ void qmp_block_commit(const char *device,
     }
     bs = blk_bs(blk);
 
+    if (!check_job_chunk_options(has_chunk_size, chunk_size,
+                                 has_max_in_flight, max_in_flight, errp)) {
+        return;
+    }
+
     aio_context = bdrv_get_aio_context(bs);
     aio_context_acquire(aio_context);
 
@@ -2410,10 +2581,18 @@ void qmp_block_commit(const char *device,
                              " but 'top' is the active layer");
             goto out;
         }
+        if (has_chunk_size || has_max_in_flight) {
+            error_setg(errp, "'chunk-size' and 'max-in-flight' are not "
+                       "supported when 'top' is the active layer");
+            goto out;
+        }
         commit_active_start(bs, base_bs, speed, on_error, block_job_cb,
                             bs, &local_err);
     } else {
-        commit_start(bs, base_bs, top_bs, speed, on_error, block_job_cb, bs,
+        commit_start(bs, base_bs, top_bs, speed,
+                     has_chunk_size ? chunk_size : 0,
+                     has_max_in_flight ? max_in_flight : 0,
+                     on_error, block_job_cb, bs,
                      has_backing_file ? backing_file : NULL, &local_err);
     }
     if (local_err != NULL) {
@@ -2548,6 +2727,7 @@ void qmp_drive_backup(const char *device, const char *target,
     }
 
     backup_start(bs, target_bs, speed, sync, bmap,
+                 mode != NEW_IMAGE_MODE_EXISTING,
                  on_source_error, on_target_error,
                  block_job_cb, bs, &local_err);
     if (local_err != NULL) {
@@ -2609,7 +2789,7 @@ void qmp_blockdev_backup(const char *device, const char *target,
 
     bdrv_ref(target_bs);
     bdrv_set_aio_context(target_bs, aio_context);
-    backup_start(bs, target_bs, speed, sync, NULL, on_source_error,
+    backup_start(bs, target_bs, speed, sync, NULL, false, on_source_error,
                  on_target_error, block_job_cb, bs, &local_err);
     if (local_err != NULL) {
         bdrv_unref(target_bs);
@@ -2632,6 +2812,7 @@ void qmp_drive_mirror(const char *device, const char *target,
                       bool has_buf_size, int64_t buf_size,
                       bool has_on_source_error, BlockdevOnError on_source_error,
                       bool has_on_target_error, BlockdevOnError on_target_error,
+                      bool has_copy_mode, MirrorCopyMode copy_mode,
                       Error **errp)
 {
     BlockBackend *blk;
@@ -2663,6 +2844,9 @@ void qmp_drive_mirror(const char *device, const char *target,
     if (!has_buf_size) {
         buf_size = DEFAULT_MIRROR_BUF_SIZE;
     }
+    if (!has_copy_mode) {
+        copy_mode = MIRROR_COPY_MODE_BACKGROUND;
+    }
 
     if (granularity != 0 && (granularity < 512 || granularity > 1048576 * 64)) {
         error_set(errp, QERR_INVALID_PARAMETER_VALUE, "granularity",
@@ -2800,7 +2984,7 @@ void qmp_drive_mirror(const char *device, const char *target,
      */
     mirror_start(bs, target_bs,
                  has_replaces ? replaces : NULL,
-                 speed, granularity, buf_size, sync,
+                 speed, granularity, buf_size, sync, copy_mode,
                  on_source_error, on_target_error,
                  block_job_cb, bs, &local_err);
     if (local_err != NULL) {
@@ -3189,6 +3373,10 @@ QemuOptsList qemu_common_drive_opts = {
             .name = "throttling.iops-size",
             .type = QEMU_OPT_NUMBER,
             .help = "when limiting by iops max size of an I/O in bytes",
+        },{
+            .name = "throttling.group",
+            .type = QEMU_OPT_STRING,
+            .help = "name of the block throttling group",
         },{
             .name = "copy-on-read",
             .type = QEMU_OPT_BOOL,
@@ -3197,6 +3385,21 @@ QemuOptsList qemu_common_drive_opts = {
             .name = "detect-zeroes",
             .type = QEMU_OPT_STRING,
             .help = "try to optimize zero writes (off, on, unmap)",
+        },{
+            .name = "stats-account-invalid",
+            .type = QEMU_OPT_BOOL,
+            .help = "whether to account for invalid I/O operations "
+                    "in the statistics",
+        },{
+            .name = "stats-account-failed",
+            .type = QEMU_OPT_BOOL,
+            .help = "whether to account for failed I/O operations "
+                    "in the statistics",
+        },{
+            .name = "stats-intervals",
+            .type = QEMU_OPT_STRING,
+            .help = "colon-separated list of intervals "
+                    "for collecting I/O statistics, in seconds",
         },
         { /* end of list */ }
     },
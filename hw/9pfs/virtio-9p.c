@@ -626,7 +626,9 @@ static void complete_pdu(V9fsState *s, V9fsPDU *pdu, ssize_t len)
     pdu->id = id;
 
     /* push onto queue and notify */
-    virtqueue_push(s->vq, &pdu->elem, len);
+    virtqueue_push(s->vq, pdu->elem, len);
+    g_free(pdu->elem);
+    pdu->elem = NULL;
 
     /* FIXME: we should batch these completions */
     virtio_notify(VIRTIO_DEVICE(s), s->vq);
@@ -1575,7 +1577,7 @@ static int v9fs_xattr_read(V9fsState *s, V9fsPDU *pdu, V9fsFidState *fidp,
         return err;
     }
     offset += err;
-    err = v9fs_pack(pdu->elem.in_sg, pdu->elem.in_num, offset,
+    err = v9fs_pack(pdu->elem->in_sg, pdu->elem->in_num, offset,
                     ((char *)fidp->fs.xattr.value) + off,
                     read_count);
     if (err < 0) {
@@ -1666,11 +1668,11 @@ static void v9fs_init_qiov_from_pdu(QEMUIOVector *qiov, V9fsPDU *pdu,
     unsigned int niov;
 
     if (is_write) {
-        iov = pdu->elem.out_sg;
-        niov = pdu->elem.out_num;
+        iov = pdu->elem->out_sg;
+        niov = pdu->elem->out_num;
     } else {
-        iov = pdu->elem.in_sg;
-        niov = pdu->elem.in_num;
+        iov = pdu->elem->in_sg;
+        niov = pdu->elem->in_num;
     }
 
     qemu_iovec_init_external(&elem, iov, niov);
@@ -3256,16 +3258,19 @@ void handle_9p_output(VirtIODevice *vdev, VirtQueue *vq)
 {
     V9fsState *s = (V9fsState *)vdev;
     V9fsPDU *pdu;
-    ssize_t len;
 
-    while ((pdu = alloc_pdu(s)) &&
-            (len = virtqueue_pop(vq, &pdu->elem)) != 0) {
+    while ((pdu = alloc_pdu(s))) {
         uint8_t *ptr;
+
+        pdu->elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
+        if (!pdu->elem) {
+            break;
+        }
         pdu->s = s;
-        BUG_ON(pdu->elem.out_num == 0 || pdu->elem.in_num == 0);
-        BUG_ON(pdu->elem.out_sg[0].iov_len < 7);
+        BUG_ON(pdu->elem->out_num == 0 || pdu->elem->in_num == 0);
+        BUG_ON(pdu->elem->out_sg[0].iov_len < 7);
 
-        ptr = pdu->elem.out_sg[0].iov_base;
+        ptr = pdu->elem->out_sg[0].iov_base;
 
         pdu->size = le32_to_cpu(*(uint32_t *)ptr);
         pdu->id = ptr[4];
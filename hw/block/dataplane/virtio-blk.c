@@ -26,15 +26,19 @@
 #include "hw/virtio/virtio-bus.h"
 #include "qom/object_interfaces.h"
 
-struct VirtIOBlockDataPlane {
-    bool started;
-    bool starting;
-    bool stopping;
-    bool disabled;
-
-    VirtIOBlkConf *conf;
+typedef struct VirtIOBlockDataPlane VirtIOBlockDataPlane;
+
+/* Per-virtqueue state.  Each virtqueue is serviced by the AioContext of its
+ * own IOThread, which may differ from the AioContext that the BlockBackend
+ * is bound to.  Such IOThreads pop requests from their vrings in parallel,
+ * but the block layer is not thread-safe: submission runs under the
+ * BlockBackend's AioContext lock and completion in its IOThread, so those
+ * parts do not scale with the number of IOThreads.
+ */
+typedef struct {
+    VirtIOBlockDataPlane *s;
+    unsigned index;
 
-    VirtIODevice *vdev;
     Vring vring;                    /* virtqueue vring */
     EventNotifier *guest_notifier;  /* irq */
     QEMUBH *bh;                     /* bh for guest notification */
@@ -44,10 +48,33 @@ struct VirtIOBlockDataPlane {
      * (because you don't own the file descriptor or handle; you just
      * use it).
      */
+    EventNotifier host_notifier;    /* doorbell */
+
+    IOThread *iothread;
+    AioContext *ctx;
+
+    /* Requests are popped in ctx but completed in the BlockBackend's
+     * AioContext, so the vring is protected by a lock.
+     */
+    QemuMutex lock;
+} VirtIOBlockDataPlaneQueue;
+
+struct VirtIOBlockDataPlane {
+    bool started;
+    bool starting;
+    bool stopping;
+    bool disabled;
+
+    VirtIOBlkConf *conf;
+
+    VirtIODevice *vdev;
+    unsigned num_queues;
+    VirtIOBlockDataPlaneQueue *queues;
+
+    /* The AioContext that the BlockBackend runs in */
     IOThread *iothread;
     IOThread internal_iothread_obj;
     AioContext *ctx;
-    EventNotifier host_notifier;    /* doorbell */
 
     /* Operation blocker on BDS */
     Error *blocker;
@@ -56,85 +83,142 @@ struct VirtIOBlockDataPlane {
 };
 
 /* Raise an interrupt to signal guest, if necessary */
-static void notify_guest(VirtIOBlockDataPlane *s)
+static void notify_guest(VirtIOBlockDataPlaneQueue *q)
 {
-    if (!vring_should_notify(s->vdev, &s->vring)) {
-        return;
-    }
+    bool should_notify;
 
-    event_notifier_set(s->guest_notifier);
+    qemu_mutex_lock(&q->lock);
+    should_notify = vring_should_notify(q->s->vdev, &q->vring);
+    qemu_mutex_unlock(&q->lock);
+
+    if (should_notify) {
+        event_notifier_set(q->guest_notifier);
+    }
 }
 
 static void notify_guest_bh(void *opaque)
 {
-    VirtIOBlockDataPlane *s = opaque;
+    VirtIOBlockDataPlaneQueue *q = opaque;
 
-    notify_guest(s);
+    notify_guest(q);
 }
 
 static void complete_request_vring(VirtIOBlockReq *req, unsigned char status)
 {
     VirtIOBlockDataPlane *s = req->dev->dataplane;
+    VirtIOBlockDataPlaneQueue *q = &s->queues[virtio_get_queue_index(req->vq)];
+
     stb_p(&req->in->status, status);
 
-    vring_push(s->vdev, &req->dev->dataplane->vring, &req->elem, req->in_len);
+    qemu_mutex_lock(&q->lock);
+    vring_push(s->vdev, &q->vring, &req->elem, req->in_len);
+    qemu_mutex_unlock(&q->lock);
 
     /* Suppress notification to guest by BH and its scheduled
      * flag because requests are completed as a batch after io
      * plug & unplug is introduced, and the BH can still be
      * executed in dataplane aio context even after it is
      * stopped, so needn't worry about notification loss with BH.
+     *
+     * The BH runs in the virtqueue's own AioContext, so a queue
+     * serviced by another IOThread raises its interrupt from there.
      */
-    qemu_bh_schedule(s->bh);
+    qemu_bh_schedule(q->bh);
 }
 
-static void handle_notify(EventNotifier *e)
+/* Pop up to @max requests.  This only needs the queue's own lock, so
+ * IOThreads servicing different queues walk their vrings in parallel.
+ */
+static unsigned pop_requests(VirtIOBlockDataPlaneQueue *q,
+                             VirtIOBlockReq **reqs, unsigned max)
+{
+    unsigned n = 0;
+
+    qemu_mutex_lock(&q->lock);
+    while (n < max) {
+        reqs[n] = vring_pop(q->s->vdev, &q->vring, sizeof(VirtIOBlockReq));
+        if (!reqs[n]) {
+            break; /* no more requests */
+        }
+        n++;
+    }
+    qemu_mutex_unlock(&q->lock);
+
+    return n;
+}
+
+/* Requests are submitted from the BlockBackend's AioContext.  Acquiring it
+ * is a no-op for the virtqueues that the BlockBackend's IOThread services.
+ */
+static void submit_requests(VirtIOBlockDataPlaneQueue *q,
+                            VirtIOBlockReq **reqs, unsigned n)
 {
-    VirtIOBlockDataPlane *s = container_of(e, VirtIOBlockDataPlane,
-                                           host_notifier);
+    VirtIOBlockDataPlane *s = q->s;
     VirtIOBlock *vblk = VIRTIO_BLK(s->vdev);
+    VirtQueue *vq = virtio_get_queue(s->vdev, q->index);
+    MultiReqBuffer mrb = {};
+    unsigned i;
 
-    event_notifier_test_and_clear(&s->host_notifier);
+    aio_context_acquire(s->ctx);
     blk_io_plug(s->conf->conf.blk);
-    for (;;) {
-        MultiReqBuffer mrb = {};
-        int ret;
+    for (i = 0; i < n; i++) {
+        VirtIOBlockReq *req = reqs[i];
 
-        /* Disable guest->host notifies to avoid unnecessary vmexits */
-        vring_disable_notification(s->vdev, &s->vring);
+        virtio_blk_init_request(vblk, vq, req);
 
-        for (;;) {
-            VirtIOBlockReq *req = virtio_blk_alloc_request(vblk);
+        trace_virtio_blk_data_plane_process_request(s, req->elem.out_num,
+                                                    req->elem.in_num,
+                                                    req->elem.index);
 
-            ret = vring_pop(s->vdev, &s->vring, &req->elem);
-            if (ret < 0) {
-                virtio_blk_free_request(req);
-                break; /* no more requests */
-            }
+        virtio_blk_handle_request(req, &mrb);
+    }
 
-            trace_virtio_blk_data_plane_process_request(s, req->elem.out_num,
-                                                        req->elem.in_num,
-                                                        req->elem.index);
+    if (mrb.num_reqs) {
+        virtio_blk_submit_multireq(s->conf->conf.blk, &mrb);
+    }
+    blk_io_unplug(s->conf->conf.blk);
+    aio_context_release(s->ctx);
+}
 
-            virtio_blk_handle_request(req, &mrb);
-        }
+static void handle_notify(EventNotifier *e)
+{
+    VirtIOBlockDataPlaneQueue *q = container_of(e, VirtIOBlockDataPlaneQueue,
+                                                host_notifier);
+    VirtIOBlockDataPlane *s = q->s;
 
-        if (mrb.num_reqs) {
-            virtio_blk_submit_multireq(s->conf->conf.blk, &mrb);
-        }
+    event_notifier_test_and_clear(&q->host_notifier);
+
+    for (;;) {
+        VirtIOBlockReq *reqs[VIRTIO_BLK_POP_BATCH];
+        unsigned n;
+        bool more;
+
+        /* Disable guest->host notifies to avoid unnecessary vmexits */
+        qemu_mutex_lock(&q->lock);
+        vring_disable_notification(s->vdev, &q->vring);
+        qemu_mutex_unlock(&q->lock);
+
+        do {
+            n = pop_requests(q, reqs, ARRAY_SIZE(reqs));
+            if (n) {
+                submit_requests(q, reqs, n);
+            }
+        } while (n == ARRAY_SIZE(reqs));
 
-        if (likely(ret == -EAGAIN)) { /* vring emptied */
+        if (likely(!q->vring.broken)) { /* vring emptied */
             /* Re-enable guest->host notifies and stop processing the vring.
              * But if the guest has snuck in more descriptors, keep processing.
              */
-            if (vring_enable_notification(s->vdev, &s->vring)) {
+            qemu_mutex_lock(&q->lock);
+            more = !vring_enable_notification(s->vdev, &q->vring);
+            qemu_mutex_unlock(&q->lock);
+            if (!more) {
                 break;
             }
         } else { /* fatal error */
             break;
         }
     }
-    blk_io_unplug(s->conf->conf.blk);
 }
 
 /* Context: QEMU global mutex held */
@@ -146,10 +230,15 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     Error *local_err = NULL;
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    IOThread **iothreads;
+    unsigned i;
 
     *dataplane = NULL;
 
     if (!conf->data_plane && !conf->iothread) {
+        if (conf->num_iothread_vq) {
+            error_setg(errp, "iothread-vq requires the iothread property");
+        }
         return;
     }
 
@@ -172,6 +261,20 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
         return;
     }
 
+    iothreads = g_new0(IOThread *, conf->num_queues);
+    for (i = 0; i < conf->num_iothread_vq; i++) {
+        if (!conf->iothread_vq[i]) {
+            continue;
+        }
+        iothreads[i] = iothread_find(conf->iothread_vq[i]);
+        if (!iothreads[i]) {
+            error_setg(errp, "iothread-vq[%u]: IOThread '%s' not found",
+                       i, conf->iothread_vq[i]);
+            g_free(iothreads);
+            return;
+        }
+    }
+
     s = g_new0(VirtIOBlockDataPlane, 1);
     s->vdev = vdev;
     s->conf = conf;
@@ -191,7 +294,21 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
         s->iothread = &s->internal_iothread_obj;
     }
     s->ctx = iothread_get_aio_context(s->iothread);
-    s->bh = aio_bh_new(s->ctx, notify_guest_bh, s);
+
+    s->num_queues = conf->num_queues;
+    s->queues = g_new0(VirtIOBlockDataPlaneQueue, s->num_queues);
+    for (i = 0; i < s->num_queues; i++) {
+        VirtIOBlockDataPlaneQueue *q = &s->queues[i];
+
+        q->s = s;
+        q->index = i;
+        q->iothread = iothreads[i] ? iothreads[i] : s->iothread;
+        object_ref(OBJECT(q->iothread));
+        q->ctx = iothread_get_aio_context(q->iothread);
+        q->bh = aio_bh_new(q->ctx, notify_guest_bh, q);
+        qemu_mutex_init(&q->lock);
+    }
+    g_free(iothreads);
 
     error_setg(&s->blocker, "block device is in use by data plane");
     blk_op_block_all(conf->conf.blk, s->blocker);
@@ -216,6 +333,8 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
 /* Context: QEMU global mutex held */
 void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
 {
+    unsigned i;
+
     if (!s) {
         return;
     }
@@ -223,8 +342,15 @@ void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
     virtio_blk_data_plane_stop(s);
     blk_op_unblock_all(s->conf->conf.blk, s->blocker);
     error_free(s->blocker);
+    for (i = 0; i < s->num_queues; i++) {
+        VirtIOBlockDataPlaneQueue *q = &s->queues[i];
+
+        qemu_bh_delete(q->bh);
+        qemu_mutex_destroy(&q->lock);
+        object_unref(OBJECT(q->iothread));
+    }
+    g_free(s->queues);
     object_unref(OBJECT(s->iothread));
-    qemu_bh_delete(s->bh);
     g_free(s);
 }
 
@@ -234,7 +360,7 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
     VirtIOBlock *vblk = VIRTIO_BLK(s->vdev);
-    VirtQueue *vq;
+    unsigned i, nvrings, nnotifiers;
     int r;
 
     if (s->started || s->disabled) {
@@ -247,27 +373,35 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
 
     s->starting = true;
 
-    vq = virtio_get_queue(s->vdev, 0);
-    if (!vring_setup(&s->vring, s->vdev, 0)) {
-        goto fail_vring;
+    for (nvrings = 0; nvrings < s->num_queues; nvrings++) {
+        if (!vring_setup(&s->queues[nvrings].vring, s->vdev, nvrings)) {
+            goto fail_vring;
+        }
     }
 
     /* Set up guest notifier (irq) */
-    r = k->set_guest_notifiers(qbus->parent, 1, true);
+    r = k->set_guest_notifiers(qbus->parent, s->num_queues, true);
     if (r != 0) {
         fprintf(stderr, "virtio-blk failed to set guest notifier (%d), "
                 "ensure -enable-kvm is set\n", r);
         goto fail_guest_notifiers;
     }
-    s->guest_notifier = virtio_queue_get_guest_notifier(vq);
 
     /* Set up virtqueue notify */
-    r = k->set_host_notifier(qbus->parent, 0, true);
-    if (r != 0) {
-        fprintf(stderr, "virtio-blk failed to set host notifier (%d)\n", r);
-        goto fail_host_notifier;
+    for (nnotifiers = 0; nnotifiers < s->num_queues; nnotifiers++) {
+        VirtIOBlockDataPlaneQueue *q = &s->queues[nnotifiers];
+        VirtQueue *vq = virtio_get_queue(s->vdev, nnotifiers);
+
+        q->guest_notifier = virtio_queue_get_guest_notifier(vq);
+
+        r = k->set_host_notifier(qbus->parent, nnotifiers, true);
+        if (r != 0) {
+            fprintf(stderr, "virtio-blk failed to set host notifier (%d)\n",
+                    r);
+            goto fail_host_notifier;
+        }
+        q->host_notifier = *virtio_queue_get_host_notifier(vq);
     }
-    s->host_notifier = *virtio_queue_get_host_notifier(vq);
 
     s->saved_complete_request = vblk->complete_request;
     vblk->complete_request = complete_request_vring;
@@ -278,21 +412,31 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
 
     blk_set_aio_context(s->conf->conf.blk, s->ctx);
 
-    /* Kick right away to begin processing requests already in vring */
-    event_notifier_set(virtio_queue_get_host_notifier(vq));
+    for (i = 0; i < s->num_queues; i++) {
+        VirtIOBlockDataPlaneQueue *q = &s->queues[i];
+        VirtQueue *vq = virtio_get_queue(s->vdev, i);
 
-    /* Get this show started by hooking up our callbacks */
-    aio_context_acquire(s->ctx);
-    aio_set_event_notifier(s->ctx, &s->host_notifier, handle_notify);
-    aio_context_release(s->ctx);
+        /* Kick right away to begin processing requests already in vring */
+        event_notifier_set(virtio_queue_get_host_notifier(vq));
+
+        /* Get this show started by hooking up our callbacks */
+        aio_context_acquire(q->ctx);
+        aio_set_event_notifier(q->ctx, &q->host_notifier, handle_notify);
+        aio_context_release(q->ctx);
+    }
     return;
 
   fail_host_notifier:
-    k->set_guest_notifiers(qbus->parent, 1, false);
+    while (nnotifiers-- > 0) {
+        k->set_host_notifier(qbus->parent, nnotifiers, false);
+    }
+    k->set_guest_notifiers(qbus->parent, s->num_queues, false);
   fail_guest_notifiers:
-    vring_teardown(&s->vring, s->vdev, 0);
     s->disabled = true;
   fail_vring:
+    while (nvrings-- > 0) {
+        vring_teardown(&s->queues[nvrings].vring, s->vdev, nvrings);
+    }
     s->starting = false;
 }
 
@@ -302,7 +446,7 @@ void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
     VirtIOBlock *vblk = VIRTIO_BLK(s->vdev);
-
+    unsigned i;
 
     /* Better luck next time. */
     if (s->disabled) {
@@ -313,28 +457,39 @@ void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
         return;
     }
     s->stopping = true;
-    vblk->complete_request = s->saved_complete_request;
     trace_virtio_blk_data_plane_stop(s);
 
-    aio_context_acquire(s->ctx);
+    /* Stop notifications for new requests from guest.  Once each queue's
+     * AioContext has been acquired, no IOThread is submitting requests.
+     */
+    for (i = 0; i < s->num_queues; i++) {
+        VirtIOBlockDataPlaneQueue *q = &s->queues[i];
 
-    /* Stop notifications for new requests from guest */
-    aio_set_event_notifier(s->ctx, &s->host_notifier, NULL);
+        aio_context_acquire(q->ctx);
+        aio_set_event_notifier(q->ctx, &q->host_notifier, NULL);
+        aio_context_release(q->ctx);
+    }
+
+    aio_context_acquire(s->ctx);
 
     /* Drain and switch bs back to the QEMU main loop */
     blk_set_aio_context(s->conf->conf.blk, qemu_get_aio_context());
 
     aio_context_release(s->ctx);
 
-    /* Sync vring state back to virtqueue so that non-dataplane request
-     * processing can continue when we disable the host notifier below.
-     */
-    vring_teardown(&s->vring, s->vdev, 0);
+    vblk->complete_request = s->saved_complete_request;
 
-    k->set_host_notifier(qbus->parent, 0, false);
+    for (i = 0; i < s->num_queues; i++) {
+        /* Sync vring state back to virtqueue so that non-dataplane request
+         * processing can continue when we disable the host notifier below.
+         */
+        vring_teardown(&s->queues[i].vring, s->vdev, i);
+
+        k->set_host_notifier(qbus->parent, i, false);
+    }
 
     /* Clean up guest notifier (irq) */
-    k->set_guest_notifiers(qbus->parent, 1, false);
+    k->set_guest_notifiers(qbus->parent, s->num_queues, false);
 
     s->started = false;
     s->stopping = false;
@@ -28,35 +28,63 @@
 #include "hw/virtio/virtio-bus.h"
 #include "hw/virtio/virtio-access.h"
 
-VirtIOBlockReq *virtio_blk_alloc_request(VirtIOBlock *s)
+void virtio_blk_init_request(VirtIOBlock *s, VirtQueue *vq,
+                             VirtIOBlockReq *req)
 {
-    VirtIOBlockReq *req = g_slice_new(VirtIOBlockReq);
     req->dev = s;
+    req->vq = vq;
     req->qiov.size = 0;
     req->in_len = 0;
     req->next = NULL;
     req->mr_next = NULL;
-    return req;
 }
 
 void virtio_blk_free_request(VirtIOBlockReq *req)
 {
-    if (req) {
-        g_slice_free(VirtIOBlockReq, req);
+    g_free(req);
+}
+
+/* Publish the completions filled since the last flush, with one used
+ * index update and at most one interrupt per queue.
+ */
+static void virtio_blk_flush_completions(VirtIOBlock *s)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    int i;
+
+    for (i = 0; i < s->conf.num_queues; i++) {
+        VirtQueue *vq;
+
+        if (!s->complete_pending[i]) {
+            continue;
+        }
+        vq = virtio_get_queue(vdev, i);
+        virtqueue_flush(vq, s->complete_pending[i]);
+        s->complete_pending[i] = 0;
+        virtio_notify(vdev, vq);
     }
 }
 
+static void virtio_blk_complete_bh(void *opaque)
+{
+    virtio_blk_flush_completions(opaque);
+}
+
 static void virtio_blk_complete_request(VirtIOBlockReq *req,
                                         unsigned char status)
 {
     VirtIOBlock *s = req->dev;
-    VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    unsigned int *pending;
 
     trace_virtio_blk_req_complete(req, status);
 
     stb_p(&req->in->status, status);
-    virtqueue_push(s->vq, &req->elem, req->in_len);
-    virtio_notify(vdev, s->vq);
+
+    /* Requests that complete in the same main loop iteration are
+     * gathered and made visible to the guest together. */
+    pending = &s->complete_pending[virtio_get_queue_index(req->vq)];
+    virtqueue_fill(req->vq, &req->elem, req->in_len, (*pending)++);
+    qemu_bh_schedule(s->complete_bh);
 }
 
 static void virtio_blk_req_complete(VirtIOBlockReq *req, unsigned char status)
@@ -76,7 +104,7 @@ static int virtio_blk_handle_rw_error(VirtIOBlockReq *req, int error,
         s->rq = req;
     } else if (action == BLOCK_ERROR_ACTION_REPORT) {
         virtio_blk_req_complete(req, VIRTIO_BLK_S_IOERR);
-        block_acct_done(blk_get_stats(s->blk), &req->acct);
+        block_acct_failed(blk_get_stats(s->blk), &req->acct);
         virtio_blk_free_request(req);
     }
 
@@ -187,18 +215,6 @@ out:
 
 #endif
 
-static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s)
-{
-    VirtIOBlockReq *req = virtio_blk_alloc_request(s);
-
-    if (!virtqueue_pop(s->vq, &req->elem)) {
-        virtio_blk_free_request(req);
-        return NULL;
-    }
-
-    return req;
-}
-
 static int virtio_blk_handle_scsi_req(VirtIOBlockReq *req)
 {
     int status = VIRTIO_BLK_S_OK;
@@ -537,6 +553,8 @@ void virtio_blk_handle_request(VirtIOBlockReq *req, MultiReqBuffer *mrb)
         if (!virtio_blk_sect_range_ok(req->dev, req->sector_num,
                                       req->qiov.size)) {
             virtio_blk_req_complete(req, VIRTIO_BLK_S_IOERR);
+            block_acct_invalid(blk_get_stats(req->dev->blk),
+                               is_write ? BLOCK_ACCT_WRITE : BLOCK_ACCT_READ);
             virtio_blk_free_request(req);
             return;
         }
@@ -590,20 +608,27 @@ void virtio_blk_handle_request(VirtIOBlockReq *req, MultiReqBuffer *mrb)
 static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIOBlock *s = VIRTIO_BLK(vdev);
-    VirtIOBlockReq *req;
+    VirtIOBlockReq *reqs[VIRTIO_BLK_POP_BATCH];
+    unsigned int i, n;
     MultiReqBuffer mrb = {};
 
     /* Some guests kick before setting VIRTIO_CONFIG_S_DRIVER_OK so start
      * dataplane here instead of waiting for .set_status().
      */
     if (s->dataplane) {
+        virtio_blk_flush_completions(s);
         virtio_blk_data_plane_start(s->dataplane);
         return;
     }
 
-    while ((req = virtio_blk_get_request(s))) {
-        virtio_blk_handle_request(req, &mrb);
-    }
+    do {
+        n = virtqueue_pop_batch(vq, sizeof(VirtIOBlockReq), (void **)reqs,
+                                ARRAY_SIZE(reqs));
+        for (i = 0; i < n; i++) {
+            virtio_blk_init_request(s, vq, reqs[i]);
+            virtio_blk_handle_request(reqs[i], &mrb);
+        }
+    } while (n == ARRAY_SIZE(reqs));
 
     if (mrb.num_reqs) {
         virtio_blk_submit_multireq(s->blk, &mrb);
@@ -661,6 +686,7 @@ static void virtio_blk_reset(VirtIODevice *vdev)
      * are per-device request lists.
      */
     blk_drain_all();
+    virtio_blk_flush_completions(s);
     blk_set_enable_write_cache(s->blk, s->original_wce);
 }
 
@@ -682,6 +708,7 @@ static void virtio_blk_update_config(VirtIODevice *vdev, uint8_t *config)
     virtio_stl_p(vdev, &blkcfg.blk_size, blk_size);
     virtio_stw_p(vdev, &blkcfg.min_io_size, conf->min_io_size / blk_size);
     virtio_stw_p(vdev, &blkcfg.opt_io_size, conf->opt_io_size / blk_size);
+    virtio_stw_p(vdev, &blkcfg.num_queues, s->conf.num_queues);
     blkcfg.geometry.heads = conf->heads;
     /*
      * We must ensure that the block device capacity is a multiple of
@@ -737,6 +764,9 @@ static uint32_t virtio_blk_get_features(VirtIODevice *vdev, uint32_t features)
     if (blk_is_read_only(s->blk)) {
         virtio_add_feature(&features, VIRTIO_BLK_F_RO);
     }
+    if (s->conf.num_queues > 1) {
+        virtio_add_feature(&features, VIRTIO_BLK_F_MQ);
+    }
 
     return features;
 }
@@ -781,6 +811,8 @@ static void virtio_blk_save(QEMUFile *f, void *opaque)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(opaque);
 
+    /* The used index and inuse counts must not leave requests behind */
+    virtio_blk_flush_completions(opaque);
     virtio_save(vdev, f);
 }
     
@@ -791,8 +823,10 @@ static void virtio_blk_save_device(VirtIODevice *vdev, QEMUFile *f)
 
     while (req) {
         qemu_put_sbyte(f, 1);
-        qemu_put_buffer(f, (unsigned char *)&req->elem,
-                        sizeof(VirtQueueElement));
+        if (s->conf.num_queues > 1) {
+            qemu_put_be32(f, virtio_get_queue_index(req->vq));
+        }
+        qemu_put_virtqueue_element(f, &req->elem);
         req = req->next;
     }
     qemu_put_sbyte(f, 0);
@@ -815,16 +849,22 @@ static int virtio_blk_load_device(VirtIODevice *vdev, QEMUFile *f,
     VirtIOBlock *s = VIRTIO_BLK(vdev);
 
     while (qemu_get_sbyte(f)) {
-        VirtIOBlockReq *req = virtio_blk_alloc_request(s);
-        qemu_get_buffer(f, (unsigned char *)&req->elem,
-                        sizeof(VirtQueueElement));
+        unsigned nvq = 0;
+        VirtIOBlockReq *req;
+
+        if (s->conf.num_queues > 1) {
+            nvq = qemu_get_be32(f);
+            if (nvq >= s->conf.num_queues) {
+                error_report("Invalid virtqueue index in request list: %#x",
+                             nvq);
+                return -EINVAL;
+            }
+        }
+
+        req = qemu_get_virtqueue_element(f, sizeof(VirtIOBlockReq));
+        virtio_blk_init_request(s, virtio_get_queue(vdev, nvq), req);
         req->next = s->rq;
         s->rq = req;
-
-        virtqueue_map_sg(req->elem.in_sg, req->elem.in_addr,
-            req->elem.in_num, 1);
-        virtqueue_map_sg(req->elem.out_sg, req->elem.out_addr,
-            req->elem.out_num, 0);
     }
 
     return 0;
@@ -878,6 +918,7 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
     VirtIOBlkConf *conf = &s->conf;
     Error *err = NULL;
     static int virtio_blk_id;
+    unsigned i;
 
     if (!conf->conf.blk) {
         error_setg(errp, "drive property not set");
@@ -897,6 +938,17 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
     }
     blkconf_blocksizes(&conf->conf);
 
+    if (!conf->num_queues || conf->num_queues > VIRTIO_PCI_QUEUE_MAX) {
+        error_setg(errp, "num-queues property must be between 1 and %d",
+                   VIRTIO_PCI_QUEUE_MAX);
+        return;
+    }
+    if (conf->num_iothread_vq > conf->num_queues) {
+        error_setg(errp, "iothread-vq has %u entries, but the device only has "
+                   "%u virtqueues", conf->num_iothread_vq, conf->num_queues);
+        return;
+    }
+
     virtio_init(vdev, "virtio-blk", VIRTIO_ID_BLOCK,
                 sizeof(struct virtio_blk_config));
 
@@ -904,7 +956,9 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
     s->rq = NULL;
     s->sector_mask = (s->conf.conf.logical_block_size / BDRV_SECTOR_SIZE) - 1;
 
-    s->vq = virtio_add_queue(vdev, 128, virtio_blk_handle_output);
+    for (i = 0; i < conf->num_queues; i++) {
+        virtio_add_queue(vdev, 128, virtio_blk_handle_output);
+    }
     s->complete_request = virtio_blk_complete_request;
     virtio_blk_data_plane_create(vdev, conf, &s->dataplane, &err);
     if (err != NULL) {
@@ -912,6 +966,8 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
         virtio_cleanup(vdev);
         return;
     }
+    s->complete_pending = g_new0(unsigned int, conf->num_queues);
+    s->complete_bh = qemu_bh_new(virtio_blk_complete_bh, s);
     s->migration_state_notifier.notify = virtio_blk_migration_state_changed;
     add_migration_state_change_notifier(&s->migration_state_notifier);
 
@@ -933,6 +989,9 @@ static void virtio_blk_device_unrealize(DeviceState *dev, Error **errp)
     virtio_blk_data_plane_destroy(s->dataplane);
     s->dataplane = NULL;
     qemu_del_vm_change_state_handler(s->change);
+    virtio_blk_flush_completions(s);
+    qemu_bh_delete(s->complete_bh);
+    g_free(s->complete_pending);
     unregister_savevm(dev, "virtio-blk", s);
     blockdev_mark_auto_del(s->blk);
     virtio_cleanup(vdev);
@@ -951,6 +1010,13 @@ static void virtio_blk_instance_init(Object *obj)
                                   DEVICE(obj), NULL);
 }
 
+static void virtio_blk_instance_finalize(Object *obj)
+{
+    VirtIOBlock *s = VIRTIO_BLK(obj);
+
+    g_free(s->conf.iothread_vq);
+}
+
 static Property virtio_blk_properties[] = {
     DEFINE_BLOCK_PROPERTIES(VirtIOBlock, conf.conf),
     DEFINE_BLOCK_CHS_PROPERTIES(VirtIOBlock, conf.conf),
@@ -962,6 +1028,9 @@ static Property virtio_blk_properties[] = {
     DEFINE_PROP_BIT("request-merging", VirtIOBlock, conf.request_merging, 0,
                     true),
     DEFINE_PROP_BIT("x-data-plane", VirtIOBlock, conf.data_plane, 0, false),
+    DEFINE_PROP_UINT16("num-queues", VirtIOBlock, conf.num_queues, 1),
+    DEFINE_PROP_ARRAY("iothread-vq", VirtIOBlock, conf.num_iothread_vq,
+                      conf.iothread_vq, qdev_prop_string, char *),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -988,6 +1057,7 @@ static const TypeInfo virtio_device_info = {
     .parent = TYPE_VIRTIO_DEVICE,
     .instance_size = sizeof(VirtIOBlock),
     .instance_init = virtio_blk_instance_init,
+    .instance_finalize = virtio_blk_instance_finalize,
     .class_init = virtio_blk_class_init,
 };
 
@@ -119,6 +119,16 @@ void vhost_net_ack_features(struct vhost_net *net, unsigned features)
     vhost_ack_features(&net->dev, vhost_net_get_feature_bits(net), features);
 }
 
+unsigned vhost_net_get_acked_features(struct vhost_net *net)
+{
+    return net->dev.acked_features;
+}
+
+uint64_t vhost_net_get_max_queues(struct vhost_net *net)
+{
+    return net->dev.max_queues;
+}
+
 static int vhost_net_get_fd(NetClientState *backend)
 {
     switch (backend->info->type) {
@@ -157,6 +167,7 @@ struct vhost_net *vhost_net_init(VhostNetOptions *options)
 
     net->dev.nvqs = 2;
     net->dev.vqs = net->vqs;
+    net->dev.max_queues = 1;
 
     r = vhost_dev_init(&net->dev, options->opaque,
                        options->backend_type, options->force);
@@ -217,6 +228,16 @@ static int vhost_net_start_one(struct vhost_net *net,
         net->nc->info->poll(net->nc, false);
     }
 
+    if (net->nc->info->type == NET_CLIENT_OPTIONS_KIND_VHOST_USER) {
+        /* Rings start disabled once protocol features are negotiated, and
+         * only the queue pairs the guest uses are enabled again.
+         */
+        r = vhost_net_set_vring_enable(net->nc, net->nc->vring_enable);
+        if (r < 0) {
+            goto fail;
+        }
+    }
+
     if (net->nc->info->type == NET_CLIENT_OPTIONS_KIND_TAP) {
         qemu_set_fd_handler(net->backend, NULL, NULL, NULL);
         file.fd = net->backend;
@@ -264,11 +285,17 @@ static void vhost_net_stop_one(struct vhost_net *net,
             assert(r >= 0);
         }
     } else if (net->nc->info->type == NET_CLIENT_OPTIONS_KIND_VHOST_USER) {
-        for (file.index = 0; file.index < net->dev.nvqs; ++file.index) {
-            const VhostOps *vhost_ops = net->dev.vhost_ops;
-            int r = vhost_ops->vhost_call(&net->dev, VHOST_RESET_OWNER,
-                                          NULL);
-            assert(r >= 0);
+        const VhostOps *vhost_ops = net->dev.vhost_ops;
+        /* Resetting the owner would also drop the rings of the other queue
+         * pairs on the socket, so only do it if rings cannot be disabled.
+         */
+        if (vhost_ops->vhost_backend_set_vring_enable(&net->dev, 0) ==
+            -ENOTSUP) {
+            for (file.index = 0; file.index < net->dev.nvqs; ++file.index) {
+                int r = vhost_ops->vhost_call(&net->dev, VHOST_RESET_OWNER,
+                                              NULL);
+                assert(r >= 0);
+            }
         }
     }
     if (net->nc->info->poll) {
@@ -402,6 +429,31 @@ VHostNetState *get_vhost_net(NetClientState *nc)
 
     return vhost_net;
 }
+
+/* Enable or disable the rings of a vhost-user queue pair.  The state is
+ * kept in the net client, so that it can be sent again when the backend
+ * is started or has reconnected.
+ */
+int vhost_net_set_vring_enable(NetClientState *nc, int enable)
+{
+    VHostNetState *net = get_vhost_net(nc);
+    const VhostOps *vhost_ops;
+    int r;
+
+    nc->vring_enable = enable;
+    if (!net || !net->dev.started) {
+        return 0;
+    }
+
+    vhost_ops = net->dev.vhost_ops;
+    if (!vhost_ops->vhost_backend_set_vring_enable) {
+        return 0;
+    }
+
+    /* Legacy backends have their rings enabled all the time */
+    r = vhost_ops->vhost_backend_set_vring_enable(&net->dev, enable);
+    return r == -ENOTSUP ? 0 : r;
+}
 #else
 struct vhost_net *vhost_net_init(VhostNetOptions *options)
 {
@@ -438,6 +490,16 @@ void vhost_net_ack_features(struct vhost_net *net, unsigned features)
 {
 }
 
+unsigned vhost_net_get_acked_features(struct vhost_net *net)
+{
+    return 0;
+}
+
+uint64_t vhost_net_get_max_queues(struct vhost_net *net)
+{
+    return 1;
+}
+
 bool vhost_net_virtqueue_pending(VHostNetState *net, int idx)
 {
     return false;
@@ -452,4 +514,9 @@ VHostNetState *get_vhost_net(NetClientState *nc)
 {
     return 0;
 }
+
+int vhost_net_set_vring_enable(NetClientState *nc, int enable)
+{
+    return 0;
+}
 #endif
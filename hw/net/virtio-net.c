@@ -24,6 +24,9 @@
 #include "qapi/qmp/qjson.h"
 #include "qapi-event.h"
 #include "hw/virtio/virtio-access.h"
+#include "block/aio.h"
+#include "net/eth.h"
+#include "migration/migration.h"
 
 #define VIRTIO_NET_VM_VERSION    11
 
@@ -155,6 +158,204 @@ static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
     }
 }
 
+/* Interrupt the guest from whichever thread services @q */
+static void virtio_net_notify(VirtIONetQueue *q, VirtQueue *vq)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(q->n);
+
+    if (q->ctx) {
+        virtio_notify_irqfd(vdev, vq);
+    } else {
+        virtio_notify(vdev, vq);
+    }
+}
+
+static void virtio_net_tx_bh(void *opaque);
+static void virtio_net_rsc_flush(VirtIONetQueue *q);
+static void virtio_net_rsc_detach_bh(VirtIONetQueue *q);
+
+/* Move the TX bottom half of @q to @ctx, or to the main loop if @ctx is
+ * NULL, keeping it scheduled if a flush was pending.
+ */
+static void virtio_net_move_tx_bh(VirtIONetQueue *q, AioContext *ctx)
+{
+    qemu_bh_delete(q->tx_bh);
+    if (ctx) {
+        q->tx_bh = aio_bh_new(ctx, virtio_net_tx_bh, q);
+    } else {
+        q->tx_bh = qemu_bh_new(virtio_net_tx_bh, q);
+    }
+    if (q->tx_waiting) {
+        qemu_bh_schedule(q->tx_bh);
+    }
+}
+
+static bool virtio_net_dataplane_enabled(VirtIONet *n)
+{
+    return n->net_conf.iothread != NULL;
+}
+
+/* Context: QEMU global mutex held */
+static void virtio_net_dataplane_start(VirtIONet *n, int queues)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int i, r;
+
+    if (n->dataplane_started || n->dataplane_fenced) {
+        return;
+    }
+
+    /* Don't try if transport does not support notifiers. */
+    if (!k->set_guest_notifiers || !k->set_host_notifier) {
+        error_report("virtio-net: Failed to start IOThread datapath "
+                     "(transport does not support notifiers)");
+        n->dataplane_fenced = true;
+        return;
+    }
+    for (i = 0; i < queues; i++) {
+        NetClientState *nc = qemu_get_subqueue(n->nic, i);
+
+        if (!nc->peer || !nc->peer->info->set_aio_context) {
+            error_report("virtio-net: Failed to start IOThread datapath "
+                         "(backend of queue %d only runs in the main loop)",
+                         i);
+            n->dataplane_fenced = true;
+            return;
+        }
+    }
+
+    /* Set up guest notifier (irq) */
+    r = k->set_guest_notifiers(qbus->parent, queues * 2, true);
+    if (r < 0) {
+        error_report("virtio-net: Failed to set guest notifiers (%d), "
+                     "ensure -enable-kvm is set", r);
+        n->dataplane_fenced = true;
+        return;
+    }
+
+    /* Set up virtqueue notify */
+    for (i = 0; i < queues * 2; i++) {
+        r = k->set_host_notifier(qbus->parent, i, true);
+        if (r < 0) {
+            error_report("virtio-net: Failed to set host notifier (%d)", r);
+            while (--i >= 0) {
+                k->set_host_notifier(qbus->parent, i, false);
+            }
+            k->set_guest_notifiers(qbus->parent, queues * 2, false);
+            n->dataplane_fenced = true;
+            return;
+        }
+    }
+
+    for (i = 0; i < queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+        AioContext *ctx = iothread_get_aio_context(q->iothread);
+
+        aio_context_acquire(ctx);
+        virtio_net_rsc_detach_bh(q);
+        q->ctx = ctx;
+        virtio_net_move_tx_bh(q, ctx);
+        virtio_queue_aio_set_host_notifier_handler(q->rx_vq, ctx, true);
+        virtio_queue_aio_set_host_notifier_handler(q->tx_vq, ctx, true);
+        qemu_net_set_aio_context(qemu_get_subqueue(n->nic, i)->peer, ctx);
+        aio_context_release(ctx);
+    }
+
+    /* Dirty memory tracking is not safe against the IOThreads, which
+     * write to guest memory without holding the global mutex.
+     */
+    error_setg(&n->dataplane_migration_blocker,
+               "virtio-net IOThread datapath does not support migration");
+    migrate_add_blocker(n->dataplane_migration_blocker);
+
+    n->dataplane_queues = queues;
+    n->dataplane_started = true;
+}
+
+/* Context: QEMU global mutex held */
+static void virtio_net_dataplane_stop(VirtIONet *n)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int i, queues = n->dataplane_queues;
+
+    if (!n->dataplane_started) {
+        return;
+    }
+
+    for (i = 0; i < queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+        AioContext *ctx = q->ctx;
+
+        aio_context_acquire(ctx);
+        qemu_net_set_aio_context(qemu_get_subqueue(n->nic, i)->peer, NULL);
+        virtio_queue_aio_set_host_notifier_handler(q->rx_vq, ctx, false);
+        virtio_queue_aio_set_host_notifier_handler(q->tx_vq, ctx, false);
+        virtio_net_move_tx_bh(q, NULL);
+        virtio_net_rsc_detach_bh(q);
+        q->ctx = NULL;
+        aio_context_release(ctx);
+    }
+
+    for (i = 0; i < queues * 2; i++) {
+        k->set_host_notifier(qbus->parent, i, false);
+    }
+
+    /* Clean up guest notifier (irq) */
+    k->set_guest_notifiers(qbus->parent, queues * 2, false);
+
+    migrate_del_blocker(n->dataplane_migration_blocker);
+    error_free(n->dataplane_migration_blocker);
+    n->dataplane_migration_blocker = NULL;
+
+    n->dataplane_queues = 0;
+    n->dataplane_started = false;
+}
+
+static void virtio_net_dataplane_status(VirtIONet *n, uint8_t status)
+{
+    int queues = n->multiqueue ? n->curr_queues : 1;
+
+    if (!virtio_net_dataplane_enabled(n)) {
+        return;
+    }
+
+    if (!virtio_net_started(n, status) || n->vhost_started) {
+        virtio_net_dataplane_stop(n);
+        /* Better luck next time. */
+        n->dataplane_fenced = false;
+        return;
+    }
+
+    /* The guest changed the number of queue pairs */
+    if (n->dataplane_started && n->dataplane_queues != queues) {
+        virtio_net_dataplane_stop(n);
+    }
+    virtio_net_dataplane_start(n, queues);
+}
+
+/* Keep the IOThreads away from state that the main loop changes */
+static void virtio_net_dataplane_acquire(VirtIONet *n)
+{
+    int i;
+
+    for (i = 0; i < n->dataplane_queues; i++) {
+        aio_context_acquire(n->vqs[i].ctx);
+    }
+}
+
+static void virtio_net_dataplane_release(VirtIONet *n)
+{
+    int i;
+
+    for (i = 0; i < n->dataplane_queues; i++) {
+        aio_context_release(n->vqs[i].ctx);
+    }
+}
+
 static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -163,6 +364,7 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
     uint8_t queue_status;
 
     virtio_net_vhost_status(n, status);
+    virtio_net_dataplane_status(n, status);
 
     for (i = 0; i < n->max_queues; i++) {
         q = &n->vqs[i];
@@ -316,6 +518,7 @@ static RxFilterInfo *virtio_net_query_rxfilter(NetClientState *nc)
 static void virtio_net_reset(VirtIODevice *vdev)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
+    int i;
 
     /* Reset back to compatibility mode */
     n->promisc = 1;
@@ -339,6 +542,10 @@ static void virtio_net_reset(VirtIODevice *vdev)
     memcpy(&n->mac[0], &n->nic->conf->macaddr, sizeof(n->mac));
     qemu_format_nic_info_str(qemu_get_queue(n->nic), n->mac);
     memset(n->vlans, 0, MAX_VLAN >> 3);
+
+    for (i = 0; i < n->max_queues; i++) {
+        n->vqs[i].rsc.len = 0;
+    }
 }
 
 static void peer_test_vnet_hdr(VirtIONet *n)
@@ -395,6 +602,10 @@ static int peer_attach(VirtIONet *n, int index)
         return 0;
     }
 
+    if (nc->peer->info->type == NET_CLIENT_OPTIONS_KIND_VHOST_USER) {
+        return vhost_net_set_vring_enable(nc->peer, 1);
+    }
+
     if (nc->peer->info->type != NET_CLIENT_OPTIONS_KIND_TAP) {
         return 0;
     }
@@ -410,6 +621,10 @@ static int peer_detach(VirtIONet *n, int index)
         return 0;
     }
 
+    if (nc->peer->info->type == NET_CLIENT_OPTIONS_KIND_VHOST_USER) {
+        return vhost_net_set_vring_enable(nc->peer, 0);
+    }
+
     if (nc->peer->info->type !=  NET_CLIENT_OPTIONS_KIND_TAP) {
         return 0;
     }
@@ -422,6 +637,9 @@ static void virtio_net_set_queues(VirtIONet *n)
     int i;
     int r;
 
+    /* Attaching a tap peer that runs in an IOThread changes the fd handlers
+     * of its AioContext */
+    virtio_net_dataplane_acquire(n);
     for (i = 0; i < n->max_queues; i++) {
         if (i < n->curr_queues) {
             r = peer_attach(n, i);
@@ -431,6 +649,7 @@ static void virtio_net_set_queues(VirtIONet *n)
             assert(!r);
         }
     }
+    virtio_net_dataplane_release(n);
 }
 
 static void virtio_net_set_multiqueue(VirtIONet *n, int multiqueue);
@@ -446,14 +665,20 @@ static uint32_t virtio_net_get_features(VirtIODevice *vdev, uint32_t features)
     virtio_add_feature(&features, VIRTIO_NET_F_MAC);
 
     if (!peer_has_vnet_hdr(n)) {
-        virtio_clear_feature(&features, VIRTIO_NET_F_CSUM);
-        virtio_clear_feature(&features, VIRTIO_NET_F_HOST_TSO4);
-        virtio_clear_feature(&features, VIRTIO_NET_F_HOST_TSO6);
-        virtio_clear_feature(&features, VIRTIO_NET_F_HOST_ECN);
-
-        virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_CSUM);
-        virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO4);
-        virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO6);
+        /* Checksum and TSO can be done in software on transmit */
+        if (!n->net_conf.tx_offload) {
+            virtio_clear_feature(&features, VIRTIO_NET_F_CSUM);
+            virtio_clear_feature(&features, VIRTIO_NET_F_HOST_TSO4);
+            virtio_clear_feature(&features, VIRTIO_NET_F_HOST_TSO6);
+            virtio_clear_feature(&features, VIRTIO_NET_F_HOST_ECN);
+        }
+
+        /* Coalesced receive segments are passed up as TSO packets */
+        if (!n->net_conf.rx_coalesce) {
+            virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_CSUM);
+            virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO4);
+            virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO6);
+        }
         virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_ECN);
     }
 
@@ -527,6 +752,9 @@ static void virtio_net_set_features(VirtIODevice *vdev, uint32_t features)
         n->curr_guest_offloads =
             virtio_net_guest_offloads_by_features(features);
         virtio_net_apply_guest_offloads(n);
+    } else if (n->net_conf.rx_coalesce) {
+        n->curr_guest_offloads =
+            virtio_net_guest_offloads_by_features(features);
     }
 
     for (i = 0;  i < n->max_queues; i++) {
@@ -597,7 +825,7 @@ static int virtio_net_handle_offloads(VirtIONet *n, uint8_t cmd,
     if (cmd == VIRTIO_NET_CTRL_GUEST_OFFLOADS_SET) {
         uint64_t supported_offloads;
 
-        if (!n->has_vnet_hdr) {
+        if (!n->has_vnet_hdr && !n->net_conf.rx_coalesce) {
             return VIRTIO_NET_ERR;
         }
 
@@ -607,7 +835,9 @@ static int virtio_net_handle_offloads(VirtIONet *n, uint8_t cmd,
         }
 
         n->curr_guest_offloads = offloads;
-        virtio_net_apply_guest_offloads(n);
+        if (n->has_vnet_hdr) {
+            virtio_net_apply_guest_offloads(n);
+        }
 
         return VIRTIO_NET_OK;
     } else {
@@ -796,30 +1026,41 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
     VirtIONet *n = VIRTIO_NET(vdev);
     struct virtio_net_ctrl_hdr ctrl;
     virtio_net_ctrl_ack status = VIRTIO_NET_ERR;
-    VirtQueueElement elem;
+    VirtQueueElement *elem;
     size_t s;
     struct iovec *iov, *iov2;
     unsigned int iov_cnt;
 
-    while (virtqueue_pop(vq, &elem)) {
-        if (iov_size(elem.in_sg, elem.in_num) < sizeof(status) ||
-            iov_size(elem.out_sg, elem.out_num) < sizeof(ctrl)) {
+    for (;;) {
+        elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
+        if (!elem) {
+            break;
+        }
+        if (iov_size(elem->in_sg, elem->in_num) < sizeof(status) ||
+            iov_size(elem->out_sg, elem->out_num) < sizeof(ctrl)) {
             error_report("virtio-net ctrl missing headers");
             exit(1);
         }
 
-        iov_cnt = elem.out_num;
-        iov2 = iov = g_memdup(elem.out_sg, sizeof(struct iovec) * elem.out_num);
+        iov_cnt = elem->out_num;
+        iov2 = iov = g_memdup(elem->out_sg,
+                              sizeof(struct iovec) * elem->out_num);
         s = iov_to_buf(iov, iov_cnt, 0, &ctrl, sizeof(ctrl));
         iov_discard_front(&iov, &iov_cnt, sizeof(ctrl));
         if (s != sizeof(ctrl)) {
             status = VIRTIO_NET_ERR;
         } else if (ctrl.class == VIRTIO_NET_CTRL_RX) {
+            virtio_net_dataplane_acquire(n);
             status = virtio_net_handle_rx_mode(n, ctrl.cmd, iov, iov_cnt);
+            virtio_net_dataplane_release(n);
         } else if (ctrl.class == VIRTIO_NET_CTRL_MAC) {
+            virtio_net_dataplane_acquire(n);
             status = virtio_net_handle_mac(n, ctrl.cmd, iov, iov_cnt);
+            virtio_net_dataplane_release(n);
         } else if (ctrl.class == VIRTIO_NET_CTRL_VLAN) {
+            virtio_net_dataplane_acquire(n);
             status = virtio_net_handle_vlan_table(n, ctrl.cmd, iov, iov_cnt);
+            virtio_net_dataplane_release(n);
         } else if (ctrl.class == VIRTIO_NET_CTRL_ANNOUNCE) {
             status = virtio_net_handle_announce(n, ctrl.cmd, iov, iov_cnt);
         } else if (ctrl.class == VIRTIO_NET_CTRL_MQ) {
@@ -828,12 +1069,14 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
             status = virtio_net_handle_offloads(n, ctrl.cmd, iov, iov_cnt);
         }
 
-        s = iov_from_buf(elem.in_sg, elem.in_num, 0, &status, sizeof(status));
+        s = iov_from_buf(elem->in_sg, elem->in_num, 0, &status,
+                         sizeof(status));
         assert(s == sizeof(status));
 
-        virtqueue_push(vq, &elem, sizeof(status));
+        virtqueue_push(vq, elem, sizeof(status));
         virtio_notify(vdev, vq);
         g_free(iov2);
+        g_free(elem);
     }
 }
 
@@ -844,6 +1087,8 @@ static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
     VirtIONet *n = VIRTIO_NET(vdev);
     int queue_index = vq2q(virtio_get_queue_index(vq));
 
+    /* Held segments go first, they were received before the queue filled */
+    virtio_net_rsc_flush(&n->vqs[queue_index]);
     qemu_flush_queued_packets(qemu_get_subqueue(n->nic, queue_index));
 }
 
@@ -997,20 +1242,22 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
     return 0;
 }
 
-static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+/* Copy one packet to the guest, with @hdr as the virtio-net header if
+ * given instead of the one from the peer.  @notify is set if the guest
+ * has to be interrupted.
+ */
+static ssize_t virtio_net_do_receive(VirtIONetQueue *q,
+                                     const struct virtio_net_hdr *hdr,
+                                     const uint8_t *buf, size_t size,
+                                     bool *notify)
 {
-    VirtIONet *n = qemu_get_nic_opaque(nc);
-    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
     struct iovec mhdr_sg[VIRTQUEUE_MAX_SIZE];
     struct virtio_net_hdr_mrg_rxbuf mhdr;
     unsigned mhdr_cnt = 0;
     size_t offset, i, guest_offset;
 
-    if (!virtio_net_can_receive(nc)) {
-        return -1;
-    }
-
     /* hdr_len refers to the header we supply to the guest */
     if (!virtio_net_has_buffers(q, size + n->guest_hdr_len - n->host_hdr_len)) {
         return 0;
@@ -1022,13 +1269,14 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
     offset = i = 0;
 
     while (offset < size) {
-        VirtQueueElement elem;
+        VirtQueueElement *elem;
         int len, total;
-        const struct iovec *sg = elem.in_sg;
+        const struct iovec *sg;
 
         total = 0;
 
-        if (virtqueue_pop(q->rx_vq, &elem) == 0) {
+        elem = virtqueue_pop(q->rx_vq, sizeof(VirtQueueElement));
+        if (!elem) {
             if (i == 0)
                 return -1;
             error_report("virtio-net unexpected empty queue: "
@@ -1039,21 +1287,29 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
             exit(1);
         }
 
-        if (elem.in_num < 1) {
+        if (elem->in_num < 1) {
             error_report("virtio-net receive queue contains no in buffers");
             exit(1);
         }
 
+        sg = elem->in_sg;
         if (i == 0) {
             assert(offset == 0);
             if (n->mergeable_rx_bufs) {
                 mhdr_cnt = iov_copy(mhdr_sg, ARRAY_SIZE(mhdr_sg),
-                                    sg, elem.in_num,
+                                    sg, elem->in_num,
                                     offsetof(typeof(mhdr), num_buffers),
                                     sizeof(mhdr.num_buffers));
             }
 
-            receive_header(n, sg, elem.in_num, buf, size);
+            if (hdr) {
+                struct virtio_net_hdr h = *hdr;
+
+                virtio_net_hdr_swap(vdev, &h);
+                iov_from_buf(sg, elem->in_num, 0, &h, sizeof(h));
+            } else {
+                receive_header(n, sg, elem->in_num, buf, size);
+            }
             offset = n->host_hdr_len;
             total += n->guest_hdr_len;
             guest_offset = n->guest_hdr_len;
@@ -1062,7 +1318,7 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
         }
 
         /* copy in packet.  ugh */
-        len = iov_from_buf(sg, elem.in_num, guest_offset,
+        len = iov_from_buf(sg, elem->in_num, guest_offset,
                            buf + offset, size - offset);
         total += len;
         offset += len;
@@ -1077,11 +1333,13 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
                          i, n->mergeable_rx_bufs,
                          offset, size, n->guest_hdr_len, n->host_hdr_len);
 #endif
+            g_free(elem);
             return size;
         }
 
         /* signal other side */
-        virtqueue_fill(q->rx_vq, &elem, total, i++);
+        virtqueue_fill(q->rx_vq, elem, total, i++);
+        g_free(elem);
     }
 
     if (mhdr_cnt) {
@@ -1092,50 +1350,596 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
     }
 
     virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+    *notify = true;
+
+    return size;
+}
+
+/* Receive segment coalescing
+ *
+ * Without a vnet header the peer hands us every TCP segment separately,
+ * and each one costs the guest a descriptor chain and possibly an
+ * interrupt.  If the guest accepts TSO packets, consecutive in-order
+ * segments of one flow are merged into a single frame that is passed up
+ * with GSO metadata, like a host stack would do with GRO.  Segments are
+ * held until the flow is interrupted, a PSH or short segment arrives, or
+ * the bottom half runs once the current burst from the peer is over.
+ */
+
+typedef struct VirtIONetRscSeg {
+    bool ipv6;
+    bool push;
+    size_t l4_off;              /* start of the TCP header */
+    size_t hdr_len;             /* start of the TCP payload */
+    size_t payload_len;
+    uint32_t seq;
+} VirtIONetRscSeg;
+
+#define VIRTIO_NET_TCP_FLAGS_MASK   0x1ff
+
+/* Check that @buf is a plain TCP/IP segment carrying data and fill @seg.
+ * The TCP checksum is verified here since the guest will not see the
+ * original segments.
+ */
+static bool virtio_net_rsc_parse(const uint8_t *buf, size_t size,
+                                 VirtIONetRscSeg *seg)
+{
+    const struct eth_header *eth = (const struct eth_header *)buf;
+    const tcp_header *tcp;
+    size_t l4_len, tcp_len;
+    uint32_t csum;
+    uint16_t flags;
+
+    if (size < sizeof(struct eth_header)) {
+        return false;
+    }
+
+    switch (be16_to_cpu(eth->h_proto)) {
+    case ETH_P_IP: {
+        struct ip_header *ip = (struct ip_header *)(buf + sizeof(*eth));
+
+        seg->l4_off = sizeof(*eth) + sizeof(*ip);
+        if (size < seg->l4_off + sizeof(tcp_header) ||
+            ip->ip_ver_len != 0x45 || ip->ip_p != IP_PROTO_TCP ||
+            (be16_to_cpu(ip->ip_off) & (IP_MF | IP_OFFMASK)) ||
+            be16_to_cpu(ip->ip_len) < sizeof(*ip) ||
+            net_raw_checksum((uint8_t *)ip, sizeof(*ip))) {
+            return false;
+        }
+        l4_len = be16_to_cpu(ip->ip_len) - sizeof(*ip);
+        csum = eth_calc_pseudo_hdr_csum(ip, l4_len);
+        seg->ipv6 = false;
+        break;
+    }
+    case ETH_P_IPV6: {
+        struct ip6_header *ip6 = (struct ip6_header *)(buf + sizeof(*eth));
+
+        seg->l4_off = sizeof(*eth) + sizeof(*ip6);
+        if (size < seg->l4_off + sizeof(tcp_header) ||
+            (ip6->ip6_ctlun.ip6_un2_vfc & 0xf0) != 0x60 ||
+            ip6->ip6_nxt != IP_PROTO_TCP) {
+            return false;
+        }
+        l4_len = be16_to_cpu(ip6->ip6_ctlun.ip6_un1.ip6_un1_plen);
+        csum = net_checksum_add(2 * sizeof(struct in6_address),
+                                (uint8_t *)&ip6->ip6_src);
+        csum += IP_PROTO_TCP + l4_len;
+        seg->ipv6 = true;
+        break;
+    }
+    default:
+        return false;
+    }
+
+    if (seg->l4_off + l4_len > size) {
+        return false;
+    }
+    tcp = (const tcp_header *)(buf + seg->l4_off);
+    tcp_len = (be16_to_cpu(tcp->th_offset_flags) >> 12) * 4;
+    flags = be16_to_cpu(tcp->th_offset_flags) & VIRTIO_NET_TCP_FLAGS_MASK;
+    if (tcp_len < sizeof(tcp_header) || tcp_len >= l4_len ||
+        (flags & ~TH_PUSH) != TH_ACK) {
+        return false;
+    }
+
+    csum += net_checksum_add(l4_len, (uint8_t *)tcp);
+    if (net_checksum_finish(csum)) {
+        return false;
+    }
+
+    seg->push = flags & TH_PUSH;
+    seg->hdr_len = seg->l4_off + tcp_len;
+    seg->payload_len = l4_len - tcp_len;
+    seg->seq = be32_to_cpu(tcp->th_seq);
+    return true;
+}
+
+/* Can @buf be appended to the held segments? */
+static bool virtio_net_rsc_match(VirtIONetRsc *rsc, const uint8_t *buf,
+                                 const VirtIONetRscSeg *seg)
+{
+    const uint8_t *held = rsc->buf;
+    size_t l3 = sizeof(struct eth_header);
+    size_t l4 = seg->l4_off;
+
+    /* Only full-sized segments can be followed by more */
+    if (seg->ipv6 != rsc->ipv6 || seg->hdr_len != rsc->hdr_len ||
+        seg->seq != rsc->next_seq || seg->payload_len > rsc->mss ||
+        (rsc->len - rsc->hdr_len) % rsc->mss || (held[l4 + 13] & TH_PUSH) ||
+        rsc->len + seg->payload_len > VIRTIO_NET_RSC_BUFSIZE) {
+        return false;
+    }
+
+    /* Ethernet header, then everything in the IP header except lengths,
+     * IP ID and header checksum
+     */
+    if (memcmp(held, buf, l3)) {
+        return false;
+    }
+    if (seg->ipv6) {
+        if (memcmp(held + l3, buf + l3, 4) ||
+            memcmp(held + l3 + 6, buf + l3 + 6, 34)) {
+            return false;
+        }
+    } else {
+        if (memcmp(held + l3, buf + l3, 2) ||
+            memcmp(held + l3 + 6, buf + l3 + 6, 4) ||
+            memcmp(held + l3 + 12, buf + l3 + 12, 8)) {
+            return false;
+        }
+    }
+
+    /* TCP ports, ack number, data offset, flags but PSH, and options */
+    return !memcmp(held + l4, buf + l4, 4) &&
+           !memcmp(held + l4 + 8, buf + l4 + 8, 5) &&
+           (held[l4 + 13] | TH_PUSH) == (buf[l4 + 13] | TH_PUSH) &&
+           !memcmp(held + l4 + 20, buf + l4 + 20, rsc->hdr_len - l4 - 20);
+}
+
+static void virtio_net_rsc_bh(void *opaque);
 
+/* Pass the held segments to the guest.  Returns false if the guest has
+ * no buffers, in which case they stay held.
+ */
+static bool virtio_net_rsc_drain(VirtIONetQueue *q, bool *notify)
+{
+    VirtIONetRsc *rsc = &q->rsc;
+    struct virtio_net_hdr hdr = {
+        .flags = 0,
+        .gso_type = VIRTIO_NET_HDR_GSO_NONE
+    };
+
+    if (!rsc->len) {
+        return true;
+    }
+
+    if (rsc->segs > 1) {
+        uint8_t *l3 = rsc->buf + sizeof(struct eth_header);
+        size_t l4_off = rsc->ipv6 ? sizeof(struct ip6_header) :
+                                    sizeof(struct ip_header);
+        uint16_t l4_len, csum;
+        uint32_t sum;
+
+        l4_off += sizeof(struct eth_header);
+        l4_len = rsc->len - l4_off;
+        if (rsc->ipv6) {
+            struct ip6_header *ip6 = (struct ip6_header *)l3;
+
+            ip6->ip6_ctlun.ip6_un1.ip6_un1_plen = cpu_to_be16(l4_len);
+            sum = net_checksum_add(2 * sizeof(struct in6_address),
+                                   (uint8_t *)&ip6->ip6_src);
+            sum += IP_PROTO_TCP + l4_len;
+            hdr.gso_type = VIRTIO_NET_HDR_GSO_TCPV6;
+        } else {
+            struct ip_header *ip = (struct ip_header *)l3;
+
+            ip->ip_len = cpu_to_be16(rsc->len - sizeof(struct eth_header));
+            eth_fix_ip4_checksum(ip, sizeof(*ip));
+            sum = eth_calc_pseudo_hdr_csum(ip, l4_len);
+            hdr.gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+        }
+
+        /* Leave the TCP checksum to the guest, as in a TSO packet */
+        csum = cpu_to_be16(~net_checksum_finish(sum));
+        memcpy(rsc->buf + l4_off + offsetof(tcp_header, th_sum),
+               &csum, sizeof(csum));
+        hdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        hdr.hdr_len = rsc->hdr_len;
+        hdr.gso_size = rsc->mss;
+        hdr.csum_start = l4_off;
+        hdr.csum_offset = offsetof(tcp_header, th_sum);
+    }
+
+    if (virtio_net_do_receive(q, &hdr, rsc->buf, rsc->len, notify) == 0) {
+        return false;
+    }
+    rsc->len = 0;
+    return true;
+}
+
+static ssize_t virtio_net_rsc_receive(VirtIONetQueue *q, const uint8_t *buf,
+                                      size_t size, bool *notify)
+{
+    VirtIONet *n = q->n;
+    VirtIONetRsc *rsc = &q->rsc;
+    VirtIONetRscSeg seg;
+    bool mergeable;
+    uint64_t tso;
+
+    mergeable = virtio_net_rsc_parse(buf, size, &seg);
+    if (mergeable) {
+        tso = 1ULL << (seg.ipv6 ? VIRTIO_NET_F_GUEST_TSO6 :
+                                  VIRTIO_NET_F_GUEST_TSO4);
+        mergeable = (n->curr_guest_offloads & tso) &&
+                    (n->curr_guest_offloads &
+                     (1ULL << VIRTIO_NET_F_GUEST_CSUM));
+    }
+
+    if (rsc->len) {
+        if (mergeable && virtio_net_rsc_match(rsc, buf, &seg)) {
+            memcpy(rsc->buf + rsc->len, buf + seg.hdr_len, seg.payload_len);
+            rsc->len += seg.payload_len;
+            rsc->next_seq += seg.payload_len;
+            rsc->segs++;
+            /* Use the latest window */
+            memcpy(rsc->buf + seg.l4_off + offsetof(tcp_header, th_win),
+                   buf + seg.l4_off + offsetof(tcp_header, th_win),
+                   sizeof(uint16_t));
+            if (seg.push || seg.payload_len < rsc->mss) {
+                rsc->buf[seg.l4_off + 13] |= TH_PUSH;
+                virtio_net_rsc_drain(q, notify);
+            }
+            return size;
+        }
+        if (!virtio_net_rsc_drain(q, notify)) {
+            return 0;
+        }
+    }
+
+    /* Segments that do not fit the buffer are passed on as they are */
+    if (!mergeable || seg.push || !receive_filter(n, buf, size) ||
+        seg.hdr_len + seg.payload_len > VIRTIO_NET_RSC_BUFSIZE) {
+        return virtio_net_do_receive(q, NULL, buf, size, notify);
+    }
+
+    if (!rsc->buf) {
+        rsc->buf = g_malloc(VIRTIO_NET_RSC_BUFSIZE);
+    }
+    memcpy(rsc->buf, buf, seg.hdr_len + seg.payload_len);
+    rsc->len = seg.hdr_len + seg.payload_len;
+    rsc->hdr_len = seg.hdr_len;
+    rsc->next_seq = seg.seq + seg.payload_len;
+    rsc->mss = seg.payload_len;
+    rsc->segs = 1;
+    rsc->ipv6 = seg.ipv6;
+
+    if (!rsc->bh) {
+        if (q->ctx) {
+            rsc->bh = aio_bh_new(q->ctx, virtio_net_rsc_bh, q);
+        } else {
+            rsc->bh = qemu_bh_new(virtio_net_rsc_bh, q);
+        }
+    }
+    qemu_bh_schedule(rsc->bh);
     return size;
 }
 
+static void virtio_net_rsc_flush(VirtIONetQueue *q)
+{
+    NetClientState *nc = qemu_get_subqueue(q->n->nic, q - q->n->vqs);
+    bool notify = false;
+
+    if (q->rsc.len && virtio_net_can_receive(nc)) {
+        virtio_net_rsc_drain(q, &notify);
+        if (notify) {
+            virtio_net_notify(q, q->rx_vq);
+        }
+    }
+}
+
+static void virtio_net_rsc_bh(void *opaque)
+{
+    virtio_net_rsc_flush(opaque);
+}
+
+/* Called when @q moves to another AioContext; the bottom half is created
+ * again in the new one when needed.
+ */
+static void virtio_net_rsc_detach_bh(VirtIONetQueue *q)
+{
+    virtio_net_rsc_flush(q);
+    if (q->rsc.bh) {
+        qemu_bh_delete(q->rsc.bh);
+        q->rsc.bh = NULL;
+    }
+}
+
+/* Receive one packet.  @notify is set if the guest has to be interrupted,
+ * which the caller does once for a whole batch.
+ */
+static ssize_t virtio_net_receive_one(NetClientState *nc, const uint8_t *buf,
+                                      size_t size, bool *notify)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+
+    if (!virtio_net_can_receive(nc)) {
+        return -1;
+    }
+
+    if (n->net_conf.rx_coalesce && !n->has_vnet_hdr) {
+        return virtio_net_rsc_receive(q, buf, size, notify);
+    }
+    return virtio_net_do_receive(q, NULL, buf, size, notify);
+}
+
+static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf,
+                                  size_t size)
+{
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    bool notify = false;
+    ssize_t ret;
+
+    ret = virtio_net_receive_one(nc, buf, size, &notify);
+    if (notify) {
+        virtio_net_notify(q, q->rx_vq);
+    }
+    return ret;
+}
+
+static int virtio_net_receive_batch(NetClientState *nc,
+                                    const struct iovec *pkts, int count)
+{
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    bool notify = false;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        /* Like qemu_deliver_packet(), only stop when out of buffers */
+        if (virtio_net_receive_one(nc, pkts[i].iov_base, pkts[i].iov_len,
+                                   &notify) == 0) {
+            break;
+        }
+    }
+    if (notify) {
+        virtio_net_notify(q, q->rx_vq);
+    }
+    return i;
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
 
 static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
 {
-    VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
-    VirtIODevice *vdev = VIRTIO_DEVICE(n);
 
-    virtqueue_push(q->tx_vq, &q->async_tx.elem, 0);
-    virtio_notify(vdev, q->tx_vq);
+    virtqueue_push(q->tx_vq, q->async_tx.elem, 0);
+    virtio_net_notify(q, q->tx_vq);
 
-    q->async_tx.elem.out_num = q->async_tx.len = 0;
+    g_free(q->async_tx.elem);
+    q->async_tx.elem = NULL;
+    q->async_tx.len = 0;
 
     virtio_queue_set_notification(q->tx_vq, 1);
     virtio_net_flush_tx(q);
 }
 
+/* Software checksum and TSO
+ *
+ * A peer without a vnet header only takes complete frames.  Rather than
+ * making the guest checksum and segment everything itself, one exit per
+ * MTU-sized frame, the offloads stay advertised and are done here.
+ */
+
+#define VIRTIO_NET_TSO_MAX_HDR_LEN  256
+#define VIRTIO_NET_TH_CWR           0x80
+
+/* Fill in the checksum the guest left to us, see VIRTIO_NET_HDR_F_NEEDS_CSUM,
+ * and send the frame.  The guest has put the pseudo-header sum in the
+ * checksum field already.  The frame is device-readable, so like the
+ * segments of a TSO frame it is sent with a patched copy of the headers.
+ */
+static ssize_t virtio_net_tx_csum(NetClientState *nc,
+                                  const struct virtio_net_hdr *hdr,
+                                  const struct iovec *sg, unsigned int num)
+{
+    uint8_t buf[VIRTIO_NET_TSO_MAX_HDR_LEN], *hdrs;
+    struct iovec frame[VIRTQUEUE_MAX_SIZE + 1];
+    size_t size = iov_size(sg, num);
+    size_t hdrs_len = hdr->csum_start + hdr->csum_offset + sizeof(uint16_t);
+    unsigned int cnt;
+    ssize_t ret;
+
+    if (hdrs_len > size) {
+        return qemu_sendv_packet_async(nc, sg, num, virtio_net_tx_complete);
+    }
+
+    hdrs = hdrs_len <= sizeof(buf) ? buf : g_malloc(hdrs_len);
+    iov_to_buf(sg, num, 0, hdrs, hdrs_len);
+    stw_be_p(hdrs + hdrs_len - sizeof(uint16_t),
+             net_checksum_finish(net_checksum_add_iov(sg, num,
+                                                      hdr->csum_start,
+                                                      size - hdr->csum_start)));
+
+    /* A busy peer copies the frame into its queue, so the headers need
+     * not outlive this call.
+     */
+    frame[0].iov_base = hdrs;
+    frame[0].iov_len = hdrs_len;
+    cnt = 1 + iov_copy(frame + 1, ARRAY_SIZE(frame) - 1, sg, num,
+                       hdrs_len, size - hdrs_len);
+    ret = qemu_sendv_packet_async(nc, frame, cnt, virtio_net_tx_complete);
+
+    if (hdrs != buf) {
+        g_free(hdrs);
+    }
+    return ret;
+}
+
+/* Split a TSO frame into gso_size segments and send them.  The payload is
+ * not copied; each segment gets its own copy of the headers.  Returns
+ * false if the frame can't be segmented and nothing was sent.
+ */
+static bool virtio_net_tx_segment(NetClientState *nc,
+                                  const struct virtio_net_hdr *hdr,
+                                  const struct iovec *sg, unsigned int num,
+                                  ssize_t *ret)
+{
+    uint8_t hdrs[VIRTIO_NET_TSO_MAX_HDR_LEN];
+    struct iovec seg[VIRTQUEUE_MAX_SIZE + 1];
+    uint8_t gso_type = hdr->gso_type & ~VIRTIO_NET_HDR_GSO_ECN;
+    bool ipv6 = gso_type == VIRTIO_NET_HDR_GSO_TCPV6;
+    size_t size = iov_size(sg, num);
+    size_t copied, l3, l4, hdrs_len, payload_len, off, chunk;
+    uint8_t *tcp, flags;
+    uint16_t ip_id = 0;
+    uint32_t seq;
+
+    if (gso_type != VIRTIO_NET_HDR_GSO_TCPV4 && !ipv6) {
+        return false;
+    }
+
+    copied = iov_to_buf(sg, num, 0, hdrs, sizeof(hdrs));
+    l4 = hdr->csum_start;
+    if (!hdr->gso_size || l4 + sizeof(tcp_header) > copied) {
+        return false;
+    }
+    l3 = eth_get_l2_hdr_length(hdrs);
+    if (l3 + (ipv6 ? sizeof(struct ip6_header) :
+                     sizeof(struct ip_header)) > l4 ||
+        (hdrs[l3] >> 4) != (ipv6 ? IP_HEADER_VERSION_6 :
+                                   IP_HEADER_VERSION_4)) {
+        return false;
+    }
+    tcp = hdrs + l4;
+    hdrs_len = l4 + (tcp[12] >> 4) * 4;
+    if (hdrs_len < l4 + sizeof(tcp_header) || hdrs_len > copied ||
+        hdrs_len >= size) {
+        return false;
+    }
+
+    if (!ipv6) {
+        ip_id = be16_to_cpu(((struct ip_header *)(hdrs + l3))->ip_id);
+    }
+    seq = ldl_be_p(tcp + offsetof(tcp_header, th_seq));
+    flags = tcp[13];
+    payload_len = size - hdrs_len;
+
+    for (off = 0; off < payload_len; off += chunk) {
+        size_t l4_len;
+        unsigned int cnt;
+        uint32_t sum;
+        uint16_t csum;
+
+        chunk = MIN(hdr->gso_size, payload_len - off);
+        l4_len = hdrs_len - l4 + chunk;
+
+        if (ipv6) {
+            struct ip6_header *ip6 = (struct ip6_header *)(hdrs + l3);
+
+            ip6->ip6_ctlun.ip6_un1.ip6_un1_plen =
+                cpu_to_be16(l4 - l3 - sizeof(*ip6) + l4_len);
+            sum = net_checksum_add(2 * sizeof(struct in6_address),
+                                   (uint8_t *)&ip6->ip6_src);
+            sum += IP_PROTO_TCP + l4_len;
+        } else {
+            struct ip_header *ip = (struct ip_header *)(hdrs + l3);
+
+            ip->ip_len = cpu_to_be16(l4 - l3 + l4_len);
+            ip->ip_id = cpu_to_be16(ip_id++);
+            eth_fix_ip4_checksum(ip, l4 - l3);
+            sum = eth_calc_pseudo_hdr_csum(ip, l4_len);
+        }
+
+        /* FIN and PSH go on the last segment, CWR on the first */
+        stl_be_p(tcp + offsetof(tcp_header, th_seq), seq + off);
+        tcp[13] = flags;
+        if (off + chunk < payload_len) {
+            tcp[13] &= ~(TH_FIN | TH_PUSH);
+        }
+        if (off) {
+            tcp[13] &= ~VIRTIO_NET_TH_CWR;
+        }
+
+        seg[0].iov_base = hdrs;
+        seg[0].iov_len = hdrs_len;
+        cnt = 1 + iov_copy(seg + 1, ARRAY_SIZE(seg) - 1, sg, num,
+                           hdrs_len + off, chunk);
+
+        stw_be_p(tcp + offsetof(tcp_header, th_sum), 0);
+        sum += net_checksum_add(hdrs_len - l4, tcp);
+        sum += net_checksum_add_iov(seg + 1, cnt - 1, 0, chunk);
+        csum = net_checksum_finish(sum);
+        stw_be_p(tcp + offsetof(tcp_header, th_sum), csum);
+
+        /* Only the last segment completes the element; the others are
+         * copied into the peer's queue if it is busy.
+         */
+        if (off + chunk < payload_len) {
+            qemu_sendv_packet(nc, seg, cnt);
+        } else {
+            *ret = qemu_sendv_packet_async(nc, seg, cnt,
+                                           virtio_net_tx_complete);
+        }
+    }
+    return true;
+}
+
+/* Send a frame whose offloads the peer can't handle.  @sg starts with the
+ * guest's virtio-net header, @frame_sg is the frame itself.
+ */
+static ssize_t virtio_net_tx_offload(VirtIONetQueue *q, NetClientState *nc,
+                                     const struct iovec *sg, unsigned int num,
+                                     const struct iovec *frame_sg,
+                                     unsigned int frame_num)
+{
+    struct virtio_net_hdr hdr;
+    ssize_t ret;
+
+    iov_to_buf(sg, num, 0, &hdr, sizeof(hdr));
+    virtio_net_hdr_swap(VIRTIO_DEVICE(q->n), &hdr);
+
+    if (hdr.gso_type != VIRTIO_NET_HDR_GSO_NONE &&
+        virtio_net_tx_segment(nc, &hdr, frame_sg, frame_num, &ret)) {
+        return ret;
+    }
+    if (hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+        return virtio_net_tx_csum(nc, &hdr, frame_sg, frame_num);
+    }
+    return qemu_sendv_packet_async(nc, frame_sg, frame_num,
+                                   virtio_net_tx_complete);
+}
+
 /* TX */
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 {
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
-    VirtQueueElement elem;
+    VirtQueueElement *elem;
     int32_t num_packets = 0;
+    unsigned int num_filled = 0;
     int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
         return num_packets;
     }
 
-    if (q->async_tx.elem.out_num) {
+    if (q->async_tx.elem) {
         virtio_queue_set_notification(q->tx_vq, 0);
         return num_packets;
     }
 
-    while (virtqueue_pop(q->tx_vq, &elem)) {
+    for (;;) {
         ssize_t ret, len;
-        unsigned int out_num = elem.out_num;
-        struct iovec *out_sg = &elem.out_sg[0];
-        struct iovec sg[VIRTQUEUE_MAX_SIZE];
+        unsigned int out_num;
+        struct iovec sg[VIRTQUEUE_MAX_SIZE], *out_sg;
+
+        elem = virtqueue_pop(q->tx_vq, sizeof(VirtQueueElement));
+        if (!elem) {
+            break;
+        }
+
+        out_num = elem->out_num;
+        out_sg = elem->out_sg;
 
         if (out_num < 1) {
             error_report("virtio-net header not in first element");
@@ -1169,24 +1973,41 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 
         len = n->guest_hdr_len;
 
-        ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
-                                      out_sg, out_num, virtio_net_tx_complete);
+        if (n->net_conf.tx_offload && !n->has_vnet_hdr) {
+            ret = virtio_net_tx_offload(q, qemu_get_subqueue(n->nic,
+                                                             queue_index),
+                                        elem->out_sg, elem->out_num,
+                                        out_sg, out_num);
+        } else {
+            ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic,
+                                                            queue_index),
+                                          out_sg, out_num,
+                                          virtio_net_tx_complete);
+        }
         if (ret == 0) {
             virtio_queue_set_notification(q->tx_vq, 0);
             q->async_tx.elem = elem;
             q->async_tx.len  = len;
-            return -EBUSY;
+            num_packets = -EBUSY;
+            break;
         }
 
         len += ret;
 
-        virtqueue_push(q->tx_vq, &elem, 0);
-        virtio_notify(vdev, q->tx_vq);
+        /* Return the whole burst to the guest with one used index
+         * update and one interrupt. */
+        virtqueue_fill(q->tx_vq, elem, 0, num_filled++);
+        g_free(elem);
 
         if (++num_packets >= n->tx_burst) {
             break;
         }
     }
+
+    if (num_filled) {
+        virtqueue_flush(q->tx_vq, num_filled);
+        virtio_net_notify(q, q->tx_vq);
+    }
     return num_packets;
 }
 
@@ -1345,6 +2166,7 @@ static void virtio_net_save(QEMUFile *f, void *opaque)
     /* At this point, backend must be stopped, otherwise
      * it might keep writing to memory. */
     assert(!n->vhost_started);
+    assert(!n->dataplane_started);
     virtio_save(vdev, f);
 }
 
@@ -1527,6 +2349,7 @@ static NetClientInfo net_virtio_info = {
     .size = sizeof(NICState),
     .can_receive = virtio_net_can_receive,
     .receive = virtio_net_receive,
+    .receive_batch = virtio_net_receive_batch,
     .link_status_changed = virtio_net_set_link_status,
     .query_rx_filter = virtio_net_query_rxfilter,
 };
@@ -1593,7 +2416,47 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
         virtio_cleanup(vdev);
         return;
     }
+    if (!virtio_net_dataplane_enabled(n) && n->net_conf.num_iothread_queue) {
+        error_setg(errp, "iothread-queue requires the iothread property");
+        virtio_cleanup(vdev);
+        return;
+    }
+    if (n->net_conf.num_iothread_queue > n->max_queues) {
+        error_setg(errp, "iothread-queue has %u entries, but the device only "
+                   "has %u queue pairs", n->net_conf.num_iothread_queue,
+                   n->max_queues);
+        virtio_cleanup(vdev);
+        return;
+    }
+    for (i = 0; i < n->net_conf.num_iothread_queue; i++) {
+        if (n->net_conf.iothread_queue[i] &&
+            !iothread_find(n->net_conf.iothread_queue[i])) {
+            error_setg(errp, "iothread-queue[%d]: IOThread '%s' not found",
+                       i, n->net_conf.iothread_queue[i]);
+            virtio_cleanup(vdev);
+            return;
+        }
+    }
+    if (virtio_net_dataplane_enabled(n) &&
+        n->net_conf.tx && !strcmp(n->net_conf.tx, "timer")) {
+        error_setg(errp, "iothread is incompatible with tx=timer");
+        virtio_cleanup(vdev);
+        return;
+    }
+
     n->vqs = g_malloc0(sizeof(VirtIONetQueue) * n->max_queues);
+    if (virtio_net_dataplane_enabled(n)) {
+        for (i = 0; i < n->max_queues; i++) {
+            IOThread *iothread = n->net_conf.iothread;
+
+            if (i < n->net_conf.num_iothread_queue &&
+                n->net_conf.iothread_queue[i]) {
+                iothread = iothread_find(n->net_conf.iothread_queue[i]);
+            }
+            n->vqs[i].iothread = iothread;
+            object_ref(OBJECT(iothread));
+        }
+    }
     n->vqs[0].rx_vq = virtio_add_queue(vdev, 256, virtio_net_handle_rx);
     n->curr_queues = 1;
     n->vqs[0].n = n;
@@ -1688,6 +2551,8 @@ static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
         NetClientState *nc = qemu_get_subqueue(n->nic, i);
 
         qemu_purge_queued_packets(nc);
+        g_free(q->async_tx.elem);
+        q->async_tx.elem = NULL;
 
         if (q->tx_timer) {
             timer_del(q->tx_timer);
@@ -1695,6 +2560,13 @@ static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
         } else if (q->tx_bh) {
             qemu_bh_delete(q->tx_bh);
         }
+        if (q->rsc.bh) {
+            qemu_bh_delete(q->rsc.bh);
+        }
+        g_free(q->rsc.buf);
+        if (q->iothread) {
+            object_unref(OBJECT(q->iothread));
+        }
     }
 
     timer_del(n->announce_timer);
@@ -1713,11 +2585,22 @@ static void virtio_net_instance_init(Object *obj)
      * Can be overriden with virtio_net_set_config_size.
      */
     n->config_size = sizeof(struct virtio_net_config);
+    object_property_add_link(obj, "iothread", TYPE_IOTHREAD,
+                             (Object **)&n->net_conf.iothread,
+                             qdev_prop_allow_set_link_before_realize,
+                             OBJ_PROP_LINK_UNREF_ON_RELEASE, NULL);
     device_add_bootindex_property(obj, &n->nic_conf.bootindex,
                                   "bootindex", "/ethernet-phy@0",
                                   DEVICE(n), NULL);
 }
 
+static void virtio_net_instance_finalize(Object *obj)
+{
+    VirtIONet *n = VIRTIO_NET(obj);
+
+    g_free(n->net_conf.iothread_queue);
+}
+
 static Property virtio_net_properties[] = {
     DEFINE_VIRTIO_NET_FEATURES(VirtIONet, host_features),
     DEFINE_NIC_PROPERTIES(VirtIONet, nic_conf),
@@ -1725,6 +2608,10 @@ static Property virtio_net_properties[] = {
                                                TX_TIMER_INTERVAL),
     DEFINE_PROP_INT32("x-txburst", VirtIONet, net_conf.txburst, TX_BURST),
     DEFINE_PROP_STRING("tx", VirtIONet, net_conf.tx),
+    DEFINE_PROP_BOOL("rx-coalesce", VirtIONet, net_conf.rx_coalesce, false),
+    DEFINE_PROP_BOOL("tx-offload", VirtIONet, net_conf.tx_offload, false),
+    DEFINE_PROP_ARRAY("iothread-queue", VirtIONet, net_conf.num_iothread_queue,
+                      net_conf.iothread_queue, qdev_prop_string, char *),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -1755,6 +2642,7 @@ static const TypeInfo virtio_net_info = {
     .parent = TYPE_VIRTIO_DEVICE,
     .instance_size = sizeof(VirtIONet),
     .instance_init = virtio_net_instance_init,
+    .instance_finalize = virtio_net_instance_finalize,
     .class_init = virtio_net_class_init,
 };
 
@@ -169,7 +169,11 @@ static void scsi_aio_complete(void *opaque, int ret)
 
     assert(r->req.aiocb != NULL);
     r->req.aiocb = NULL;
-    block_acct_done(blk_get_stats(s->qdev.conf.blk), &r->acct);
+    if (ret < 0) {
+        block_acct_failed(blk_get_stats(s->qdev.conf.blk), &r->acct);
+    } else {
+        block_acct_done(blk_get_stats(s->qdev.conf.blk), &r->acct);
+    }
     if (r->req.io_canceled) {
         scsi_req_cancel_complete(&r->req);
         goto done;
@@ -242,7 +246,11 @@ static void scsi_dma_complete_noio(void *opaque, int ret)
 
     if (r->req.aiocb != NULL) {
         r->req.aiocb = NULL;
-        block_acct_done(blk_get_stats(s->qdev.conf.blk), &r->acct);
+        if (ret < 0) {
+            block_acct_failed(blk_get_stats(s->qdev.conf.blk), &r->acct);
+        } else {
+            block_acct_done(blk_get_stats(s->qdev.conf.blk), &r->acct);
+        }
     }
     if (r->req.io_canceled) {
         scsi_req_cancel_complete(&r->req);
@@ -284,7 +292,11 @@ static void scsi_read_complete(void * opaque, int ret)
 
     assert(r->req.aiocb != NULL);
     r->req.aiocb = NULL;
-    block_acct_done(blk_get_stats(s->qdev.conf.blk), &r->acct);
+    if (ret < 0) {
+        block_acct_failed(blk_get_stats(s->qdev.conf.blk), &r->acct);
+    } else {
+        block_acct_done(blk_get_stats(s->qdev.conf.blk), &r->acct);
+    }
     if (r->req.io_canceled) {
         scsi_req_cancel_complete(&r->req);
         goto done;
@@ -316,7 +328,11 @@ static void scsi_do_read(void *opaque, int ret)
 
     if (r->req.aiocb != NULL) {
         r->req.aiocb = NULL;
-        block_acct_done(blk_get_stats(s->qdev.conf.blk), &r->acct);
+        if (ret < 0) {
+            block_acct_failed(blk_get_stats(s->qdev.conf.blk), &r->acct);
+        } else {
+            block_acct_done(blk_get_stats(s->qdev.conf.blk), &r->acct);
+        }
     }
     if (r->req.io_canceled) {
         scsi_req_cancel_complete(&r->req);
@@ -438,7 +454,11 @@ static void scsi_write_complete(void * opaque, int ret)
 
     if (r->req.aiocb != NULL) {
         r->req.aiocb = NULL;
-        block_acct_done(blk_get_stats(s->qdev.conf.blk), &r->acct);
+        if (ret < 0) {
+            block_acct_failed(blk_get_stats(s->qdev.conf.blk), &r->acct);
+        } else {
+            block_acct_done(blk_get_stats(s->qdev.conf.blk), &r->acct);
+        }
     }
     if (r->req.io_canceled) {
         scsi_req_cancel_complete(&r->req);
@@ -1651,7 +1671,11 @@ static void scsi_write_same_complete(void *opaque, int ret)
 
     assert(r->req.aiocb != NULL);
     r->req.aiocb = NULL;
-    block_acct_done(blk_get_stats(s->qdev.conf.blk), &r->acct);
+    if (ret < 0) {
+        block_acct_failed(blk_get_stats(s->qdev.conf.blk), &r->acct);
+    } else {
+        block_acct_done(blk_get_stats(s->qdev.conf.blk), &r->acct);
+    }
     if (r->req.io_canceled) {
         scsi_req_cancel_complete(&r->req);
         goto done;
@@ -2127,6 +2151,9 @@ static int32_t scsi_disk_dma_command(SCSIRequest *req, uint8_t *buf)
         scsi_check_condition(r, SENSE_CODE(INVALID_FIELD));
         return 0;
     illegal_lba:
+        block_acct_invalid(blk_get_stats(s->qdev.conf.blk),
+                           r->req.cmd.mode == SCSI_XFER_TO_DEV ?
+                           BLOCK_ACCT_WRITE : BLOCK_ACCT_READ);
         scsi_check_condition(r, SENSE_CODE(LBA_OUT_OF_RANGE));
         return 0;
     }
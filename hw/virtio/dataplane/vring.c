@@ -85,6 +85,7 @@ bool vring_setup(Vring *vring, VirtIODevice *vdev, int n)
     vring_init(&vring->vr, virtio_queue_get_num(vdev, n), vring_ptr, 4096);
 
     vring->last_avail_idx = virtio_queue_get_last_avail_idx(vdev, n);
+    vring->shadow_avail_idx = vring->last_avail_idx;
     vring->last_used_idx = vring_get_used_idx(vdev, vring);
     vring->signalled_used = 0;
     vring->signalled_used_valid = false;
@@ -157,7 +158,17 @@ bool vring_should_notify(VirtIODevice *vdev, Vring *vring)
 }
 
 
-static int get_desc(Vring *vring, VirtQueueElement *elem,
+/* Descriptors gathered by vring_pop() before the element is allocated.
+ * Output descriptors come first, so the input ones start at out_num.
+ */
+typedef struct VringDescChain {
+    unsigned int out_num;
+    unsigned int in_num;
+    hwaddr addr[VIRTQUEUE_MAX_SIZE];
+    struct iovec iov[VIRTQUEUE_MAX_SIZE];
+} VringDescChain;
+
+static int get_desc(Vring *vring, VringDescChain *chain,
                     struct vring_desc *desc)
 {
     unsigned *num;
@@ -166,27 +177,25 @@ static int get_desc(Vring *vring, VirtQueueElement *elem,
     MemoryRegion *mr;
 
     if (desc->flags & VRING_DESC_F_WRITE) {
-        num = &elem->in_num;
-        iov = &elem->in_sg[*num];
-        addr = &elem->in_addr[*num];
+        num = &chain->in_num;
     } else {
-        num = &elem->out_num;
-        iov = &elem->out_sg[*num];
-        addr = &elem->out_addr[*num];
+        num = &chain->out_num;
 
         /* If it's an output descriptor, they're all supposed
          * to come before any input descriptors. */
-        if (unlikely(elem->in_num)) {
+        if (unlikely(chain->in_num)) {
             error_report("Descriptor has out after in");
             return -EFAULT;
         }
     }
 
     /* Stop for now if there are not enough iovecs available. */
-    if (*num >= VIRTQUEUE_MAX_SIZE) {
+    if (chain->out_num + chain->in_num >= VIRTQUEUE_MAX_SIZE) {
         error_report("Invalid SG num: %u", *num);
         return -EFAULT;
     }
+    iov = &chain->iov[chain->out_num + chain->in_num];
+    addr = &chain->addr[chain->out_num + chain->in_num];
 
     /* TODO handle non-contiguous memory across region boundaries */
     iov->iov_base = vring_map(&mr, desc->addr, desc->len,
@@ -217,7 +226,7 @@ static void copy_in_vring_desc(VirtIODevice *vdev,
 
 /* This is stolen from linux/drivers/vhost/vhost.c. */
 static int get_indirect(VirtIODevice *vdev, Vring *vring,
-                        VirtQueueElement *elem, struct vring_desc *indirect)
+                        VringDescChain *chain, struct vring_desc *indirect)
 {
     struct vring_desc desc;
     unsigned int i = 0, count, found = 0;
@@ -276,7 +285,7 @@ static int get_indirect(VirtIODevice *vdev, Vring *vring,
             return -EFAULT;
         }
 
-        ret = get_desc(vring, elem, &desc);
+        ret = get_desc(vring, chain, &desc);
         if (ret < 0) {
             vring->broken |= (ret == -EFAULT);
             return ret;
@@ -303,27 +312,41 @@ static void vring_unmap_element(VirtQueueElement *elem)
     }
 }
 
+static void vring_unmap_chain(VringDescChain *chain)
+{
+    int i;
+
+    for (i = 0; i < chain->out_num; i++) {
+        vring_unmap(chain->iov[i].iov_base, false);
+    }
+
+    for (i = 0; i < chain->in_num; i++) {
+        vring_unmap(chain->iov[chain->out_num + i].iov_base, true);
+    }
+}
+
 /* This looks in the virtqueue and for the first available buffer, and converts
  * it to an iovec for convenient access.  Since descriptors consist of some
  * number of output then some number of input descriptors, it's actually two
  * iovecs, but we pack them into one and note how many of each there were.
  *
- * This function returns the descriptor number found, or vq->num (which is
- * never a valid descriptor number) if none was found.  A negative code is
- * returned on error.
+ * The element is returned in a new allocation of @sz bytes, as with
+ * virtqueue_pop().  NULL is returned if the ring is empty or on error; the
+ * two cases can be told apart with vring->broken.
  *
  * Stolen from linux/drivers/vhost/vhost.c.
  */
-int vring_pop(VirtIODevice *vdev, Vring *vring,
-              VirtQueueElement *elem)
+void *vring_pop(VirtIODevice *vdev, Vring *vring, size_t sz)
 {
     struct vring_desc desc;
     unsigned int i, head, found = 0, num = vring->vr.num;
     uint16_t avail_idx, last_avail_idx;
+    VringDescChain chain;
+    VirtQueueElement *elem;
     int ret;
 
-    /* Initialize elem so it can be safely unmapped */
-    elem->in_num = elem->out_num = 0;
+    /* Initialize chain so it can be safely unmapped */
+    chain.in_num = chain.out_num = 0;
 
     /* If there was a fatal error then refuse operation */
     if (vring->broken) {
@@ -333,8 +356,12 @@ int vring_pop(VirtIODevice *vdev, Vring *vring,
 
     /* Check it isn't doing very strange things with descriptor numbers. */
     last_avail_idx = vring->last_avail_idx;
-    avail_idx = vring_get_avail_idx(vdev, vring);
-    barrier(); /* load indices now and not again later */
+    avail_idx = vring->shadow_avail_idx;
+    if (avail_idx == last_avail_idx) {
+        /* Only touch the guest's cache line when we ran out of requests */
+        avail_idx = vring->shadow_avail_idx = vring_get_avail_idx(vdev, vring);
+        barrier(); /* load indices now and not again later */
+    }
 
     if (unlikely((uint16_t)(avail_idx - last_avail_idx) > num)) {
         error_report("Guest moved used index from %u to %u",
@@ -356,8 +383,6 @@ int vring_pop(VirtIODevice *vdev, Vring *vring,
      * the index we've seen. */
     head = vring_get_avail_ring(vdev, vring, last_avail_idx % num);
 
-    elem->index = head;
-
     /* If their number is silly, that's an error. */
     if (unlikely(head >= num)) {
         error_report("Guest says index %u > %u is available", head, num);
@@ -384,14 +409,14 @@ int vring_pop(VirtIODevice *vdev, Vring *vring,
         barrier();
 
         if (desc.flags & VRING_DESC_F_INDIRECT) {
-            ret = get_indirect(vdev, vring, elem, &desc);
+            ret = get_indirect(vdev, vring, &chain, &desc);
             if (ret < 0) {
                 goto out;
             }
             continue;
         }
 
-        ret = get_desc(vring, elem, &desc);
+        ret = get_desc(vring, &chain, &desc);
         if (ret < 0) {
             goto out;
         }
@@ -405,15 +430,25 @@ int vring_pop(VirtIODevice *vdev, Vring *vring,
         vring_avail_event(&vring->vr) = vring->last_avail_idx;
     }
 
-    return head;
+    elem = virtqueue_alloc_element(sz, chain.out_num, chain.in_num);
+    elem->index = head;
+    for (i = 0; i < chain.out_num; i++) {
+        elem->out_addr[i] = chain.addr[i];
+        elem->out_sg[i] = chain.iov[i];
+    }
+    for (i = 0; i < chain.in_num; i++) {
+        elem->in_addr[i] = chain.addr[chain.out_num + i];
+        elem->in_sg[i] = chain.iov[chain.out_num + i];
+    }
+    return elem;
 
 out:
     assert(ret < 0);
     if (ret == -EFAULT) {
         vring->broken = true;
     }
-    vring_unmap_element(elem);
-    return ret;
+    vring_unmap_chain(&chain);
+    return NULL;
 }
 
 /* After we've used one of their buffers, we tell them about it.
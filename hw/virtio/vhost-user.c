@@ -24,6 +24,16 @@
 #include <linux/vhost.h>
 
 #define VHOST_MEMORY_MAX_NREGIONS    8
+#define VHOST_USER_MAX_RAM_SLOTS     32
+
+#define VHOST_USER_F_PROTOCOL_FEATURES 30
+
+#define VHOST_USER_PROTOCOL_F_MQ                    0
+#define VHOST_USER_PROTOCOL_F_CONFIGURE_MEM_SLOTS  15
+
+#define VHOST_USER_PROTOCOL_FEATURE_MASK \
+    ((1ULL << VHOST_USER_PROTOCOL_F_MQ) | \
+     (1ULL << VHOST_USER_PROTOCOL_F_CONFIGURE_MEM_SLOTS))
 
 typedef enum VhostUserRequest {
     VHOST_USER_NONE = 0,
@@ -41,6 +51,13 @@ typedef enum VhostUserRequest {
     VHOST_USER_SET_VRING_KICK = 12,
     VHOST_USER_SET_VRING_CALL = 13,
     VHOST_USER_SET_VRING_ERR = 14,
+    VHOST_USER_GET_PROTOCOL_FEATURES = 15,
+    VHOST_USER_SET_PROTOCOL_FEATURES = 16,
+    VHOST_USER_GET_QUEUE_NUM = 17,
+    VHOST_USER_SET_VRING_ENABLE = 18,
+    VHOST_USER_GET_MAX_MEM_SLOTS = 36,
+    VHOST_USER_ADD_MEM_REG = 37,
+    VHOST_USER_REM_MEM_REG = 38,
     VHOST_USER_MAX
 } VhostUserRequest;
 
@@ -57,6 +74,11 @@ typedef struct VhostUserMemory {
     VhostUserMemoryRegion regions[VHOST_MEMORY_MAX_NREGIONS];
 } VhostUserMemory;
 
+typedef struct VhostUserMemRegMsg {
+    uint64_t padding;
+    VhostUserMemoryRegion region;
+} VhostUserMemRegMsg;
+
 typedef struct VhostUserMsg {
     VhostUserRequest request;
 
@@ -71,9 +93,20 @@ typedef struct VhostUserMsg {
         struct vhost_vring_state state;
         struct vhost_vring_addr addr;
         VhostUserMemory memory;
+        VhostUserMemRegMsg mem_reg;
     };
 } QEMU_PACKED VhostUserMsg;
 
+struct vhost_user {
+    CharDriverState *chr;
+    uint64_t protocol_features;
+    uint64_t max_mem_slots;
+    /* The memory table the backend currently has, valid once sent */
+    bool mem_valid;
+    int mem_nregions;
+    VhostUserMemoryRegion mem_regions[VHOST_USER_MAX_RAM_SLOTS];
+};
+
 static VhostUserMsg m __attribute__ ((unused));
 #define VHOST_USER_HDR_SIZE (sizeof(m.request) \
                             + sizeof(m.flags) \
@@ -122,7 +155,8 @@ static VhostUserRequest vhost_user_request_translate(unsigned long int request)
 
 static int vhost_user_read(struct vhost_dev *dev, VhostUserMsg *msg)
 {
-    CharDriverState *chr = dev->opaque;
+    struct vhost_user *u = dev->opaque;
+    CharDriverState *chr = u->chr;
     uint8_t *p = (uint8_t *) msg;
     int r, size = VHOST_USER_HDR_SIZE;
 
@@ -169,7 +203,8 @@ fail:
 static int vhost_user_write(struct vhost_dev *dev, VhostUserMsg *msg,
                             int *fds, int fd_num)
 {
-    CharDriverState *chr = dev->opaque;
+    struct vhost_user *u = dev->opaque;
+    CharDriverState *chr = u->chr;
     int size = VHOST_USER_HDR_SIZE + msg->size;
 
     if (fd_num) {
@@ -180,6 +215,234 @@ static int vhost_user_write(struct vhost_dev *dev, VhostUserMsg *msg,
             0 : -1;
 }
 
+static int vhost_user_get_u64(struct vhost_dev *dev, VhostUserRequest request,
+                              uint64_t *u64)
+{
+    VhostUserMsg msg;
+
+    msg.request = request;
+    msg.flags = VHOST_USER_VERSION;
+    msg.size = 0;
+
+    if (vhost_user_write(dev, &msg, NULL, 0) < 0 ||
+        vhost_user_read(dev, &msg) < 0) {
+        return -1;
+    }
+
+    if (msg.request != request) {
+        error_report("Received unexpected msg type."
+                " Expected %d received %d", request, msg.request);
+        return -1;
+    }
+
+    if (msg.size != sizeof(m.u64)) {
+        error_report("Received bad msg size.");
+        return -1;
+    }
+
+    *u64 = msg.u64;
+    return 0;
+}
+
+static int vhost_user_set_u64(struct vhost_dev *dev, VhostUserRequest request,
+                              uint64_t u64)
+{
+    VhostUserMsg msg;
+
+    msg.request = request;
+    msg.flags = VHOST_USER_VERSION;
+    msg.u64 = u64;
+    msg.size = sizeof(m.u64);
+
+    return vhost_user_write(dev, &msg, NULL, 0);
+}
+
+static bool vhost_user_has_protocol_feature(struct vhost_dev *dev,
+                                            unsigned int feature)
+{
+    struct vhost_user *u = dev->opaque;
+
+    return u->protocol_features & (1ULL << feature);
+}
+
+/* Collect the regions backed by shareable memory, with their fds. */
+static int vhost_user_fill_regions(struct vhost_dev *dev,
+                                   VhostUserMemoryRegion *regions, int *fds,
+                                   int max)
+{
+    int i, fd, nregions = 0;
+
+    for (i = 0; i < dev->mem->nregions; ++i) {
+        struct vhost_memory_region *reg = dev->mem->regions + i;
+        ram_addr_t ram_addr;
+
+        assert((uintptr_t)reg->userspace_addr == reg->userspace_addr);
+        qemu_ram_addr_from_host((void *)(uintptr_t)reg->userspace_addr,
+                                &ram_addr);
+        fd = qemu_get_ram_fd(ram_addr);
+        if (fd > 0) {
+            if (nregions == max) {
+                error_report("vhost-user backend supports at most %d memory "
+                             "regions", max);
+                return -1;
+            }
+            regions[nregions].userspace_addr = reg->userspace_addr;
+            regions[nregions].memory_size = reg->memory_size;
+            regions[nregions].guest_phys_addr = reg->guest_phys_addr;
+            regions[nregions].mmap_offset = reg->userspace_addr -
+                (uintptr_t) qemu_get_ram_block_host_ptr(ram_addr);
+            fds[nregions++] = fd;
+        }
+    }
+
+    if (!nregions) {
+        error_report("Failed initializing vhost-user memory map, "
+                "consider using -object memory-backend-file share=on");
+        return -1;
+    }
+
+    return nregions;
+}
+
+static int vhost_user_find_region(const VhostUserMemoryRegion *regions,
+                                  int nregions,
+                                  const VhostUserMemoryRegion *reg)
+{
+    int i;
+
+    for (i = 0; i < nregions; i++) {
+        if (!memcmp(&regions[i], reg, sizeof(*reg))) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int vhost_user_send_mem_reg(struct vhost_dev *dev,
+                                   VhostUserRequest request,
+                                   const VhostUserMemoryRegion *reg, int fd)
+{
+    VhostUserMsg msg;
+
+    msg.request = request;
+    msg.flags = VHOST_USER_VERSION;
+    msg.size = sizeof(m.mem_reg);
+    msg.mem_reg.padding = 0;
+    msg.mem_reg.region = *reg;
+
+    return vhost_user_write(dev, &msg, &fd, fd >= 0 ? 1 : 0);
+}
+
+/* Send only the regions that changed since the last table. */
+static int vhost_user_update_mem_regions(struct vhost_dev *dev,
+                                         const VhostUserMemoryRegion *regions,
+                                         int *fds, int nregions)
+{
+    struct vhost_user *u = dev->opaque;
+    int i;
+
+    for (i = 0; i < u->mem_nregions; i++) {
+        if (vhost_user_find_region(regions, nregions,
+                                   &u->mem_regions[i]) < 0 &&
+            vhost_user_send_mem_reg(dev, VHOST_USER_REM_MEM_REG,
+                                    &u->mem_regions[i], -1) < 0) {
+            return -1;
+        }
+    }
+
+    for (i = 0; i < nregions; i++) {
+        if (vhost_user_find_region(u->mem_regions, u->mem_nregions,
+                                   &regions[i]) < 0 &&
+            vhost_user_send_mem_reg(dev, VHOST_USER_ADD_MEM_REG,
+                                    &regions[i], fds[i]) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int vhost_user_set_mem_table(struct vhost_dev *dev)
+{
+    struct vhost_user *u = dev->opaque;
+    VhostUserMemoryRegion regions[VHOST_USER_MAX_RAM_SLOTS];
+    int fds[VHOST_USER_MAX_RAM_SLOTS];
+    bool mem_slots;
+    VhostUserMsg msg;
+    int nregions, r;
+
+    /* All queue pairs share the backend's memory table */
+    if (dev->vq_index) {
+        return 0;
+    }
+
+    mem_slots = vhost_user_has_protocol_feature(dev,
+                    VHOST_USER_PROTOCOL_F_CONFIGURE_MEM_SLOTS);
+    nregions = vhost_user_fill_regions(dev, regions, fds,
+                                       mem_slots ? u->max_mem_slots
+                                                 : VHOST_MEMORY_MAX_NREGIONS);
+    if (nregions < 0) {
+        return -1;
+    }
+
+    /* Memory listener commits often leave the shared regions untouched */
+    if (u->mem_valid && nregions == u->mem_nregions &&
+        !memcmp(regions, u->mem_regions, nregions * sizeof(regions[0]))) {
+        return 0;
+    }
+
+    if (mem_slots) {
+        r = vhost_user_update_mem_regions(dev, regions, fds, nregions);
+    } else {
+        msg.request = VHOST_USER_SET_MEM_TABLE;
+        msg.flags = VHOST_USER_VERSION;
+        msg.memory.nregions = nregions;
+        msg.memory.padding = 0;
+        memcpy(msg.memory.regions, regions, nregions * sizeof(regions[0]));
+
+        msg.size = sizeof(m.memory.nregions);
+        msg.size += sizeof(m.memory.padding);
+        msg.size += nregions * sizeof(VhostUserMemoryRegion);
+
+        r = vhost_user_write(dev, &msg, fds, nregions);
+    }
+
+    if (r < 0) {
+        /* The backend is gone and gets a full table once it is back */
+        u->mem_valid = false;
+        return 0;
+    }
+
+    memcpy(u->mem_regions, regions, nregions * sizeof(regions[0]));
+    u->mem_nregions = nregions;
+    u->mem_valid = true;
+    return 0;
+}
+
+static int vhost_user_set_vring_enable(struct vhost_dev *dev, int enable)
+{
+    VhostUserMsg msg;
+    int i;
+
+    if (!(dev->backend_features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES))) {
+        return -ENOTSUP;
+    }
+
+    for (i = 0; i < dev->nvqs; i++) {
+        msg.request = VHOST_USER_SET_VRING_ENABLE;
+        msg.flags = VHOST_USER_VERSION;
+        msg.state.index = dev->vq_index + i;
+        msg.state.num = enable;
+        msg.size = sizeof(m.state);
+
+        if (vhost_user_write(dev, &msg, NULL, 0) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
 static int vhost_user_call(struct vhost_dev *dev, unsigned long int request,
         void *arg)
 {
@@ -188,7 +451,6 @@ static int vhost_user_call(struct vhost_dev *dev, unsigned long int request,
     struct vhost_vring_file *file = 0;
     int need_reply = 0;
     int fds[VHOST_MEMORY_MAX_NREGIONS];
-    int i, fd;
     size_t fd_num = 0;
 
     assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
@@ -210,60 +472,40 @@ static int vhost_user_call(struct vhost_dev *dev, unsigned long int request,
         break;
 
     case VHOST_SET_OWNER:
+        break;
+
     case VHOST_RESET_OWNER:
+        /* The backend drops its memory table along with the owner */
+        ((struct vhost_user *)dev->opaque)->mem_valid = false;
         break;
 
     case VHOST_SET_MEM_TABLE:
-        for (i = 0; i < dev->mem->nregions; ++i) {
-            struct vhost_memory_region *reg = dev->mem->regions + i;
-            ram_addr_t ram_addr;
-
-            assert((uintptr_t)reg->userspace_addr == reg->userspace_addr);
-            qemu_ram_addr_from_host((void *)(uintptr_t)reg->userspace_addr, &ram_addr);
-            fd = qemu_get_ram_fd(ram_addr);
-            if (fd > 0) {
-                msg.memory.regions[fd_num].userspace_addr = reg->userspace_addr;
-                msg.memory.regions[fd_num].memory_size  = reg->memory_size;
-                msg.memory.regions[fd_num].guest_phys_addr = reg->guest_phys_addr;
-                msg.memory.regions[fd_num].mmap_offset = reg->userspace_addr -
-                    (uintptr_t) qemu_get_ram_block_host_ptr(ram_addr);
-                assert(fd_num < VHOST_MEMORY_MAX_NREGIONS);
-                fds[fd_num++] = fd;
-            }
-        }
-
-        msg.memory.nregions = fd_num;
-
-        if (!fd_num) {
-            error_report("Failed initializing vhost-user memory map, "
-                    "consider using -object memory-backend-file share=on");
-            return -1;
-        }
-
-        msg.size = sizeof(m.memory.nregions);
-        msg.size += sizeof(m.memory.padding);
-        msg.size += fd_num * sizeof(VhostUserMemoryRegion);
-
-        break;
+        return vhost_user_set_mem_table(dev);
 
     case VHOST_SET_LOG_FD:
         fds[fd_num++] = *((int *) arg);
         break;
 
+    /* Queue pairs share the socket, so vrings are addressed by their
+     * index in the device rather than in this vhost_dev.
+     */
     case VHOST_SET_VRING_NUM:
     case VHOST_SET_VRING_BASE:
         memcpy(&msg.state, arg, sizeof(struct vhost_vring_state));
+        msg.state.index += dev->vq_index;
         msg.size = sizeof(m.state);
         break;
 
     case VHOST_GET_VRING_BASE:
         memcpy(&msg.state, arg, sizeof(struct vhost_vring_state));
+        msg.state.index += dev->vq_index;
         msg.size = sizeof(m.state);
         need_reply = 1;
         break;
 
     case VHOST_SET_VRING_ADDR:
         memcpy(&msg.addr, arg, sizeof(struct vhost_vring_addr));
+        msg.addr.index += dev->vq_index;
         msg.size = sizeof(m.addr);
         break;
 
@@ -271,7 +513,7 @@ static int vhost_user_call(struct vhost_dev *dev, unsigned long int request,
     case VHOST_SET_VRING_CALL:
     case VHOST_SET_VRING_ERR:
         file = arg;
-        msg.u64 = file->index & VHOST_USER_VRING_IDX_MASK;
+        msg.u64 = (file->index + dev->vq_index) & VHOST_USER_VRING_IDX_MASK;
         msg.size = sizeof(m.u64);
         if (ioeventfd_enabled() && file->fd > 0) {
             fds[fd_num++] = file->fd;
@@ -285,13 +527,16 @@ static int vhost_user_call(struct vhost_dev *dev, unsigned long int request,
         break;
     }
 
+    /* A lost backend is noticed through the chardev going down, but
+     * requests waiting for a reply must not make up one.
+     */
     if (vhost_user_write(dev, &msg, fds, fd_num) < 0) {
-        return 0;
+        return need_reply ? -1 : 0;
     }
 
     if (need_reply) {
         if (vhost_user_read(dev, &msg) < 0) {
-            return 0;
+            return -1;
         }
 
         if (msg_request != msg.request) {
@@ -313,6 +558,7 @@ static int vhost_user_call(struct vhost_dev *dev, unsigned long int request,
                 error_report("Received bad msg size.");
                 return -1;
             }
+            msg.state.index -= dev->vq_index;
             memcpy(arg, &msg.state, sizeof(struct vhost_vring_state));
             break;
         default:
@@ -327,17 +573,69 @@ static int vhost_user_call(struct vhost_dev *dev, unsigned long int request,
 
 static int vhost_user_init(struct vhost_dev *dev, void *opaque)
 {
+    struct vhost_user *u;
+    uint64_t features;
+
     assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
 
-    dev->opaque = opaque;
+    u = g_new0(struct vhost_user, 1);
+    u->chr = opaque;
+    dev->opaque = u;
+
+    if (vhost_user_get_u64(dev, VHOST_USER_GET_FEATURES, &features) < 0) {
+        goto fail;
+    }
+
+    if (!(features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES))) {
+        return 0;
+    }
+
+    /* Acked on every SET_FEATURES, the guest never sees it */
+    dev->backend_features |= 1ULL << VHOST_USER_F_PROTOCOL_FEATURES;
+
+    if (vhost_user_get_u64(dev, VHOST_USER_GET_PROTOCOL_FEATURES,
+                           &u->protocol_features) < 0) {
+        goto fail;
+    }
+    u->protocol_features &= VHOST_USER_PROTOCOL_FEATURE_MASK;
+
+    if (vhost_user_has_protocol_feature(dev,
+                VHOST_USER_PROTOCOL_F_CONFIGURE_MEM_SLOTS)) {
+        if (vhost_user_get_u64(dev, VHOST_USER_GET_MAX_MEM_SLOTS,
+                               &u->max_mem_slots) < 0) {
+            goto fail;
+        }
+        if (!u->max_mem_slots) {
+            u->protocol_features &=
+                ~(1ULL << VHOST_USER_PROTOCOL_F_CONFIGURE_MEM_SLOTS);
+        }
+        u->max_mem_slots = MIN(u->max_mem_slots, VHOST_USER_MAX_RAM_SLOTS);
+    }
+
+    if (vhost_user_set_u64(dev, VHOST_USER_SET_PROTOCOL_FEATURES,
+                           u->protocol_features) < 0) {
+        goto fail;
+    }
+
+    if (vhost_user_has_protocol_feature(dev, VHOST_USER_PROTOCOL_F_MQ) &&
+        vhost_user_get_u64(dev, VHOST_USER_GET_QUEUE_NUM,
+                           &dev->max_queues) < 0) {
+        goto fail;
+    }
 
     return 0;
+
+fail:
+    dev->opaque = 0;
+    g_free(u);
+    return -1;
 }
 
 static int vhost_user_cleanup(struct vhost_dev *dev)
 {
     assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
 
+    g_free(dev->opaque);
     dev->opaque = 0;
 
     return 0;
@@ -347,5 +645,6 @@ const VhostOps user_ops = {
         .backend_type = VHOST_BACKEND_TYPE_USER,
         .vhost_call = vhost_user_call,
         .vhost_backend_init = vhost_user_init,
-        .vhost_backend_cleanup = vhost_user_cleanup
+        .vhost_backend_cleanup = vhost_user_cleanup,
+        .vhost_backend_set_vring_enable = vhost_user_set_vring_enable
         };
@@ -756,10 +756,13 @@ static void vhost_virtqueue_stop(struct vhost_dev *dev,
     if (r < 0) {
         fprintf(stderr, "vhost VQ %d ring restore failed: %d\n", idx, r);
         fflush(stderr);
+        /* Only a vhost-user backend can go away under us */
+        assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
+        virtio_queue_restore_last_avail_idx(vdev, idx);
+    } else {
+        virtio_queue_set_last_avail_idx(vdev, idx, state.num);
     }
-    virtio_queue_set_last_avail_idx(vdev, idx, state.num);
     virtio_queue_invalidate_signalled_used(vdev, idx);
-    assert (r >= 0);
     cpu_physical_memory_unmap(vq->ring, virtio_queue_get_ring_size(vdev, idx),
                               0, virtio_queue_get_ring_size(vdev, idx));
     cpu_physical_memory_unmap(vq->used, virtio_queue_get_used_size(vdev, idx),
@@ -822,8 +825,10 @@ int vhost_dev_init(struct vhost_dev *hdev, void *opaque,
     }
 
     if (hdev->vhost_ops->vhost_backend_init(hdev, opaque) < 0) {
-        close((uintptr_t)opaque);
-        return -errno;
+        if (backend_type == VHOST_BACKEND_TYPE_KERNEL) {
+            close((uintptr_t)opaque);
+        }
+        return errno ? -errno : -EIO;
     }
 
     r = hdev->vhost_ops->vhost_call(hdev, VHOST_SET_OWNER, NULL);
@@ -881,7 +886,7 @@ fail_vq:
         vhost_virtqueue_cleanup(hdev->vqs + i);
     }
 fail:
-    r = -errno;
+    r = errno ? -errno : -EIO;
     hdev->vhost_ops->vhost_backend_cleanup(hdev);
     return r;
 }
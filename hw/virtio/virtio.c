@@ -18,6 +18,7 @@
 #include "qemu/error-report.h"
 #include "hw/virtio/virtio.h"
 #include "qemu/atomic.h"
+#include "block/aio.h"
 #include "hw/virtio/virtio-bus.h"
 #include "migration/migration.h"
 #include "hw/virtio/virtio-access.h"
@@ -66,11 +67,37 @@ typedef struct VRing
     hwaddr used;
 } VRing;
 
+/* Host mapping of one of the rings.  @ptr is NULL if the ring is not in
+ * contiguous RAM, in which case the slow physical memory accessors are
+ * used instead.
+ */
+typedef struct VRingCache
+{
+    void *ptr;
+    MemoryRegion *mr;
+    hwaddr offset;              /* of the ring within @mr */
+} VRingCache;
+
 struct VirtQueue
 {
     VRing vring;
+
+    /* Ring mappings, rebuilt on first use after the ring addresses or the
+     * guest memory map have changed */
+    bool rings_cached;
+    VRingCache desc_cache;
+    VRingCache avail_cache;
+    VRingCache used_cache;
+
     hwaddr pa;
     uint16_t last_avail_idx;
+
+    /* Last avail_idx read from the guest, and the used_idx we last
+     * published.  Keeping them here avoids reading the cache lines that
+     * the guest is writing to for every request. */
+    uint16_t shadow_avail_idx;
+    uint16_t used_idx;
+
     /* Last used index value we have signalled on */
     uint16_t signalled_used;
 
@@ -89,71 +116,166 @@ struct VirtQueue
     VirtIODevice *vdev;
     EventNotifier guest_notifier;
     EventNotifier host_notifier;
+    /* AioContext that services host_notifier, if not the main loop */
+    AioContext *ctx;
     QLIST_ENTRY(VirtQueue) node;
 };
 
-/* virt queue functions */
-static void virtqueue_init(VirtQueue *vq)
+/* ring mappings */
+static void vring_cache_map(VRingCache *cache, hwaddr pa, hwaddr len,
+                            bool is_write)
 {
-    hwaddr pa = vq->pa;
+    MemoryRegionSection section;
 
-    vq->vring.desc = pa;
-    vq->vring.avail = pa + vq->vring.num * sizeof(VRingDesc);
-    vq->vring.used = vring_align(vq->vring.avail +
-                                 offsetof(VRingAvail, ring[vq->vring.num]),
-                                 vq->vring.align);
+    section = memory_region_find(get_system_memory(), pa, len);
+    if (!section.mr || int128_get64(section.size) < len ||
+        (is_write && section.readonly) ||
+        !memory_region_is_ram(section.mr)) {
+        memory_region_unref(section.mr);
+        cache->ptr = NULL;
+        cache->mr = NULL;
+        return;
+    }
+
+    cache->mr = section.mr;
+    cache->offset = section.offset_within_region;
+    cache->ptr = memory_region_get_ram_ptr(section.mr) + cache->offset;
 }
 
-static inline uint64_t vring_desc_addr(VirtIODevice *vdev, hwaddr desc_pa,
-                                       int i)
+static void vring_cache_unmap(VRingCache *cache)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, addr);
-    return virtio_ldq_phys(vdev, pa);
+    memory_region_unref(cache->mr);
+    cache->ptr = NULL;
+    cache->mr = NULL;
 }
 
-static inline uint32_t vring_desc_len(VirtIODevice *vdev, hwaddr desc_pa, int i)
+static void virtqueue_invalidate_rings(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, len);
-    return virtio_ldl_phys(vdev, pa);
+    if (!vq->rings_cached) {
+        return;
+    }
+    vring_cache_unmap(&vq->desc_cache);
+    vring_cache_unmap(&vq->avail_cache);
+    vring_cache_unmap(&vq->used_cache);
+    vq->rings_cached = false;
 }
 
-static inline uint16_t vring_desc_flags(VirtIODevice *vdev, hwaddr desc_pa,
-                                        int i)
+static void virtqueue_cache_rings(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, flags);
-    return virtio_lduw_phys(vdev, pa);
+    unsigned int num = vq->vring.num;
+
+    assert(!vq->rings_cached);
+    if (!vq->vring.desc || !num) {
+        return;
+    }
+
+    vring_cache_map(&vq->desc_cache, vq->vring.desc,
+                    num * sizeof(VRingDesc), false);
+    /* The avail ring is followed by used_event */
+    vring_cache_map(&vq->avail_cache, vq->vring.avail,
+                    offsetof(VRingAvail, ring[num + 1]), false);
+    /* The used ring is followed by avail_event */
+    vring_cache_map(&vq->used_cache, vq->vring.used,
+                    offsetof(VRingUsed, ring[num]) + sizeof(uint16_t), true);
+    vq->rings_cached = true;
 }
 
-static inline uint16_t vring_desc_next(VirtIODevice *vdev, hwaddr desc_pa,
-                                       int i)
+static inline VRingCache *vring_get_cache(VirtQueue *vq, VRingCache *cache)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, next);
-    return virtio_lduw_phys(vdev, pa);
+    if (unlikely(!vq->rings_cached)) {
+        virtqueue_cache_rings(vq);
+    }
+    return cache;
+}
+
+static inline uint16_t vring_cache_lduw(VirtQueue *vq, VRingCache *cache,
+                                        hwaddr pa, hwaddr offset)
+{
+    cache = vring_get_cache(vq, cache);
+    if (likely(cache->ptr)) {
+        return virtio_lduw_p(vq->vdev, cache->ptr + offset);
+    }
+    return virtio_lduw_phys(vq->vdev, pa + offset);
+}
+
+static inline void vring_cache_stw(VirtQueue *vq, VRingCache *cache,
+                                   hwaddr pa, hwaddr offset, uint16_t val)
+{
+    cache = vring_get_cache(vq, cache);
+    if (likely(cache->ptr)) {
+        virtio_stw_p(vq->vdev, cache->ptr + offset, val);
+        memory_region_set_dirty(cache->mr, cache->offset + offset,
+                                sizeof(val));
+    } else {
+        virtio_stw_phys(vq->vdev, pa + offset, val);
+    }
+}
+
+static inline void vring_cache_stl(VirtQueue *vq, VRingCache *cache,
+                                   hwaddr pa, hwaddr offset, uint32_t val)
+{
+    cache = vring_get_cache(vq, cache);
+    if (likely(cache->ptr)) {
+        virtio_stl_p(vq->vdev, cache->ptr + offset, val);
+        memory_region_set_dirty(cache->mr, cache->offset + offset,
+                                sizeof(val));
+    } else {
+        virtio_stl_phys(vq->vdev, pa + offset, val);
+    }
+}
+
+/* virt queue functions */
+static void virtqueue_init(VirtQueue *vq)
+{
+    hwaddr pa = vq->pa;
+
+    virtqueue_invalidate_rings(vq);
+    vq->vring.desc = pa;
+    vq->vring.avail = pa + vq->vring.num * sizeof(VRingDesc);
+    vq->vring.used = vring_align(vq->vring.avail +
+                                 offsetof(VRingAvail, ring[vq->vring.num]),
+                                 vq->vring.align);
+}
+
+/* Read descriptor @i of the table at @desc_pa.  The queue's own table is
+ * read through its mapping; indirect tables go through physical memory.
+ */
+static void vring_desc_read(VirtQueue *vq, VRingDesc *desc, hwaddr desc_pa,
+                            unsigned int i)
+{
+    VirtIODevice *vdev = vq->vdev;
+    VRingCache *cache = vring_get_cache(vq, &vq->desc_cache);
+
+    if (desc_pa == vq->vring.desc && i < vq->vring.num && cache->ptr) {
+        memcpy(desc, cache->ptr + i * sizeof(VRingDesc), sizeof(VRingDesc));
+    } else {
+        cpu_physical_memory_read(desc_pa + i * sizeof(VRingDesc),
+                                 desc, sizeof(VRingDesc));
+    }
+    virtio_tswap64s(vdev, &desc->addr);
+    virtio_tswap32s(vdev, &desc->len);
+    virtio_tswap16s(vdev, &desc->flags);
+    virtio_tswap16s(vdev, &desc->next);
 }
 
 static inline uint16_t vring_avail_flags(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, flags);
-    return virtio_lduw_phys(vq->vdev, pa);
+    return vring_cache_lduw(vq, &vq->avail_cache, vq->vring.avail,
+                            offsetof(VRingAvail, flags));
 }
 
 static inline uint16_t vring_avail_idx(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, idx);
-    return virtio_lduw_phys(vq->vdev, pa);
+    vq->shadow_avail_idx = vring_cache_lduw(vq, &vq->avail_cache,
+                                            vq->vring.avail,
+                                            offsetof(VRingAvail, idx));
+    return vq->shadow_avail_idx;
 }
 
 static inline uint16_t vring_avail_ring(VirtQueue *vq, int i)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, ring[i]);
-    return virtio_lduw_phys(vq->vdev, pa);
+    return vring_cache_lduw(vq, &vq->avail_cache, vq->vring.avail,
+                            offsetof(VRingAvail, ring[i]));
 }
 
 static inline uint16_t vring_get_used_event(VirtQueue *vq)
@@ -163,56 +285,55 @@ static inline uint16_t vring_get_used_event(VirtQueue *vq)
 
 static inline void vring_used_ring_id(VirtQueue *vq, int i, uint32_t val)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, ring[i].id);
-    virtio_stl_phys(vq->vdev, pa, val);
+    vring_cache_stl(vq, &vq->used_cache, vq->vring.used,
+                    offsetof(VRingUsed, ring[i].id), val);
 }
 
 static inline void vring_used_ring_len(VirtQueue *vq, int i, uint32_t val)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, ring[i].len);
-    virtio_stl_phys(vq->vdev, pa, val);
+    vring_cache_stl(vq, &vq->used_cache, vq->vring.used,
+                    offsetof(VRingUsed, ring[i].len), val);
 }
 
 static uint16_t vring_used_idx(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, idx);
-    return virtio_lduw_phys(vq->vdev, pa);
+    return vring_cache_lduw(vq, &vq->used_cache, vq->vring.used,
+                            offsetof(VRingUsed, idx));
 }
 
 static inline void vring_used_idx_set(VirtQueue *vq, uint16_t val)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, idx);
-    virtio_stw_phys(vq->vdev, pa, val);
+    vring_cache_stw(vq, &vq->used_cache, vq->vring.used,
+                    offsetof(VRingUsed, idx), val);
 }
 
 static inline void vring_used_flags_set_bit(VirtQueue *vq, int mask)
 {
-    VirtIODevice *vdev = vq->vdev;
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, flags);
-    virtio_stw_phys(vdev, pa, virtio_lduw_phys(vdev, pa) | mask);
+    hwaddr offset = offsetof(VRingUsed, flags);
+    uint16_t flags;
+
+    flags = vring_cache_lduw(vq, &vq->used_cache, vq->vring.used, offset);
+    vring_cache_stw(vq, &vq->used_cache, vq->vring.used, offset,
+                    flags | mask);
 }
 
 static inline void vring_used_flags_unset_bit(VirtQueue *vq, int mask)
 {
-    VirtIODevice *vdev = vq->vdev;
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, flags);
-    virtio_stw_phys(vdev, pa, virtio_lduw_phys(vdev, pa) & ~mask);
+    hwaddr offset = offsetof(VRingUsed, flags);
+    uint16_t flags;
+
+    flags = vring_cache_lduw(vq, &vq->used_cache, vq->vring.used, offset);
+    vring_cache_stw(vq, &vq->used_cache, vq->vring.used, offset,
+                    flags & ~mask);
 }
 
 static inline void vring_set_avail_event(VirtQueue *vq, uint16_t val)
 {
-    hwaddr pa;
     if (!vq->notification) {
         return;
     }
-    pa = vq->vring.used + offsetof(VRingUsed, ring[vq->vring.num]);
-    virtio_stw_phys(vq->vdev, pa, val);
+    vring_cache_stw(vq, &vq->used_cache, vq->vring.used,
+                    offsetof(VRingUsed, ring[vq->vring.num]), val);
 }
 
 void virtio_queue_set_notification(VirtQueue *vq, int enable)
@@ -238,6 +359,9 @@ int virtio_queue_ready(VirtQueue *vq)
 
 int virtio_queue_empty(VirtQueue *vq)
 {
+    if (vq->shadow_avail_idx != vq->last_avail_idx) {
+        return 0;
+    }
     return vring_avail_idx(vq) == vq->last_avail_idx;
 }
 
@@ -265,7 +389,7 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
                                   elem->out_sg[i].iov_len,
                                   0, elem->out_sg[i].iov_len);
 
-    idx = (idx + vring_used_idx(vq)) % vq->vring.num;
+    idx = (idx + vq->used_idx) % vq->vring.num;
 
     /* Get a pointer to the next entry in the used ring. */
     vring_used_ring_id(vq, idx, elem->index);
@@ -278,9 +402,10 @@ void virtqueue_flush(VirtQueue *vq, unsigned int count)
     /* Make sure buffer is written before we update index. */
     smp_wmb();
     trace_virtqueue_flush(vq, count);
-    old = vring_used_idx(vq);
+    old = vq->used_idx;
     new = old + count;
     vring_used_idx_set(vq, new);
+    vq->used_idx = new;
     vq->inuse -= count;
     if (unlikely((int16_t)(new - vq->signalled_used) < (uint16_t)(new - old)))
         vq->signalled_used_valid = false;
@@ -295,12 +420,19 @@ void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
 
 static int virtqueue_num_heads(VirtQueue *vq, unsigned int idx)
 {
-    uint16_t num_heads = vring_avail_idx(vq) - idx;
+    uint16_t avail_idx = vq->shadow_avail_idx;
+    uint16_t num_heads;
+
+    /* Only go to guest memory once the known requests are used up */
+    if (avail_idx == (uint16_t)idx) {
+        avail_idx = vring_avail_idx(vq);
+    }
+    num_heads = avail_idx - idx;
 
     /* Check it isn't doing very strange things with descriptor numbers. */
     if (num_heads > vq->vring.num) {
         error_report("Guest moved used index from %u to %u",
-                     idx, vring_avail_idx(vq));
+                     idx, avail_idx);
         exit(1);
     }
     /* On success, callers read a descriptor at vq->last_avail_idx.
@@ -329,18 +461,21 @@ static unsigned int virtqueue_get_head(VirtQueue *vq, unsigned int idx)
     return head;
 }
 
-static unsigned virtqueue_next_desc(VirtIODevice *vdev, hwaddr desc_pa,
-                                    unsigned int i, unsigned int max)
+/* Follow the chain from @desc, reading the next descriptor into @desc.
+ * Returns its index, or @max at the end of the chain.
+ */
+static unsigned virtqueue_read_next_desc(VirtQueue *vq, VRingDesc *desc,
+                                         hwaddr desc_pa, unsigned int max)
 {
     unsigned int next;
 
     /* If this descriptor says it doesn't chain, we're done. */
-    if (!(vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_NEXT)) {
+    if (!(desc->flags & VRING_DESC_F_NEXT)) {
         return max;
     }
 
     /* Check they're not leading us off end of descriptors. */
-    next = vring_desc_next(vdev, desc_pa, i);
+    next = desc->next;
     /* Make sure compiler knows to grab that: we don't want it changing! */
     smp_wmb();
 
@@ -349,6 +484,7 @@ static unsigned virtqueue_next_desc(VirtIODevice *vdev, hwaddr desc_pa,
         exit(1);
     }
 
+    vring_desc_read(vq, desc, desc_pa, next);
     return next;
 }
 
@@ -363,8 +499,8 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
 
     total_bufs = in_total = out_total = 0;
     while (virtqueue_num_heads(vq, idx)) {
-        VirtIODevice *vdev = vq->vdev;
         unsigned int max, num_bufs, indirect = 0;
+        VRingDesc desc;
         hwaddr desc_pa;
         int i;
 
@@ -372,9 +508,10 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
         num_bufs = total_bufs;
         i = virtqueue_get_head(vq, idx++);
         desc_pa = vq->vring.desc;
+        vring_desc_read(vq, &desc, desc_pa, i);
 
-        if (vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_INDIRECT) {
-            if (vring_desc_len(vdev, desc_pa, i) % sizeof(VRingDesc)) {
+        if (desc.flags & VRING_DESC_F_INDIRECT) {
+            if (desc.len % sizeof(VRingDesc)) {
                 error_report("Invalid size for indirect buffer table");
                 exit(1);
             }
@@ -387,9 +524,10 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
 
             /* loop over the indirect descriptor table */
             indirect = 1;
-            max = vring_desc_len(vdev, desc_pa, i) / sizeof(VRingDesc);
-            desc_pa = vring_desc_addr(vdev, desc_pa, i);
+            max = desc.len / sizeof(VRingDesc);
+            desc_pa = desc.addr;
             num_bufs = i = 0;
+            vring_desc_read(vq, &desc, desc_pa, i);
         }
 
         do {
@@ -399,15 +537,16 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
                 exit(1);
             }
 
-            if (vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_WRITE) {
-                in_total += vring_desc_len(vdev, desc_pa, i);
+            if (desc.flags & VRING_DESC_F_WRITE) {
+                in_total += desc.len;
             } else {
-                out_total += vring_desc_len(vdev, desc_pa, i);
+                out_total += desc.len;
             }
             if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
                 goto done;
             }
-        } while ((i = virtqueue_next_desc(vdev, desc_pa, i, max)) != max);
+        } while ((i = virtqueue_read_next_desc(vq, &desc, desc_pa, max))
+                 != max);
 
         if (!indirect)
             total_bufs = num_bufs;
@@ -454,76 +593,253 @@ void virtqueue_map_sg(struct iovec *sg, hwaddr *addr,
     }
 }
 
-int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
+void virtqueue_map(VirtQueueElement *elem)
+{
+    virtqueue_map_sg(elem->in_sg, elem->in_addr, elem->in_num, 1);
+    virtqueue_map_sg(elem->out_sg, elem->out_addr, elem->out_num, 0);
+}
+
+/* Allocate @sz bytes for a device request that starts with a
+ * VirtQueueElement, followed by arrays for @out_num + @in_num descriptors.
+ */
+void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_num)
+{
+    VirtQueueElement *elem;
+    size_t in_addr_ofs = QEMU_ALIGN_UP(sz, __alignof__(elem->in_addr[0]));
+    size_t out_addr_ofs = in_addr_ofs + in_num * sizeof(elem->in_addr[0]);
+    size_t out_addr_end = out_addr_ofs + out_num * sizeof(elem->out_addr[0]);
+    size_t in_sg_ofs = QEMU_ALIGN_UP(out_addr_end, __alignof__(elem->in_sg[0]));
+    size_t out_sg_ofs = in_sg_ofs + in_num * sizeof(elem->in_sg[0]);
+    size_t out_sg_end = out_sg_ofs + out_num * sizeof(elem->out_sg[0]);
+
+    assert(sz >= sizeof(VirtQueueElement));
+    elem = g_malloc(out_sg_end);
+    elem->out_num = out_num;
+    elem->in_num = in_num;
+    elem->in_addr = (void *)elem + in_addr_ofs;
+    elem->out_addr = (void *)elem + out_addr_ofs;
+    elem->in_sg = (void *)elem + in_sg_ofs;
+    elem->out_sg = (void *)elem + out_sg_ofs;
+    return elem;
+}
+
+/* Pop the request at last_avail_idx; the caller has already checked
+ * that the guest made one available and updates the avail event.
+ */
+static void *virtqueue_pop_avail(VirtQueue *vq, size_t sz)
 {
     unsigned int i, head, max;
     hwaddr desc_pa = vq->vring.desc;
-    VirtIODevice *vdev = vq->vdev;
-
-    if (!virtqueue_num_heads(vq, vq->last_avail_idx))
-        return 0;
+    VirtQueueElement *elem;
+    unsigned out_num, in_num;
+    hwaddr addr[VIRTQUEUE_MAX_SIZE];
+    struct iovec iov[VIRTQUEUE_MAX_SIZE];
+    VRingDesc desc;
 
     /* When we start there are none of either input nor output. */
-    elem->out_num = elem->in_num = 0;
+    out_num = in_num = 0;
 
     max = vq->vring.num;
 
     i = head = virtqueue_get_head(vq, vq->last_avail_idx++);
-    if (virtio_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
-        vring_set_avail_event(vq, vq->last_avail_idx);
-    }
 
-    if (vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_INDIRECT) {
-        if (vring_desc_len(vdev, desc_pa, i) % sizeof(VRingDesc)) {
+    vring_desc_read(vq, &desc, desc_pa, i);
+    if (desc.flags & VRING_DESC_F_INDIRECT) {
+        if (desc.len % sizeof(VRingDesc)) {
             error_report("Invalid size for indirect buffer table");
             exit(1);
         }
 
         /* loop over the indirect descriptor table */
-        max = vring_desc_len(vdev, desc_pa, i) / sizeof(VRingDesc);
-        desc_pa = vring_desc_addr(vdev, desc_pa, i);
+        max = desc.len / sizeof(VRingDesc);
+        desc_pa = desc.addr;
         i = 0;
+        vring_desc_read(vq, &desc, desc_pa, i);
     }
 
-    /* Collect all the descriptors */
+    /* Collect all the descriptors into on-stack arrays, then copy them
+     * into an element of the right size.  Output descriptors fill the
+     * arrays from the front and input descriptors from the back, so the
+     * two kinds may still be interleaved in the chain. */
     do {
-        struct iovec *sg;
+        unsigned int n;
 
-        if (vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_WRITE) {
-            if (elem->in_num >= ARRAY_SIZE(elem->in_sg)) {
-                error_report("Too many write descriptors in indirect table");
-                exit(1);
-            }
-            elem->in_addr[elem->in_num] = vring_desc_addr(vdev, desc_pa, i);
-            sg = &elem->in_sg[elem->in_num++];
-        } else {
-            if (elem->out_num >= ARRAY_SIZE(elem->out_sg)) {
-                error_report("Too many read descriptors in indirect table");
-                exit(1);
-            }
-            elem->out_addr[elem->out_num] = vring_desc_addr(vdev, desc_pa, i);
-            sg = &elem->out_sg[elem->out_num++];
+        if (out_num + in_num >= VIRTQUEUE_MAX_SIZE) {
+            error_report("Too many descriptors in indirect table");
+            exit(1);
         }
 
-        sg->iov_len = vring_desc_len(vdev, desc_pa, i);
+        if (desc.flags & VRING_DESC_F_WRITE) {
+            n = VIRTQUEUE_MAX_SIZE - 1 - in_num++;
+        } else {
+            n = out_num++;
+        }
+        addr[n] = desc.addr;
+        iov[n].iov_len = desc.len;
 
         /* If we've got too many, that implies a descriptor loop. */
-        if ((elem->in_num + elem->out_num) > max) {
+        if ((in_num + out_num) > max) {
             error_report("Looped descriptor");
             exit(1);
         }
-    } while ((i = virtqueue_next_desc(vdev, desc_pa, i, max)) != max);
-
-    /* Now map what we have collected */
-    virtqueue_map_sg(elem->in_sg, elem->in_addr, elem->in_num, 1);
-    virtqueue_map_sg(elem->out_sg, elem->out_addr, elem->out_num, 0);
+    } while ((i = virtqueue_read_next_desc(vq, &desc, desc_pa, max)) != max);
 
+    elem = virtqueue_alloc_element(sz, out_num, in_num);
     elem->index = head;
+    for (i = 0; i < out_num; i++) {
+        elem->out_addr[i] = addr[i];
+        elem->out_sg[i] = iov[i];
+    }
+    for (i = 0; i < in_num; i++) {
+        elem->in_addr[i] = addr[VIRTQUEUE_MAX_SIZE - 1 - i];
+        elem->in_sg[i] = iov[VIRTQUEUE_MAX_SIZE - 1 - i];
+    }
+
+    /* Now map what we have collected */
+    virtqueue_map(elem);
 
     vq->inuse++;
 
     trace_virtqueue_pop(vq, elem, elem->in_num, elem->out_num);
-    return elem->in_num + elem->out_num;
+    return elem;
+}
+
+/* Pop the next request into a new allocation of @sz bytes (at least
+ * sizeof(VirtQueueElement)) whose descriptor arrays are sized for this
+ * request only.  Returns NULL if the queue is empty.
+ */
+void *virtqueue_pop(VirtQueue *vq, size_t sz)
+{
+    VirtQueueElement *elem;
+
+    if (!virtqueue_num_heads(vq, vq->last_avail_idx)) {
+        return NULL;
+    }
+
+    elem = virtqueue_pop_avail(vq, sz);
+    if (virtio_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_set_avail_event(vq, vq->last_avail_idx);
+    }
+    return elem;
+}
+
+/* Pop up to @n requests like virtqueue_pop, storing them in @elems.
+ * The avail index is read (and the read barrier issued) at most once for
+ * the whole batch, and the avail event is only published after the last
+ * request.  Returns the number of requests popped; fewer than @n means
+ * that the queue is empty.
+ */
+unsigned int virtqueue_pop_batch(VirtQueue *vq, size_t sz, void **elems,
+                                 unsigned int n)
+{
+    unsigned int i, num_heads;
+
+    if ((uint16_t)(vq->shadow_avail_idx - vq->last_avail_idx) < n) {
+        vring_avail_idx(vq);
+    }
+    num_heads = virtqueue_num_heads(vq, vq->last_avail_idx);
+    n = MIN(n, num_heads);
+    for (i = 0; i < n; i++) {
+        elems[i] = virtqueue_pop_avail(vq, sz);
+    }
+
+    if (n && virtio_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_set_avail_event(vq, vq->last_avail_idx);
+    }
+    trace_virtqueue_pop_batch(vq, n);
+    return n;
+}
+
+/* Reading and writing a structure directly to QEMUFile is *awful*, but
+ * it is what QEMU has always done by mistake.  We can change it sooner
+ * or later by bumping the version number of the affected vm states.
+ * In the meanwhile, since the in-memory layout of VirtQueueElement
+ * has changed, we need to marshal to and from the layout that was
+ * used before the change.
+ */
+typedef struct VirtQueueElementOld {
+    unsigned int index;
+    unsigned int out_num;
+    unsigned int in_num;
+    hwaddr in_addr[VIRTQUEUE_MAX_SIZE];
+    hwaddr out_addr[VIRTQUEUE_MAX_SIZE];
+    struct iovec in_sg[VIRTQUEUE_MAX_SIZE];
+    struct iovec out_sg[VIRTQUEUE_MAX_SIZE];
+} VirtQueueElementOld;
+
+void *qemu_get_virtqueue_element(QEMUFile *f, size_t sz)
+{
+    VirtQueueElement *elem;
+    VirtQueueElementOld *data;
+    int i;
+
+    data = g_new(VirtQueueElementOld, 1);
+    qemu_get_buffer(f, (uint8_t *)data, sizeof(VirtQueueElementOld));
+
+    if (data->out_num > VIRTQUEUE_MAX_SIZE ||
+        data->in_num > VIRTQUEUE_MAX_SIZE) {
+        error_report("virtio: invalid element size in migration stream");
+        exit(1);
+    }
+
+    elem = virtqueue_alloc_element(sz, data->out_num, data->in_num);
+    elem->index = data->index;
+
+    for (i = 0; i < elem->in_num; i++) {
+        elem->in_addr[i] = data->in_addr[i];
+    }
+
+    for (i = 0; i < elem->out_num; i++) {
+        elem->out_addr[i] = data->out_addr[i];
+    }
+
+    for (i = 0; i < elem->in_num; i++) {
+        /* Base is overwritten by virtqueue_map.  */
+        elem->in_sg[i].iov_base = 0;
+        elem->in_sg[i].iov_len = data->in_sg[i].iov_len;
+    }
+
+    for (i = 0; i < elem->out_num; i++) {
+        /* Base is overwritten by virtqueue_map.  */
+        elem->out_sg[i].iov_base = 0;
+        elem->out_sg[i].iov_len = data->out_sg[i].iov_len;
+    }
+
+    virtqueue_map(elem);
+    g_free(data);
+    return elem;
+}
+
+void qemu_put_virtqueue_element(QEMUFile *f, VirtQueueElement *elem)
+{
+    VirtQueueElementOld *data;
+    int i;
+
+    data = g_new0(VirtQueueElementOld, 1);
+    data->index = elem->index;
+    data->in_num = elem->in_num;
+    data->out_num = elem->out_num;
+
+    for (i = 0; i < elem->in_num; i++) {
+        data->in_addr[i] = elem->in_addr[i];
+    }
+
+    for (i = 0; i < elem->out_num; i++) {
+        data->out_addr[i] = elem->out_addr[i];
+    }
+
+    for (i = 0; i < elem->in_num; i++) {
+        /* Base is overwritten by virtqueue_map when loading.  Do not
+         * save it, as it would leak the QEMU address space layout.  */
+        data->in_sg[i].iov_len = elem->in_sg[i].iov_len;
+    }
+
+    for (i = 0; i < elem->out_num; i++) {
+        /* Do not save iov_base as above.  */
+        data->out_sg[i].iov_len = elem->out_sg[i].iov_len;
+    }
+    qemu_put_buffer(f, (uint8_t *)data, sizeof(VirtQueueElementOld));
+    g_free(data);
 }
 
 /* virtio device */
@@ -601,10 +917,13 @@ void virtio_reset(void *opaque)
     virtio_notify_vector(vdev, vdev->config_vector);
 
     for(i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+        virtqueue_invalidate_rings(&vdev->vq[i]);
         vdev->vq[i].vring.desc = 0;
         vdev->vq[i].vring.avail = 0;
         vdev->vq[i].vring.used = 0;
         vdev->vq[i].last_avail_idx = 0;
+        vdev->vq[i].shadow_avail_idx = 0;
+        vdev->vq[i].used_idx = 0;
         vdev->vq[i].pa = 0;
         virtio_queue_set_vector(vdev, i, VIRTIO_NO_VECTOR);
         vdev->vq[i].signalled_used = 0;
@@ -832,6 +1151,7 @@ void virtio_del_queue(VirtIODevice *vdev, int n)
         abort();
     }
 
+    virtqueue_invalidate_rings(&vdev->vq[n]);
     vdev->vq[n].vring.num = 0;
 }
 
@@ -861,7 +1181,7 @@ static bool vring_notify(VirtIODevice *vdev, VirtQueue *vq)
     v = vq->signalled_used_valid;
     vq->signalled_used_valid = true;
     old = vq->signalled_used;
-    new = vq->signalled_used = vring_used_idx(vq);
+    new = vq->signalled_used = vq->used_idx;
     return !v || vring_need_event(vring_get_used_event(vq), new, old);
 }
 
@@ -876,6 +1196,20 @@ void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
     virtio_notify_vector(vdev, vq->vector);
 }
 
+/* Like virtio_notify(), but usable outside the QEMU global mutex once the
+ * transport has set up guest notifiers.
+ */
+void virtio_notify_irqfd(VirtIODevice *vdev, VirtQueue *vq)
+{
+    if (!vring_notify(vdev, vq)) {
+        return;
+    }
+
+    trace_virtio_notify_irqfd(vdev, vq);
+    atomic_or(&vdev->isr, 0x01);
+    event_notifier_set(&vq->guest_notifier);
+}
+
 void virtio_notify_config(VirtIODevice *vdev)
 {
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK))
@@ -1049,6 +1383,8 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
         }
         vdev->vq[i].pa = qemu_get_be64(f);
         qemu_get_be16s(f, &vdev->vq[i].last_avail_idx);
+        vdev->vq[i].shadow_avail_idx = vdev->vq[i].last_avail_idx;
+        vdev->vq[i].used_idx = 0;
         vdev->vq[i].signalled_used_valid = false;
         vdev->vq[i].notification = true;
 
@@ -1099,6 +1435,7 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
                              vdev->vq[i].last_avail_idx, nheads);
                 return -1;
             }
+            vdev->vq[i].used_idx = vring_used_idx(&vdev->vq[i]);
         }
     }
 
@@ -1107,6 +1444,12 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
 
 void virtio_cleanup(VirtIODevice *vdev)
 {
+    int i;
+
+    memory_listener_unregister(&vdev->listener);
+    for (i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+        virtqueue_invalidate_rings(&vdev->vq[i]);
+    }
     qemu_del_vm_change_state_handler(vdev->vmstate);
     g_free(vdev->config);
     g_free(vdev->vq);
@@ -1134,6 +1477,47 @@ static void virtio_vmstate_change(void *opaque, int running, RunState state)
     }
 }
 
+/* Drop the ring mappings of any queue whose rings overlap a section that
+ * is added to or removed from guest memory.  They are rebuilt on next use.
+ */
+static void virtio_memory_listener_update(MemoryListener *listener,
+                                          MemoryRegionSection *section)
+{
+    VirtIODevice *vdev = container_of(listener, VirtIODevice, listener);
+    hwaddr start = section->offset_within_address_space;
+    hwaddr end = start + int128_get64(section->size);
+    int i;
+
+    for (i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+        VirtQueue *vq = &vdev->vq[i];
+        unsigned int num = vq->vring.num;
+        hwaddr ring_start, ring_end;
+
+        if (!vq->rings_cached) {
+            continue;
+        }
+        /* virtqueue_init() lays the rings out contiguously from pa */
+        ring_start = vq->vring.desc;
+        ring_end = vq->vring.used + offsetof(VRingUsed, ring[num]) +
+                   sizeof(uint16_t);
+        if (ring_start < end && start < ring_end) {
+            /* Queues serviced by an IOThread may be using the mapping */
+            if (vq->ctx) {
+                aio_context_acquire(vq->ctx);
+            }
+            virtqueue_invalidate_rings(vq);
+            if (vq->ctx) {
+                aio_context_release(vq->ctx);
+            }
+        }
+    }
+}
+
+static const MemoryListener virtio_memory_listener = {
+    .region_add = virtio_memory_listener_update,
+    .region_del = virtio_memory_listener_update,
+};
+
 void virtio_instance_init_common(Object *proxy_obj, void *data,
                                  size_t vdev_size, const char *vdev_name)
 {
@@ -1180,6 +1564,8 @@ void virtio_init(VirtIODevice *vdev, const char *name,
     }
     vdev->vmstate = qemu_add_vm_change_state_handler(virtio_vmstate_change,
                                                      vdev);
+    vdev->listener = virtio_memory_listener;
+    memory_listener_register(&vdev->listener, &address_space_memory);
     vdev->device_endian = virtio_default_endian();
 }
 
@@ -1231,9 +1617,33 @@ uint16_t virtio_queue_get_last_avail_idx(VirtIODevice *vdev, int n)
     return vdev->vq[n].last_avail_idx;
 }
 
+/* Called when the ring is handed back by vhost or dataplane, which
+ * have been publishing used entries behind our back.
+ */
 void virtio_queue_set_last_avail_idx(VirtIODevice *vdev, int n, uint16_t idx)
 {
-    vdev->vq[n].last_avail_idx = idx;
+    VirtQueue *vq = &vdev->vq[n];
+
+    vq->last_avail_idx = idx;
+    vq->shadow_avail_idx = idx;
+    if (vq->vring.desc) {
+        vq->used_idx = vring_used_idx(vq);
+    }
+}
+
+/* Called when the backend went away without handing the ring back:
+ * resume after the last buffer it completed.  Requests it had popped
+ * but not finished are seen again by whoever takes over.
+ */
+void virtio_queue_restore_last_avail_idx(VirtIODevice *vdev, int n)
+{
+    VirtQueue *vq = &vdev->vq[n];
+
+    if (vq->vring.desc) {
+        vq->used_idx = vring_used_idx(vq);
+        vq->last_avail_idx = vq->used_idx;
+        vq->shadow_avail_idx = vq->used_idx;
+    }
 }
 
 void virtio_queue_invalidate_signalled_used(VirtIODevice *vdev, int n)
@@ -1304,6 +1714,26 @@ void virtio_queue_set_host_notifier_fd_handler(VirtQueue *vq, bool assign,
     }
 }
 
+/* Service the host notifier from @ctx instead of the main loop.  The
+ * transport's ioeventfd must already be assigned without a handler.
+ */
+void virtio_queue_aio_set_host_notifier_handler(VirtQueue *vq,
+                                                AioContext *ctx,
+                                                bool assign)
+{
+    if (assign) {
+        vq->ctx = ctx;
+        aio_set_event_notifier(ctx, &vq->host_notifier,
+                               virtio_queue_host_notifier_read);
+    } else {
+        aio_set_event_notifier(ctx, &vq->host_notifier, NULL);
+        vq->ctx = NULL;
+        /* Test and clear notifier after disabling the handler, in case
+         * the poll callback didn't have time to run. */
+        virtio_queue_host_notifier_read(&vq->host_notifier);
+    }
+}
+
 EventNotifier *virtio_queue_get_host_notifier(VirtQueue *vq)
 {
     return &vq->host_notifier;
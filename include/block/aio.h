@@ -87,6 +87,17 @@ struct AioContext {
 
     /* TimerLists for calling timers - one per clock type */
     QEMUTimerListGroup tlg;
+
+#ifdef CONFIG_EPOLL_CREATE1
+    /* epoll(7) state used when there are many fd handlers.  epollfd is
+     * created by aio_context_setup(); epoll_enabled is set once all
+     * handlers have been registered with it, and epoll_available is
+     * cleared for good if a handler cannot be added (e.g. regular files).
+     */
+    int epollfd;
+    bool epoll_enabled;
+    bool epoll_available;
+#endif
 };
 
 /* Used internally to synchronize aio_poll against qemu_bh_schedule.  */
@@ -101,6 +112,22 @@ void aio_set_dispatching(AioContext *ctx, bool dispatching);
  */
 AioContext *aio_context_new(Error **errp);
 
+/**
+ * aio_context_setup:
+ * @ctx: The AioContext to operate on.
+ *
+ * Initialize the platform-specific part of an AioContext.
+ */
+void aio_context_setup(AioContext *ctx);
+
+/**
+ * aio_context_cleanup:
+ * @ctx: The AioContext to operate on.
+ *
+ * Free the resources allocated by aio_context_setup().
+ */
+void aio_context_cleanup(AioContext *ctx);
+
 /**
  * aio_context_ref:
  * @ctx: The AioContext to operate on.
@@ -78,6 +78,19 @@ typedef struct BdrvTrackedRequest {
     struct BdrvTrackedRequest *waiting_for;
 } BdrvTrackedRequest;
 
+/* Passed to after-write notifiers.  The range is aligned to the request
+ * alignment of the BlockDriverState, and @qiov holds the data that was
+ * written unless @flags includes BDRV_REQ_ZERO_WRITE.
+ */
+typedef struct BdrvCompletedWrite {
+    BdrvTrackedRequest *req;
+    int64_t sector_num;
+    int nb_sectors;
+    QEMUIOVector *qiov;
+    BdrvRequestFlags flags;
+    int ret;
+} BdrvCompletedWrite;
+
 struct BlockDriver {
     const char *format_name;
     int instance_size;
@@ -166,6 +179,12 @@ struct BlockDriver {
      */
     void (*bdrv_invalidate_cache)(BlockDriverState *bs, Error **errp);
 
+    /*
+     * Write back all cached meta-data before another process takes over the
+     * image, e.g. at the end of an outgoing migration.
+     */
+    int (*bdrv_inactivate)(BlockDriverState *bs);
+
     /*
      * Flushes all data that was already written to the OS all the way down to
      * the disk (for example raw-posix calls fsync()).
@@ -281,6 +300,17 @@ struct BlockDriver {
      * On failure, return negative errno.
      */
     int (*bdrv_probe_blocksizes)(BlockDriverState *bs, BlockSizes *bsz);
+
+    /*
+     * Returns true if a dirty bitmap with the given name and granularity
+     * (in bytes) can be saved in the image when it is closed.  Drivers that
+     * support persistent bitmaps store every bitmap marked as persistent in
+     * their .bdrv_close.
+     */
+    bool (*bdrv_can_store_dirty_bitmap)(BlockDriverState *bs,
+                                        const char *name,
+                                        uint32_t granularity,
+                                        Error **errp);
     /**
      * Try to get @bs's geometry (cyls, heads, sectors)
      * On success, store them in @geo and return 0.
@@ -372,13 +402,24 @@ struct BlockDriverState {
     /* Callback before write request is processed */
     NotifierWithReturnList before_write_notifiers;
 
+    /* Callback after write request is processed */
+    NotifierList after_write_notifiers;
+
     /* number of in-flight serialising requests */
     unsigned int serialising_in_flight;
 
-    /* I/O throttling */
-    ThrottleState throttle_state;
+    /* I/O throttling.
+     * throttle_state tells us if this BDS has I/O limits configured.
+     * io_limits_enabled tells us if they are currently being
+     * enforced, but it can be temporarily set to false */
     CoQueue      throttled_reqs[2];
     bool         io_limits_enabled;
+    /* The following fields are protected by the ThrottleGroup lock.
+     * See the ThrottleGroup documentation for details. */
+    ThrottleState *throttle_state;
+    ThrottleTimers throttle_timers;
+    unsigned       pending_reqs[2];
+    QLIST_ENTRY(BlockDriverState) round_robin;
 
     /* I/O stats (display with "info blockstats"). */
     BlockAcctStats stats;
@@ -465,6 +506,16 @@ void bdrv_set_io_limits(BlockDriverState *bs,
 void bdrv_add_before_write_notifier(BlockDriverState *bs,
                                     NotifierWithReturn *notifier);
 
+/**
+ * bdrv_add_after_write_notifier:
+ *
+ * Register a callback that is invoked in coroutine context after write
+ * requests have been processed, whether they succeeded or not.  The callback
+ * receives a #BdrvCompletedWrite and may yield; the request does not complete
+ * until it returns.
+ */
+void bdrv_add_after_write_notifier(BlockDriverState *bs, Notifier *notifier);
+
 /**
  * bdrv_detach_aio_context:
  *
@@ -526,6 +577,9 @@ int is_windows_drive(const char *filename);
  * @base_id: The file name that will be written to @bs as the new
  * backing file if the job completes.  Ignored if @base is %NULL.
  * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
+ * @chunk_size: Bytes copied per request, a multiple of the sector size, or 0
+ * for the default.
+ * @max_in_flight: Number of requests copied in parallel, or 0 for the default.
  * @on_error: The action to take upon error.
  * @cb: Completion function for the job.
  * @opaque: Opaque pointer value passed to @cb.
@@ -538,8 +592,9 @@ int is_windows_drive(const char *filename);
  * @base_id in the written image and to @base in the live BlockDriverState.
  */
 void stream_start(BlockDriverState *bs, BlockDriverState *base,
-                  const char *base_id, int64_t speed, BlockdevOnError on_error,
-                  BlockCompletionFunc *cb,
+                  const char *base_id, int64_t speed,
+                  int64_t chunk_size, int max_in_flight,
+                  BlockdevOnError on_error, BlockCompletionFunc *cb,
                   void *opaque, Error **errp);
 
 /**
@@ -548,6 +603,9 @@ void stream_start(BlockDriverState *bs, BlockDriverState *base,
  * @top: Top block device to be committed.
  * @base: Block device that will be written into, and become the new top.
  * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
+ * @chunk_size: Bytes copied per request, a multiple of the sector size, or 0
+ * for the default.
+ * @max_in_flight: Number of requests copied in parallel, or 0 for the default.
  * @on_error: The action to take upon error.
  * @cb: Completion function for the job.
  * @opaque: Opaque pointer value passed to @cb.
@@ -557,6 +615,7 @@ void stream_start(BlockDriverState *bs, BlockDriverState *base,
  */
 void commit_start(BlockDriverState *bs, BlockDriverState *base,
                  BlockDriverState *top, int64_t speed,
+                 int64_t chunk_size, int max_in_flight,
                  BlockdevOnError on_error, BlockCompletionFunc *cb,
                  void *opaque, const char *backing_file_str, Error **errp);
 /**
@@ -585,6 +644,7 @@ void commit_active_start(BlockDriverState *bs, BlockDriverState *base,
  * @granularity: The chosen granularity for the dirty bitmap.
  * @buf_size: The amount of data that can be in flight at one time.
  * @mode: Whether to collapse all images in the chain to the target.
+ * @copy_mode: Whether guest writes are also copied synchronously.
  * @on_source_error: The action to take upon error reading from the source.
  * @on_target_error: The action to take upon error writing to the target.
  * @cb: Completion function for the job.
@@ -599,7 +659,8 @@ void commit_active_start(BlockDriverState *bs, BlockDriverState *base,
 void mirror_start(BlockDriverState *bs, BlockDriverState *target,
                   const char *replaces,
                   int64_t speed, uint32_t granularity, int64_t buf_size,
-                  MirrorSyncMode mode, BlockdevOnError on_source_error,
+                  MirrorSyncMode mode, MirrorCopyMode copy_mode,
+                  BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   BlockCompletionFunc *cb,
                   void *opaque, Error **errp);
@@ -611,6 +672,7 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
  * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
  * @sync_mode: What parts of the disk image should be copied to the destination.
  * @sync_bitmap: The dirty bitmap if sync_mode is MIRROR_SYNC_MODE_DIRTY_BITMAP.
+ * @target_is_new: Whether @target was freshly created for this backup.
  * @on_source_error: The action to take upon error reading from the source.
  * @on_target_error: The action to take upon error writing to the target.
  * @cb: Completion function for the job.
@@ -621,7 +683,7 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
  */
 void backup_start(BlockDriverState *bs, BlockDriverState *target,
                   int64_t speed, MirrorSyncMode sync_mode,
-                  BdrvDirtyBitmap *sync_bitmap,
+                  BdrvDirtyBitmap *sync_bitmap, bool target_is_new,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   BlockCompletionFunc *cb, void *opaque,
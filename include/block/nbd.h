@@ -36,14 +36,41 @@ struct nbd_reply {
     uint32_t magic;
     uint32_t error;
     uint64_t handle;
+    /* Only valid for structured reply chunks */
+    uint16_t flags;
+    uint16_t type;
+    uint32_t length;
 } QEMU_PACKED;
 
+/* A reply header that is received piecewise from a non-blocking socket;
+ * see nbd_receive_reply().  Large enough for a structured reply chunk.
+ */
+typedef struct NBDReplyHeader {
+    uint8_t buf[4 + 2 + 2 + 8 + 4];
+    size_t received;
+} NBDReplyHeader;
+
+/* Protocol extensions to negotiate on the client side.  If the server
+ * hangs up after refusing them, nbd_receive_negotiate() fails with
+ * -ENOTSUP and the client should reconnect without asking for them.
+ */
+typedef struct NBDExtensions {
+    bool structured_reply;
+    bool base_allocation;
+    uint32_t context_id;
+} NBDExtensions;
+
+#define NBD_REPLY_MAGIC             0x67446698
+#define NBD_STRUCTURED_REPLY_MAGIC  0x668e33ef
+
 #define NBD_FLAG_HAS_FLAGS      (1 << 0)        /* Flags are there */
 #define NBD_FLAG_READ_ONLY      (1 << 1)        /* Device is read-only */
 #define NBD_FLAG_SEND_FLUSH     (1 << 2)        /* Send FLUSH */
 #define NBD_FLAG_SEND_FUA       (1 << 3)        /* Send FUA (Force Unit Access) */
 #define NBD_FLAG_ROTATIONAL     (1 << 4)        /* Use elevator algorithm - rotational media */
 #define NBD_FLAG_SEND_TRIM      (1 << 5)        /* Send TRIM (discard) */
+#define NBD_FLAG_CAN_MULTI_CONN (1 << 8)        /* Flush is consistent across
+                                                   multiple connections */
 
 /* New-style global flags. */
 #define NBD_FLAG_FIXED_NEWSTYLE     (1 << 0)    /* Fixed newstyle protocol. */
@@ -54,31 +81,58 @@ struct nbd_reply {
 /* Reply types. */
 #define NBD_REP_ACK             (1)             /* Data sending finished. */
 #define NBD_REP_SERVER          (2)             /* Export description. */
+#define NBD_REP_META_CONTEXT    (4)             /* Selected metadata context. */
 #define NBD_REP_ERR_UNSUP       ((UINT32_C(1) << 31) | 1) /* Unknown option. */
 #define NBD_REP_ERR_INVALID     ((UINT32_C(1) << 31) | 3) /* Invalid length. */
 
 #define NBD_CMD_MASK_COMMAND	0x0000ffff
 #define NBD_CMD_FLAG_FUA	(1 << 16)
+#define NBD_CMD_FLAG_REQ_ONE	(1 << 19)       /* Only one block status extent */
 
 enum {
     NBD_CMD_READ = 0,
     NBD_CMD_WRITE = 1,
     NBD_CMD_DISC = 2,
     NBD_CMD_FLUSH = 3,
-    NBD_CMD_TRIM = 4
+    NBD_CMD_TRIM = 4,
+    NBD_CMD_BLOCK_STATUS = 7,
 };
 
+/* Structured reply chunk flags and types. */
+#define NBD_REPLY_FLAG_DONE         (1 << 0)    /* Last chunk of the reply */
+
+#define NBD_REPLY_TYPE_NONE         0
+#define NBD_REPLY_TYPE_OFFSET_DATA  1
+#define NBD_REPLY_TYPE_OFFSET_HOLE  2
+#define NBD_REPLY_TYPE_BLOCK_STATUS 5
+#define NBD_REPLY_TYPE_ERROR        ((1 << 15) + 1)
+#define NBD_REPLY_TYPE_ERROR_OFFSET ((1 << 15) + 2)
+#define NBD_REPLY_TYPE_IS_ERROR(t)  (((t) >> 15) & 1)
+
+/* Extent flags for the "base:allocation" metadata context. */
+#define NBD_META_BASE_ALLOCATION    "base:allocation"
+#define NBD_STATE_HOLE              (1 << 0)    /* Extent is not allocated */
+#define NBD_STATE_ZERO              (1 << 1)    /* Extent reads as zeroes */
+
 #define NBD_DEFAULT_PORT	10809
 
+/* Maximum number of requests in flight on a single connection.  NBD has
+ * no way to negotiate this; a server that allows fewer simply stops
+ * reading from the socket, which throttles the client.
+ */
+#define MAX_NBD_REQUESTS 64
+
 /* Maximum size of a single READ/WRITE data buffer */
 #define NBD_MAX_BUFFER_SIZE (32 * 1024 * 1024)
 
 ssize_t nbd_wr_sync(int fd, void *buffer, size_t size, bool do_read);
 int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
-                          off_t *size, Error **errp);
+                          off_t *size, NBDExtensions *ext, Error **errp);
 int nbd_init(int fd, int csock, uint32_t flags, off_t size);
 ssize_t nbd_send_request(int csock, struct nbd_request *request);
-ssize_t nbd_receive_reply(int csock, struct nbd_reply *reply);
+ssize_t nbd_receive_reply(int csock, struct nbd_reply *reply,
+                          NBDReplyHeader *hdr);
+int nbd_errno_to_system_errno(int err);
 int nbd_client(int fd);
 int nbd_disconnect(int fd);
 
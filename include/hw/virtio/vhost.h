@@ -41,6 +41,8 @@ struct vhost_dev {
     unsigned long long features;
     unsigned long long acked_features;
     unsigned long long backend_features;
+    /* queue pairs the backend can serve */
+    uint64_t max_queues;
     bool started;
     bool log_enabled;
     vhost_log_chunk_t *log;
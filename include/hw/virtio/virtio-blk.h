@@ -39,6 +39,12 @@ struct VirtIOBlkConf
     uint32_t config_wce;
     uint32_t data_plane;
     uint32_t request_merging;
+    uint16_t num_queues;
+    /* Optional per-virtqueue IOThread ids; queues without an entry are
+     * serviced by @iothread.
+     */
+    uint32_t num_iothread_vq;
+    char **iothread_vq;
 };
 
 struct VirtIOBlockDataPlane;
@@ -47,9 +53,11 @@ struct VirtIOBlockReq;
 typedef struct VirtIOBlock {
     VirtIODevice parent_obj;
     BlockBackend *blk;
-    VirtQueue *vq;
     void *rq;
     QEMUBH *bh;
+    /* Completions filled into the used rings but not yet flushed */
+    QEMUBH *complete_bh;
+    unsigned int *complete_pending;
     VirtIOBlkConf conf;
     unsigned short sector_mask;
     bool original_wce;
@@ -61,9 +69,10 @@ typedef struct VirtIOBlock {
 } VirtIOBlock;
 
 typedef struct VirtIOBlockReq {
+    VirtQueueElement elem;
     int64_t sector_num;
     VirtIOBlock *dev;
-    VirtQueueElement elem;
+    VirtQueue *vq;
     struct virtio_blk_inhdr *in;
     struct virtio_blk_outhdr out;
     QEMUIOVector qiov;
@@ -74,6 +83,7 @@ typedef struct VirtIOBlockReq {
 } VirtIOBlockReq;
 
 #define VIRTIO_BLK_MAX_MERGE_REQS 32
+#define VIRTIO_BLK_POP_BATCH 32
 
 typedef struct MultiReqBuffer {
     VirtIOBlockReq *reqs[VIRTIO_BLK_MAX_MERGE_REQS];
@@ -81,7 +91,8 @@ typedef struct MultiReqBuffer {
     bool is_write;
 } MultiReqBuffer;
 
-VirtIOBlockReq *virtio_blk_alloc_request(VirtIOBlock *s);
+void virtio_blk_init_request(VirtIOBlock *s, VirtQueue *vq,
+                             VirtIOBlockReq *req);
 
 void virtio_blk_free_request(VirtIOBlockReq *req);
 
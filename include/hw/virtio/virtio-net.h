@@ -16,6 +16,7 @@
 
 #include "standard-headers/linux/virtio_net.h"
 #include "hw/virtio/virtio.h"
+#include "sysemu/iothread.h"
 
 #define TYPE_VIRTIO_NET "virtio-net-device"
 #define VIRTIO_NET(obj) \
@@ -38,11 +39,34 @@ typedef struct virtio_net_conf
     uint32_t txtimer;
     int32_t txburst;
     char *tx;
+    IOThread *iothread;
+    /* Optional per-queue-pair IOThread ids; queue pairs without an entry
+     * are serviced by @iothread.
+     */
+    uint32_t num_iothread_queue;
+    char **iothread_queue;
+    bool rx_coalesce;
+    bool tx_offload;
 } virtio_net_conf;
 
 /* Maximum packet size we can receive from tap device: header + 64k */
 #define VIRTIO_NET_MAX_BUFSIZE (sizeof(struct virtio_net_hdr) + (64 << 10))
 
+/* Largest frame built by receive segment coalescing */
+#define VIRTIO_NET_RSC_BUFSIZE (64 << 10)
+
+/* TCP segments held back for coalescing when the peer has no vnet header */
+typedef struct VirtIONetRsc {
+    uint8_t *buf;               /* VIRTIO_NET_RSC_BUFSIZE bytes */
+    size_t len;                 /* 0 if no segment is held */
+    size_t hdr_len;             /* Ethernet, IP and TCP headers */
+    uint32_t next_seq;
+    uint16_t mss;
+    uint16_t segs;
+    bool ipv6;
+    QEMUBH *bh;
+} VirtIONetRsc;
+
 typedef struct VirtIONetQueue {
     VirtQueue *rx_vq;
     VirtQueue *tx_vq;
@@ -50,10 +74,14 @@ typedef struct VirtIONetQueue {
     QEMUBH *tx_bh;
     int tx_waiting;
     struct {
-        VirtQueueElement elem;
+        VirtQueueElement *elem;
         ssize_t len;
     } async_tx;
     struct VirtIONet *n;
+    IOThread *iothread;
+    /* AioContext servicing this queue pair, NULL for the main loop */
+    AioContext *ctx;
+    VirtIONetRsc rsc;
 } VirtIONetQueue;
 
 typedef struct VirtIONet {
@@ -98,6 +126,11 @@ typedef struct VirtIONet {
     uint64_t curr_guest_offloads;
     QEMUTimer *announce_timer;
     int announce_counter;
+    bool dataplane_started;
+    bool dataplane_fenced;
+    int dataplane_queues;
+    /* The IOThreads dirty guest memory without the global mutex */
+    Error *dataplane_migration_blocker;
 } VirtIONet;
 
 /*
@@ -136,7 +169,9 @@ typedef struct VirtIONet {
 #define DEFINE_VIRTIO_NET_PROPERTIES(_state, _field)                           \
     DEFINE_PROP_UINT32("x-txtimer", _state, _field.txtimer, TX_TIMER_INTERVAL),\
     DEFINE_PROP_INT32("x-txburst", _state, _field.txburst, TX_BURST),          \
-    DEFINE_PROP_STRING("tx", _state, _field.tx)
+    DEFINE_PROP_STRING("tx", _state, _field.tx),                               \
+    DEFINE_PROP_BOOL("rx-coalesce", _state, _field.rx_coalesce, false),        \
+    DEFINE_PROP_BOOL("tx-offload", _state, _field.tx_offload, false)
 
 void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
                                    const char *type);
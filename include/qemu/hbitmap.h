@@ -87,6 +87,67 @@ void hbitmap_truncate(HBitmap *hb, uint64_t size);
  */
 bool hbitmap_merge(HBitmap *a, const HBitmap *b);
 
+/**
+ * hbitmap_serialization_granularity:
+ * @hb: HBitmap to operate on.
+ *
+ * Return the number of elements that a serialized chunk must be aligned to.
+ * Only the final chunk of a bitmap may cover a smaller range.
+ */
+uint64_t hbitmap_serialization_granularity(const HBitmap *hb);
+
+/**
+ * hbitmap_serialization_size:
+ * @hb: HBitmap to operate on.
+ * @start: Starting element (0-based).
+ * @count: Number of elements.
+ *
+ * Return the number of bytes hbitmap_serialize_part needs to store the
+ * bits of @count elements starting at @start.
+ */
+uint64_t hbitmap_serialization_size(const HBitmap *hb,
+                                    uint64_t start, uint64_t count);
+
+/**
+ * hbitmap_serialize_part:
+ * @hb: HBitmap to operate on.
+ * @buf: Buffer to store the serialized data.
+ * @start: Starting element (0-based).
+ * @count: Number of elements.
+ *
+ * Store the bits of a range of elements in @buf as a little endian bitmap,
+ * one bit per granularity group.  @start must be aligned to
+ * hbitmap_serialization_granularity, and so must @count unless the range
+ * extends to the end of the bitmap.
+ */
+void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
+                            uint64_t start, uint64_t count);
+
+/**
+ * hbitmap_deserialize_part:
+ * @hb: HBitmap to operate on.
+ * @buf: Buffer holding data produced by hbitmap_serialize_part.
+ * @start: Starting element (0-based).
+ * @count: Number of elements.
+ * @finish: Whether to call hbitmap_deserialize_finish afterwards.
+ *
+ * Overwrite the bits of a range of elements from @buf.  The same alignment
+ * rules as for hbitmap_serialize_part apply.  The bitmap is inconsistent
+ * until hbitmap_deserialize_finish is called.
+ */
+void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
+                              uint64_t start, uint64_t count,
+                              bool finish);
+
+/**
+ * hbitmap_deserialize_finish:
+ * @hb: HBitmap to operate on.
+ *
+ * Rebuild the internal structure of the bitmap after one or more calls to
+ * hbitmap_deserialize_part.
+ */
+void hbitmap_deserialize_finish(HBitmap *hb);
+
 /**
  * hbitmap_empty:
  * @hb: HBitmap to operate on.
@@ -761,6 +761,12 @@ static void *migration_thread(void *opaque)
                 old_vm_running = runstate_is_running();
 
                 ret = vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
+                if (ret >= 0) {
+                    /* The destination may start using the images as soon as
+                     * it has the device state, so they must be written back
+                     * before it is sent */
+                    ret = bdrv_inactivate_all();
+                }
                 if (ret >= 0) {
                     qemu_file_set_rate_limit(s->file, INT64_MAX);
                     qemu_savevm_state_complete(s->file);
@@ -826,7 +832,13 @@ static void *migration_thread(void *opaque)
         }
         runstate_set(RUN_STATE_POSTMIGRATE);
     } else {
-        if (old_vm_running) {
+        Error *local_err = NULL;
+
+        /* Take back the images that may have been inactivated */
+        bdrv_invalidate_cache_all(&local_err);
+        if (local_err) {
+            error_report_err(local_err);
+        } else if (old_vm_running) {
             vm_start();
         }
     }
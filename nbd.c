@@ -64,8 +64,8 @@
 
 #define NBD_REQUEST_SIZE        (4 + 4 + 8 + 8 + 4)
 #define NBD_REPLY_SIZE          (4 + 4 + 8)
+#define NBD_CHUNK_SIZE          (4 + 2 + 2 + 8 + 4)
 #define NBD_REQUEST_MAGIC       0x25609513
-#define NBD_REPLY_MAGIC         0x67446698
 #define NBD_OPTS_MAGIC          0x49484156454F5054LL
 #define NBD_CLIENT_MAGIC        0x0000420281861253LL
 #define NBD_REP_MAGIC           0x3e889045565a9LL
@@ -85,6 +85,14 @@
 #define NBD_OPT_EXPORT_NAME     (1)
 #define NBD_OPT_ABORT           (2)
 #define NBD_OPT_LIST            (3)
+#define NBD_OPT_STRUCTURED_REPLY (8)
+#define NBD_OPT_SET_META_CONTEXT (10)
+
+/* Context id used by the server for "base:allocation" */
+#define NBD_META_ID_BASE_ALLOCATION 0
+
+/* Upper bound on extents in one NBD_CMD_BLOCK_STATUS reply */
+#define NBD_MAX_BLOCK_STATUS_EXTENTS 128
 
 /* NBD errors are based on errno numbers, so there is a 1:1 mapping,
  * but only a limited set of errno values is specified in the protocol.
@@ -120,7 +128,7 @@ static int system_errno_to_nbd_errno(int err)
     }
 }
 
-static int nbd_errno_to_system_errno(int err)
+int nbd_errno_to_system_errno(int err)
 {
     switch (err) {
     case NBD_SUCCESS:
@@ -180,6 +188,9 @@ struct NBDClient {
 
     bool can_read;
 
+    bool structured_reply;
+    bool base_allocation;
+
     QTAILQ_ENTRY(NBDClient) next;
     int nb_requests;
     bool closing;
@@ -303,10 +314,10 @@ static ssize_t write_sync(int fd, void *buffer, size_t size)
 
 */
 
-static int nbd_send_rep(int csock, uint32_t type, uint32_t opt)
+static int nbd_send_rep_len(int csock, uint32_t type, uint32_t opt,
+                            uint32_t len)
 {
     uint64_t magic;
-    uint32_t len;
 
     magic = cpu_to_be64(NBD_REP_MAGIC);
     if (write_sync(csock, &magic, sizeof(magic)) != sizeof(magic)) {
@@ -323,7 +334,7 @@ static int nbd_send_rep(int csock, uint32_t type, uint32_t opt)
         LOG("write failed (rep type)");
         return -EINVAL;
     }
-    len = cpu_to_be32(0);
+    len = cpu_to_be32(len);
     if (write_sync(csock, &len, sizeof(len)) != sizeof(len)) {
         LOG("write failed (rep data length)");
         return -EINVAL;
@@ -331,6 +342,11 @@ static int nbd_send_rep(int csock, uint32_t type, uint32_t opt)
     return 0;
 }
 
+static int nbd_send_rep(int csock, uint32_t type, uint32_t opt)
+{
+    return nbd_send_rep_len(csock, type, opt, 0);
+}
+
 static int nbd_send_rep_list(int csock, NBDExport *exp)
 {
     uint64_t magic, name_len;
@@ -424,6 +440,103 @@ fail:
     return rc;
 }
 
+static int nbd_handle_structured_reply(NBDClient *client, uint32_t length)
+{
+    int csock = client->sock;
+
+    if (length) {
+        if (drop_sync(csock, length) != length) {
+            return -EIO;
+        }
+        return nbd_send_rep(csock, NBD_REP_ERR_INVALID,
+                            NBD_OPT_STRUCTURED_REPLY);
+    }
+
+    client->structured_reply = true;
+    return nbd_send_rep(csock, NBD_REP_ACK, NBD_OPT_STRUCTURED_REPLY);
+}
+
+static int nbd_handle_set_meta_context(NBDClient *client, uint32_t length)
+{
+    int csock = client->sock;
+    const char *ctx_name = NBD_META_BASE_ALLOCATION;
+    uint32_t ctx_len = strlen(ctx_name);
+    uint32_t name_len, nb_queries, query_len, id;
+    uint8_t *buf, *p, *end;
+    int ret = 0;
+
+    /* Client sends:
+        [ 0 ..   3]   export name length
+        [ 4 ..  xx]   export name
+        [xx ..  xx]   number of queries, then each query as length + string
+     */
+    if (length > 4096) {
+        if (drop_sync(csock, length) != length) {
+            return -EIO;
+        }
+        return nbd_send_rep(csock, NBD_REP_ERR_INVALID,
+                            NBD_OPT_SET_META_CONTEXT);
+    }
+
+    buf = g_malloc(length);
+    if (read_sync(csock, buf, length) != length) {
+        LOG("read failed");
+        g_free(buf);
+        return -EIO;
+    }
+
+    p = buf;
+    end = buf + length;
+    if (!client->structured_reply || end - p < 4) {
+        goto invalid;
+    }
+    name_len = be32_to_cpup((uint32_t *)p);
+    p += 4;
+    if (end - p < name_len + 4) {
+        goto invalid;
+    }
+    p += name_len;
+    nb_queries = be32_to_cpup((uint32_t *)p);
+    p += 4;
+
+    client->base_allocation = false;
+    while (nb_queries--) {
+        if (end - p < 4) {
+            goto invalid;
+        }
+        query_len = be32_to_cpup((uint32_t *)p);
+        p += 4;
+        if (end - p < query_len) {
+            goto invalid;
+        }
+        if (query_len == ctx_len && !memcmp(p, ctx_name, ctx_len)) {
+            client->base_allocation = true;
+        }
+        p += query_len;
+    }
+
+    if (client->base_allocation) {
+        id = cpu_to_be32(NBD_META_ID_BASE_ALLOCATION);
+        if (nbd_send_rep_len(csock, NBD_REP_META_CONTEXT,
+                             NBD_OPT_SET_META_CONTEXT,
+                             sizeof(id) + ctx_len) < 0 ||
+            write_sync(csock, &id, sizeof(id)) != sizeof(id) ||
+            write_sync(csock, (char *)ctx_name, ctx_len) != ctx_len) {
+            LOG("write failed (meta context)");
+            ret = -EINVAL;
+            goto out;
+        }
+    }
+    ret = nbd_send_rep(csock, NBD_REP_ACK, NBD_OPT_SET_META_CONTEXT);
+    goto out;
+
+invalid:
+    ret = nbd_send_rep(csock, NBD_REP_ERR_INVALID, NBD_OPT_SET_META_CONTEXT);
+out:
+    g_free(buf);
+    return ret;
+}
+
 static int nbd_receive_options(NBDClient *client)
 {
     int csock = client->sock;
@@ -495,11 +608,39 @@ static int nbd_receive_options(NBDClient *client)
         case NBD_OPT_EXPORT_NAME:
             return nbd_handle_export_name(client, length);
 
+        case NBD_OPT_STRUCTURED_REPLY:
+            ret = nbd_handle_structured_reply(client, length);
+            if (ret < 0) {
+                return ret;
+            }
+            break;
+
+        case NBD_OPT_SET_META_CONTEXT:
+            ret = nbd_handle_set_meta_context(client, length);
+            if (ret < 0) {
+                return ret;
+            }
+            break;
+
         default:
             tmp = be32_to_cpu(tmp);
             LOG("Unsupported option 0x%x", tmp);
-            nbd_send_rep(client->sock, NBD_REP_ERR_UNSUP, tmp);
-            return -EINVAL;
+            if (!(flags & NBD_FLAG_C_FIXED_NEWSTYLE)) {
+                nbd_send_rep(client->sock, NBD_REP_ERR_UNSUP, tmp);
+                return -EINVAL;
+            }
+
+            /* Fixed newstyle clients may probe for options we do not
+             * know about; skip the data and let them go on.
+             */
+            if (drop_sync(csock, length) != length) {
+                return -EIO;
+            }
+            ret = nbd_send_rep(csock, NBD_REP_ERR_UNSUP, tmp);
+            if (ret < 0) {
+                return ret;
+            }
+            break;
         }
     }
 }
@@ -579,12 +720,130 @@ fail:
     return rc;
 }
 
+static int nbd_send_option(int csock, uint32_t opt, uint32_t len,
+                           const void *data)
+{
+    uint64_t magic = cpu_to_be64(NBD_OPTS_MAGIC);
+    uint32_t be_opt = cpu_to_be32(opt);
+    uint32_t be_len = cpu_to_be32(len);
+
+    if (write_sync(csock, &magic, sizeof(magic)) != sizeof(magic) ||
+        write_sync(csock, &be_opt, sizeof(be_opt)) != sizeof(be_opt) ||
+        write_sync(csock, &be_len, sizeof(be_len)) != sizeof(be_len) ||
+        (len && write_sync(csock, (void *)data, len) != len)) {
+        return -EIO;
+    }
+    return 0;
+}
+
+static int nbd_receive_option_reply(int csock, uint32_t opt, uint32_t *type,
+                                    uint32_t *len)
+{
+    uint64_t magic;
+    uint32_t rep_opt;
+
+    if (read_sync(csock, &magic, sizeof(magic)) != sizeof(magic) ||
+        read_sync(csock, &rep_opt, sizeof(rep_opt)) != sizeof(rep_opt) ||
+        read_sync(csock, type, sizeof(*type)) != sizeof(*type) ||
+        read_sync(csock, len, sizeof(*len)) != sizeof(*len)) {
+        return -EIO;
+    }
+    if (be64_to_cpu(magic) != NBD_REP_MAGIC || be32_to_cpu(rep_opt) != opt) {
+        return -EINVAL;
+    }
+    *type = be32_to_cpu(*type);
+    *len = be32_to_cpu(*len);
+    return 0;
+}
+
+/* Ask a fixed newstyle server for structured replies and, if those are
+ * available, for the "base:allocation" metadata context.  Options the
+ * server does not know about are simply not used.
+ */
+static int nbd_negotiate_extensions(int csock, const char *name,
+                                    NBDExtensions *ext, Error **errp)
+{
+    const char *query = NBD_META_BASE_ALLOCATION;
+    uint32_t name_len = strlen(name), query_len = strlen(query);
+    uint32_t type, len, id;
+    uint8_t *buf, *p;
+    char ctx[64];
+    int ret;
+
+    memset(ext, 0, sizeof(*ext));
+
+    if (nbd_send_option(csock, NBD_OPT_STRUCTURED_REPLY, 0, NULL) < 0 ||
+        nbd_receive_option_reply(csock, NBD_OPT_STRUCTURED_REPLY,
+                                 &type, &len) < 0) {
+        error_setg(errp, "Failed to negotiate structured replies");
+        return -EINVAL;
+    }
+    if (len && drop_sync(csock, len) != len) {
+        error_setg(errp, "Failed to read option reply");
+        return -EINVAL;
+    }
+    if (type != NBD_REP_ACK) {
+        return 0;
+    }
+    ext->structured_reply = true;
+
+    len = 4 + name_len + 4 + 4 + query_len;
+    buf = p = g_malloc(len);
+    cpu_to_be32w((uint32_t *)p, name_len);
+    memcpy(p + 4, name, name_len);
+    p += 4 + name_len;
+    cpu_to_be32w((uint32_t *)p, 1);
+    cpu_to_be32w((uint32_t *)(p + 4), query_len);
+    memcpy(p + 8, query, query_len);
+    ret = nbd_send_option(csock, NBD_OPT_SET_META_CONTEXT, len, buf);
+    g_free(buf);
+    if (ret < 0) {
+        error_setg(errp, "Failed to send metadata context query");
+        return -EINVAL;
+    }
+
+    for (;;) {
+        if (nbd_receive_option_reply(csock, NBD_OPT_SET_META_CONTEXT,
+                                     &type, &len) < 0) {
+            error_setg(errp, "Failed to read metadata context reply");
+            return -EINVAL;
+        }
+        if (type == NBD_REP_META_CONTEXT && len >= sizeof(id) &&
+            len - sizeof(id) < sizeof(ctx)) {
+            if (read_sync(csock, &id, sizeof(id)) != sizeof(id) ||
+                read_sync(csock, ctx, len - sizeof(id)) != len - sizeof(id)) {
+                error_setg(errp, "Failed to read metadata context");
+                return -EINVAL;
+            }
+            ctx[len - sizeof(id)] = '\0';
+            if (!strcmp(ctx, query)) {
+                ext->base_allocation = true;
+                ext->context_id = be32_to_cpu(id);
+            }
+            continue;
+        }
+        if (len && drop_sync(csock, len) != len) {
+            error_setg(errp, "Failed to read option reply");
+            return -EINVAL;
+        }
+        if (type == NBD_REP_META_CONTEXT) {
+            continue;
+        }
+        if (type != NBD_REP_ACK) {
+            /* An error reply: no context was selected */
+            ext->base_allocation = false;
+        }
+        return 0;
+    }
+}
+
 int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
-                          off_t *size, Error **errp)
+                          off_t *size, NBDExtensions *ext, Error **errp)
 {
     char buf[256];
     uint64_t magic, s;
     uint16_t tmp;
+    bool ext_refused = false;
     int rc;
 
     TRACE("Receiving negotiation.");
@@ -643,12 +902,23 @@ int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
             goto fail;
         }
         *flags = be16_to_cpu(tmp) << 16;
-        /* reserved for future use */
+        /* client flags; extensions need the fixed newstyle protocol */
+        if (ext && (*flags & (NBD_FLAG_FIXED_NEWSTYLE << 16))) {
+            reserved = cpu_to_be32(NBD_FLAG_C_FIXED_NEWSTYLE);
+        }
         if (write_sync(csock, &reserved, sizeof(reserved)) !=
             sizeof(reserved)) {
             error_setg(errp, "Failed to read reserved field");
             goto fail;
         }
+        if (reserved) {
+            if (nbd_negotiate_extensions(csock, name, ext, errp) < 0) {
+                goto fail;
+            }
+            ext_refused = !ext->structured_reply;
+        } else if (ext) {
+            memset(ext, 0, sizeof(*ext));
+        }
         /* write the export name */
         magic = cpu_to_be64(magic);
         if (write_sync(csock, &magic, sizeof(magic)) != sizeof(magic)) {
@@ -673,6 +943,10 @@ int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
     } else {
         TRACE("Checking magic (cli_magic)");
 
+        if (ext) {
+            memset(ext, 0, sizeof(*ext));
+        }
+
         if (magic != NBD_CLIENT_MAGIC) {
             if (magic == NBD_OPTS_MAGIC) {
                 error_setg(errp, "Server requires an export name");
@@ -710,6 +984,12 @@ int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
     rc = 0;
 
 fail:
+    /* Older QEMU servers drop the connection after refusing an option
+     * they do not know.  Let the caller retry without extensions.
+     */
+    if (rc < 0 && ext_refused) {
+        rc = -ENOTSUP;
+    }
     return rc;
 }
 
@@ -883,33 +1163,95 @@ static ssize_t nbd_receive_request(int csock, struct nbd_request *request)
     return 0;
 }
 
-ssize_t nbd_receive_reply(int csock, struct nbd_reply *reply)
+/* Fill @hdr up to @size bytes without blocking.  If the socket runs dry
+ * first, return -EAGAIN and keep what was read so far in @hdr; the next
+ * call resumes from there.
+ */
+static ssize_t read_reply_header(int csock, NBDReplyHeader *hdr, size_t size)
 {
-    uint8_t buf[NBD_REPLY_SIZE];
+    while (hdr->received < size) {
+        ssize_t len;
+        int err;
+
+        len = qemu_recv(csock, hdr->buf + hdr->received,
+                        size - hdr->received, 0);
+        if (len == 0) {
+            LOG("read failed");
+            return -EINVAL;
+        }
+        if (len < 0) {
+            err = socket_error();
+            if (err == EINTR) {
+                continue;
+            }
+            return err == EWOULDBLOCK ? -EAGAIN : -err;
+        }
+        hdr->received += len;
+    }
+    return 0;
+}
+
+/* Parse the header of the next reply or structured reply chunk.  The
+ * socket is non-blocking and the header may trickle in; in that case
+ * -EAGAIN is returned and the call should be repeated with the same @hdr
+ * once the socket becomes readable again.
+ */
+ssize_t nbd_receive_reply(int csock, struct nbd_reply *reply,
+                          NBDReplyHeader *hdr)
+{
+    uint8_t *buf = hdr->buf;
     uint32_t magic;
     ssize_t ret;
 
-    ret = read_sync(csock, buf, sizeof(buf));
-    if (ret < 0) {
-        return ret;
-    }
+    QEMU_BUILD_BUG_ON(sizeof(hdr->buf) != NBD_CHUNK_SIZE);
 
-    if (ret != sizeof(buf)) {
-        LOG("read failed");
-        return -EINVAL;
+    ret = read_reply_header(csock, hdr, NBD_REPLY_SIZE);
+    if (ret < 0) {
+        goto out;
     }
 
-    /* Reply
+    /* Simple reply
        [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
        [ 4 ..  7]    error   (0 == no error)
        [ 7 .. 15]    handle
+
+       Structured reply chunk
+       [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+       [ 4 ..  5]    flags
+       [ 6 ..  7]    type
+       [ 8 .. 15]    handle
+       [16 .. 19]    length of the payload that follows
      */
 
     magic = be32_to_cpup((uint32_t*)buf);
-    reply->error  = be32_to_cpup((uint32_t*)(buf + 4));
+    if (magic == NBD_STRUCTURED_REPLY_MAGIC) {
+        ret = read_reply_header(csock, hdr, NBD_CHUNK_SIZE);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
+    reply->magic = magic;
     reply->handle = be64_to_cpup((uint64_t*)(buf + 8));
 
+    if (magic == NBD_STRUCTURED_REPLY_MAGIC) {
+        reply->error = 0;
+        reply->flags = be16_to_cpup((uint16_t *)(buf + 4));
+        reply->type = be16_to_cpup((uint16_t *)(buf + 6));
+        reply->length = be32_to_cpup((uint32_t *)(buf + 16));
+
+        TRACE("Got chunk: "
+              "{ .flags = 0x%x, .type = %d, handle = %" PRIu64
+              ", .length = %u }",
+              reply->flags, reply->type, reply->handle, reply->length);
+        goto out;
+    }
+
+    reply->error  = be32_to_cpup((uint32_t*)(buf + 4));
     reply->error = nbd_errno_to_system_errno(reply->error);
+    reply->flags = NBD_REPLY_FLAG_DONE;
+    reply->type = NBD_REPLY_TYPE_NONE;
+    reply->length = 0;
 
     TRACE("Got reply: "
           "{ magic = 0x%x, .error = %d, handle = %" PRIu64" }",
@@ -917,9 +1259,14 @@ ssize_t nbd_receive_reply(int csock, struct nbd_reply *reply)
 
     if (magic != NBD_REPLY_MAGIC) {
         LOG("invalid magic (got 0x%x)", magic);
-        return -EINVAL;
+        ret = -EINVAL;
     }
-    return 0;
+
+out:
+    if (ret != -EAGAIN) {
+        hdr->received = 0;
+    }
+    return ret;
 }
 
 static ssize_t nbd_send_reply(int csock, struct nbd_reply *reply)
@@ -952,8 +1299,6 @@ static ssize_t nbd_send_reply(int csock, struct nbd_reply *reply)
     return 0;
 }
 
-#define MAX_NBD_REQUESTS 16
-
 void nbd_client_get(NBDClient *client)
 {
     client->refcount++;
@@ -1208,6 +1553,183 @@ static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
     return rc;
 }
 
+static ssize_t nbd_co_send_chunk(NBDRequest *req, uint64_t handle,
+                                 uint16_t flags, uint16_t type,
+                                 void *payload, uint32_t payload_len,
+                                 void *data, uint32_t data_len)
+{
+    NBDClient *client = req->client;
+    int csock = client->sock;
+    uint8_t buf[NBD_CHUNK_SIZE];
+    ssize_t rc = 0;
+
+    cpu_to_be32w((uint32_t *)buf, NBD_STRUCTURED_REPLY_MAGIC);
+    cpu_to_be16w((uint16_t *)(buf + 4), flags);
+    cpu_to_be16w((uint16_t *)(buf + 6), type);
+    cpu_to_be64w((uint64_t *)(buf + 8), handle);
+    cpu_to_be32w((uint32_t *)(buf + 16), payload_len + data_len);
+
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+    nbd_set_handlers(client);
+
+    socket_set_cork(csock, 1);
+    if (write_sync(csock, buf, sizeof(buf)) != sizeof(buf) ||
+        (payload_len &&
+         write_sync(csock, payload, payload_len) != payload_len) ||
+        (data_len && qemu_co_send(csock, data, data_len) != data_len)) {
+        LOG("writing chunk to socket failed");
+        rc = -EIO;
+    }
+    socket_set_cork(csock, 0);
+
+    client->send_coroutine = NULL;
+    nbd_set_handlers(client);
+    qemu_co_mutex_unlock(&client->send_lock);
+    return rc;
+}
+
+static ssize_t nbd_co_send_error_chunk(NBDRequest *req, uint64_t handle,
+                                       int error)
+{
+    uint8_t payload[4 + 2];
+
+    /* error, then a zero-length message */
+    cpu_to_be32w((uint32_t *)payload, system_errno_to_nbd_errno(error));
+    cpu_to_be16w((uint16_t *)(payload + 4), 0);
+    return nbd_co_send_chunk(req, handle, NBD_REPLY_FLAG_DONE,
+                             NBD_REPLY_TYPE_ERROR, payload, sizeof(payload),
+                             NULL, 0);
+}
+
+/* Send a read reply as a series of data and hole chunks.  Zero ranges are
+ * not read from the image at all, and do not cross the network either.
+ */
+static ssize_t nbd_co_send_structured_read(NBDRequest *req,
+                                           struct nbd_request *request)
+{
+    NBDExport *exp = req->client->exp;
+    BlockDriverState *bs = blk_bs(exp->blk);
+    uint64_t offset = request->from;
+    uint64_t end = request->from + request->len;
+    uint16_t flags = 0;
+    ssize_t ret;
+
+    while (offset < end) {
+        int64_t sector_num = (offset + exp->dev_offset) / BDRV_SECTOR_SIZE;
+        int nb_sectors = (end - offset) / BDRV_SECTOR_SIZE;
+        uint8_t payload[8 + 4];
+        int64_t status;
+        uint32_t n;
+        int pnum;
+
+        if (nb_sectors == 0) {
+            break;
+        }
+
+        status = bdrv_get_block_status_above(bs, NULL, sector_num,
+                                             nb_sectors, &pnum);
+        if (status < 0 || pnum <= 0) {
+            /* Just read the data if the status is not known */
+            status = BDRV_BLOCK_DATA;
+            pnum = nb_sectors;
+        }
+        n = pnum * BDRV_SECTOR_SIZE;
+        flags = (offset + n == end) ? NBD_REPLY_FLAG_DONE : 0;
+
+        cpu_to_be64w((uint64_t *)payload, offset);
+        if (status & BDRV_BLOCK_ZERO) {
+            cpu_to_be32w((uint32_t *)(payload + 8), n);
+            ret = nbd_co_send_chunk(req, request->handle, flags,
+                                    NBD_REPLY_TYPE_OFFSET_HOLE,
+                                    payload, sizeof(payload), NULL, 0);
+        } else {
+            uint8_t *data = req->data + (offset - request->from);
+
+            ret = blk_read(exp->blk, sector_num, data, pnum);
+            if (ret < 0) {
+                LOG("reading from file failed");
+                return nbd_co_send_error_chunk(req, request->handle, -ret);
+            }
+            ret = nbd_co_send_chunk(req, request->handle, flags,
+                                    NBD_REPLY_TYPE_OFFSET_DATA,
+                                    payload, 8, data, n);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+        offset += n;
+    }
+
+    if (!(flags & NBD_REPLY_FLAG_DONE)) {
+        return nbd_co_send_chunk(req, request->handle, NBD_REPLY_FLAG_DONE,
+                                 NBD_REPLY_TYPE_NONE, NULL, 0, NULL, 0);
+    }
+    return 0;
+}
+
+/* Reply to NBD_CMD_BLOCK_STATUS for the "base:allocation" context */
+static ssize_t nbd_co_send_block_status(NBDRequest *req,
+                                        struct nbd_request *request)
+{
+    NBDExport *exp = req->client->exp;
+    BlockDriverState *bs = blk_bs(exp->blk);
+    uint32_t payload[1 + 2 * NBD_MAX_BLOCK_STATUS_EXTENTS];
+    int max_extents = (request->type & NBD_CMD_FLAG_REQ_ONE) ?
+                      1 : NBD_MAX_BLOCK_STATUS_EXTENTS;
+    uint64_t offset = request->from;
+    uint64_t end = request->from + request->len;
+    uint32_t length = 0, flags = 0;
+    int count = 0;
+
+    while (offset < end) {
+        int64_t sector_num = (offset + exp->dev_offset) / BDRV_SECTOR_SIZE;
+        int nb_sectors = DIV_ROUND_UP(end - offset, BDRV_SECTOR_SIZE);
+        int64_t status;
+        uint32_t n, f;
+        int pnum;
+
+        status = bdrv_get_block_status_above(bs, NULL, sector_num,
+                                             nb_sectors, &pnum);
+        if (status < 0) {
+            return nbd_co_send_error_chunk(req, request->handle, -status);
+        }
+        if (pnum <= 0) {
+            break;
+        }
+
+        n = MIN((uint64_t)pnum * BDRV_SECTOR_SIZE, end - offset);
+        f = (status & BDRV_BLOCK_DATA ? 0 : NBD_STATE_HOLE) |
+            (status & BDRV_BLOCK_ZERO ? NBD_STATE_ZERO : 0);
+        if (count && f == flags) {
+            length += n;
+        } else {
+            if (count == max_extents) {
+                break;
+            }
+            if (count) {
+                payload[2 * count - 1] = cpu_to_be32(length);
+                payload[2 * count] = cpu_to_be32(flags);
+            }
+            count++;
+            length = n;
+            flags = f;
+        }
+        offset += n;
+    }
+
+    if (!count) {
+        return nbd_co_send_error_chunk(req, request->handle, EINVAL);
+    }
+
+    payload[0] = cpu_to_be32(NBD_META_ID_BASE_ALLOCATION);
+    payload[2 * count - 1] = cpu_to_be32(length);
+    payload[2 * count] = cpu_to_be32(flags);
+    return nbd_co_send_chunk(req, request->handle, NBD_REPLY_FLAG_DONE,
+                             NBD_REPLY_TYPE_BLOCK_STATUS, payload,
+                             (1 + 2 * count) * sizeof(uint32_t), NULL, 0);
+}
+
 static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *request)
 {
     NBDClient *client = req->client;
@@ -1226,7 +1748,9 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
         goto out;
     }
 
-    if (request->len > NBD_MAX_BUFFER_SIZE) {
+    command = request->type & NBD_CMD_MASK_COMMAND;
+    if (request->len > NBD_MAX_BUFFER_SIZE &&
+        command != NBD_CMD_BLOCK_STATUS) {
         LOG("len (%u) is larger than max len (%u)",
             request->len, NBD_MAX_BUFFER_SIZE);
         rc = -EINVAL;
@@ -1242,7 +1766,6 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
 
     TRACE("Decoding type");
 
-    command = request->type & NBD_CMD_MASK_COMMAND;
     if (command == NBD_CMD_READ || command == NBD_CMD_WRITE) {
         req->data = blk_blockalign(client->exp->blk, request->len);
     }
@@ -1318,6 +1841,13 @@ static void nbd_trip(void *opaque)
             }
         }
 
+        if (client->structured_reply) {
+            if (nbd_co_send_structured_read(req, &request) < 0) {
+                goto out;
+            }
+            break;
+        }
+
         ret = blk_read(exp->blk,
                        (request.from + exp->dev_offset) / BDRV_SECTOR_SIZE,
                        req->data, request.len / BDRV_SECTOR_SIZE);
@@ -1393,6 +1923,16 @@ static void nbd_trip(void *opaque)
             goto out;
         }
         break;
+    case NBD_CMD_BLOCK_STATUS:
+        TRACE("Request type is BLOCK_STATUS");
+
+        if (!client->base_allocation || !request.len) {
+            goto invalid_request;
+        }
+        if (nbd_co_send_block_status(req, &request) < 0) {
+            goto out;
+        }
+        break;
     default:
         LOG("invalid request type (%u) received", request.type);
     invalid_request:
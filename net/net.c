@@ -459,6 +459,19 @@ void qemu_set_vnet_hdr_len(NetClientState *nc, int len)
     nc->info->set_vnet_hdr_len(nc, len);
 }
 
+/* Run the I/O handlers of @nc in @ctx, or in the main loop if @ctx is
+ * NULL.  Returns false if @nc can only be serviced by the main loop.
+ */
+bool qemu_net_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    if (!nc || !nc->info->set_aio_context) {
+        return false;
+    }
+
+    nc->info->set_aio_context(nc, ctx);
+    return true;
+}
+
 int qemu_can_send_packet(NetClientState *sender)
 {
     int vm_running = runstate_is_running();
@@ -643,6 +656,63 @@ ssize_t qemu_sendv_packet_async(NetClientState *sender,
                                    iov, iovcnt, sent_cb);
 }
 
+/* Deliver @count packets, each described by one element of @pkts.
+ * Returns how many were consumed (delivered or dropped); the rest must
+ * be queued by the caller.
+ */
+int qemu_deliver_packet_batch(NetClientState *sender,
+                              unsigned flags,
+                              const struct iovec *pkts,
+                              int count,
+                              void *opaque)
+{
+    NetClientState *nc = opaque;
+    int i;
+
+    if (nc->link_down) {
+        return count;
+    }
+
+    if (nc->receive_disabled) {
+        return 0;
+    }
+
+    if (nc->info->receive_batch && !(flags & QEMU_NET_PACKET_FLAG_RAW)) {
+        i = nc->info->receive_batch(nc, pkts, count);
+        if (i < count) {
+            nc->receive_disabled = 1;
+        }
+        return i;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (qemu_deliver_packet(sender, flags, pkts[i].iov_base,
+                                pkts[i].iov_len, opaque) == 0) {
+            break;
+        }
+    }
+    return i;
+}
+
+/* Send a burst of packets, one per element of @pkts, so that the peer
+ * can process them together.  Returns @count, or 0 if some packets had
+ * to be queued; in that case the caller must not send more packets, nor
+ * touch the buffers behind @pkts, until @sent_cb is invoked.  Queued
+ * packets are not copied.
+ */
+int qemu_send_packet_batch_async(NetClientState *sender,
+                                 const struct iovec *pkts, int count,
+                                 NetPacketSent *sent_cb)
+{
+    if (sender->link_down || !sender->peer) {
+        return count;
+    }
+
+    return qemu_net_queue_send_batch(sender->peer->incoming_queue, sender,
+                                     QEMU_NET_PACKET_FLAG_NONE,
+                                     pkts, count, sent_cb);
+}
+
 ssize_t
 qemu_sendv_packet(NetClientState *nc, const struct iovec *iov, int iovcnt)
 {
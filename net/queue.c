@@ -22,7 +22,7 @@
  */
 
 #include "net/queue.h"
-#include "qemu/queue.h"
+#include "qemu/iov.h"
 #include "net/net.h"
 
 /* The delivery handler may only return zero if it will call
@@ -39,13 +39,30 @@
  * unbounded queueing.
  */
 
+/* Pending packets live in a ring of NetPacket pointers that only grows.
+ * Packets that fit in NET_QUEUE_SLOT_SIZE bytes are recycled through a
+ * small per-queue pool, so a queue that keeps backing up under a steady
+ * stream of small packets stops allocating once it is warm.  A queue is
+ * only ever touched from the thread that owns its net client, so none of
+ * this needs locking.
+ *
+ * Senders that pass QEMU_NET_PACKET_FLAG_NOCOPY keep the payload alive
+ * until their sent callback runs; such packets are queued by reference.
+ */
+
+#define NET_QUEUE_RING_MIN   64
+#define NET_QUEUE_POOL_SIZE  64
+#define NET_QUEUE_SLOT_SIZE  2048     /* Ethernet frame plus vnet header */
+#define NET_QUEUE_FLUSH_BATCH 64
+
 struct NetPacket {
-    QTAILQ_ENTRY(NetPacket) entry;
     NetClientState *sender;
     unsigned flags;
     int size;
     NetPacketSent *sent_cb;
-    uint8_t data[0];
+    const uint8_t *data;        /* buf, or the sender's buffer if NOCOPY */
+    size_t buf_size;
+    uint8_t buf[0];
 };
 
 struct NetQueue {
@@ -53,7 +70,12 @@ struct NetQueue {
     uint32_t nq_maxlen;
     uint32_t nq_count;
 
-    QTAILQ_HEAD(packets, NetPacket) packets;
+    NetPacket **ring;
+    uint32_t ring_size;         /* zero or a power of two */
+    uint32_t head;
+
+    NetPacket *pool[NET_QUEUE_POOL_SIZE];
+    unsigned pool_count;
 
     unsigned delivering : 1;
 };
@@ -68,25 +90,107 @@ NetQueue *qemu_new_net_queue(void *opaque)
     queue->nq_maxlen = 10000;
     queue->nq_count = 0;
 
-    QTAILQ_INIT(&queue->packets);
-
     queue->delivering = 0;
 
     return queue;
 }
 
-void qemu_del_net_queue(NetQueue *queue)
+static inline NetPacket **qemu_net_queue_slot(NetQueue *queue, uint32_t i)
+{
+    return &queue->ring[(queue->head + i) & (queue->ring_size - 1)];
+}
+
+static NetPacket *qemu_net_queue_alloc_packet(NetQueue *queue, size_t size)
 {
-    NetPacket *packet, *next;
+    NetPacket *packet;
+
+    if (size <= NET_QUEUE_SLOT_SIZE && queue->pool_count) {
+        return queue->pool[--queue->pool_count];
+    }
+
+    size = MAX(size, NET_QUEUE_SLOT_SIZE);
+    packet = g_malloc(sizeof(NetPacket) + size);
+    packet->buf_size = size;
+    return packet;
+}
 
-    QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
-        QTAILQ_REMOVE(&queue->packets, packet, entry);
+static void qemu_net_queue_free_packet(NetQueue *queue, NetPacket *packet)
+{
+    if (packet->buf_size == NET_QUEUE_SLOT_SIZE &&
+        queue->pool_count < NET_QUEUE_POOL_SIZE) {
+        queue->pool[queue->pool_count++] = packet;
+    } else {
         g_free(packet);
     }
+}
+
+/* Make room for @n more packets, preserving their order */
+static void qemu_net_queue_reserve(NetQueue *queue, uint32_t n)
+{
+    NetPacket **ring;
+    uint32_t size, i;
+
+    if (queue->nq_count + n <= queue->ring_size) {
+        return;
+    }
+
+    size = queue->ring_size ? queue->ring_size : NET_QUEUE_RING_MIN;
+    while (size < queue->nq_count + n) {
+        size *= 2;
+    }
 
+    ring = g_new(NetPacket *, size);
+    for (i = 0; i < queue->nq_count; i++) {
+        ring[i] = *qemu_net_queue_slot(queue, i);
+    }
+    g_free(queue->ring);
+    queue->ring = ring;
+    queue->ring_size = size;
+    queue->head = 0;
+}
+
+void qemu_del_net_queue(NetQueue *queue)
+{
+    uint32_t i;
+
+    for (i = 0; i < queue->nq_count; i++) {
+        g_free(*qemu_net_queue_slot(queue, i));
+    }
+    for (i = 0; i < queue->pool_count; i++) {
+        g_free(queue->pool[i]);
+    }
+    g_free(queue->ring);
     g_free(queue);
 }
 
+static void qemu_net_queue_push(NetQueue *queue,
+                                NetClientState *sender,
+                                unsigned flags,
+                                const struct iovec *iov,
+                                int iovcnt,
+                                NetPacketSent *sent_cb)
+{
+    NetPacket *packet;
+    size_t size = iov_size(iov, iovcnt);
+
+    if ((flags & QEMU_NET_PACKET_FLAG_NOCOPY) && iovcnt == 1) {
+        packet = qemu_net_queue_alloc_packet(queue, 0);
+        packet->data = iov[0].iov_base;
+    } else {
+        packet = qemu_net_queue_alloc_packet(queue, size);
+        iov_to_buf(iov, iovcnt, 0, packet->buf, size);
+        packet->data = packet->buf;
+    }
+    packet->sender = sender;
+    packet->flags = flags;
+    packet->size = size;
+    packet->sent_cb = sent_cb;
+
+    qemu_net_queue_reserve(queue, 1);
+    *qemu_net_queue_slot(queue, queue->nq_count) = packet;
+    queue->nq_count++;
+}
+
 static void qemu_net_queue_append(NetQueue *queue,
                                   NetClientState *sender,
                                   unsigned flags,
@@ -94,20 +198,15 @@ static void qemu_net_queue_append(NetQueue *queue,
                                   size_t size,
                                   NetPacketSent *sent_cb)
 {
-    NetPacket *packet;
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = size,
+    };
 
     if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
         return; /* drop if queue full and no callback */
     }
-    packet = g_malloc(sizeof(NetPacket) + size);
-    packet->sender = sender;
-    packet->flags = flags;
-    packet->size = size;
-    packet->sent_cb = sent_cb;
-    memcpy(packet->data, buf, size);
-
-    queue->nq_count++;
-    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+    qemu_net_queue_push(queue, sender, flags, &iov, 1, sent_cb);
 }
 
 static void qemu_net_queue_append_iov(NetQueue *queue,
@@ -117,32 +216,10 @@ static void qemu_net_queue_append_iov(NetQueue *queue,
                                       int iovcnt,
                                       NetPacketSent *sent_cb)
 {
-    NetPacket *packet;
-    size_t max_len = 0;
-    int i;
-
     if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
         return; /* drop if queue full and no callback */
     }
-    for (i = 0; i < iovcnt; i++) {
-        max_len += iov[i].iov_len;
-    }
-
-    packet = g_malloc(sizeof(NetPacket) + max_len);
-    packet->sender = sender;
-    packet->sent_cb = sent_cb;
-    packet->flags = flags;
-    packet->size = 0;
-
-    for (i = 0; i < iovcnt; i++) {
-        size_t len = iov[i].iov_len;
-
-        memcpy(packet->data + packet->size, iov[i].iov_base, len);
-        packet->size += len;
-    }
-
-    queue->nq_count++;
-    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+    qemu_net_queue_push(queue, sender, flags, iov, iovcnt, sent_cb);
 }
 
 static ssize_t qemu_net_queue_deliver(NetQueue *queue,
@@ -225,48 +302,125 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
     return ret;
 }
 
+int qemu_net_queue_send_batch(NetQueue *queue,
+                              NetClientState *sender,
+                              unsigned flags,
+                              const struct iovec *pkts,
+                              int count,
+                              NetPacketSent *sent_cb)
+{
+    int i = 0;
+
+    if (!queue->delivering && qemu_can_send_packet(sender)) {
+        queue->delivering = 1;
+        i = qemu_deliver_packet_batch(sender, flags, pkts, count,
+                                      queue->opaque);
+        queue->delivering = 0;
+    }
+
+    if (i == count) {
+        qemu_net_queue_flush(queue);
+        return count;
+    }
+
+    /* The payloads stay valid until sent_cb runs, so queue them by
+     * reference.  Only the last packet carries the callback: the sender
+     * may reuse the buffers as soon as it is called.
+     */
+    for (; i < count; i++) {
+        qemu_net_queue_push(queue, sender, flags | QEMU_NET_PACKET_FLAG_NOCOPY,
+                            &pkts[i], 1, i == count - 1 ? sent_cb : NULL);
+    }
+    return 0;
+}
+
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
 {
-    NetPacket *packet, *next;
+    NetPacket **purged;
+    uint32_t i, kept = 0, n = 0;
+
+    if (!queue->nq_count) {
+        return;
+    }
+
+    /* Compact the ring first; sent callbacks may queue new packets */
+    purged = g_new(NetPacket *, queue->nq_count);
+    for (i = 0; i < queue->nq_count; i++) {
+        NetPacket *packet = *qemu_net_queue_slot(queue, i);
 
-    QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
         if (packet->sender == from) {
-            QTAILQ_REMOVE(&queue->packets, packet, entry);
-            queue->nq_count--;
-            if (packet->sent_cb) {
-                packet->sent_cb(packet->sender, 0);
-            }
-            g_free(packet);
+            purged[n++] = packet;
+        } else {
+            *qemu_net_queue_slot(queue, kept++) = packet;
         }
     }
+    queue->nq_count = kept;
+
+    for (i = 0; i < n; i++) {
+        if (purged[i]->sent_cb) {
+            purged[i]->sent_cb(purged[i]->sender, 0);
+        }
+        qemu_net_queue_free_packet(queue, purged[i]);
+    }
+    g_free(purged);
 }
 
+/* Redeliver queued packets in order.  Consecutive packets from the same
+ * sender are handed to the receiver as one batch.
+ */
 bool qemu_net_queue_flush(NetQueue *queue)
 {
-    while (!QTAILQ_EMPTY(&queue->packets)) {
-        NetPacket *packet;
-        int ret;
-
-        packet = QTAILQ_FIRST(&queue->packets);
-        QTAILQ_REMOVE(&queue->packets, packet, entry);
-        queue->nq_count--;
-
-        ret = qemu_net_queue_deliver(queue,
-                                     packet->sender,
-                                     packet->flags,
-                                     packet->data,
-                                     packet->size);
-        if (ret == 0) {
-            queue->nq_count++;
-            QTAILQ_INSERT_HEAD(&queue->packets, packet, entry);
-            return false;
+    while (queue->nq_count) {
+        NetPacket *batch[NET_QUEUE_FLUSH_BATCH];
+        struct iovec pkts[NET_QUEUE_FLUSH_BATCH];
+        NetPacket *first = *qemu_net_queue_slot(queue, 0);
+        int n, ret, i;
+
+        for (n = 0; n < MIN(queue->nq_count, NET_QUEUE_FLUSH_BATCH); n++) {
+            NetPacket *packet = *qemu_net_queue_slot(queue, n);
+
+            if (packet->sender != first->sender ||
+                packet->flags != first->flags) {
+                break;
+            }
+            batch[n] = packet;
+            pkts[n].iov_base = (void *)packet->data;
+            pkts[n].iov_len = packet->size;
         }
 
-        if (packet->sent_cb) {
-            packet->sent_cb(packet->sender, ret);
+        /* Dequeue the batch while it is being delivered, like a packet
+         * that is sent directly.
+         */
+        queue->head += n;
+        queue->nq_count -= n;
+
+        queue->delivering = 1;
+        ret = qemu_deliver_packet_batch(first->sender, first->flags,
+                                        pkts, n, queue->opaque);
+        queue->delivering = 0;
+
+        if (ret < n) {
+            /* Put back what the receiver did not take, ahead of anything
+             * that was queued meanwhile.
+             */
+            qemu_net_queue_reserve(queue, n - ret);
+            queue->head -= n - ret;
+            queue->nq_count += n - ret;
+            for (i = ret; i < n; i++) {
+                *qemu_net_queue_slot(queue, i - ret) = batch[i];
+            }
         }
 
-        g_free(packet);
+        for (i = 0; i < ret; i++) {
+            if (batch[i]->sent_cb) {
+                batch[i]->sent_cb(batch[i]->sender, batch[i]->size);
+            }
+            qemu_net_queue_free_packet(queue, batch[i]);
+        }
+
+        if (ret < n) {
+            return false;
+        }
     }
     return true;
 }
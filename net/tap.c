@@ -43,22 +43,36 @@
 #include "net/tap.h"
 
 #include "net/vhost_net.h"
+#include "block/aio.h"
+
+/* Packets are read back to back into the buffer and passed to the peer
+ * in batches of up to TAP_SEND_BATCH.  Each read needs NET_BUFSIZE bytes
+ * of room so that no packet is truncated.
+ */
+#define TAP_SEND_BATCH      64
+#define TAP_BUFSIZE         (4 * NET_BUFSIZE)
 
 typedef struct TAPState {
     NetClientState nc;
     int fd;
     char down_script[1024];
     char down_script_arg[128];
-    uint8_t buf[NET_BUFSIZE];
+    uint8_t buf[TAP_BUFSIZE];
     bool read_poll;
     bool write_poll;
+    bool send_pending;          /* peer still references buf */
     bool using_vnet_hdr;
     bool has_ufo;
     bool enabled;
     VHostNetState *vhost_net;
     unsigned host_vnet_hdr_len;
+    AioContext *ctx;            /* services fd, main loop if NULL */
 } TAPState;
 
+/* Packets read per tap_send() call in the main loop and in an IOThread */
+#define TAP_SEND_BURST      50
+#define TAP_SEND_BURST_AIO  256
+
 static int launch_script(const char *setup_script, const char *ifname, int fd);
 
 static int tap_can_send(void *opaque);
@@ -67,6 +81,16 @@ static void tap_writable(void *opaque);
 
 static void tap_update_fd_handler(TAPState *s)
 {
+    if (s->ctx) {
+        /* There is no can_read callback here, so the peer must stay
+         * able to receive while the tap is attached to an AioContext.
+         * Reads are still suspended while a packet is queued. */
+        aio_set_fd_handler(s->ctx, s->fd,
+                           s->read_poll && s->enabled ? tap_send : NULL,
+                           s->write_poll && s->enabled ? tap_writable : NULL,
+                           s);
+        return;
+    }
     qemu_set_fd_handler2(s->fd,
                          s->read_poll && s->enabled ? tap_can_send : NULL,
                          s->read_poll && s->enabled ? tap_send     : NULL,
@@ -182,44 +206,63 @@ ssize_t tap_read_packet(int tapfd, uint8_t *buf, int maxlen)
 static void tap_send_completed(NetClientState *nc, ssize_t len)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    s->send_pending = false;
     tap_read_poll(s, true);
 }
 
 static void tap_send(void *opaque)
 {
     TAPState *s = opaque;
+    struct iovec pkts[TAP_SEND_BATCH];
     int size;
     int packets = 0;
 
     while (qemu_can_send_packet(&s->nc)) {
-        uint8_t *buf = s->buf;
+        size_t offset = 0;
+        int n = 0;
 
-        size = tap_read_packet(s->fd, s->buf, sizeof(s->buf));
-        if (size <= 0) {
-            break;
-        }
+        size = 0;
+        while (n < ARRAY_SIZE(pkts) &&
+               sizeof(s->buf) - offset >= NET_BUFSIZE) {
+            uint8_t *buf = s->buf + offset;
+
+            size = tap_read_packet(s->fd, buf, NET_BUFSIZE);
+            if (size <= 0) {
+                break;
+            }
+            offset = QEMU_ALIGN_UP(offset + size, sizeof(uint64_t));
 
-        if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
-            buf  += s->host_vnet_hdr_len;
-            size -= s->host_vnet_hdr_len;
+            if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
+                buf  += s->host_vnet_hdr_len;
+                size -= s->host_vnet_hdr_len;
+            }
+            pkts[n].iov_base = buf;
+            pkts[n].iov_len = size;
+            n++;
+        }
+        if (n == 0) {
+            break;
         }
 
-        size = qemu_send_packet_async(&s->nc, buf, size, tap_send_completed);
-        if (size == 0) {
+        if (qemu_send_packet_batch_async(&s->nc, pkts, n,
+                                         tap_send_completed) == 0) {
+            s->send_pending = true;
             tap_read_poll(s, false);
             break;
-        } else if (size < 0) {
-            break;
+        }
+        if (size <= 0) {
+            break;          /* the tap device is empty */
         }
 
         /*
          * When the host keeps receiving more packets while tap_send() is
          * running we can hog the QEMU global mutex.  Limit the number of
          * packets that are processed per tap_send() callback to prevent
-         * stalling the guest.
+         * stalling the guest.  An IOThread only has to stay fair to the
+         * other handlers in its own AioContext, so it can go further.
          */
-        packets++;
-        if (packets >= 50) {
+        packets += n;
+        if (packets >= (s->ctx ? TAP_SEND_BURST_AIO : TAP_SEND_BURST)) {
             break;
         }
     }
@@ -308,10 +351,27 @@ static void tap_cleanup(NetClientState *nc)
 static void tap_poll(NetClientState *nc, bool enable)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
-    tap_read_poll(s, enable);
+    tap_read_poll(s, enable && !s->send_pending);
     tap_write_poll(s, enable);
 }
 
+static void tap_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+
+    if (s->ctx == ctx) {
+        return;
+    }
+
+    if (s->ctx) {
+        aio_set_fd_handler(s->ctx, s->fd, NULL, NULL, NULL);
+    } else {
+        qemu_set_fd_handler2(s->fd, NULL, NULL, NULL, NULL);
+    }
+    s->ctx = ctx;
+    tap_update_fd_handler(s);
+}
+
 int tap_get_fd(NetClientState *nc)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
@@ -335,6 +395,7 @@ static NetClientInfo net_tap_info = {
     .using_vnet_hdr = tap_using_vnet_hdr,
     .set_offload = tap_set_offload,
     .set_vnet_hdr_len = tap_set_vnet_hdr_len,
+    .set_aio_context = tap_set_aio_context,
 };
 
 static TAPState *net_tap_fd_init(NetClientState *peer,
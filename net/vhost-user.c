@@ -14,11 +14,14 @@
 #include "sysemu/char.h"
 #include "qemu/config-file.h"
 #include "qemu/error-report.h"
+#include "qmp-commands.h"
 
 typedef struct VhostUserState {
     NetClientState nc;
     CharDriverState *chr;
     VHostNetState *vhost_net;
+    /* what the guest acked, replayed when the backend reconnects */
+    unsigned acked_features;
 } VhostUserState;
 
 typedef struct VhostUserChardevProps {
@@ -39,7 +42,26 @@ static int vhost_user_running(VhostUserState *s)
     return (s->vhost_net) ? 1 : 0;
 }
 
-static int vhost_user_start(VhostUserState *s)
+static void vhost_user_stop_one(VhostUserState *s)
+{
+    if (vhost_user_running(s)) {
+        s->acked_features = vhost_net_get_acked_features(s->vhost_net);
+        vhost_net_cleanup(s->vhost_net);
+    }
+
+    s->vhost_net = 0;
+}
+
+static void vhost_user_stop(int queues, NetClientState *ncs[])
+{
+    int i;
+
+    for (i = 0; i < queues; i++) {
+        vhost_user_stop_one(DO_UPCAST(VhostUserState, nc, ncs[i]));
+    }
+}
+
+static int vhost_user_start_one(VhostUserState *s)
 {
     VhostNetOptions options;
 
@@ -53,24 +75,63 @@ static int vhost_user_start(VhostUserState *s)
     options.force = true;
 
     s->vhost_net = vhost_net_init(&options);
+    if (!vhost_user_running(s)) {
+        return -1;
+    }
+
+    /* After a reconnect, the guest is not going to ack features again */
+    if (s->acked_features) {
+        if (vhost_net_get_features(s->vhost_net, s->acked_features) !=
+            s->acked_features) {
+            error_report("vhost-user backend lacks features acked by the "
+                         "guest");
+            vhost_net_cleanup(s->vhost_net);
+            s->vhost_net = 0;
+            return -1;
+        }
+        vhost_net_ack_features(s->vhost_net, s->acked_features);
+    }
 
-    return vhost_user_running(s) ? 0 : -1;
+    return 0;
 }
 
-static void vhost_user_stop(VhostUserState *s)
+static int vhost_user_start(int queues, NetClientState *ncs[])
 {
-    if (vhost_user_running(s)) {
-        vhost_net_cleanup(s->vhost_net);
+    VhostUserState *s;
+    uint64_t max_queues;
+    int i;
+
+    for (i = 0; i < queues; i++) {
+        s = DO_UPCAST(VhostUserState, nc, ncs[i]);
+        if (vhost_user_start_one(s) < 0) {
+            goto err;
+        }
+
+        if (i == 0) {
+            max_queues = vhost_net_get_max_queues(s->vhost_net);
+            if (queues > max_queues) {
+                error_report("vhost-user backend supports %" PRIu64
+                             " queues, %d requested", max_queues, queues);
+                goto err;
+            }
+        }
     }
 
-    s->vhost_net = 0;
+    return 0;
+
+err:
+    vhost_user_stop(i + 1, ncs);
+    return -1;
 }
 
 static void vhost_user_cleanup(NetClientState *nc)
 {
     VhostUserState *s = DO_UPCAST(VhostUserState, nc, nc);
 
-    vhost_user_stop(s);
+    vhost_user_stop_one(s);
+    if (nc->queue_index == 0) {
+        qemu_chr_add_handlers(s->chr, NULL, NULL, NULL, NULL);
+    }
     qemu_purge_queued_packets(nc);
 }
 
@@ -96,59 +157,69 @@ static NetClientInfo net_vhost_user_info = {
         .has_ufo = vhost_user_has_ufo,
 };
 
-static void net_vhost_link_down(VhostUserState *s, bool link_down)
-{
-    s->nc.link_down = link_down;
-
-    if (s->nc.peer) {
-        s->nc.peer->link_down = link_down;
-    }
-
-    if (s->nc.info->link_status_changed) {
-        s->nc.info->link_status_changed(&s->nc);
-    }
-
-    if (s->nc.peer && s->nc.peer->info->link_status_changed) {
-        s->nc.peer->info->link_status_changed(s->nc.peer);
-    }
-}
-
+/* The link is brought down before stopping, so that the guest side
+ * hands the rings back first, and only brought up once every queue
+ * is ready again.  A backend that reconnects picks up where the last
+ * one stopped.
+ */
 static void net_vhost_user_event(void *opaque, int event)
 {
     VhostUserState *s = opaque;
+    NetClientState *ncs[MAX_QUEUE_NUM];
+    Error *err = NULL;
+    int queues;
+
+    queues = qemu_find_net_clients_except(s->nc.name, ncs,
+                                          NET_CLIENT_OPTIONS_KIND_NIC,
+                                          MAX_QUEUE_NUM);
 
     switch (event) {
     case CHR_EVENT_OPENED:
-        vhost_user_start(s);
-        net_vhost_link_down(s, false);
+        if (vhost_user_start(queues, ncs) < 0) {
+            error_report("chardev \"%s\" went up, vhost-user setup failed",
+                         s->chr->label);
+            break;
+        }
+        qmp_set_link(s->nc.name, true, &err);
         error_report("chardev \"%s\" went up", s->chr->label);
         break;
     case CHR_EVENT_CLOSED:
-        net_vhost_link_down(s, true);
-        vhost_user_stop(s);
+        qmp_set_link(s->nc.name, false, &err);
+        vhost_user_stop(queues, ncs);
         error_report("chardev \"%s\" went down", s->chr->label);
         break;
     }
+
+    if (err) {
+        error_report_err(err);
+    }
 }
 
 static int net_vhost_user_init(NetClientState *peer, const char *device,
-                               const char *name, CharDriverState *chr)
+                               const char *name, CharDriverState *chr,
+                               int queues)
 {
     NetClientState *nc;
-    VhostUserState *s;
+    VhostUserState *s = NULL;
+    int i;
 
-    nc = qemu_new_net_client(&net_vhost_user_info, peer, device, name);
+    for (i = 0; i < queues; i++) {
+        nc = qemu_new_net_client(&net_vhost_user_info, peer, device, name);
 
-    snprintf(nc->info_str, sizeof(nc->info_str), "vhost-user to %s",
-             chr->label);
+        snprintf(nc->info_str, sizeof(nc->info_str), "vhost-user%d to %s",
+                 i, chr->label);
+        nc->queue_index = i;
 
-    s = DO_UPCAST(VhostUserState, nc, nc);
+        /* We don't provide a receive callback */
+        nc->receive_disabled = 1;
 
-    /* We don't provide a receive callback */
-    s->nc.receive_disabled = 1;
-    s->chr = chr;
+        DO_UPCAST(VhostUserState, nc, nc)->chr = chr;
+        if (i == 0) {
+            s = DO_UPCAST(VhostUserState, nc, nc);
+        }
+    }
 
-    qemu_chr_add_handlers(s->chr, NULL, NULL, net_vhost_user_event, s);
+    qemu_chr_add_handlers(chr, NULL, NULL, net_vhost_user_event, s);
 
     return 0;
 }
@@ -164,6 +235,8 @@ static int net_vhost_chardev_opts(const char *name, const char *value,
         props->is_unix = true;
     } else if (strcmp(name, "server") == 0) {
         props->is_server = true;
+    } else if (strcmp(name, "reconnect") == 0) {
+        /* a client socket that comes back after the backend restarts */
     } else {
         error_report("vhost-user does not support a chardev"
                      " with the following option:\n %s = %s",
@@ -227,10 +300,22 @@ int net_init_vhost_user(const NetClientOptions *opts, const char *name,
 {
     const NetdevVhostUserOptions *vhost_user_opts;
     CharDriverState *chr;
+    int queues;
 
     assert(opts->kind == NET_CLIENT_OPTIONS_KIND_VHOST_USER);
     vhost_user_opts = opts->vhost_user;
 
+    queues = 1;
+    if (vhost_user_opts->has_queues) {
+        if (vhost_user_opts->queues < 1 ||
+            vhost_user_opts->queues > MAX_QUEUE_NUM) {
+            error_report("vhost-user: invalid number of queues %" PRId64,
+                         vhost_user_opts->queues);
+            return -1;
+        }
+        queues = vhost_user_opts->queues;
+    }
+
     chr = net_vhost_parse_chardev(vhost_user_opts);
     if (!chr) {
         error_report("No suitable chardev found");
@@ -244,5 +329,5 @@ int net_init_vhost_user(const NetClientOptions *opts, const char *name,
     }
 
 
-    return net_vhost_user_init(peer, "vhost_user", name, chr);
+    return net_vhost_user_init(peer, "vhost_user", name, chr, queues);
 }
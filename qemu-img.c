@@ -33,6 +33,7 @@
 #include "block/block_int.h"
 #include "block/blockjob.h"
 #include "block/qapi.h"
+#include "qemu/timer.h"
 #include <getopt.h>
 
 #define QEMU_IMG_VERSION "qemu-img version " QEMU_VERSION QEMU_PKGVERSION \
@@ -46,6 +47,7 @@ typedef struct img_cmd_t {
 enum {
     OPTION_OUTPUT = 256,
     OPTION_BACKING_CHAIN = 257,
+    OPTION_RWMIXREAD = 258,
 };
 
 typedef enum OutputFormat {
@@ -128,6 +130,9 @@ static void QEMU_NORETURN help(void)
            "  '--output' takes the format in which the output must be done (human or json)\n"
            "  '-n' skips the target volume creation (useful if the volume is created\n"
            "       prior to running qemu-img)\n"
+           "  '-m' specifies how many coroutines work in parallel during the convert\n"
+           "       process (defaults to 8)\n"
+           "  '-W' allow to write to the target out of order rather than sequential\n"
            "\n"
            "Parameters to check subcommand:\n"
            "  '-r' tries to repair any inconsistencies that are found during the check.\n"
@@ -145,7 +150,19 @@ static void QEMU_NORETURN help(void)
            "Parameters to compare subcommand:\n"
            "  '-f' first image format\n"
            "  '-F' second image format\n"
-           "  '-s' run in Strict mode - fail on different image size or sector allocation\n";
+           "  '-s' run in Strict mode - fail on different image size or sector allocation\n"
+           "\n"
+           "Parameters to bench subcommand:\n"
+           "  '-c' number of requests to submit (defaults to 75000 unless '-D' is given)\n"
+           "  '-d' number of requests in flight (defaults to 64)\n"
+           "  '-D' run for the given number of seconds\n"
+           "  '-i' AIO backend, 'threads' (default) or 'native'\n"
+           "  '-o' start of the area to benchmark, in bytes\n"
+           "  '-r' use random offsets instead of a sequential pattern\n"
+           "  '-s' request size in bytes (defaults to 4k)\n"
+           "  '-S' step between sequential requests (defaults to the request size)\n"
+           "  '-w' issue write requests instead of reads\n"
+           "  '--rwmixread' percentage of read requests in a mixed workload\n";
 
     printf("%s\nSupported formats:", help_msg);
     bdrv_iterate_format(format_print, NULL);
@@ -913,6 +930,15 @@ static int is_allocated_sectors(const uint8_t *buf, int n, int *pnum)
         return 0;
     }
     is_zero = buffer_is_zero(buf, 512);
+
+    /* A run of zero sectors can be measured with a single scan over the
+     * rest of the buffer; the offset returned is never rounded below the
+     * start of the sector that contains the first non-zero byte. */
+    if (is_zero && can_use_buffer_find_nonzero_offset(buf, n * 512)) {
+        *pnum = buffer_find_nonzero_offset(buf, n * 512) / 512;
+        return 0;
+    }
+
     for(i = 1; i < n; i++) {
         buf += 512;
         if (is_zero != buffer_is_zero(buf, 512)) {
@@ -965,6 +991,8 @@ static int is_allocated_sectors_min(const uint8_t *buf, int n, int *pnum,
     return 1;
 }
 
+#define COMPARE_BLOCK_SECTORS 128
+
 /*
  * Compares two buffers sector by sector. Returns 0 if the first sector of both
  * buffers matches, non-zero otherwise.
@@ -984,6 +1012,29 @@ static int compare_sectors(const uint8_t *buf1, const uint8_t *buf2, int n,
     }
 
     res = !!memcmp(buf1, buf2, 512);
+
+    /* Matching sectors are the common case; look for the first difference
+     * in large blocks so that memcmp() can run at full vector width, and
+     * only go back to single sectors inside the block that differs. */
+    if (!res) {
+        i = 1;
+        while (i < n) {
+            int len = MIN(n - i, COMPARE_BLOCK_SECTORS);
+
+            if (memcmp(buf1 + i * 512, buf2 + i * 512, len * 512)) {
+                break;
+            }
+            i += len;
+        }
+        for (; i < n; i++) {
+            if (memcmp(buf1 + i * 512, buf2 + i * 512, 512)) {
+                break;
+            }
+        }
+        *pnum = i;
+        return 0;
+    }
+
     for(i = 1; i < n; i++) {
         buf1 += 512;
         buf2 += 512;
@@ -1043,6 +1094,61 @@ static int check_empty_sectors(BlockBackend *blk, int64_t sect_num,
     return 0;
 }
 
+typedef struct CompareReadReq {
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int ret;
+    bool done;
+} CompareReadReq;
+
+static void compare_read_cb(void *opaque, int ret)
+{
+    CompareReadReq *req = opaque;
+
+    req->ret = ret;
+    req->done = true;
+}
+
+/*
+ * Reads the same sectors from both images with the two requests in flight at
+ * the same time, so that the latencies of the two images overlap instead of
+ * adding up.
+ *
+ * Returns 0 on success. On failure, the negative errno is returned and
+ * *failed is set to the index (0 or 1) of the image that could not be read.
+ */
+static int compare_read_both(BlockBackend *blk1, uint8_t *buf1,
+                             BlockBackend *blk2, uint8_t *buf2,
+                             int64_t sector_num, int nb_sectors, int *failed)
+{
+    BlockBackend *blk[2] = { blk1, blk2 };
+    uint8_t *buf[2] = { buf1, buf2 };
+    CompareReadReq req[2];
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        req[i].iov.iov_base = buf[i];
+        req[i].iov.iov_len = nb_sectors << BDRV_SECTOR_BITS;
+        qemu_iovec_init_external(&req[i].qiov, &req[i].iov, 1);
+        req[i].ret = 0;
+        req[i].done = false;
+        blk_aio_readv(blk[i], sector_num, &req[i].qiov, nb_sectors,
+                      compare_read_cb, &req[i]);
+    }
+
+    while (!req[0].done || !req[1].done) {
+        aio_poll(qemu_get_aio_context(), true);
+    }
+
+    for (i = 0; i < 2; i++) {
+        if (req[i].ret < 0) {
+            *failed = i;
+            return req[i].ret;
+        }
+    }
+    return 0;
+}
+
 /*
  * Compares two images. Exit codes:
  *
@@ -1188,22 +1294,18 @@ static int img_compare(int argc, char **argv)
 
         if (allocated1 == allocated2) {
             if (allocated1) {
-                ret = blk_read(blk1, sector_num, buf1, nb_sectors);
+                int failed;
+
+                ret = compare_read_both(blk1, buf1, blk2, buf2, sector_num,
+                                        nb_sectors, &failed);
                 if (ret < 0) {
                     error_report("Error while reading offset %" PRId64 " of %s:"
-                                 " %s", sectors_to_bytes(sector_num), filename1,
+                                 " %s", sectors_to_bytes(sector_num),
+                                 failed ? filename2 : filename1,
                                  strerror(-ret));
                     ret = 4;
                     goto out;
                 }
-                ret = blk_read(blk2, sector_num, buf2, nb_sectors);
-                if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64
-                                 " of %s: %s", sectors_to_bytes(sector_num),
-                                 filename2, strerror(-ret));
-                    ret = 4;
-                    goto out;
-                }
                 ret = compare_sectors(buf1, buf2, nb_sectors, &pnum);
                 if (ret || pnum != nb_sectors) {
                     qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
@@ -1311,6 +1413,8 @@ enum ImgConvertBlockStatus {
     BLK_BACKING_FILE,
 };
 
+#define MAX_COROUTINES 16
+
 typedef struct ImgConvertState {
     BlockBackend **src;
     int64_t *src_sectors;
@@ -1318,24 +1422,36 @@ typedef struct ImgConvertState {
     int64_t src_cur_offset;
     int64_t total_sectors;
     int64_t allocated_sectors;
+    int64_t allocated_done;
+    int64_t sector_num;
+    int64_t wr_offs;
     enum ImgConvertBlockStatus status;
     int64_t sector_next_status;
     BlockBackend *target;
     bool has_zero_init;
     bool compressed;
     bool target_has_backing;
+    bool wr_in_order;
     int min_sparse;
     size_t cluster_sectors;
     size_t buf_sectors;
+    int num_coroutines;
+    int running_coroutines;
+    Coroutine *co[MAX_COROUTINES];
+    int64_t wait_sector_num[MAX_COROUTINES];
+    CoMutex lock;
+    int ret;
 } ImgConvertState;
 
-static void convert_select_part(ImgConvertState *s, int64_t sector_num)
+static void convert_select_part(ImgConvertState *s, int64_t sector_num,
+                                int *src_cur, int64_t *src_cur_offset)
 {
-    assert(sector_num >= s->src_cur_offset);
-    while (sector_num - s->src_cur_offset >= s->src_sectors[s->src_cur]) {
-        s->src_cur_offset += s->src_sectors[s->src_cur];
-        s->src_cur++;
-        assert(s->src_cur < s->src_num);
+    *src_cur = 0;
+    *src_cur_offset = 0;
+    while (sector_num - *src_cur_offset >= s->src_sectors[*src_cur]) {
+        *src_cur_offset += s->src_sectors[*src_cur];
+        (*src_cur)++;
+        assert(*src_cur < s->src_num);
     }
 }
 
@@ -1344,7 +1460,7 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
     int64_t ret;
     int n;
 
-    convert_select_part(s, sector_num);
+    convert_select_part(s, sector_num, &s->src_cur, &s->src_cur_offset);
 
     assert(s->total_sectors > sector_num);
     n = MIN(s->total_sectors - sector_num, BDRV_REQUEST_MAX_SECTORS);
@@ -1395,30 +1511,34 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
     return n;
 }
 
-static int convert_read(ImgConvertState *s, int64_t sector_num, int nb_sectors,
-                        uint8_t *buf)
+static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
+                                        int nb_sectors, uint8_t *buf)
 {
     int n;
     int ret;
 
-    if (s->status == BLK_ZERO || s->status == BLK_BACKING_FILE) {
-        return 0;
-    }
-
     assert(nb_sectors <= s->buf_sectors);
     while (nb_sectors > 0) {
         BlockBackend *blk;
-        int64_t bs_sectors;
+        int src_cur;
+        int64_t bs_sectors, src_cur_offset;
+        QEMUIOVector qiov;
+        struct iovec iov;
 
         /* In the case of compression with multiple source files, we can get a
          * nb_sectors that spreads into the next part. So we must be able to
-         * read across multiple BDSes for one convert_read() call. */
-        convert_select_part(s, sector_num);
-        blk = s->src[s->src_cur];
-        bs_sectors = s->src_sectors[s->src_cur];
-
-        n = MIN(nb_sectors, bs_sectors - (sector_num - s->src_cur_offset));
-        ret = blk_read(blk, sector_num - s->src_cur_offset, buf, n);
+         * read across multiple BDSes for one convert_co_read() call.  Other
+         * coroutines move s->src_cur around, so look the part up locally. */
+        convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+        blk = s->src[src_cur];
+        bs_sectors = s->src_sectors[src_cur];
+
+        n = MIN(nb_sectors, bs_sectors - (sector_num - src_cur_offset));
+        iov.iov_base = buf;
+        iov.iov_len = n << BDRV_SECTOR_BITS;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+
+        ret = blk_co_readv(blk, sector_num - src_cur_offset, n, &qiov);
         if (ret < 0) {
             return ret;
         }
@@ -1431,15 +1551,18 @@ static int convert_read(ImgConvertState *s, int64_t sector_num, int nb_sectors,
     return 0;
 }
 
-static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
-                         const uint8_t *buf)
+static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
+                                         int nb_sectors, uint8_t *buf,
+                                         enum ImgConvertBlockStatus status)
 {
     int ret;
+    QEMUIOVector qiov;
+    struct iovec iov;
 
     while (nb_sectors > 0) {
         int n = nb_sectors;
 
-        switch (s->status) {
+        switch (status) {
         case BLK_BACKING_FILE:
             /* If we have a backing file, leave clusters unallocated that are
              * unallocated in the source image, so that the backing file is
@@ -1473,7 +1596,11 @@ static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
             if (!s->min_sparse ||
                 is_allocated_sectors_min(buf, n, &n, s->min_sparse))
             {
-                ret = blk_write(s->target, sector_num, buf, n);
+                iov.iov_base = buf;
+                iov.iov_len = n << BDRV_SECTOR_BITS;
+                qemu_iovec_init_external(&qiov, &iov, 1);
+
+                ret = blk_co_writev(s->target, sector_num, n, &qiov);
                 if (ret < 0) {
                     return ret;
                 }
@@ -1485,7 +1612,7 @@ static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
             if (s->has_zero_init) {
                 break;
             }
-            ret = blk_write_zeroes(s->target, sector_num, n, 0);
+            ret = blk_co_write_zeroes(s->target, sector_num, n, 0);
             if (ret < 0) {
                 return ret;
             }
@@ -1500,11 +1627,122 @@ static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
     return 0;
 }
 
-static int convert_do_copy(ImgConvertState *s)
+/* Each copy coroutine claims the next extent under s->lock, then reads and
+ * writes it on its own buffer, so that up to s->num_coroutines requests are
+ * in flight and zero detection on one buffer overlaps with I/O on the others.
+ * Unless out-of-order writes were allowed, writes are issued in ascending
+ * order: a coroutine whose extent does not start at s->wr_offs waits until
+ * the coroutine owning the preceding extent re-enters it.
+ */
+static void coroutine_fn convert_co_do_copy(void *opaque)
 {
+    ImgConvertState *s = opaque;
     uint8_t *buf = NULL;
-    int64_t sector_num, allocated_done;
-    int ret;
+    int ret, i;
+    int index = -1;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] == qemu_coroutine_self()) {
+            index = i;
+            break;
+        }
+    }
+    assert(index >= 0);
+
+    s->running_coroutines++;
+    buf = blk_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+
+    while (1) {
+        int n;
+        int64_t sector_num;
+        enum ImgConvertBlockStatus status;
+
+        qemu_co_mutex_lock(&s->lock);
+        if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        n = convert_iteration_sectors(s, s->sector_num);
+        if (n < 0) {
+            qemu_co_mutex_unlock(&s->lock);
+            s->ret = n;
+            break;
+        }
+        /* Save the extent and its status before other coroutines advance
+         * the iterator */
+        sector_num = s->sector_num;
+        status = s->status;
+        s->sector_num += n;
+        qemu_co_mutex_unlock(&s->lock);
+
+        if (status == BLK_DATA) {
+            s->allocated_done += n;
+            qemu_progress_print(100.0 * s->allocated_done /
+                                s->allocated_sectors, 0);
+
+            ret = convert_co_read(s, sector_num, n, buf);
+            if (ret < 0) {
+                error_report("error while reading sector %" PRId64
+                             ": %s", sector_num, strerror(-ret));
+                s->ret = ret;
+            }
+        }
+
+        if (s->wr_in_order) {
+            /* keep writes in order */
+            while (s->wr_offs != sector_num && s->ret == -EINPROGRESS) {
+                s->wait_sector_num[index] = sector_num;
+                qemu_coroutine_yield();
+            }
+            s->wait_sector_num[index] = -1;
+        }
+
+        if (s->ret == -EINPROGRESS) {
+            ret = convert_co_write(s, sector_num, n, buf, status);
+            if (ret < 0) {
+                error_report("error while writing sector %" PRId64
+                             ": %s", sector_num, strerror(-ret));
+                s->ret = ret;
+            }
+        }
+
+        if (s->wr_in_order) {
+            /* Re-enter the coroutine that may be waiting for this write to
+             * complete.  A -> B -> A cannot occur because A has
+             * s->wait_sector_num[index] == -1 while it is running. */
+            s->wr_offs = sector_num + n;
+            for (i = 0; i < s->num_coroutines; i++) {
+                if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
+                    qemu_coroutine_enter(s->co[i], NULL);
+                    break;
+                }
+            }
+        }
+    }
+
+    /* Wake up writers that are waiting for an extent that will never be
+     * written because of an error */
+    if (s->wr_in_order && s->ret != -EINPROGRESS) {
+        for (i = 0; i < s->num_coroutines; i++) {
+            if (s->co[i] && s->wait_sector_num[i] != -1) {
+                qemu_coroutine_enter(s->co[i], NULL);
+            }
+        }
+    }
+
+    qemu_vfree(buf);
+    s->co[index] = NULL;
+    s->running_coroutines--;
+    if (!s->running_coroutines && s->ret == -EINPROGRESS) {
+        /* the convert job finished successfully */
+        s->ret = 0;
+    }
+}
+
+static int convert_do_copy(ImgConvertState *s)
+{
+    int64_t sector_num;
+    int ret, i;
     int n;
 
     /* Check whether we have zero initialisation or can get it efficiently */
@@ -1526,12 +1764,10 @@ static int convert_do_copy(ImgConvertState *s)
     if (s->compressed) {
         if (s->cluster_sectors <= 0 || s->cluster_sectors > s->buf_sectors) {
             error_report("invalid cluster size");
-            ret = -EINVAL;
-            goto fail;
+            return -EINVAL;
         }
         s->buf_sectors = s->cluster_sectors;
     }
-    buf = blk_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
 
     /* Calculate allocated sectors for progress */
     s->allocated_sectors = 0;
@@ -1539,8 +1775,7 @@ static int convert_do_copy(ImgConvertState *s)
     while (sector_num < s->total_sectors) {
         n = convert_iteration_sectors(s, sector_num);
         if (n < 0) {
-            ret = n;
-            goto fail;
+            return n;
         }
         if (s->status == BLK_DATA) {
             s->allocated_sectors += n;
@@ -1549,54 +1784,32 @@ static int convert_do_copy(ImgConvertState *s)
     }
 
     /* Do the copy */
-    s->src_cur = 0;
-    s->src_cur_offset = 0;
     s->sector_next_status = 0;
+    s->sector_num = 0;
+    s->wr_offs = 0;
+    s->allocated_done = 0;
+    s->ret = -EINPROGRESS;
 
-    sector_num = 0;
-    allocated_done = 0;
-
-    while (sector_num < s->total_sectors) {
-        n = convert_iteration_sectors(s, sector_num);
-        if (n < 0) {
-            ret = n;
-            goto fail;
-        }
-        if (s->status == BLK_DATA) {
-            allocated_done += n;
-            qemu_progress_print(100.0 * allocated_done / s->allocated_sectors,
-                                0);
-        }
-
-        ret = convert_read(s, sector_num, n, buf);
-        if (ret < 0) {
-            error_report("error while reading sector %" PRId64
-                         ": %s", sector_num, strerror(-ret));
-            goto fail;
-        }
-
-        ret = convert_write(s, sector_num, n, buf);
-        if (ret < 0) {
-            error_report("error while writing sector %" PRId64
-                         ": %s", sector_num, strerror(-ret));
-            goto fail;
-        }
+    qemu_co_mutex_init(&s->lock);
+    for (i = 0; i < s->num_coroutines; i++) {
+        s->co[i] = qemu_coroutine_create(convert_co_do_copy);
+        s->wait_sector_num[i] = -1;
+        qemu_coroutine_enter(s->co[i], s);
+    }
 
-        sector_num += n;
+    while (s->ret == -EINPROGRESS) {
+        aio_poll(qemu_get_aio_context(), true);
     }
 
-    if (s->compressed) {
+    if (s->compressed && !s->ret) {
         /* signal EOF to align */
         ret = blk_write_compressed(s->target, 0, NULL, 0);
         if (ret < 0) {
-            goto fail;
+            return ret;
         }
     }
 
-    ret = 0;
-fail:
-    qemu_vfree(buf);
-    return ret;
+    return s->ret;
 }
 
 static int img_convert(int argc, char **argv)
@@ -1622,6 +1835,8 @@ static int img_convert(int argc, char **argv)
     Error *local_err = NULL;
     QemuOpts *sn_opts = NULL;
     ImgConvertState state;
+    int num_coroutines = 8;
+    bool wr_in_order = true;
 
     fmt = NULL;
     out_fmt = "raw";
@@ -1631,7 +1846,7 @@ static int img_convert(int argc, char **argv)
     compress = 0;
     skip_create = 0;
     for(;;) {
-        c = getopt(argc, argv, "hf:O:B:ce6o:s:l:S:pt:T:qn");
+        c = getopt(argc, argv, "hf:O:B:ce6o:s:l:S:pt:T:qnm:W");
         if (c == -1) {
             break;
         }
@@ -1721,6 +1936,23 @@ static int img_convert(int argc, char **argv)
         case 'n':
             skip_create = 1;
             break;
+        case 'm':
+        {
+            char *end;
+            long val = strtol(optarg, &end, 0);
+
+            if (*end || val < 1 || val > MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d", MAX_COROUTINES);
+                ret = -1;
+                goto fail_getopt;
+            }
+            num_coroutines = val;
+            break;
+        }
+        case 'W':
+            wr_in_order = false;
+            break;
         }
     }
 
@@ -1954,6 +2186,12 @@ static int img_convert(int argc, char **argv)
         cluster_sectors = bdi.cluster_size / BDRV_SECTOR_SIZE;
     }
 
+    if (compress && !wr_in_order) {
+        error_report("Out of order write and compress are mutually exclusive");
+        ret = -1;
+        goto out;
+    }
+
     state = (ImgConvertState) {
         .src                = blk,
         .src_sectors        = bs_sectors,
@@ -1965,6 +2203,8 @@ static int img_convert(int argc, char **argv)
         .min_sparse         = min_sparse,
         .cluster_sectors    = cluster_sectors,
         .buf_sectors        = bufsectors,
+        .wr_in_order        = wr_in_order,
+        .num_coroutines     = num_coroutines,
     };
     ret = convert_do_copy(&state);
 
@@ -3131,6 +3371,468 @@ out:
     return 0;
 }
 
+/* Latencies are kept in a log-linear histogram: values below
+ * BENCH_HIST_SUB nanoseconds get one bucket each, larger values get
+ * BENCH_HIST_SUB buckets per power of two, so percentiles are accurate to
+ * about 6% no matter how long the benchmark runs.
+ */
+#define BENCH_HIST_SUB_BITS 4
+#define BENCH_HIST_SUB      (1 << BENCH_HIST_SUB_BITS)
+#define BENCH_HIST_BUCKETS  ((64 - BENCH_HIST_SUB_BITS + 1) * BENCH_HIST_SUB)
+
+typedef struct BenchData BenchData;
+
+typedef struct BenchRequest {
+    BenchData *b;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int64_t start_ns;
+    bool is_write;
+} BenchRequest;
+
+struct BenchData {
+    BlockBackend *blk;
+    uint64_t image_size;
+    int bufsize;
+    int step;
+    int nrreq;
+    int read_percent;
+    bool random;
+    GRand *rand;
+    uint64_t start_offset;  /* first byte requests may touch */
+    uint64_t offset;
+    int64_t count;          /* requests left to submit, -1 if unlimited */
+    int64_t deadline_ns;
+    int in_flight;
+    int ret;
+    BenchRequest *reqs;
+
+    uint64_t n_reads;
+    uint64_t n_writes;
+    int64_t lat_min;
+    int64_t lat_max;
+    uint64_t lat_total;
+    uint64_t lat_hist[BENCH_HIST_BUCKETS];
+};
+
+static int bench_hist_index(uint64_t ns)
+{
+    int msb;
+
+    if (ns < BENCH_HIST_SUB) {
+        return ns;
+    }
+    msb = 63 - clz64(ns);
+    return (msb - BENCH_HIST_SUB_BITS + 1) * BENCH_HIST_SUB +
+           ((ns >> (msb - BENCH_HIST_SUB_BITS)) & (BENCH_HIST_SUB - 1));
+}
+
+/* Returns the largest value that falls into bucket @index */
+static uint64_t bench_hist_value(int index)
+{
+    int major = index / BENCH_HIST_SUB;
+    uint64_t sub = index % BENCH_HIST_SUB;
+
+    if (major == 0) {
+        return sub;
+    }
+    return ((BENCH_HIST_SUB + sub + 1) << (major - 1)) - 1;
+}
+
+static uint64_t bench_percentile(BenchData *b, double percent)
+{
+    uint64_t total = b->n_reads + b->n_writes;
+    uint64_t target = (uint64_t)(total * percent / 100.0);
+    uint64_t seen = 0;
+    int i;
+
+    for (i = 0; i < BENCH_HIST_BUCKETS; i++) {
+        seen += b->lat_hist[i];
+        if (seen > target) {
+            return MIN(bench_hist_value(i), b->lat_max);
+        }
+    }
+    return b->lat_max;
+}
+
+static void bench_cb(void *opaque, int ret);
+
+static void bench_submit(BenchRequest *req)
+{
+    BenchData *b = req->b;
+    BlockAIOCB *acb;
+    uint64_t offset;
+
+    if (b->random) {
+        uint64_t nr_steps = (b->image_size - b->bufsize - b->start_offset) /
+                            b->step + 1;
+        uint64_t r = ((uint64_t)g_rand_int(b->rand) << 32) |
+                     g_rand_int(b->rand);
+        offset = b->start_offset + (r % nr_steps) * b->step;
+    } else {
+        offset = b->offset;
+        b->offset += b->step;
+        if (b->offset + b->bufsize > b->image_size) {
+            b->offset = b->start_offset;
+        }
+    }
+
+    req->is_write = b->read_percent < 100 &&
+                    g_rand_int_range(b->rand, 0, 100) >= b->read_percent;
+    req->start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    if (req->is_write) {
+        acb = blk_aio_writev(b->blk, offset >> BDRV_SECTOR_BITS, &req->qiov,
+                             b->bufsize >> BDRV_SECTOR_BITS, bench_cb, req);
+    } else {
+        acb = blk_aio_readv(b->blk, offset >> BDRV_SECTOR_BITS, &req->qiov,
+                            b->bufsize >> BDRV_SECTOR_BITS, bench_cb, req);
+    }
+    if (!acb) {
+        error_report("Failed to issue request");
+        exit(EXIT_FAILURE);
+    }
+
+    b->in_flight++;
+    if (b->count > 0) {
+        b->count--;
+    }
+}
+
+static bool bench_more(BenchData *b)
+{
+    if (b->ret < 0 || b->count == 0) {
+        return false;
+    }
+    return !b->deadline_ns ||
+           qemu_clock_get_ns(QEMU_CLOCK_REALTIME) < b->deadline_ns;
+}
+
+static void bench_cb(void *opaque, int ret)
+{
+    BenchRequest *req = opaque;
+    BenchData *b = req->b;
+    int64_t lat;
+
+    b->in_flight--;
+    if (ret < 0) {
+        error_report("Failed request: %s", strerror(-ret));
+        if (b->ret == 0) {
+            b->ret = ret;
+        }
+        return;
+    }
+
+    lat = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - req->start_ns;
+    if (req->is_write) {
+        b->n_writes++;
+    } else {
+        b->n_reads++;
+    }
+    b->lat_min = MIN(b->lat_min, lat);
+    b->lat_max = MAX(b->lat_max, lat);
+    b->lat_total += lat;
+    b->lat_hist[bench_hist_index(lat)]++;
+
+    if (bench_more(b)) {
+        bench_submit(req);
+    }
+}
+
+static int img_bench(int argc, char **argv)
+{
+    int c, ret = 0;
+    const char *fmt = NULL, *filename;
+    const char *cache = BDRV_DEFAULT_CACHE;
+    const char *aio = NULL;
+    bool quiet = false;
+    bool is_write = false;
+    bool random = false;
+    int read_percent = -1;
+    int64_t count = -1;
+    int64_t duration = 0;
+    int depth = 64;
+    int64_t offset = 0;
+    size_t bufsize = 4096;
+    size_t step = 0;
+    int flags = 0;
+    int64_t image_size;
+    BlockBackend *blk = NULL;
+    BenchData data = {};
+    uint8_t *buf = NULL;
+    int64_t t_start, t_end;
+    double elapsed;
+    uint64_t total;
+    int i;
+
+    for (;;) {
+        static const struct option long_options[] = {
+            {"help", no_argument, 0, 'h'},
+            {"rwmixread", required_argument, 0, OPTION_RWMIXREAD},
+            {0, 0, 0, 0}
+        };
+        c = getopt_long(argc, argv, "hc:d:D:f:i:o:qrs:S:t:w", long_options,
+                        NULL);
+        if (c == -1) {
+            break;
+        }
+
+        switch (c) {
+        case 'h':
+        case '?':
+            help();
+            break;
+        case 'c':
+        {
+            char *end;
+            errno = 0;
+            count = strtoll(optarg, &end, 0);
+            if (errno || *end || count <= 0) {
+                error_report("Invalid request count specified");
+                return 1;
+            }
+            break;
+        }
+        case 'd':
+        {
+            char *end;
+            errno = 0;
+            depth = strtol(optarg, &end, 0);
+            if (errno || *end || depth <= 0 || depth > 65536) {
+                error_report("Invalid queue depth specified");
+                return 1;
+            }
+            break;
+        }
+        case 'D':
+        {
+            char *end;
+            errno = 0;
+            duration = strtoll(optarg, &end, 0);
+            if (errno || *end || duration <= 0) {
+                error_report("Invalid duration specified");
+                return 1;
+            }
+            break;
+        }
+        case 'f':
+            fmt = optarg;
+            break;
+        case 'i':
+            aio = optarg;
+            break;
+        case 'o':
+        {
+            char *end;
+            errno = 0;
+            offset = strtosz_suffix(optarg, &end, STRTOSZ_DEFSUFFIX_B);
+            if (offset < 0 || *end) {
+                error_report("Invalid offset specified");
+                return 1;
+            }
+            break;
+        }
+        case 'q':
+            quiet = true;
+            break;
+        case 'r':
+            random = true;
+            break;
+        case 's':
+        {
+            int64_t sval;
+            char *end;
+
+            sval = strtosz_suffix(optarg, &end, STRTOSZ_DEFSUFFIX_B);
+            if (sval <= 0 || sval > INT_MAX || *end) {
+                error_report("Invalid buffer size specified");
+                return 1;
+            }
+            bufsize = sval;
+            break;
+        }
+        case 'S':
+        {
+            int64_t sval;
+            char *end;
+
+            sval = strtosz_suffix(optarg, &end, STRTOSZ_DEFSUFFIX_B);
+            if (sval <= 0 || sval > INT_MAX || *end) {
+                error_report("Invalid step size specified");
+                return 1;
+            }
+            step = sval;
+            break;
+        }
+        case 't':
+            cache = optarg;
+            break;
+        case 'w':
+            is_write = true;
+            break;
+        case OPTION_RWMIXREAD:
+        {
+            char *end;
+            errno = 0;
+            read_percent = strtol(optarg, &end, 0);
+            if (errno || *end || read_percent < 0 || read_percent > 100) {
+                error_report("Invalid read percentage specified");
+                return 1;
+            }
+            break;
+        }
+        }
+    }
+
+    if (optind != argc - 1) {
+        error_exit("Expecting one image file name");
+    }
+    filename = argv[argc - 1];
+
+    if (read_percent < 0) {
+        read_percent = is_write ? 0 : 100;
+    } else if (is_write) {
+        error_report("-w and --rwmixread are mutually exclusive");
+        return 1;
+    }
+    if (count < 0 && !duration) {
+        count = 75000;
+    }
+    if (!step) {
+        step = bufsize;
+    }
+    if ((bufsize | step | offset) & (BDRV_SECTOR_SIZE - 1)) {
+        error_report("Offset, buffer and step size must be multiples of the "
+                     "sector size");
+        return 1;
+    }
+
+    if (read_percent < 100) {
+        flags |= BDRV_O_RDWR;
+    }
+    ret = bdrv_parse_cache_flags(cache, &flags);
+    if (ret < 0) {
+        error_report("Invalid cache option: %s", cache);
+        return 1;
+    }
+    if (aio && !strcmp(aio, "native")) {
+        if (!(flags & BDRV_O_NOCACHE)) {
+            error_report("aio=native requires a cache mode that bypasses the "
+                         "host page cache ('none' or 'directsync')");
+            return 1;
+        }
+        flags |= BDRV_O_NATIVE_AIO;
+    } else if (aio && strcmp(aio, "threads")) {
+        error_report("Invalid aio option: %s", aio);
+        return 1;
+    }
+
+    blk = img_open("image", filename, fmt, flags, true, quiet);
+    if (!blk) {
+        return 1;
+    }
+
+    image_size = blk_getlength(blk);
+    if (image_size < 0) {
+        error_report("Could not get image size: %s", strerror(-image_size));
+        ret = -1;
+        goto out;
+    }
+    if (image_size < bufsize || offset > image_size - bufsize) {
+        error_report("Image is too small for the requested offset and size");
+        ret = -1;
+        goto out;
+    }
+
+    data = (BenchData) {
+        .blk            = blk,
+        .image_size     = image_size,
+        .bufsize        = bufsize,
+        .step           = step,
+        .nrreq          = depth,
+        .read_percent   = read_percent,
+        .random         = random,
+        .rand           = g_rand_new(),
+        .start_offset   = offset,
+        .offset         = offset,
+        .count          = count,
+        .lat_min        = INT64_MAX,
+    };
+
+    /* Every request gets its own slice of the buffer; fill it with a non-zero
+     * pattern so that write requests are not short-cut by zero detection. */
+    buf = blk_blockalign(blk, (size_t)depth * bufsize);
+    memset(buf, 0xa5, (size_t)depth * bufsize);
+
+    data.reqs = g_new0(BenchRequest, depth);
+    for (i = 0; i < depth; i++) {
+        data.reqs[i].b = &data;
+        data.reqs[i].iov.iov_base = buf + i * bufsize;
+        data.reqs[i].iov.iov_len = bufsize;
+        qemu_iovec_init_external(&data.reqs[i].qiov, &data.reqs[i].iov, 1);
+    }
+
+    if (duration) {
+        qprintf(quiet, "Running for %" PRId64 " seconds", duration);
+    } else {
+        qprintf(quiet, "Sending %" PRId64 " requests", count);
+    }
+    qprintf(quiet, " (%d%% reads, %s), %zu bytes each, %d in parallel "
+            "(starting at offset %" PRId64 ", step size %zu)\n",
+            read_percent, random ? "random" : "sequential", bufsize, depth,
+            offset, step);
+
+    t_start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    if (duration) {
+        data.deadline_ns = t_start + duration * 1000000000LL;
+    }
+    for (i = 0; i < depth && bench_more(&data); i++) {
+        bench_submit(&data.reqs[i]);
+    }
+    while (data.in_flight > 0) {
+        aio_poll(qemu_get_aio_context(), true);
+    }
+    t_end = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    if (data.ret < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    elapsed = (t_end - t_start) / 1e9;
+    total = data.n_reads + data.n_writes;
+    qprintf(quiet, "Run completed in %3.3f seconds.\n", elapsed);
+    if (!total) {
+        goto out;
+    }
+    qprintf(quiet, "%" PRIu64 " requests (%" PRIu64 " reads, %" PRIu64
+            " writes): %.0f IOPS, %.2f MiB/s\n",
+            total, data.n_reads, data.n_writes, total / elapsed,
+            (double)total * bufsize / elapsed / (1024 * 1024));
+    qprintf(quiet, "Latency (us): min %.1f, avg %.1f, max %.1f\n",
+            data.lat_min / 1e3, data.lat_total / 1e3 / total,
+            data.lat_max / 1e3);
+    qprintf(quiet, "Latency percentiles (us): 50%%: %.1f, 90%%: %.1f, "
+            "99%%: %.1f, 99.9%%: %.1f\n",
+            bench_percentile(&data, 50) / 1e3,
+            bench_percentile(&data, 90) / 1e3,
+            bench_percentile(&data, 99) / 1e3,
+            bench_percentile(&data, 99.9) / 1e3);
+
+out:
+    if (data.rand) {
+        g_rand_free(data.rand);
+    }
+    g_free(data.reqs);
+    qemu_vfree(buf);
+    blk_unref(blk);
+
+    if (ret) {
+        return 1;
+    }
+    return 0;
+}
+
 static const img_cmd_t img_cmds[] = {
 #define DEF(option, callback, arg_string)        \
     { option, callback },
@@ -464,6 +464,9 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [[,bps_max=bm]|[[,bps_rd_max=rm][,bps_wr_max=wm]]]\n"
     "       [[,iops_max=im]|[[,iops_rd_max=irm][,iops_wr_max=iwm]]]\n"
     "       [[,iops_size=is]]\n"
+    "       [[,group=g]]\n"
+    "       [,stats-account-invalid=on|off][,stats-account-failed=on|off]\n"
+    "       [,stats-intervals=t1[:t2...]]\n"
     "                use 'file' as a drive image\n", QEMU_ARCH_ALL)
 STEXI
 @item -drive @var{option}[,@var{option}[,@var{option}[,...]]]
@@ -525,6 +528,21 @@ file sectors into the image file.
 conversion of plain zero writes by the OS to driver specific optimized
 zero write commands. You may even choose "unmap" if @var{discard} is set
 to "unmap" to allow a zero write to be converted to an UNMAP operation.
+@item stats-account-invalid=@var{on|off}
+@item stats-account-failed=@var{on|off}
+Whether invalid (e.g. out of range) and failed requests are included in the
+last access and latency statistics reported by @code{query-blockstats}. They
+are always counted separately. Both default to "on".
+@item stats-intervals=@var{t1}[:@var{t2}...]
+Colon-separated list of interval lengths in seconds. For each interval,
+@code{query-blockstats} reports the minimum, maximum and average latency,
+the average queue depth and the IOPS of the requests completed within it.
+@item group=@var{g}
+Put the drive in I/O throttling group @var{g}.  All drives in the same group
+share a single set of limits, and the available bandwidth is distributed
+among them in a round-robin fashion.  The limits of the group are those of
+the last drive that set them.  Without this option, each throttled drive
+forms a group of its own named after the drive.
 @end table
 
 By default, the @option{cache=writeback} mode is used. It will report data
@@ -1942,13 +1960,19 @@ The hubport netdev lets you connect a NIC to a QEMU "vlan" instead of a single
 netdev.  @code{-net} and @code{-device} with parameter @option{vlan} create the
 required hub automatically.
 
-@item -netdev vhost-user,chardev=@var{id}[,vhostforce=on|off]
+@item -netdev vhost-user,chardev=@var{id}[,vhostforce=on|off][,queues=@var{n}]
 
 Establish a vhost-user netdev, backed by a chardev @var{id}. The chardev should
 be a unix domain socket backed one. The vhost-user uses a specifically defined
 protocol to pass vhost ioctl replacement messages to an application on the other
 end of the socket. On non-MSIX guests, the feature can be forced with
-@var{vhostforce}.
+@var{vhostforce}. Use @option{queues=@var{n}} to create @var{n} queue pairs
+over the same socket; the backend has to support multiqueue.
+
+The link goes down when the socket disconnects and back up once the backend
+reconnects, resuming the rings where they stopped. Use a listening socket, or
+a client socket with @option{reconnect=@var{seconds}}, to have QEMU accept a
+restarted backend.
 
 Example:
 @example
@@ -1003,7 +1003,8 @@ EQMP
 
     {
         .name       = "block-stream",
-        .args_type  = "device:B,base:s?,speed:o?,backing-file:s?,on-error:s?",
+        .args_type  = "device:B,base:s?,speed:o?,backing-file:s?,"
+                      "chunk-size:o?,max-in-flight:i?,on-error:s?",
         .mhandler.cmd_new = qmp_marshal_input_block_stream,
     },
 
@@ -1032,6 +1033,11 @@ Arguments:
                   string, to specify a valid filename or protocol.
                   (json-string, optional) (Since 2.1)
 - "speed":  the maximum speed, in bytes per second (json-int, optional)
+- "chunk-size": the amount of data copied by one request, in bytes; a
+                multiple of 512 no larger than 64M (json-int, optional,
+                default 512k) (Since 2.4)
+- "max-in-flight": the number of requests copied in parallel, between 1
+                   and 64 (json-int, optional, default 4) (Since 2.4)
 - "on-error": the action to take on an error (default 'report').  'stop' and
               'enospc' can only be used if the block device supports io-status.
               (json-string, optional) (Since 2.1)
@@ -1046,7 +1052,8 @@ EQMP
 
     {
         .name       = "block-commit",
-        .args_type  = "device:B,base:s?,top:s?,backing-file:s?,speed:o?",
+        .args_type  = "device:B,base:s?,top:s?,backing-file:s?,speed:o?,"
+                      "chunk-size:o?,max-in-flight:i?",
         .mhandler.cmd_new = qmp_marshal_input_block_commit,
     },
 
@@ -1097,6 +1104,13 @@ Arguments:
           yourself once the commit operation successfully completes.
           (json-string)
 - "speed":  the maximum speed, in bytes per second (json-int, optional)
+- "chunk-size": the amount of data copied by one request, in bytes; a
+                multiple of 512 no larger than 64M.  Not supported if
+                'top' is the active layer (json-int, optional, default
+                512k) (Since 2.4)
+- "max-in-flight": the number of requests copied in parallel, between 1
+                   and 64.  Not supported if 'top' is the active layer
+                   (json-int, optional, default 4) (Since 2.4)
 
 
 Example:
@@ -1309,7 +1323,7 @@ EQMP
 
     {
         .name       = "block-dirty-bitmap-add",
-        .args_type  = "node:B,name:s,granularity:i?",
+        .args_type  = "node:B,name:s,granularity:i?,persistent:b?",
         .mhandler.cmd_new = qmp_marshal_input_block_dirty_bitmap_add,
     },
 
@@ -1326,6 +1340,9 @@ Arguments:
 - "node": device/node on which to create dirty bitmap (json-string)
 - "name": name of the new dirty bitmap (json-string)
 - "granularity": granularity to track writes with (int, optional)
+- "persistent": save the bitmap in the image on close and reload it on open;
+                requires a qcow2 image with compat=1.1 (json-bool, optional,
+                default false)
 
 Example:
 
@@ -1503,7 +1520,7 @@ EQMP
         .args_type  = "sync:s,device:B,target:s,speed:i?,mode:s?,format:s?,"
                       "node-name:s?,replaces:s?,"
                       "on-source-error:s?,on-target-error:s?,"
-                      "granularity:i?,buf-size:i?",
+                      "granularity:i?,buf-size:i?,copy-mode:s?",
         .mhandler.cmd_new = qmp_marshal_input_drive_mirror,
     },
 
@@ -1542,6 +1559,10 @@ Arguments:
   (BlockdevOnError, default 'report')
 - "on-target-error": the action to take on an error on the target
   (BlockdevOnError, default 'report')
+- "copy-mode": "background" to only copy data in the background, or
+  "write-blocking" to also copy guest writes to the target before they
+  complete, which guarantees that the job converges (MirrorCopyMode,
+  default 'background')
 
 The default value of the granularity is the image cluster size clamped
 between 4096 and 65536, if the image format defines one.  If the format
@@ -1849,11 +1870,49 @@ Example:
                                                "password": "12345" } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "block-latency-histogram-set",
+        .args_type  = "device:B,boundaries:q?,boundaries-read:q?,"
+                      "boundaries-write:q?,boundaries-flush:q?",
+        .mhandler.cmd_new = qmp_marshal_input_block_latency_histogram_set,
+    },
+
+SQMP
+block-latency-histogram-set
+---------------------------
+
+Manage read, write and flush latency histograms for the device.  The
+histograms are reported by query-blockstats.
+
+Arguments:
+
+- "device": device name (json-string)
+- "boundaries": boundaries in nanoseconds for all I/O types, positive and
+                in ascending order (json-array of json-int, optional)
+- "boundaries-read": boundaries for read latencies, overriding "boundaries"
+                     (json-array of json-int, optional)
+- "boundaries-write": boundaries for write latencies, overriding "boundaries"
+                      (json-array of json-int, optional)
+- "boundaries-flush": boundaries for flush latencies, overriding "boundaries"
+                      (json-array of json-int, optional)
+
+If only "device" is given, all histograms of the device are removed.  Setting
+the boundaries of a histogram resets its counters.
+
+Example:
+
+-> { "execute": "block-latency-histogram-set",
+     "arguments": { "device": "drive0",
+                    "boundaries": [10000, 50000, 100000, 1000000] } }
+<- { "return": {} }
+
 EQMP
 
     {
         .name       = "block_set_io_throttle",
-        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,bps_max:l?,bps_rd_max:l?,bps_wr_max:l?,iops_max:l?,iops_rd_max:l?,iops_wr_max:l?,iops_size:l?",
+        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,bps_max:l?,bps_rd_max:l?,bps_wr_max:l?,iops_max:l?,iops_rd_max:l?,iops_wr_max:l?,iops_size:l?,group:s?",
         .mhandler.cmd_new = qmp_marshal_input_block_set_io_throttle,
     },
 
@@ -1879,6 +1938,7 @@ Arguments:
 - "iops_rd_max":  read I/O operations max (json-int)
 - "iops_wr_max":  write I/O operations max (json-int)
 - "iops_size":  I/O size in bytes when limiting (json-int)
+- "group": throttle group name (json-string, optional)
 
 Example:
 
@@ -2292,6 +2352,7 @@ Each json-object contain the following:
          - "iops_rd_max":  read I/O operations max (json-int)
          - "iops_wr_max":  write I/O operations max (json-int)
          - "iops_size": I/O size when limiting by iops (json-int)
+         - "group": throttle group name (json-string, optional)
          - "detect_zeroes": detect and optimize zero writing (json-string)
              - Possible values: "off", "on", "unmap"
          - "write_threshold": write offset threshold in bytes, a event will be
@@ -2458,6 +2519,37 @@ Each json-object contain the following:
                    another request (json-int)
     - "wr_merged": number of write requests that have been merged into
                    another request (json-int)
+    - "idle_time_ns": time since the last I/O operation, in nanoseconds
+                      (json-int, optional)
+    - "failed_rd_operations": failed read operations (json-int)
+    - "failed_wr_operations": failed write operations (json-int)
+    - "failed_flush_operations": failed flush operations (json-int)
+    - "invalid_rd_operations": invalid read operations (json-int)
+    - "invalid_wr_operations": invalid write operations (json-int)
+    - "invalid_flush_operations": invalid flush operations (json-int)
+    - "account_invalid": whether invalid operations are included in the
+                         last access statistics (json-bool)
+    - "account_failed": whether failed operations are included in the
+                         latency and last access statistics (json-bool)
+    - "timed_stats": A json-array containing statistics collected in
+                     specific intervals, with the following members:
+        - "interval_length": interval used for calculating the
+                             statistics, in seconds (json-int)
+        - "min_rd_latency_ns", "max_rd_latency_ns", "avg_rd_latency_ns",
+          "min_wr_latency_ns", "max_wr_latency_ns", "avg_wr_latency_ns",
+          "min_flush_latency_ns", "max_flush_latency_ns",
+          "avg_flush_latency_ns": minimum, maximum and average latency of
+                                  the operations in the interval, in
+                                  nanoseconds (json-int)
+        - "avg_rd_queue_depth", "avg_wr_queue_depth": average number of
+                                pending operations (json-number)
+        - "rd_iops", "wr_iops", "flush_iops": completed operations per
+                                second (json-number)
+    - "rd_latency_histogram", "wr_latency_histogram",
+      "flush_latency_histogram": latency histograms set with
+                                 block-latency-histogram-set, containing
+                                 "boundaries" and "bins" (json-object,
+                                 optional)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
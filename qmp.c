@@ -185,6 +185,13 @@ void qmp_cont(Error **errp)
     if (runstate_check(RUN_STATE_INMIGRATE)) {
         autostart = 1;
     } else {
+        /* After a completed outgoing migration the images were handed over
+         * and must be activated again */
+        bdrv_invalidate_cache_all(&local_err);
+        if (local_err) {
+            error_propagate(errp, local_err);
+            return;
+        }
         vm_start();
     }
 }
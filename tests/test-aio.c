@@ -15,6 +15,7 @@
 #include "qemu/timer.h"
 #include "qemu/sockets.h"
 #include "qemu/error-report.h"
+#include "qapi/error.h"
 
 static AioContext *ctx;
 
@@ -379,6 +380,48 @@ static void test_flush_event_notifier(void)
     event_notifier_cleanup(&data.e);
 }
 
+/* Enough handlers to make aio_poll switch from ppoll to epoll */
+#define MANY_NOTIFIERS 100
+
+static void test_wait_many_event_notifiers(void)
+{
+    EventNotifierTestData data[MANY_NOTIFIERS];
+    int i;
+
+    for (i = 0; i < MANY_NOTIFIERS; i++) {
+        data[i] = (EventNotifierTestData) { .n = 0, .active = 1 };
+        event_notifier_init(&data[i].e, false);
+        aio_set_event_notifier(ctx, &data[i].e, event_ready_cb);
+    }
+    g_assert(!aio_poll(ctx, false));
+
+    for (i = 0; i < MANY_NOTIFIERS; i += 7) {
+        event_notifier_set(&data[i].e);
+    }
+    while (aio_poll(ctx, false)) {
+        /* Dispatch everything that is ready */
+    }
+    for (i = 0; i < MANY_NOTIFIERS; i++) {
+        g_assert_cmpint(data[i].n, ==, i % 7 ? 0 : 1);
+        g_assert_cmpint(data[i].active, ==, i % 7 ? 1 : 0);
+    }
+
+    /* Removing half of the handlers must not leave stale registrations */
+    for (i = 0; i < MANY_NOTIFIERS; i += 2) {
+        aio_set_event_notifier(ctx, &data[i].e, NULL);
+        event_notifier_cleanup(&data[i].e);
+    }
+    event_notifier_set(&data[MANY_NOTIFIERS - 1].e);
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data[MANY_NOTIFIERS - 1].n, ==, 1);
+
+    for (i = 1; i < MANY_NOTIFIERS; i += 2) {
+        aio_set_event_notifier(ctx, &data[i].e, NULL);
+        event_notifier_cleanup(&data[i].e);
+    }
+    g_assert(!aio_poll(ctx, false));
+}
+
 static void test_wait_event_notifier_noflush(void)
 {
     EventNotifierTestData data = { .n = 0 };
@@ -810,6 +853,51 @@ static void test_source_timer_schedule(void)
 }
 
 
+/* Benchmarks.  */
+
+static void dummy_event_cb(EventNotifier *e)
+{
+    event_notifier_test_and_clear(e);
+}
+
+/* Measure the cost of one aio_poll iteration that dispatches a single
+ * ready handler, as a function of the number of registered handlers.
+ */
+static void perf_poll_handlers(gconstpointer opaque)
+{
+    unsigned int nr_handlers = GPOINTER_TO_UINT(opaque);
+    unsigned int i, maxcycles = 100000;
+    EventNotifier *notifiers;
+    AioContext *perf_ctx;
+    double duration;
+
+    perf_ctx = aio_context_new(&error_abort);
+    notifiers = g_new(EventNotifier, nr_handlers);
+    for (i = 0; i < nr_handlers; i++) {
+        event_notifier_init(&notifiers[i], false);
+        aio_set_event_notifier(perf_ctx, &notifiers[i], dummy_event_cb);
+    }
+
+    g_test_timer_start();
+    for (i = 0; i < maxcycles; i++) {
+        event_notifier_set(&notifiers[i % nr_handlers]);
+        aio_poll(perf_ctx, true);
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("aio_poll with %u handlers: %u iterations %f s, "
+                   "%luns per iteration",
+                   nr_handlers, maxcycles, duration,
+                   (unsigned long)(1000000000.0 * duration / maxcycles));
+
+    for (i = 0; i < nr_handlers; i++) {
+        aio_set_event_notifier(perf_ctx, &notifiers[i], NULL);
+        event_notifier_cleanup(&notifiers[i]);
+    }
+    g_free(notifiers);
+    aio_context_unref(perf_ctx);
+}
+
 /* End of tests.  */
 
 int main(int argc, char **argv)
@@ -846,6 +934,7 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/event/wait",              test_wait_event_notifier);
     g_test_add_func("/aio/event/wait/no-flush-cb",  test_wait_event_notifier_noflush);
     g_test_add_func("/aio/event/flush",             test_flush_event_notifier);
+    g_test_add_func("/aio/event/wait/many",         test_wait_many_event_notifiers);
     g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
 
     g_test_add_func("/aio-gsource/notify",                  test_source_notify);
@@ -862,5 +951,15 @@ int main(int argc, char **argv)
     g_test_add_func("/aio-gsource/event/wait/no-flush-cb",  test_source_wait_event_notifier_noflush);
     g_test_add_func("/aio-gsource/event/flush",             test_source_flush_event_notifier);
     g_test_add_func("/aio-gsource/timer/schedule",          test_source_timer_schedule);
+    if (g_test_perf()) {
+        g_test_add_data_func("/perf/aio-poll/handlers/8",
+                             GUINT_TO_POINTER(8), perf_poll_handlers);
+        g_test_add_data_func("/perf/aio-poll/handlers/32",
+                             GUINT_TO_POINTER(32), perf_poll_handlers);
+        g_test_add_data_func("/perf/aio-poll/handlers/128",
+                             GUINT_TO_POINTER(128), perf_poll_handlers);
+        g_test_add_data_func("/perf/aio-poll/handlers/512",
+                             GUINT_TO_POINTER(512), perf_poll_handlers);
+    }
     return g_test_run();
 }
@@ -226,6 +226,34 @@ static void test_parse_uint_full_correct(void)
     g_assert_cmpint(i, ==, 123);
 }
 
+static void test_buffer_find_nonzero_offset(void)
+{
+    const size_t len = 64 * 1024;
+    uint8_t *buf = qemu_memalign(64, len);
+    size_t pos, chunk, ret;
+
+    chunk = BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR * sizeof(VECTYPE);
+
+    memset(buf, 0, len);
+    g_assert(can_use_buffer_find_nonzero_offset(buf, len));
+    g_assert_cmpint(buffer_find_nonzero_offset(buf, len), ==, len);
+    g_assert(buffer_is_zero(buf, len));
+
+    for (pos = 0; pos < len; pos += 37) {
+        buf[pos] = 1;
+        ret = buffer_find_nonzero_offset(buf, len);
+        if (pos < chunk) {
+            g_assert_cmpint(ret, ==, QEMU_ALIGN_DOWN(pos, sizeof(VECTYPE)));
+        } else {
+            g_assert_cmpint(ret, ==, QEMU_ALIGN_DOWN(pos, chunk));
+        }
+        g_assert(!buffer_is_zero(buf, len));
+        buf[pos] = 0;
+    }
+
+    qemu_vfree(buf);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -246,6 +274,8 @@ int main(int argc, char **argv)
                     test_parse_uint_full_trailing);
     g_test_add_func("/cutils/parse_uint_full/correct",
                     test_parse_uint_full_correct);
+    g_test_add_func("/cutils/buffer_find_nonzero_offset",
+                    test_buffer_find_nonzero_offset);
 
     return g_test_run();
 }
@@ -602,6 +602,67 @@ static void test_hbitmap_truncate_shrink_large(TestHBitmapData *data,
     hbitmap_test_truncate(data, size, -diff, 0);
 }
 
+/* Serialize the bitmap and load it back into a fresh one, in two parts
+ * so that both the aligned and the final partial chunk are exercised.
+ */
+static void hbitmap_test_serialize_roundtrip(TestHBitmapData *data)
+{
+    uint64_t gran = hbitmap_serialization_granularity(data->hb);
+    uint64_t split = (data->size / 2) & ~(gran - 1);
+    uint64_t len = hbitmap_serialization_size(data->hb, 0, data->size);
+    uint8_t *buf = g_malloc0(len);
+    HBitmap *hb;
+    uint64_t i;
+
+    hbitmap_serialize_part(data->hb, buf, 0, split);
+    hbitmap_serialize_part(data->hb,
+                           buf + hbitmap_serialization_size(data->hb, 0, split),
+                           split, data->size - split);
+
+    hb = hbitmap_alloc(data->size, data->granularity);
+    hbitmap_deserialize_part(hb, buf, 0, split, false);
+    hbitmap_deserialize_part(hb,
+                             buf + hbitmap_serialization_size(hb, 0, split),
+                             split, data->size - split, true);
+
+    g_assert_cmpint(hbitmap_count(hb), ==, hbitmap_count(data->hb));
+    for (i = 0; i < data->size; i++) {
+        g_assert_cmpint(hbitmap_get(hb, i), ==, hbitmap_get(data->hb, i));
+    }
+
+    /* The deserialized bitmap must also iterate correctly */
+    hbitmap_free(data->hb);
+    data->hb = hb;
+    hbitmap_test_check(data, 0);
+    g_free(buf);
+}
+
+static void test_hbitmap_serialize_empty(TestHBitmapData *data,
+                                         const void *unused)
+{
+    hbitmap_test_init(data, L2 + 7, 0);
+    hbitmap_test_serialize_roundtrip(data);
+}
+
+static void test_hbitmap_serialize_part(TestHBitmapData *data,
+                                        const void *unused)
+{
+    hbitmap_test_init(data, L3 / 2 + 7, 0);
+    hbitmap_test_set(data, 0, 1);
+    hbitmap_test_set(data, L1 - 1, 3);
+    hbitmap_test_set(data, L2 + 1, L1 + 5);
+    hbitmap_test_set(data, L3 / 2 + 6, 1);
+    hbitmap_test_serialize_roundtrip(data);
+}
+
+static void test_hbitmap_serialize_full(TestHBitmapData *data,
+                                        const void *unused)
+{
+    hbitmap_test_init(data, L2 * 3 + 1, 0);
+    hbitmap_test_set(data, 0, L2 * 3 + 1);
+    hbitmap_test_serialize_roundtrip(data);
+}
+
 static void hbitmap_test_add(const char *testpath,
                                    void (*test_func)(TestHBitmapData *data, const void *user_data))
 {
@@ -650,6 +711,10 @@ int main(int argc, char **argv)
                      test_hbitmap_truncate_grow_large);
     hbitmap_test_add("/hbitmap/truncate/shrink/large",
                      test_hbitmap_truncate_shrink_large);
+
+    hbitmap_test_add("/hbitmap/serialize/empty", test_hbitmap_serialize_empty);
+    hbitmap_test_add("/hbitmap/serialize/part", test_hbitmap_serialize_part);
+    hbitmap_test_add("/hbitmap/serialize/full", test_hbitmap_serialize_full);
     g_test_run();
 
     return 0;
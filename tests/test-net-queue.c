@@ -0,0 +1,470 @@
+/*
+ * NetQueue unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <string.h>
+#include "qemu-common.h"
+#include "qemu/iov.h"
+#include "net/net.h"
+#include "net/queue.h"
+
+#define PKT_SIZE    64
+#define MAX_PKTS    1024
+
+/* The receiving end of the queue.  It takes up to @budget packets and
+ * then stalls until the test gives it a new budget, like a guest that
+ * runs out of receive buffers.
+ */
+typedef struct TestPeer {
+    bool has_batch;             /* like NetClientInfo.receive_batch */
+    int budget;                 /* -1 takes everything */
+    bool stalled;
+    int batch_calls;
+    int single_calls;
+    int received[MAX_PKTS];     /* first payload byte of each packet */
+    int nb_received;
+    void (*on_receive)(void);   /* runs once, from the next delivery */
+} TestPeer;
+
+static TestPeer peer;
+static NetQueue *queue;
+static NetClientState senders[2];
+static int sent_calls[2];
+static ssize_t sent_ret[2];
+
+/* Stubs for the delivery functions of net/net.c */
+
+int qemu_can_send_packet(NetClientState *nc)
+{
+    return !peer.stalled;
+}
+
+static bool peer_take(const uint8_t *data, size_t size)
+{
+    size_t i;
+
+    if (peer.budget == 0) {
+        peer.stalled = true;
+        return false;
+    }
+    if (peer.budget > 0) {
+        peer.budget--;
+    }
+
+    /* Payloads are filled with their id; check that none was mixed up */
+    for (i = 1; i < size; i++) {
+        g_assert_cmpint(data[i], ==, data[0]);
+    }
+    g_assert_cmpint(peer.nb_received, <, MAX_PKTS);
+    peer.received[peer.nb_received++] = data[0];
+    return true;
+}
+
+static void peer_hook(void)
+{
+    void (*fn)(void) = peer.on_receive;
+
+    if (fn) {
+        peer.on_receive = NULL;
+        fn();
+    }
+}
+
+ssize_t qemu_deliver_packet(NetClientState *sender,
+                            unsigned flags,
+                            const uint8_t *data,
+                            size_t size,
+                            void *opaque)
+{
+    g_assert(opaque == &peer);
+    peer.single_calls++;
+    if (!peer_take(data, size)) {
+        return 0;
+    }
+    peer_hook();
+    return size;
+}
+
+ssize_t qemu_deliver_packet_iov(NetClientState *sender,
+                                unsigned flags,
+                                const struct iovec *iov,
+                                int iovcnt,
+                                void *opaque)
+{
+    size_t size = iov_size(iov, iovcnt);
+    uint8_t *buf = g_malloc(size);
+    ssize_t ret;
+
+    iov_to_buf(iov, iovcnt, 0, buf, size);
+    ret = qemu_deliver_packet(sender, flags, buf, size, opaque);
+    g_free(buf);
+    return ret;
+}
+
+/* Same as net/net.c: peers without receive_batch get one packet at a
+ * time, until one is refused.
+ */
+int qemu_deliver_packet_batch(NetClientState *sender,
+                              unsigned flags,
+                              const struct iovec *pkts,
+                              int count,
+                              void *opaque)
+{
+    int i;
+
+    g_assert(opaque == &peer);
+    if (!peer.has_batch) {
+        for (i = 0; i < count; i++) {
+            if (qemu_deliver_packet(sender, flags, pkts[i].iov_base,
+                                    pkts[i].iov_len, opaque) == 0) {
+                break;
+            }
+        }
+        return i;
+    }
+
+    peer.batch_calls++;
+    for (i = 0; i < count; i++) {
+        if (!peer_take(pkts[i].iov_base, pkts[i].iov_len)) {
+            break;
+        }
+    }
+    peer_hook();
+    return i;
+}
+
+static void sent_cb(NetClientState *sender, ssize_t ret)
+{
+    int i = sender - senders;
+
+    sent_calls[i]++;
+    sent_ret[i] = ret;
+}
+
+static void setup(bool has_batch, int budget)
+{
+    memset(&peer, 0, sizeof(peer));
+    peer.has_batch = has_batch;
+    peer.budget = budget;
+    memset(sent_calls, 0, sizeof(sent_calls));
+    memset(sent_ret, 0, sizeof(sent_ret));
+    queue = qemu_new_net_queue(&peer);
+}
+
+static void teardown(void)
+{
+    qemu_del_net_queue(queue);
+    queue = NULL;
+}
+
+/* Let the peer take @budget more packets and flush the queue */
+static bool resume(int budget)
+{
+    peer.budget = budget;
+    peer.stalled = false;
+    return qemu_net_queue_flush(queue);
+}
+
+static void assert_received(int first, int count)
+{
+    int i;
+
+    g_assert_cmpint(peer.nb_received, ==, count);
+    for (i = 0; i < count; i++) {
+        g_assert_cmpint(peer.received[i], ==, first + i);
+    }
+}
+
+/* A burst of @count packets with ids starting at @first */
+static struct iovec *make_burst(int first, int count)
+{
+    struct iovec *pkts = g_new(struct iovec, count);
+    int i;
+
+    for (i = 0; i < count; i++) {
+        pkts[i].iov_base = g_malloc(PKT_SIZE);
+        pkts[i].iov_len = PKT_SIZE;
+        memset(pkts[i].iov_base, first + i, PKT_SIZE);
+    }
+    return pkts;
+}
+
+/* Send a copied packet of @size bytes filled with @id */
+static void send_one(int sender, int id, size_t size)
+{
+    uint8_t *buf = g_malloc(size);
+
+    memset(buf, id, size);
+    qemu_net_queue_send(queue, &senders[sender], 0, buf, size, sent_cb);
+    g_free(buf);
+}
+
+static void free_burst(struct iovec *pkts, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        g_free(pkts[i].iov_base);
+    }
+    g_free(pkts);
+}
+
+static void test_batch_all(void)
+{
+    struct iovec *pkts = make_burst(0, 8);
+    int ret;
+
+    setup(true, -1);
+    ret = qemu_net_queue_send_batch(queue, &senders[0], 0, pkts, 8, sent_cb);
+    g_assert_cmpint(ret, ==, 8);
+    g_assert_cmpint(peer.batch_calls, ==, 1);
+    assert_received(0, 8);
+    g_assert_cmpint(sent_calls[0], ==, 0);
+    teardown();
+    free_burst(pkts, 8);
+}
+
+static void test_batch_partial(void)
+{
+    struct iovec *pkts = make_burst(0, 8);
+    int ret;
+
+    setup(true, 3);
+    ret = qemu_net_queue_send_batch(queue, &senders[0], 0, pkts, 8, sent_cb);
+    g_assert_cmpint(ret, ==, 0);
+    assert_received(0, 3);
+
+    /* The rest is queued by reference, so the sender must not touch the
+     * buffers before its callback; show that by changing one.
+     */
+    memset(pkts[3].iov_base, 42, PKT_SIZE);
+    g_assert(!resume(2));
+    g_assert_cmpint(peer.nb_received, ==, 5);
+    g_assert_cmpint(peer.received[3], ==, 42);
+    g_assert_cmpint(peer.received[4], ==, 4);
+    g_assert_cmpint(sent_calls[0], ==, 0);
+
+    /* Only the last packet carries the sent callback */
+    g_assert(resume(-1));
+    g_assert_cmpint(peer.nb_received, ==, 8);
+    g_assert_cmpint(peer.received[7], ==, 7);
+    g_assert_cmpint(sent_calls[0], ==, 1);
+    g_assert_cmpint(sent_ret[0], ==, PKT_SIZE);
+    g_assert_cmpint(peer.batch_calls, ==, 3);
+    teardown();
+    free_burst(pkts, 8);
+}
+
+static void test_batch_fallback(void)
+{
+    struct iovec *pkts = make_burst(0, 8);
+    int ret;
+
+    setup(false, 3);
+    ret = qemu_net_queue_send_batch(queue, &senders[0], 0, pkts, 8, sent_cb);
+    g_assert_cmpint(ret, ==, 0);
+    assert_received(0, 3);
+    g_assert_cmpint(peer.single_calls, ==, 4);
+
+    g_assert(resume(-1));
+    assert_received(0, 8);
+    g_assert_cmpint(peer.single_calls, ==, 9);
+    g_assert_cmpint(peer.batch_calls, ==, 0);
+    g_assert_cmpint(sent_calls[0], ==, 1);
+    teardown();
+    free_burst(pkts, 8);
+}
+
+static void test_batch_stalled(void)
+{
+    struct iovec *pkts = make_burst(0, 8);
+    int ret;
+
+    /* Nothing is delivered while the peer cannot receive */
+    setup(true, -1);
+    peer.stalled = true;
+    ret = qemu_net_queue_send_batch(queue, &senders[0], 0, pkts, 8, sent_cb);
+    g_assert_cmpint(ret, ==, 0);
+    g_assert_cmpint(peer.batch_calls, ==, 0);
+
+    /* ...and the queued burst goes out as one batch later */
+    g_assert(resume(-1));
+    assert_received(0, 8);
+    g_assert_cmpint(peer.batch_calls, ==, 1);
+    g_assert_cmpint(sent_calls[0], ==, 1);
+    teardown();
+    free_burst(pkts, 8);
+}
+
+static void test_ring_wrap(void)
+{
+    int i;
+
+    /* Move the head of the ring away from slot zero... */
+    setup(true, -1);
+    peer.stalled = true;
+    for (i = 0; i < 40; i++) {
+        send_one(0, i, PKT_SIZE);
+    }
+    g_assert(!resume(30));
+    assert_received(0, 30);
+
+    /* ...then grow it while the packets wrap around its end */
+    peer.stalled = true;
+    for (i = 40; i < 200; i++) {
+        send_one(0, i, PKT_SIZE);
+    }
+    g_assert(resume(-1));
+    assert_received(0, 200);
+    g_assert_cmpint(sent_calls[0], ==, 200);
+    teardown();
+}
+
+static void reentrant_send(void)
+{
+    send_one(0, 100, PKT_SIZE);
+    send_one(0, 101, PKT_SIZE);
+}
+
+static void test_flush_reentrant(void)
+{
+    int i;
+
+    setup(true, -1);
+    peer.stalled = true;
+    for (i = 0; i < 10; i++) {
+        send_one(0, i, PKT_SIZE);
+    }
+
+    /* Packets that the peer leaves behind go back to the head of the
+     * queue, ahead of those sent while they were being delivered.
+     */
+    peer.on_receive = reentrant_send;
+    g_assert(!resume(4));
+    assert_received(0, 4);
+
+    g_assert(resume(-1));
+    g_assert_cmpint(peer.nb_received, ==, 12);
+    for (i = 4; i < 10; i++) {
+        g_assert_cmpint(peer.received[i], ==, i);
+    }
+    g_assert_cmpint(peer.received[10], ==, 100);
+    g_assert_cmpint(peer.received[11], ==, 101);
+    teardown();
+}
+
+static void test_flush_split(void)
+{
+    int i;
+
+    /* Consecutive packets from the same sender make up one batch */
+    setup(true, -1);
+    peer.stalled = true;
+    for (i = 0; i < 9; i++) {
+        send_one(i / 3 == 1, i, PKT_SIZE);
+    }
+    g_assert(resume(-1));
+    assert_received(0, 9);
+    g_assert_cmpint(peer.batch_calls, ==, 3);
+    g_assert_cmpint(sent_calls[0], ==, 6);
+    g_assert_cmpint(sent_calls[1], ==, 3);
+    teardown();
+}
+
+static void purge_sent_cb(NetClientState *sender, ssize_t ret)
+{
+    sent_cb(sender, ret);
+    g_assert_cmpint(ret, ==, 0);
+
+    /* The purged packets are already out of the ring */
+    if (sent_calls[0] == 1) {
+        send_one(1, 50, PKT_SIZE);
+    }
+}
+
+static void test_purge(void)
+{
+    uint8_t buf[PKT_SIZE];
+    int i;
+
+    setup(true, -1);
+    peer.stalled = true;
+    for (i = 0; i < 10; i++) {
+        memset(buf, i, sizeof(buf));
+        qemu_net_queue_send(queue, &senders[i % 2], 0, buf, sizeof(buf),
+                            i % 2 ? sent_cb : purge_sent_cb);
+    }
+
+    qemu_net_queue_purge(queue, &senders[0]);
+    g_assert_cmpint(sent_calls[0], ==, 5);
+    g_assert_cmpint(sent_calls[1], ==, 0);
+
+    g_assert(resume(-1));
+    g_assert_cmpint(peer.nb_received, ==, 6);
+    for (i = 0; i < 5; i++) {
+        g_assert_cmpint(peer.received[i], ==, 2 * i + 1);
+    }
+    g_assert_cmpint(peer.received[5], ==, 50);
+    g_assert_cmpint(sent_calls[1], ==, 6);
+    teardown();
+}
+
+static void test_purge_nocopy(void)
+{
+    struct iovec *pkts = make_burst(0, 8);
+
+    /* A purged burst still gets its sent callback, so that the sender
+     * can reuse its buffers.
+     */
+    setup(true, 2);
+    g_assert_cmpint(qemu_net_queue_send_batch(queue, &senders[0], 0, pkts, 8,
+                                              sent_cb), ==, 0);
+    qemu_net_queue_purge(queue, &senders[0]);
+    g_assert_cmpint(sent_calls[0], ==, 1);
+    g_assert_cmpint(sent_ret[0], ==, 0);
+
+    g_assert(resume(-1));
+    assert_received(0, 2);
+    teardown();
+    free_burst(pkts, 8);
+}
+
+static void test_pool(void)
+{
+    static const size_t sizes[] = { 60, PKT_SIZE, 1514, 2048, 2049, 9000 };
+    int round, i;
+
+    /* Recycled packets of any size must not leak stale payload */
+    setup(false, -1);
+    for (round = 0; round < 4; round++) {
+        peer.stalled = true;
+        peer.nb_received = 0;
+        for (i = 0; i < 100; i++) {
+            send_one(0, i, sizes[(i + round) % ARRAY_SIZE(sizes)]);
+        }
+        g_assert(resume(-1));
+        assert_received(0, 100);
+    }
+    g_assert_cmpint(sent_calls[0], ==, 400);
+    teardown();
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/net/queue/batch/all", test_batch_all);
+    g_test_add_func("/net/queue/batch/partial", test_batch_partial);
+    g_test_add_func("/net/queue/batch/fallback", test_batch_fallback);
+    g_test_add_func("/net/queue/batch/stalled", test_batch_stalled);
+    g_test_add_func("/net/queue/ring/wrap", test_ring_wrap);
+    g_test_add_func("/net/queue/flush/reentrant", test_flush_reentrant);
+    g_test_add_func("/net/queue/flush/split", test_flush_split);
+    g_test_add_func("/net/queue/purge/senders", test_purge);
+    g_test_add_func("/net/queue/purge/nocopy", test_purge_nocopy);
+    g_test_add_func("/net/queue/pool", test_pool);
+    return g_test_run();
+}
@@ -15,6 +15,11 @@
 #include "qemu/option.h"
 #include "sysemu/char.h"
 #include "sysemu/sysemu.h"
+#include "libqos/virtio.h"
+#include "libqos/virtio-pci.h"
+#include "libqos/pci-pc.h"
+#include "libqos/malloc.h"
+#include "libqos/malloc-pc.h"
 
 #include <linux/vhost.h>
 #include <sys/mman.h>
@@ -47,12 +52,41 @@
 #define QEMU_CMD        QEMU_CMD_ACCEL QEMU_CMD_MEM QEMU_CMD_CHR \
                         QEMU_CMD_NETDEV QEMU_CMD_NET QEMU_CMD_ROM
 
+/* Two queue pairs, driven by the test through libqos instead of a ROM */
+#define QEMU_CMD_MQ_NETDEV  " -netdev vhost-user,id=net0,chardev=chr0," \
+                            "vhostforce,queues=2"
+#define QEMU_CMD_MQ_NET     " -device virtio-net-pci,netdev=net0,mq=on," \
+                            "romfile="
+#define QEMU_CMD_MQ         QEMU_CMD_MEM QEMU_CMD_CHR "%s" \
+                            QEMU_CMD_MQ_NETDEV QEMU_CMD_MQ_NET
+
+#define QVIRTIO_NET_F_CTRL_VQ   0x00020000
+#define QVIRTIO_NET_F_MQ        0x00400000
+
+#define QVIRTIO_NET_CTRL_MQ             4
+#define QVIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET 0
+
+#define TEST_PAIRS          2
+#define TEST_VRINGS         (TEST_PAIRS * 2)
+#define TEST_MAX_MEM_SLOTS  8
+#define TEST_TIMEOUT_US     (10 * 1000 * 1000)
+
+/* i440FX register for the shadow RAM at 0xc0000-0xc3fff (low nibble) */
+#define I440FX_PAM1         0x5a
+#define PAM_RAM_ADDR        0xc0000
+#define PAM_RAM_SIZE        0x4000
+
 #define HUGETLBFS_MAGIC       0x958458f6
 
 /*********** FROM hw/virtio/vhost-user.c *************************************/
 
 #define VHOST_MEMORY_MAX_NREGIONS    8
 
+#define VHOST_USER_F_PROTOCOL_FEATURES 30
+
+#define VHOST_USER_PROTOCOL_F_MQ                    0
+#define VHOST_USER_PROTOCOL_F_CONFIGURE_MEM_SLOTS  15
+
 typedef enum VhostUserRequest {
     VHOST_USER_NONE = 0,
     VHOST_USER_GET_FEATURES = 1,
@@ -69,6 +103,13 @@ typedef enum VhostUserRequest {
     VHOST_USER_SET_VRING_KICK = 12,
     VHOST_USER_SET_VRING_CALL = 13,
     VHOST_USER_SET_VRING_ERR = 14,
+    VHOST_USER_GET_PROTOCOL_FEATURES = 15,
+    VHOST_USER_SET_PROTOCOL_FEATURES = 16,
+    VHOST_USER_GET_QUEUE_NUM = 17,
+    VHOST_USER_SET_VRING_ENABLE = 18,
+    VHOST_USER_GET_MAX_MEM_SLOTS = 36,
+    VHOST_USER_ADD_MEM_REG = 37,
+    VHOST_USER_REM_MEM_REG = 38,
     VHOST_USER_MAX
 } VhostUserRequest;
 
@@ -85,6 +126,11 @@ typedef struct VhostUserMemory {
     VhostUserMemoryRegion regions[VHOST_MEMORY_MAX_NREGIONS];
 } VhostUserMemory;
 
+typedef struct VhostUserMemRegMsg {
+    uint64_t padding;
+    VhostUserMemoryRegion region;
+} VhostUserMemRegMsg;
+
 typedef struct VhostUserMsg {
     VhostUserRequest request;
 
@@ -97,6 +143,7 @@ typedef struct VhostUserMsg {
         struct vhost_vring_state state;
         struct vhost_vring_addr addr;
         VhostUserMemory memory;
+        VhostUserMemRegMsg mem_reg;
     };
 } QEMU_PACKED VhostUserMsg;
 
@@ -111,10 +158,30 @@ static VhostUserMsg m __attribute__ ((unused));
 #define VHOST_USER_VERSION    (0x1)
 /*****************************************************************************/
 
-int fds_num = 0, fds[VHOST_MEMORY_MAX_NREGIONS];
-static VhostUserMemory memory;
+/* What the test offers as a vhost-user slave, and what QEMU told it */
+typedef struct TestSlave {
+    uint64_t features;
+    uint64_t protocol_features;
+    uint64_t acked_features;
+    uint64_t acked_protocol_features;
+    int connections;
+    int get_features;
+    int get_queue_num;
+    int set_mem_table;
+    int removed_regions;
+    int nregions;
+    VhostUserMemoryRegion regions[TEST_MAX_MEM_SLOTS];
+    int fds[TEST_MAX_MEM_SLOTS];
+    int vring_base[TEST_VRINGS];    /* -1 until set */
+    int vring_enable[TEST_VRINGS];  /* -1 until set */
+} TestSlave;
+
+static TestSlave slave;
 static GMutex *data_mutex;
 static GCond *data_cond;
+static const char *hugefs;
+static char *socket_path;
+static CharDriverState *server_chr;
 
 static gint64 _get_time(void)
 {
@@ -201,58 +268,89 @@ static GThread *_thread_new(const gchar *name, GThreadFunc func, gpointer data)
     return thread;
 }
 
-static void read_guest_mem(void)
+/* Wait, with data_mutex held, until the slave state satisfies @cond */
+#define SLAVE_WAIT(cond) do {                                           \
+    gint64 end_time = _get_time() + TEST_TIMEOUT_US;                    \
+    while (!(cond)) {                                                   \
+        if (!_cond_wait_until(data_cond, data_mutex, end_time)) {       \
+            /* timeout has passed */                                    \
+            g_assert(cond);                                             \
+            break;                                                      \
+        }                                                               \
+    }                                                                   \
+} while (0)
+
+/* Called with data_mutex held */
+static int slave_find_region(uint64_t guest_phys_addr)
 {
-    uint32_t *guest_mem;
-    gint64 end_time;
-    int i, j;
-    size_t size;
-
-    g_mutex_lock(data_mutex);
+    int i;
 
-    end_time = _get_time() + 5 * G_TIME_SPAN_SECOND;
-    while (!fds_num) {
-        if (!_cond_wait_until(data_cond, data_mutex, end_time)) {
-            /* timeout has passed */
-            g_assert(fds_num);
-            break;
+    for (i = 0; i < slave.nregions; i++) {
+        if (slave.regions[i].guest_phys_addr == guest_phys_addr) {
+            return i;
         }
     }
+    return -1;
+}
 
-    /* check for sanity */
-    g_assert_cmpint(fds_num, >, 0);
-    g_assert_cmpint(fds_num, ==, memory.nregions);
-
-    /* iterate all regions */
-    for (i = 0; i < fds_num; i++) {
+static void slave_clear_regions(void)
+{
+    int i;
 
-        /* We'll check only the region statring at 0x0*/
-        if (memory.regions[i].guest_phys_addr != 0x0) {
-            continue;
-        }
+    for (i = 0; i < slave.nregions; i++) {
+        close(slave.fds[i]);
+    }
+    slave.nregions = 0;
+}
 
-        g_assert_cmpint(memory.regions[i].memory_size, >, 1024);
+/* Compare the start of a region, mapped through its fd, with what the
+ * guest sees at its address.
+ */
+static void check_guest_mem(const VhostUserMemoryRegion *reg, int fd)
+{
+    struct stat st;
+    uint32_t *guest_mem;
+    void *base;
+    int j;
 
-        size =  memory.regions[i].memory_size + memory.regions[i].mmap_offset;
+    g_assert_cmpint(reg->memory_size, >, 1024);
+    g_assert_cmpint(fstat(fd, &st), ==, 0);
+    g_assert_cmpint(st.st_size, >=, reg->mmap_offset + reg->memory_size);
 
-        guest_mem = mmap(0, size, PROT_READ | PROT_WRITE,
-                         MAP_SHARED, fds[i], 0);
+    /* hugetlbfs maps whole pages only, so map all of the file */
+    base = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    g_assert(base != MAP_FAILED);
+    guest_mem = (uint32_t *)((uint8_t *)base + reg->mmap_offset);
 
-        g_assert(guest_mem != MAP_FAILED);
-        guest_mem += (memory.regions[i].mmap_offset / sizeof(*guest_mem));
+    for (j = 0; j < 256; j++) {
+        uint32_t a = readl(reg->guest_phys_addr + j * 4);
+        uint32_t b = guest_mem[j];
 
-        for (j = 0; j < 256; j++) {
-            uint32_t a = readl(memory.regions[i].guest_phys_addr + j*4);
-            uint32_t b = guest_mem[j];
+        g_assert_cmpint(a, ==, b);
+    }
 
-            g_assert_cmpint(a, ==, b);
-        }
+    munmap(base, st.st_size);
+}
 
-        munmap(guest_mem, memory.regions[i].memory_size);
-    }
+/* Check the region at @guest_phys_addr, which must have been sent */
+static void check_region(uint64_t guest_phys_addr, uint64_t size)
+{
+    VhostUserMemoryRegion reg;
+    int i, fd;
 
-    g_assert_cmpint(1, ==, 1);
+    g_mutex_lock(data_mutex);
+    SLAVE_WAIT(slave_find_region(guest_phys_addr) >= 0);
+    i = slave_find_region(guest_phys_addr);
+    reg = slave.regions[i];
+    fd = dup(slave.fds[i]);
     g_mutex_unlock(data_mutex);
+
+    if (size) {
+        g_assert_cmphex(reg.memory_size, ==, size);
+    }
+    g_assert_cmpint(fd, >=, 0);
+    check_guest_mem(&reg, fd);
+    close(fd);
 }
 
 static void *thread_function(void *data)
@@ -268,12 +366,22 @@ static int chr_can_read(void *opaque)
     return VHOST_USER_HDR_SIZE;
 }
 
+static void slave_reply_u64(CharDriverState *chr, VhostUserMsg *msg,
+                            uint64_t u64)
+{
+    msg->flags |= VHOST_USER_REPLY_MASK;
+    msg->size = sizeof(m.u64);
+    msg->u64 = u64;
+    qemu_chr_fe_write_all(chr, (uint8_t *) msg,
+                          VHOST_USER_HDR_SIZE + msg->size);
+}
+
 static void chr_read(void *opaque, const uint8_t *buf, int size)
 {
     CharDriverState *chr = opaque;
     VhostUserMsg msg;
     uint8_t *p = (uint8_t *) &msg;
-    int fd;
+    int fd, i;
 
     if (size != VHOST_USER_HDR_SIZE) {
         g_test_message("Wrong message size received %d\n", size);
@@ -291,11 +399,39 @@ static void chr_read(void *opaque, const uint8_t *buf, int size)
     switch (msg.request) {
     case VHOST_USER_GET_FEATURES:
         /* send back features to qemu */
-        msg.flags |= VHOST_USER_REPLY_MASK;
-        msg.size = sizeof(m.u64);
-        msg.u64 = 0;
-        p = (uint8_t *) &msg;
-        qemu_chr_fe_write_all(chr, p, VHOST_USER_HDR_SIZE + msg.size);
+        slave.get_features++;
+        slave_reply_u64(chr, &msg, slave.features);
+        break;
+
+    case VHOST_USER_SET_FEATURES:
+        slave.acked_features = msg.u64;
+        break;
+
+    case VHOST_USER_GET_PROTOCOL_FEATURES:
+        slave_reply_u64(chr, &msg, slave.protocol_features);
+        break;
+
+    case VHOST_USER_SET_PROTOCOL_FEATURES:
+        slave.acked_protocol_features = msg.u64;
+        break;
+
+    case VHOST_USER_GET_QUEUE_NUM:
+        slave.get_queue_num++;
+        slave_reply_u64(chr, &msg, TEST_PAIRS);
+        break;
+
+    case VHOST_USER_GET_MAX_MEM_SLOTS:
+        slave_reply_u64(chr, &msg, TEST_MAX_MEM_SLOTS);
+        break;
+
+    case VHOST_USER_SET_VRING_BASE:
+        g_assert_cmpint(msg.state.index, <, TEST_VRINGS);
+        slave.vring_base[msg.state.index] = msg.state.num;
+        break;
+
+    case VHOST_USER_SET_VRING_ENABLE:
+        g_assert_cmpint(msg.state.index, <, TEST_VRINGS);
+        slave.vring_enable[msg.state.index] = msg.state.num;
         break;
 
     case VHOST_USER_GET_VRING_BASE:
@@ -309,11 +445,33 @@ static void chr_read(void *opaque, const uint8_t *buf, int size)
 
     case VHOST_USER_SET_MEM_TABLE:
         /* received the mem table */
-        memcpy(&memory, &msg.memory, sizeof(msg.memory));
-        fds_num = qemu_chr_fe_get_msgfds(chr, fds, sizeof(fds) / sizeof(int));
+        slave_clear_regions();
+        slave.nregions = msg.memory.nregions;
+        memcpy(slave.regions, msg.memory.regions,
+               slave.nregions * sizeof(slave.regions[0]));
+        g_assert_cmpint(qemu_chr_fe_get_msgfds(chr, slave.fds,
+                                               VHOST_MEMORY_MAX_NREGIONS),
+                        ==, slave.nregions);
+        slave.set_mem_table++;
+        break;
+
+    case VHOST_USER_ADD_MEM_REG:
+        g_assert_cmpint(slave.nregions, <, TEST_MAX_MEM_SLOTS);
+        slave.regions[slave.nregions] = msg.mem_reg.region;
+        g_assert_cmpint(qemu_chr_fe_get_msgfds(chr,
+                                               &slave.fds[slave.nregions], 1),
+                        ==, 1);
+        slave.nregions++;
+        break;
 
-        /* signal the test that it can continue */
-        g_cond_signal(data_cond);
+    case VHOST_USER_REM_MEM_REG:
+        i = slave_find_region(msg.mem_reg.region.guest_phys_addr);
+        g_assert_cmpint(i, >=, 0);
+        close(slave.fds[i]);
+        slave.nregions--;
+        slave.regions[i] = slave.regions[slave.nregions];
+        slave.fds[i] = slave.fds[slave.nregions];
+        slave.removed_regions++;
         break;
 
     case VHOST_USER_SET_VRING_KICK:
@@ -330,9 +488,75 @@ static void chr_read(void *opaque, const uint8_t *buf, int size)
     default:
         break;
     }
+
+    /* signal the test that it can continue */
+    g_cond_broadcast(data_cond);
     g_mutex_unlock(data_mutex);
 }
 
+/* Called with data_mutex held */
+static void slave_reset(void)
+{
+    int i;
+
+    slave_clear_regions();
+    slave.acked_features = 0;
+    slave.acked_protocol_features = 0;
+    slave.get_features = 0;
+    slave.get_queue_num = 0;
+    slave.set_mem_table = 0;
+    slave.removed_regions = 0;
+    for (i = 0; i < TEST_VRINGS; i++) {
+        slave.vring_base[i] = -1;
+        slave.vring_enable[i] = -1;
+    }
+}
+
+/* Set up the slave for the next QEMU instance */
+static void slave_start(uint64_t features, uint64_t protocol_features)
+{
+    g_mutex_lock(data_mutex);
+    slave_reset();
+    slave.features = features;
+    slave.protocol_features = protocol_features;
+    slave.connections = 0;
+    g_mutex_unlock(data_mutex);
+}
+
+/* Every connection starts from scratch, as a slave that was restarted */
+static void chr_event(void *opaque, int event)
+{
+    if (event != CHR_EVENT_OPENED) {
+        return;
+    }
+
+    g_mutex_lock(data_mutex);
+    slave_reset();
+    slave.connections++;
+    g_cond_broadcast(data_cond);
+    g_mutex_unlock(data_mutex);
+}
+
+static void server_start(void)
+{
+    char *chr_path;
+
+    chr_path = g_strdup_printf("unix:%s,server,nowait", socket_path);
+    server_chr = qemu_chr_new("chr0", chr_path, NULL);
+    g_free(chr_path);
+    g_assert(server_chr != NULL);
+    qemu_chr_add_handlers(server_chr, chr_can_read, chr_read, chr_event,
+                          server_chr);
+}
+
+/* Runs in the main loop thread, which owns the chardev */
+static gboolean restart_server(gpointer data)
+{
+    qemu_chr_delete(server_chr);
+    server_start();
+    return FALSE;
+}
+
 static const char *init_hugepagefs(void)
 {
     const char *path;
@@ -366,14 +590,252 @@ static const char *init_hugepagefs(void)
     return path;
 }
 
+static void read_guest_mem(void)
+{
+    char *qemu_cmd;
+
+    slave_start(0, 0);
+
+    qemu_cmd = g_strdup_printf(QEMU_CMD, hugefs, socket_path);
+    qtest_start(qemu_cmd);
+    g_free(qemu_cmd);
+
+    /* Without protocol features, the whole table comes in one message */
+    g_mutex_lock(data_mutex);
+    SLAVE_WAIT(slave.set_mem_table);
+    g_assert_cmpint(slave.nregions, >, 0);
+    g_mutex_unlock(data_mutex);
+
+    /* We'll check only the region starting at 0x0 */
+    check_region(0, 0);
+
+    qtest_end();
+}
+
+/* A virtio-net device with two queue pairs, driven through libqos */
+typedef struct TestNet {
+    QPCIBus *bus;
+    QVirtioPCIDevice *dev;
+    QGuestAllocator *alloc;
+    QVirtQueue *vq[TEST_VRINGS + 1];    /* the last one is the control vq */
+    uint16_t ctrl_used;
+} TestNet;
+
+static void net_init(TestNet *t)
+{
+    uint32_t features = QVIRTIO_NET_F_MQ | QVIRTIO_NET_F_CTRL_VQ;
+    int i;
+
+    t->bus = qpci_init_pc();
+    t->dev = qvirtio_pci_device_find(t->bus, QVIRTIO_NET_DEVICE_ID);
+    g_assert(t->dev != NULL);
+    qvirtio_pci_device_enable(t->dev);
+    qvirtio_reset(&qvirtio_pci, &t->dev->vdev);
+    qvirtio_set_acknowledge(&qvirtio_pci, &t->dev->vdev);
+    qvirtio_set_driver(&qvirtio_pci, &t->dev->vdev);
+
+    t->alloc = pc_alloc_init();
+    for (i = 0; i <= TEST_VRINGS; i++) {
+        t->vq[i] = qvirtqueue_setup(&qvirtio_pci, &t->dev->vdev, t->alloc, i);
+    }
+    t->ctrl_used = 0;
+
+    g_assert_cmphex(qvirtio_get_features(&qvirtio_pci, &t->dev->vdev) &
+                    features, ==, features);
+    qvirtio_set_features(&qvirtio_pci, &t->dev->vdev, features);
+    qvirtio_set_driver_ok(&qvirtio_pci, &t->dev->vdev);
+}
+
+static void net_end(TestNet *t)
+{
+    int i;
+
+    for (i = 0; i <= TEST_VRINGS; i++) {
+        g_free(t->vq[i]);
+    }
+    pc_alloc_uninit(t->alloc);
+    qvirtio_pci_device_disable(t->dev);
+    g_free(t->dev);
+    qpci_free_pc(t->bus);
+    qtest_end();
+}
+
+static void net_set_queue_pairs(TestNet *t, uint16_t pairs)
+{
+    QVirtQueue *ctrl = t->vq[TEST_VRINGS];
+    uint64_t req = guest_alloc(t->alloc, 4);
+    uint64_t ack = guest_alloc(t->alloc, 1);
+    gint64 start_time;
+    uint32_t head;
+
+    writeb(req, QVIRTIO_NET_CTRL_MQ);
+    writeb(req + 1, QVIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET);
+    writew(req + 2, pairs);
+    writeb(ack, 0xff);
+
+    head = qvirtqueue_add(ctrl, req, 2, false, true);
+    qvirtqueue_add(ctrl, req + 2, 2, false, true);
+    qvirtqueue_add(ctrl, ack, 1, true, false);
+    qvirtqueue_kick(&qvirtio_pci, &t->dev->vdev, ctrl, head);
+
+    start_time = g_get_monotonic_time();
+    while (readw(ctrl->used + 2) == t->ctrl_used) {
+        clock_step(100);
+        g_assert(g_get_monotonic_time() - start_time <= TEST_TIMEOUT_US);
+    }
+    t->ctrl_used++;
+    g_assert_cmpint(readb(ack), ==, 0);
+
+    guest_free(t->alloc, req);
+    guest_free(t->alloc, ack);
+}
+
+/* Called with data_mutex held */
+static void check_vring_enable(int pairs)
+{
+    int i;
+
+    for (i = 0; i < TEST_VRINGS; i++) {
+        g_assert_cmpint(slave.vring_enable[i], ==, i / 2 < pairs);
+    }
+}
+
+static void mq_test_start(TestNet *t, uint64_t protocol_features,
+                          const char *chr_opts)
+{
+    char *qemu_cmd;
+
+    slave_start((1ULL << VHOST_USER_F_PROTOCOL_FEATURES) |
+                QVIRTIO_NET_F_MQ | QVIRTIO_NET_F_CTRL_VQ, protocol_features);
+
+    qemu_cmd = g_strdup_printf(QEMU_CMD_MQ, hugefs, socket_path, chr_opts);
+    qtest_start(qemu_cmd);
+    g_free(qemu_cmd);
+
+    /* Both queue pairs query the features once in the backend and once
+     * in vhost */
+    g_mutex_lock(data_mutex);
+    SLAVE_WAIT(slave.get_features == 2 * TEST_PAIRS);
+    g_mutex_unlock(data_mutex);
+
+    net_init(t);
+
+    /* Only the first queue pair is used until the guest asks for more */
+    g_mutex_lock(data_mutex);
+    SLAVE_WAIT(slave.vring_enable[TEST_VRINGS - 1] != -1);
+    check_vring_enable(1);
+    g_mutex_unlock(data_mutex);
+}
+
+static void test_protocol_features(void)
+{
+    uint64_t known = (1ULL << VHOST_USER_PROTOCOL_F_MQ) |
+                     (1ULL << VHOST_USER_PROTOCOL_F_CONFIGURE_MEM_SLOTS);
+    TestNet t;
+
+    /* Bit 1 is not known to QEMU and must not be acked */
+    mq_test_start(&t, known | (1ULL << 1), "");
+
+    g_mutex_lock(data_mutex);
+    g_assert_cmphex(slave.acked_protocol_features, ==, known);
+    g_assert_cmphex(slave.acked_features, ==, slave.features);
+    g_assert_cmpint(slave.get_queue_num, ==, TEST_PAIRS);
+    g_mutex_unlock(data_mutex);
+
+    net_end(&t);
+}
+
+static void test_multiqueue(void)
+{
+    TestNet t;
+
+    mq_test_start(&t, 1ULL << VHOST_USER_PROTOCOL_F_MQ, "");
+
+    net_set_queue_pairs(&t, 2);
+    g_mutex_lock(data_mutex);
+    SLAVE_WAIT(slave.vring_enable[TEST_VRINGS - 1] == 1);
+    check_vring_enable(2);
+    /* The backend was not restarted for it */
+    g_assert_cmpint(slave.set_mem_table, ==, 1);
+    g_mutex_unlock(data_mutex);
+
+    net_set_queue_pairs(&t, 1);
+    g_mutex_lock(data_mutex);
+    SLAVE_WAIT(slave.vring_enable[TEST_VRINGS - 1] == 0);
+    check_vring_enable(1);
+    g_mutex_unlock(data_mutex);
+
+    net_end(&t);
+}
+
+static void test_mem_slots(void)
+{
+    QPCIDevice *host;
+    TestNet t;
+
+    mq_test_start(&t, (1ULL << VHOST_USER_PROTOCOL_F_MQ) |
+                      (1ULL << VHOST_USER_PROTOCOL_F_CONFIGURE_MEM_SLOTS), "");
+
+    g_mutex_lock(data_mutex);
+    g_assert_cmpint(slave.set_mem_table, ==, 0);
+    g_mutex_unlock(data_mutex);
+    check_region(0, 0);
+
+    /* Shadowing the option ROM area with RAM adds one region... */
+    host = qpci_device_find(t.bus, 0);
+    g_assert(host != NULL);
+    qpci_config_writeb(host, I440FX_PAM1, 0x3);
+    writel(PAM_RAM_ADDR, 0x12345678);
+    check_region(PAM_RAM_ADDR, PAM_RAM_SIZE);
+
+    /* ...and mapping the ROM back removes it, leaving the others alone */
+    qpci_config_writeb(host, I440FX_PAM1, 0);
+    g_mutex_lock(data_mutex);
+    SLAVE_WAIT(slave.removed_regions);
+    g_assert_cmpint(slave.removed_regions, ==, 1);
+    g_assert_cmpint(slave_find_region(PAM_RAM_ADDR), <, 0);
+    g_assert_cmpint(slave_find_region(0), >=, 0);
+    g_assert_cmpint(slave.set_mem_table, ==, 0);
+    g_mutex_unlock(data_mutex);
+
+    g_free(host);
+    net_end(&t);
+}
+
+static void test_reconnect(void)
+{
+    uint64_t acked_features;
+    TestNet t;
+
+    mq_test_start(&t, 1ULL << VHOST_USER_PROTOCOL_F_MQ, ",reconnect=1");
+
+    g_mutex_lock(data_mutex);
+    acked_features = slave.acked_features;
+    g_mutex_unlock(data_mutex);
+
+    /* Pretend the slave used three buffers of the first rx ring */
+    writew(t.vq[0]->used + 2, 3);
+
+    g_idle_add(restart_server, NULL);
+
+    /* The new slave gets the rings where the old one left them, without
+     * the guest having to do anything.
+     */
+    g_mutex_lock(data_mutex);
+    SLAVE_WAIT(slave.connections == 2 &&
+               slave.vring_enable[TEST_VRINGS - 1] != -1);
+    g_assert_cmpint(slave.vring_base[0], ==, 3);
+    g_assert_cmpint(slave.vring_base[1], ==, 0);
+    g_assert_cmphex(slave.acked_features, ==, acked_features);
+    g_assert_cmpint(slave.set_mem_table, ==, 1);
+    check_vring_enable(1);
+    g_mutex_unlock(data_mutex);
+
+    net_end(&t);
+}
+
 int main(int argc, char **argv)
 {
-    QTestState *s = NULL;
-    CharDriverState *chr = NULL;
-    const char *hugefs = 0;
-    char *socket_path = 0;
-    char *qemu_cmd = 0;
-    char *chr_path = 0;
     int ret;
 
     g_test_init(&argc, &argv, NULL);
@@ -389,28 +851,21 @@ int main(int argc, char **argv)
 
     /* create char dev and add read handlers */
     qemu_add_opts(&qemu_chardev_opts);
-    chr_path = g_strdup_printf("unix:%s,server,nowait", socket_path);
-    chr = qemu_chr_new("chr0", chr_path, NULL);
-    g_free(chr_path);
-    qemu_chr_add_handlers(chr, chr_can_read, chr_read, NULL, chr);
-
-    /* run the main loop thread so the chardev may operate */
     data_mutex = _mutex_new();
     data_cond = _cond_new();
-    _thread_new(NULL, thread_function, NULL);
+    server_start();
 
-    qemu_cmd = g_strdup_printf(QEMU_CMD, hugefs, socket_path);
-    s = qtest_start(qemu_cmd);
-    g_free(qemu_cmd);
+    /* run the main loop thread so the chardev may operate */
+    _thread_new(NULL, thread_function, NULL);
 
     qtest_add_func("/vhost-user/read-guest-mem", read_guest_mem);
+    qtest_add_func("/vhost-user/protocol-features", test_protocol_features);
+    qtest_add_func("/vhost-user/multiqueue", test_multiqueue);
+    qtest_add_func("/vhost-user/mem-slots", test_mem_slots);
+    qtest_add_func("/vhost-user/reconnect", test_reconnect);
 
     ret = g_test_run();
 
-    if (s) {
-        qtest_quit(s);
-    }
-
     /* cleanup */
     unlink(socket_path);
     g_free(socket_path);
@@ -33,6 +33,7 @@
 #define QVIRTIO_BLK_F_WCE           0x00000200
 #define QVIRTIO_BLK_F_TOPOLOGY      0x00000400
 #define QVIRTIO_BLK_F_CONFIG_WCE    0x00000800
+#define QVIRTIO_BLK_F_MQ            0x00001000
 
 #define QVIRTIO_BLK_T_IN            0
 #define QVIRTIO_BLK_T_OUT           1
@@ -47,6 +48,7 @@
 #define PCI_SLOT_HP             0x06
 #define PCI_SLOT                0x04
 #define PCI_FN                  0x00
+#define MQ_CONFIG_NUM_QUEUES    34
 
 #define MMIO_PAGE_SIZE          4096
 #define MMIO_DEV_BASE_ADDR      0x0A003E00
@@ -76,18 +78,20 @@ static char *drive_create(void)
     return tmp_path;
 }
 
-static QPCIBus *pci_test_start(void)
+static QPCIBus *pci_test_start_opts(const char *extra_args,
+                                    const char *device_opts)
 {
     char *cmdline;
     char *tmp_path;
 
     tmp_path = drive_create();
 
-    cmdline = g_strdup_printf("-drive if=none,id=drive0,file=%s,format=raw "
+    cmdline = g_strdup_printf("%s"
+                        "-drive if=none,id=drive0,file=%s,format=raw "
                         "-drive if=none,id=drive1,file=/dev/null,format=raw "
                         "-device virtio-blk-pci,id=drv0,drive=drive0,"
-                        "addr=%x.%x",
-                        tmp_path, PCI_SLOT, PCI_FN);
+                        "addr=%x.%x%s",
+                        extra_args, tmp_path, PCI_SLOT, PCI_FN, device_opts);
     qtest_start(cmdline);
     unlink(tmp_path);
     g_free(tmp_path);
@@ -96,6 +100,11 @@ static QPCIBus *pci_test_start(void)
     return qpci_init_pc();
 }
 
+static QPCIBus *pci_test_start(void)
+{
+    return pci_test_start_opts("", "");
+}
+
 static void arm_test_start(void)
 {
     char *cmdline;
@@ -724,6 +733,237 @@ static void pci_hotplug(void)
     test_end();
 }
 
+/* Set up both virtqueues of a device with two queues, from reset */
+static void mq_init(QVirtioPCIDevice *dev, QGuestAllocator *alloc,
+                    QVirtQueue **vq)
+{
+    uint32_t features;
+    int i;
+
+    qvirtio_reset(&qvirtio_pci, &dev->vdev);
+    qvirtio_set_acknowledge(&qvirtio_pci, &dev->vdev);
+    qvirtio_set_driver(&qvirtio_pci, &dev->vdev);
+
+    for (i = 0; i < 2; i++) {
+        vq[i] = qvirtqueue_setup(&qvirtio_pci, &dev->vdev, alloc, i);
+    }
+
+    features = qvirtio_get_features(&qvirtio_pci, &dev->vdev);
+    g_assert(features & QVIRTIO_BLK_F_MQ);
+    qvirtio_set_features(&qvirtio_pci, &dev->vdev, QVIRTIO_BLK_F_MQ);
+    qvirtio_set_driver_ok(&qvirtio_pci, &dev->vdev);
+}
+
+static void mq_cleanup(QGuestAllocator *alloc, QVirtQueue **vq)
+{
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        guest_free(alloc, vq[i]->desc);
+        g_free(vq[i]);
+    }
+}
+
+/* Add a one-sector request to @vq, without making it available */
+static uint64_t mq_add_request(QGuestAllocator *alloc, QVirtQueue *vq,
+                               uint32_t type, uint64_t sector,
+                               const char *str, uint32_t *free_head)
+{
+    QVirtioBlkReq req;
+    uint64_t req_addr;
+
+    req.type = type;
+    req.ioprio = 1;
+    req.sector = sector;
+    req.data = g_malloc0(512);
+    if (str) {
+        strcpy(req.data, str);
+    }
+
+    req_addr = virtio_blk_request(alloc, &req, 512);
+
+    g_free(req.data);
+
+    *free_head = qvirtqueue_add(vq, req_addr, 16, false, true);
+    qvirtqueue_add(vq, req_addr + 16, 512, type == QVIRTIO_BLK_T_IN, true);
+    qvirtqueue_add(vq, req_addr + 528, 1, true, false);
+
+    return req_addr;
+}
+
+/* Make @free_head available on @vq without notifying the device */
+static void mq_publish(QVirtQueue *vq, uint32_t free_head)
+{
+    uint16_t idx = readw(vq->avail + 2);
+
+    writew(vq->avail + 4 + 2 * (idx % vq->size), free_head);
+    writew(vq->avail + 2, idx + 1);
+}
+
+static void mq_wait_used(QVirtQueue *vq, uint16_t idx)
+{
+    gint64 start_time = g_get_monotonic_time();
+
+    while (readw(vq->used + 2) != idx) {
+        clock_step(100);
+        g_assert(g_get_monotonic_time() - start_time <=
+                 QVIRTIO_BLK_TIMEOUT_US);
+    }
+}
+
+/* Run one request on each queue.  Without KVM, ioeventfds are not
+ * dispatched, so the requests are queued before the first kick, which
+ * starts dataplane; starting dataplane kicks every queue's IOThread.
+ */
+static void mq_run(QGuestAllocator *alloc, QVirtioPCIDevice *dev,
+                   QVirtQueue **vq, uint32_t type, const uint64_t *sector,
+                   const char *const *str, uint64_t *req_addr)
+{
+    uint32_t free_head[2];
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        req_addr[i] = mq_add_request(alloc, vq[i], type, sector[i], str[i],
+                                     &free_head[i]);
+    }
+    mq_publish(vq[1], free_head[1]);
+    qvirtqueue_kick(&qvirtio_pci, &dev->vdev, vq[0], free_head[0]);
+
+    for (i = 0; i < 2; i++) {
+        mq_wait_used(vq[i], 1);
+        g_assert_cmpint(readb(req_addr[i] + 528), ==, 0);
+    }
+}
+
+static void pci_mq_iothreads(void)
+{
+    static const char *const str[] = { "TEST0", "TEST1" };
+    static const char *const no_str[] = { NULL, NULL };
+    static const uint64_t write_sector[] = { 0, 8 };
+    static const uint64_t read_sector[] = { 8, 0 };
+    QVirtioPCIDevice *dev;
+    QPCIBus *bus;
+    QVirtQueue *vq[2];
+    QGuestAllocator *alloc;
+    uint64_t req_addr[2];
+    char *data;
+    int i;
+
+    bus = pci_test_start_opts("-object iothread,id=io0 "
+                              "-object iothread,id=io1 ",
+                              ",num-queues=2,iothread=io0,len-iothread-vq=2,"
+                              "iothread-vq[0]=io0,iothread-vq[1]=io1");
+    dev = virtio_blk_pci_init(bus, PCI_SLOT);
+    alloc = pc_alloc_init();
+
+    g_assert_cmpint(qvirtio_config_readw(&qvirtio_pci, &dev->vdev,
+                        (uint64_t)(uintptr_t)dev->addr +
+                        QVIRTIO_PCI_DEVICE_SPECIFIC_NO_MSIX +
+                        MQ_CONFIG_NUM_QUEUES), ==, 2);
+
+    /* Write a different sector through each queue... */
+    mq_init(dev, alloc, vq);
+    mq_run(alloc, dev, vq, QVIRTIO_BLK_T_OUT, write_sector, str, req_addr);
+    for (i = 0; i < 2; i++) {
+        guest_free(alloc, req_addr[i]);
+    }
+    mq_cleanup(alloc, vq);
+
+    /* ...and read it back through the other one.  Resetting the device
+     * stops dataplane, so that the next kick starts it again.
+     */
+    mq_init(dev, alloc, vq);
+    mq_run(alloc, dev, vq, QVIRTIO_BLK_T_IN, read_sector, no_str, req_addr);
+    data = g_malloc0(512);
+    for (i = 0; i < 2; i++) {
+        memread(req_addr[i] + 16, data, 512);
+        g_assert_cmpstr(data, ==, str[1 - i]);
+        guest_free(alloc, req_addr[i]);
+    }
+    g_free(data);
+    mq_cleanup(alloc, vq);
+
+    /* End test */
+    pc_alloc_uninit(alloc);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev);
+    qpci_free_pc(bus);
+    test_end();
+}
+
+/* Time how long the device takes to process batches of one-sector reads
+ * that are made available with a single notification, so that popping
+ * and completing the requests makes up most of the work.
+ */
+static void perf_pci_batch(gconstpointer opaque)
+{
+    unsigned int batch = GPOINTER_TO_UINT(opaque);
+    unsigned int i, j, rounds = 500;
+    QVirtioPCIDevice *dev;
+    QPCIBus *bus;
+    QVirtQueue *vq;
+    QGuestAllocator *alloc;
+    uint64_t *req_addr;
+    uint32_t features, free_head = 0;
+    uint16_t used_idx = 0;
+    double duration = 0;
+
+    bus = pci_test_start();
+    dev = virtio_blk_pci_init(bus, PCI_SLOT);
+    alloc = pc_alloc_init();
+
+    features = qvirtio_get_features(&qvirtio_pci, &dev->vdev);
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                    QVIRTIO_F_RING_INDIRECT_DESC | QVIRTIO_F_RING_EVENT_IDX |
+                            QVIRTIO_BLK_F_SCSI);
+    qvirtio_set_features(&qvirtio_pci, &dev->vdev, features);
+    vq = qvirtqueue_setup(&qvirtio_pci, &dev->vdev, alloc, 0);
+    qvirtio_set_driver_ok(&qvirtio_pci, &dev->vdev);
+
+    /* Each request takes three descriptors */
+    g_assert_cmpint(batch * 3, <=, vq->size);
+    req_addr = g_new(uint64_t, batch);
+
+    for (i = 0; i < rounds; i++) {
+        /* The previous batch has completed, reuse its descriptors */
+        vq->free_head = 0;
+        vq->num_free = vq->size;
+        for (j = 0; j < batch; j++) {
+            req_addr[j] = mq_add_request(alloc, vq, QVIRTIO_BLK_T_IN, j * 8,
+                                         NULL, &free_head);
+            if (j < batch - 1) {
+                mq_publish(vq, free_head);
+            }
+        }
+
+        g_test_timer_start();
+        qvirtqueue_kick(&qvirtio_pci, &dev->vdev, vq, free_head);
+        used_idx += batch;
+        mq_wait_used(vq, used_idx);
+        duration += g_test_timer_elapsed();
+
+        for (j = 0; j < batch; j++) {
+            g_assert_cmpint(readb(req_addr[j] + 528), ==, 0);
+            guest_free(alloc, req_addr[j]);
+        }
+    }
+
+    g_test_message("virtio-blk batches of %u requests: %u batches %f s, "
+                   "%luns per request",
+                   batch, rounds, duration,
+                   (unsigned long)(1000000000.0 * duration / rounds / batch));
+
+    /* End test */
+    g_free(req_addr);
+    guest_free(alloc, vq->desc);
+    g_free(vq);
+    pc_alloc_uninit(alloc);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev);
+    qpci_free_pc(bus);
+    test_end();
+}
+
 static void mmio_basic(void)
 {
     QVirtioMMIODevice *dev;
@@ -779,6 +1019,15 @@ int main(int argc, char **argv)
         qtest_add_func("/virtio/blk/pci/msix", pci_msix);
         qtest_add_func("/virtio/blk/pci/idx", pci_idx);
         qtest_add_func("/virtio/blk/pci/hotplug", pci_hotplug);
+        qtest_add_func("/virtio/blk/pci/mq-iothreads", pci_mq_iothreads);
+        if (g_test_perf()) {
+            qtest_add_data_func("/perf/virtio/blk/pci/batch/1",
+                                GUINT_TO_POINTER(1), perf_pci_batch);
+            qtest_add_data_func("/perf/virtio/blk/pci/batch/8",
+                                GUINT_TO_POINTER(8), perf_pci_batch);
+            qtest_add_data_func("/perf/virtio/blk/pci/batch/32",
+                                GUINT_TO_POINTER(32), perf_pci_batch);
+        }
     } else if (strcmp(arch, "arm") == 0) {
         qtest_add_func("/virtio/blk/mmio/basic", mmio_basic);
     }
@@ -9,35 +9,699 @@
 
 #include <glib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
 #include "libqtest.h"
 #include "qemu/osdep.h"
+#include "qemu/bswap.h"
 #include "libqos/pci.h"
+#include "libqos/virtio.h"
+#include "libqos/virtio-pci.h"
+#include "libqos/pci-pc.h"
+#include "libqos/malloc.h"
+#include "libqos/malloc-pc.h"
 
 #define PCI_SLOT_HP             0x06
+#define PCI_SLOT                0x04
+#define PCI_FN                  0x00
+
+#define QVIRTIO_NET_F_CSUM              0x00000001
+#define QVIRTIO_NET_F_GUEST_CSUM        0x00000002
+#define QVIRTIO_NET_F_GUEST_TSO4        0x00000080
+#define QVIRTIO_NET_F_GUEST_TSO6        0x00000100
+#define QVIRTIO_NET_F_HOST_TSO4         0x00000800
+#define QVIRTIO_NET_F_HOST_TSO6         0x00001000
+
+#define QVIRTIO_NET_HDR_F_NEEDS_CSUM    1
+#define QVIRTIO_NET_HDR_GSO_NONE        0
+#define QVIRTIO_NET_HDR_GSO_TCPV4       1
+#define QVIRTIO_NET_HDR_GSO_TCPV6       4
+#define QVIRTIO_NET_HDR_GSO_ECN         0x80
+
+#define QVIRTIO_NET_TIMEOUT_US  (30 * 1000 * 1000)
+
+#define ETH_HLEN                14
+#define IP_HLEN                 20
+#define IP6_HLEN                40
+#define TCP_HLEN                20
+#define IP_PROTO_TCP            6
+
+/* Without VIRTIO_NET_F_MRG_RXBUF, every buffer takes a whole frame */
+#define VNET_HDR_SIZE           10
+#define RX_BUF_SIZE             (VNET_HDR_SIZE + ETH_HLEN + 65535)
+#define RX_BUFS                 8
+
+#define TCP_FLAG_FIN            0x01
+#define TCP_FLAG_PSH            0x08
+#define TCP_FLAG_ACK            0x10
+#define TCP_FLAG_CWR            0x80
 
-/* Tests only initialization so far. TODO: Replace with functional tests */
 static void pci_nop(void)
 {
+    qtest_start("-device virtio-net-pci");
+    qtest_end();
 }
 
 static void hotplug(void)
 {
+    qtest_start("-device virtio-net-pci");
     qpci_plug_device_test("virtio-net-pci", "net1", PCI_SLOT_HP, NULL);
     qpci_unplug_acpi_device_test("net1", PCI_SLOT_HP);
+    qtest_end();
 }
 
-int main(int argc, char **argv)
+/* Add a device with the HMP command, which keeps the order of the options
+ * as required by array properties, and check the error it prints */
+static void device_add_expect(const char *opts, const char *error)
 {
-    int ret;
+    QDict *response;
+    const char *output;
+    char *cmd;
 
-    g_test_init(&argc, &argv, NULL);
-    qtest_add_func("/virtio/net/pci/nop", pci_nop);
-    qtest_add_func("/virtio/net/pci/hotplug", hotplug);
+    cmd = g_strdup_printf("device_add virtio-net-pci,%s", opts);
+    response = qmp("{'execute': 'human-monitor-command',"
+                   " 'arguments': { 'command-line': %s } }", cmd);
+    g_assert(response);
+    output = qdict_get_try_str(response, "return");
+    g_assert(output);
+    if (error) {
+        g_assert(strstr(output, error));
+    } else {
+        g_assert_cmpstr(output, ==, "");
+    }
+    QDECREF(response);
+    g_free(cmd);
+}
 
-    qtest_start("-device virtio-net-pci");
-    ret = g_test_run();
+static void check_iothread_link(const char *id, const char *iothread)
+{
+    QDict *response;
+    char *path, *expected;
+
+    path = g_strdup_printf("/machine/peripheral/%s", id);
+    expected = g_strdup_printf("/objects/%s", iothread);
+    response = qmp("{'execute': 'qom-get',"
+                   " 'arguments': { 'path': %s, 'property': 'iothread' } }",
+                   path);
+    g_assert(response);
+    g_assert_cmpstr(qdict_get_try_str(response, "return"), ==, expected);
+    QDECREF(response);
+    g_free(expected);
+    g_free(path);
+}
+
+static void iothread(void)
+{
+    qtest_start("-object iothread,id=iothread0 "
+                "-object iothread,id=iothread1 "
+                "-device virtio-net-pci,id=net0,iothread=iothread0,"
+                "len-iothread-queue=1,iothread-queue[0]=iothread1");
+    check_iothread_link("net0", "iothread0");
+
+    /* Hotplugged devices get the same checks */
+    device_add_expect("id=net1,addr=0x7,iothread=iothread1", NULL);
+    check_iothread_link("net1", "iothread1");
+    qtest_end();
+}
+
+static void iothread_invalid(void)
+{
+    qtest_start("-object iothread,id=iothread0");
+
+    device_add_expect("id=net1,len-iothread-queue=1,"
+                      "iothread-queue[0]=iothread0",
+                      "iothread-queue requires the iothread property");
+    device_add_expect("id=net2,iothread=iothread0,len-iothread-queue=1,"
+                      "iothread-queue[0]=nonexistent",
+                      "IOThread 'nonexistent' not found");
+    device_add_expect("id=net3,iothread=iothread0,len-iothread-queue=2,"
+                      "iothread-queue[0]=iothread0,"
+                      "iothread-queue[1]=iothread0",
+                      "iothread-queue has 2 entries");
+    device_add_expect("id=net4,iothread=iothread0,tx=timer",
+                      "iothread is incompatible with tx=timer");
+    device_add_expect("id=net5,iothread=nonexistent",
+                      "nonexistent");
+    qtest_end();
+}
+
+/* Functional tests use a socket netdev, so that the test can send and
+ * receive frames itself.  The peer has no vnet header, which means
+ * checksum and TSO offloads are done by the device model.
+ */
+typedef struct TestNet {
+    QPCIBus *bus;
+    QVirtioPCIDevice *dev;
+    QGuestAllocator *alloc;
+    QVirtQueue *rx;
+    QVirtQueue *tx;
+    uint64_t *rx_addr;          /* buffer of each rx descriptor */
+    uint16_t rx_used;
+    uint16_t tx_used;
+    int fd;
+} TestNet;
+
+static void net_start(TestNet *t, const char *opts, uint32_t features)
+{
+    struct timeval timeout = { .tv_sec = QVIRTIO_NET_TIMEOUT_US / 1000000 };
+    uint32_t host_features;
+    char *cmdline;
+    int sv[2];
+    int i;
+
+    g_assert_cmpint(socketpair(PF_UNIX, SOCK_STREAM, 0, sv), ==, 0);
+    g_assert_cmpint(setsockopt(sv[0], SOL_SOCKET, SO_RCVTIMEO,
+                               &timeout, sizeof(timeout)), ==, 0);
+    cmdline = g_strdup_printf("-netdev socket,id=hs0,fd=%d "
+                              "-device virtio-net-pci,netdev=hs0,"
+                              "addr=%x.%x,%s",
+                              sv[1], PCI_SLOT, PCI_FN, opts);
+    qtest_start(cmdline);
+    g_free(cmdline);
+    close(sv[1]);
+    t->fd = sv[0];
+
+    t->bus = qpci_init_pc();
+    t->dev = qvirtio_pci_device_find(t->bus, QVIRTIO_NET_DEVICE_ID);
+    g_assert(t->dev != NULL);
+    qvirtio_pci_device_enable(t->dev);
+    qvirtio_reset(&qvirtio_pci, &t->dev->vdev);
+    qvirtio_set_acknowledge(&qvirtio_pci, &t->dev->vdev);
+    qvirtio_set_driver(&qvirtio_pci, &t->dev->vdev);
+
+    t->alloc = pc_alloc_init();
+    t->rx = qvirtqueue_setup(&qvirtio_pci, &t->dev->vdev, t->alloc, 0);
+    t->tx = qvirtqueue_setup(&qvirtio_pci, &t->dev->vdev, t->alloc, 1);
+
+    host_features = qvirtio_get_features(&qvirtio_pci, &t->dev->vdev);
+    g_assert_cmphex(host_features & features, ==, features);
+    qvirtio_set_features(&qvirtio_pci, &t->dev->vdev, features);
+    qvirtio_set_driver_ok(&qvirtio_pci, &t->dev->vdev);
+
+    t->rx_addr = g_new0(uint64_t, t->rx->size);
+    t->rx_used = t->tx_used = 0;
+    for (i = 0; i < RX_BUFS; i++) {
+        uint64_t addr = guest_alloc(t->alloc, RX_BUF_SIZE);
+        uint32_t head = qvirtqueue_add(t->rx, addr, RX_BUF_SIZE, true, false);
+
+        t->rx_addr[head] = addr;
+        qvirtqueue_kick(&qvirtio_pci, &t->dev->vdev, t->rx, head);
+    }
+}
 
+static void net_end(TestNet *t)
+{
+    close(t->fd);
+    g_free(t->rx_addr);
+    g_free(t->rx);
+    g_free(t->tx);
+    pc_alloc_uninit(t->alloc);
+    qvirtio_pci_device_disable(t->dev);
+    g_free(t->dev);
+    qpci_free_pc(t->bus);
     qtest_end();
+}
+
+/* Wait until the device has used element @idx of @vq and return its
+ * length */
+static uint32_t net_wait_used(QVirtQueue *vq, uint16_t idx, uint32_t *id)
+{
+    gint64 start_time = g_get_monotonic_time();
+    uint64_t elem;
+
+    while (readw(vq->used + 2) == idx) {
+        clock_step(100);
+        g_assert(g_get_monotonic_time() - start_time <=
+                 QVIRTIO_NET_TIMEOUT_US);
+    }
+    elem = vq->used + 4 + sizeof(QVRingUsedElem) * (idx % vq->size);
+    *id = readl(elem);
+    return readl(elem + 4);
+}
+
+/* Frames on a stream socket netdev are preceded by their length */
+static void burst_add(GByteArray *burst, const uint8_t *frame, size_t len)
+{
+    uint32_t be_len = cpu_to_be32(len);
+
+    g_byte_array_append(burst, (uint8_t *)&be_len, sizeof(be_len));
+    g_byte_array_append(burst, frame, len);
+}
+
+/* Send all frames with one write, so that the device gets them at once */
+static void net_send(TestNet *t, GByteArray *burst)
+{
+    size_t off;
+    ssize_t ret;
+
+    for (off = 0; off < burst->len; off += ret) {
+        ret = write(t->fd, burst->data + off, burst->len - off);
+        g_assert_cmpint(ret, >, 0);
+    }
+    g_byte_array_set_size(burst, 0);
+}
+
+/* Wait for the next frame passed to the guest; returns its length */
+static size_t net_rx(TestNet *t, uint8_t *hdr, uint8_t *frame)
+{
+    uint32_t id, len;
+
+    len = net_wait_used(t->rx, t->rx_used++, &id);
+    g_assert_cmpint(len, >, VNET_HDR_SIZE);
+    memread(t->rx_addr[id], hdr, VNET_HDR_SIZE);
+    memread(t->rx_addr[id] + VNET_HDR_SIZE, frame, len - VNET_HDR_SIZE);
+    return len - VNET_HDR_SIZE;
+}
+
+static uint32_t csum_add(uint32_t sum, const uint8_t *buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        sum += i & 1 ? buf[i] : buf[i] << 8;
+    }
+    return sum;
+}
+
+static uint16_t csum_finish(uint32_t sum)
+{
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return ~sum;
+}
+
+static size_t tcp_offset(bool ipv6)
+{
+    return ETH_HLEN + (ipv6 ? IP6_HLEN : IP_HLEN);
+}
+
+static uint32_t tcp_pseudo_sum(const uint8_t *frame, bool ipv6, size_t l4_len)
+{
+    const uint8_t *ip = frame + ETH_HLEN;
+    uint32_t sum = IP_PROTO_TCP + l4_len;
+
+    return ipv6 ? csum_add(sum, ip + 8, 32) : csum_add(sum, ip + 12, 8);
+}
+
+static void check_tcp_csum(const uint8_t *frame, size_t len, bool ipv6)
+{
+    size_t l4 = tcp_offset(ipv6);
+
+    if (!ipv6) {
+        g_assert_cmphex(csum_finish(csum_add(0, frame + ETH_HLEN, IP_HLEN)),
+                        ==, 0);
+    }
+    g_assert_cmphex(csum_finish(csum_add(tcp_pseudo_sum(frame, ipv6, len - l4),
+                                         frame + l4, len - l4)), ==, 0);
+}
+
+/* Build a TCP segment with correct checksums.  The payload bytes are the
+ * low bits of their sequence number, so that they can be checked after
+ * coalescing or segmentation. */
+static size_t build_tcp(uint8_t *frame, bool ipv6, uint16_t port,
+                        uint32_t seq, uint8_t flags, size_t payload_len)
+{
+    static const uint8_t macs[] = {
+        0x52, 0x54, 0x00, 0x12, 0x34, 0x56, 0x52, 0x54, 0x00, 0x12, 0x34, 0x57
+    };
+    static const uint8_t ip4_addrs[] = { 10, 0, 2, 2, 10, 0, 2, 15 };
+    static const uint8_t ip6_addrs[] = {
+        0xfe, 0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x01,
+        0xfe, 0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x02
+    };
+    size_t l4 = tcp_offset(ipv6);
+    size_t l4_len = TCP_HLEN + payload_len;
+    uint8_t *ip = frame + ETH_HLEN;
+    uint8_t *tcp = frame + l4;
+    size_t i;
+
+    memset(frame, 0, l4 + TCP_HLEN);
+    memcpy(frame, macs, sizeof(macs));
+    if (ipv6) {
+        stw_be_p(frame + 12, 0x86dd);
+        ip[0] = 0x60;
+        stw_be_p(ip + 4, l4_len);
+        ip[6] = IP_PROTO_TCP;
+        ip[7] = 64;
+        memcpy(ip + 8, ip6_addrs, sizeof(ip6_addrs));
+    } else {
+        stw_be_p(frame + 12, 0x0800);
+        ip[0] = 0x45;
+        stw_be_p(ip + 2, IP_HLEN + l4_len);
+        stw_be_p(ip + 4, seq);
+        ip[8] = 64;
+        ip[9] = IP_PROTO_TCP;
+        memcpy(ip + 12, ip4_addrs, sizeof(ip4_addrs));
+        stw_be_p(ip + 10, csum_finish(csum_add(0, ip, IP_HLEN)));
+    }
+
+    stw_be_p(tcp, port);
+    stw_be_p(tcp + 2, 80);
+    stl_be_p(tcp + 4, seq);
+    stl_be_p(tcp + 8, 1);
+    tcp[12] = (TCP_HLEN / 4) << 4;
+    tcp[13] = flags;
+    stw_be_p(tcp + 14, 0x1000);
+    for (i = 0; i < payload_len; i++) {
+        tcp[TCP_HLEN + i] = seq + i;
+    }
+    stw_be_p(tcp + 16, csum_finish(csum_add(tcp_pseudo_sum(frame, ipv6,
+                                                           l4_len),
+                                            tcp, l4_len)));
+    return l4 + l4_len;
+}
+
+static void check_payload(const uint8_t *payload, uint32_t seq, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        g_assert_cmphex(payload[i], ==, (uint8_t)(seq + i));
+    }
+}
+
+static void burst_add_tcp(GByteArray *burst, bool ipv6, uint16_t port,
+                          uint32_t seq, uint8_t flags, size_t payload_len)
+{
+    uint8_t *frame = g_malloc(RX_BUF_SIZE);
+
+    burst_add(burst, frame,
+              build_tcp(frame, ipv6, port, seq, flags, payload_len));
+    g_free(frame);
+}
+
+/* Expect a segment that was passed to the guest unchanged */
+static void expect_plain(TestNet *t, bool ipv6, uint16_t port, uint32_t seq,
+                         size_t payload_len)
+{
+    uint8_t *frame = g_malloc(RX_BUF_SIZE);
+    uint8_t *expected = g_malloc(RX_BUF_SIZE);
+    uint8_t hdr[VNET_HDR_SIZE];
+    size_t len;
+
+    len = build_tcp(expected, ipv6, port, seq, TCP_FLAG_ACK, payload_len);
+    g_assert_cmpint(net_rx(t, hdr, frame), ==, len);
+    g_assert_cmphex(hdr[0], ==, 0);
+    g_assert_cmphex(hdr[1], ==, QVIRTIO_NET_HDR_GSO_NONE);
+    g_assert(memcmp(frame, expected, len) == 0);
+    g_free(expected);
+    g_free(frame);
+}
+
+/* Expect coalesced segments, passed to the guest as a TSO frame */
+static void expect_coalesced(TestNet *t, bool ipv6, uint32_t seq,
+                             size_t payload_len, uint16_t mss, uint8_t flags)
+{
+    uint8_t *frame = g_malloc(RX_BUF_SIZE);
+    uint8_t hdr[VNET_HDR_SIZE];
+    size_t l4 = tcp_offset(ipv6);
+    size_t len, csum_start, csum_off;
+
+    len = net_rx(t, hdr, frame);
+    g_assert_cmpint(len, ==, l4 + TCP_HLEN + payload_len);
+    g_assert_cmphex(hdr[0], ==, QVIRTIO_NET_HDR_F_NEEDS_CSUM);
+    g_assert_cmphex(hdr[1], ==, ipv6 ? QVIRTIO_NET_HDR_GSO_TCPV6 :
+                                       QVIRTIO_NET_HDR_GSO_TCPV4);
+    g_assert_cmpint(lduw_le_p(hdr + 2), ==, l4 + TCP_HLEN);
+    g_assert_cmpint(lduw_le_p(hdr + 4), ==, mss);
+    csum_start = lduw_le_p(hdr + 6);
+    csum_off = lduw_le_p(hdr + 8);
+    g_assert_cmpint(csum_start, ==, l4);
+    g_assert_cmpint(csum_off, ==, 16);
+
+    if (ipv6) {
+        g_assert_cmpint(lduw_be_p(frame + ETH_HLEN + 4), ==,
+                        TCP_HLEN + payload_len);
+    } else {
+        g_assert_cmpint(lduw_be_p(frame + ETH_HLEN + 2), ==,
+                        IP_HLEN + TCP_HLEN + payload_len);
+    }
+    g_assert_cmphex(ldl_be_p(frame + l4 + 4), ==, seq);
+    g_assert_cmphex(frame[l4 + 13], ==, flags);
+    check_payload(frame + l4 + TCP_HLEN, seq, payload_len);
+
+    /* Finish the checksum as the guest would */
+    stw_be_p(frame + csum_start + csum_off,
+             csum_finish(csum_add(0, frame + csum_start, len - csum_start)));
+    check_tcp_csum(frame, len, ipv6);
+    g_free(frame);
+}
+
+#define RSC_FEATURES    (QVIRTIO_NET_F_GUEST_CSUM | QVIRTIO_NET_F_GUEST_TSO4 | \
+                         QVIRTIO_NET_F_GUEST_TSO6)
+
+static void rx_coalesce(void)
+{
+    GByteArray *burst = g_byte_array_new();
+    uint32_t seq = 0x7ffffc00;
+    TestNet t;
+    int ipv6;
+
+    net_start(&t, "rx-coalesce=on", RSC_FEATURES);
+    for (ipv6 = 0; ipv6 <= 1; ipv6++) {
+        /* A short segment ends the run and is merged as well */
+        burst_add_tcp(burst, ipv6, 1000, seq, TCP_FLAG_ACK, 1000);
+        burst_add_tcp(burst, ipv6, 1000, seq + 1000, TCP_FLAG_ACK, 1000);
+        burst_add_tcp(burst, ipv6, 1000, seq + 2000, TCP_FLAG_ACK, 500);
+        net_send(&t, burst);
+        expect_coalesced(&t, ipv6, seq, 2500, 1000,
+                         TCP_FLAG_ACK | TCP_FLAG_PSH);
+
+        /* A full-sized segment is held until the burst is over */
+        burst_add_tcp(burst, ipv6, 1000, seq + 2500, TCP_FLAG_ACK, 1000);
+        net_send(&t, burst);
+        expect_plain(&t, ipv6, 1000, seq + 2500, 1000);
+    }
+    g_byte_array_free(burst, true);
+    net_end(&t);
+}
+
+static void rx_coalesce_flows(void)
+{
+    GByteArray *burst = g_byte_array_new();
+    uint8_t *frame = g_malloc(RX_BUF_SIZE);
+    uint8_t hdr[VNET_HDR_SIZE];
+    uint32_t seq = 0x1000;
+    TestNet t;
+    size_t len;
+    int ipv6;
+
+    net_start(&t, "rx-coalesce=on", RSC_FEATURES);
+    for (ipv6 = 0; ipv6 <= 1; ipv6++) {
+        /* Another flow and a segment with a bad checksum each pass on
+         * what was held before them */
+        burst_add_tcp(burst, ipv6, 1000, seq, TCP_FLAG_ACK, 1000);
+        burst_add_tcp(burst, ipv6, 1000, seq + 1000, TCP_FLAG_ACK, 1000);
+        burst_add_tcp(burst, ipv6, 1001, seq, TCP_FLAG_ACK, 1000);
+        len = build_tcp(frame, ipv6, 1000, seq + 2000, TCP_FLAG_ACK, 1000);
+        frame[len - 1] ^= 0xff;
+        burst_add(burst, frame, len);
+        net_send(&t, burst);
+
+        expect_coalesced(&t, ipv6, seq, 2000, 1000, TCP_FLAG_ACK);
+        expect_plain(&t, ipv6, 1001, seq, 1000);
+        len = net_rx(&t, hdr, frame);
+        g_assert_cmpint(len, ==, tcp_offset(ipv6) + TCP_HLEN + 1000);
+        g_assert_cmphex(hdr[1], ==, QVIRTIO_NET_HDR_GSO_NONE);
+        g_assert_cmphex(frame[len - 1], ==, (uint8_t)(seq + 2999) ^ 0xff);
+    }
+    g_free(frame);
+    g_byte_array_free(burst, true);
+    net_end(&t);
+}
+
+static void rx_coalesce_large(void)
+{
+    GByteArray *burst = g_byte_array_new();
+    size_t payload_len = 65535 - IP_HLEN - TCP_HLEN;
+    TestNet t;
+
+    /* The largest IPv4 segment is bigger than the coalescing buffer */
+    net_start(&t, "rx-coalesce=on", RSC_FEATURES);
+    burst_add_tcp(burst, false, 1000, 0, TCP_FLAG_ACK, payload_len);
+    net_send(&t, burst);
+    expect_plain(&t, false, 1000, 0, payload_len);
+    g_byte_array_free(burst, true);
+    net_end(&t);
+}
+
+/* Queue @frame for transmission with a virtio-net header asking for
+ * checksum offload, and TSO if @gso_type is set.  Returns the guest
+ * address of the header. */
+static uint64_t net_tx(TestNet *t, const uint8_t *frame, size_t len,
+                       bool ipv6, uint8_t gso_type, uint16_t gso_size)
+{
+    uint64_t addr = guest_alloc(t->alloc, VNET_HDR_SIZE + len);
+    uint8_t hdr[VNET_HDR_SIZE];
+    uint32_t head;
+
+    hdr[0] = QVIRTIO_NET_HDR_F_NEEDS_CSUM;
+    hdr[1] = gso_type;
+    stw_le_p(hdr + 2, tcp_offset(ipv6) + TCP_HLEN);
+    stw_le_p(hdr + 4, gso_size);
+    stw_le_p(hdr + 6, tcp_offset(ipv6));
+    stw_le_p(hdr + 8, 16);
+    memwrite(addr, hdr, VNET_HDR_SIZE);
+    memwrite(addr + VNET_HDR_SIZE, frame, len);
+
+    head = qvirtqueue_add(t->tx, addr, VNET_HDR_SIZE + len, false, false);
+    qvirtqueue_kick(&qvirtio_pci, &t->dev->vdev, t->tx, head);
+    return addr;
+}
+
+static void sock_read(int fd, void *buf, size_t len)
+{
+    size_t off;
+    ssize_t ret;
+
+    for (off = 0; off < len; off += ret) {
+        ret = read(fd, (uint8_t *)buf + off, len - off);
+        g_assert_cmpint(ret, >, 0);
+    }
+}
+
+/* Read the next frame the device sent; returns its length */
+static size_t net_recv(TestNet *t, uint8_t *frame)
+{
+    uint32_t len;
+
+    sock_read(t->fd, &len, sizeof(len));
+    len = be32_to_cpu(len);
+    g_assert_cmpint(len, <=, RX_BUF_SIZE);
+    sock_read(t->fd, frame, len);
+    return len;
+}
+
+static void net_wait_tx(TestNet *t)
+{
+    uint32_t id;
+
+    net_wait_used(t->tx, t->tx_used++, &id);
+}
+
+/* Leave the pseudo-header sum in the TCP checksum field, like a guest
+ * using checksum offload does */
+static void tcp_partial_csum(uint8_t *frame, size_t len, bool ipv6)
+{
+    size_t l4 = tcp_offset(ipv6);
+
+    stw_be_p(frame + l4 + 16,
+             ~csum_finish(tcp_pseudo_sum(frame, ipv6, len - l4)));
+}
+
+#define TX_FEATURES     (QVIRTIO_NET_F_CSUM | QVIRTIO_NET_F_HOST_TSO4 | \
+                         QVIRTIO_NET_F_HOST_TSO6)
+
+static void tx_segment(void)
+{
+    uint8_t *frame = g_malloc(RX_BUF_SIZE);
+    uint8_t *seg = g_malloc(RX_BUF_SIZE);
+    uint32_t seq = 0xfffff800;
+    size_t payload_len = 3500, off, chunk, len, l4;
+    uint8_t flags;
+    TestNet t;
+    int ipv6;
+
+    net_start(&t, "tx-offload=on", TX_FEATURES);
+    for (ipv6 = 0; ipv6 <= 1; ipv6++) {
+        l4 = tcp_offset(ipv6);
+        len = build_tcp(frame, ipv6, 1000, seq,
+                        TCP_FLAG_ACK | TCP_FLAG_PSH | TCP_FLAG_FIN |
+                        TCP_FLAG_CWR, payload_len);
+        tcp_partial_csum(frame, len, ipv6);
+        net_tx(&t, frame, len, ipv6,
+               (ipv6 ? QVIRTIO_NET_HDR_GSO_TCPV6 : QVIRTIO_NET_HDR_GSO_TCPV4) |
+               QVIRTIO_NET_HDR_GSO_ECN, 1000);
+
+        for (off = 0; off < payload_len; off += chunk) {
+            chunk = MIN(1000, payload_len - off);
+            g_assert_cmpint(net_recv(&t, seg), ==, l4 + TCP_HLEN + chunk);
+
+            /* Addresses and ports are copied from the TSO frame */
+            g_assert(memcmp(seg, frame, ETH_HLEN) == 0);
+            if (ipv6) {
+                g_assert(memcmp(seg + ETH_HLEN + 8, frame + ETH_HLEN + 8,
+                                32) == 0);
+                g_assert_cmpint(lduw_be_p(seg + ETH_HLEN + 4), ==,
+                                TCP_HLEN + chunk);
+            } else {
+                g_assert(memcmp(seg + ETH_HLEN + 12, frame + ETH_HLEN + 12,
+                                8) == 0);
+                g_assert_cmpint(lduw_be_p(seg + ETH_HLEN + 2), ==,
+                                IP_HLEN + TCP_HLEN + chunk);
+                g_assert_cmphex(lduw_be_p(seg + ETH_HLEN + 4), ==,
+                                (uint16_t)(seq + off / 1000));
+            }
+            g_assert(memcmp(seg + l4, frame + l4, 4) == 0);
+            g_assert_cmphex(ldl_be_p(seg + l4 + 4), ==, seq + off);
+
+            /* CWR only on the first segment, FIN and PSH on the last */
+            flags = TCP_FLAG_ACK;
+            if (off == 0) {
+                flags |= TCP_FLAG_CWR;
+            }
+            if (off + chunk == payload_len) {
+                flags |= TCP_FLAG_PSH | TCP_FLAG_FIN;
+            }
+            g_assert_cmphex(seg[l4 + 13], ==, flags);
+
+            check_payload(seg + l4 + TCP_HLEN, seq + off, chunk);
+            check_tcp_csum(seg, l4 + TCP_HLEN + chunk, ipv6);
+        }
+        net_wait_tx(&t);
+    }
+    g_free(seg);
+    g_free(frame);
+    net_end(&t);
+}
+
+static void tx_csum(void)
+{
+    uint8_t *frame = g_malloc(RX_BUF_SIZE);
+    uint8_t *sent = g_malloc(RX_BUF_SIZE);
+    uint64_t addr;
+    size_t len, l4;
+    TestNet t;
+    int ipv6;
+
+    net_start(&t, "tx-offload=on", TX_FEATURES);
+    for (ipv6 = 0; ipv6 <= 1; ipv6++) {
+        /* An odd length checks the padding of the last byte */
+        l4 = tcp_offset(ipv6);
+        len = build_tcp(frame, ipv6, 1000, 0x1234, TCP_FLAG_ACK, 1001);
+        tcp_partial_csum(frame, len, ipv6);
+        addr = net_tx(&t, frame, len, ipv6, QVIRTIO_NET_HDR_GSO_NONE, 0);
+
+        g_assert_cmpint(net_recv(&t, sent), ==, len);
+        g_assert(memcmp(sent, frame, l4 + 16) == 0);
+        g_assert(memcmp(sent + l4 + 18, frame + l4 + 18,
+                        len - l4 - 18) == 0);
+        check_tcp_csum(sent, len, ipv6);
+        net_wait_tx(&t);
+
+        /* The device only reads the guest's buffer */
+        memread(addr + VNET_HDR_SIZE, sent, len);
+        g_assert(memcmp(sent, frame, len) == 0);
+    }
+    g_free(sent);
+    g_free(frame);
+    net_end(&t);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    qtest_add_func("/virtio/net/pci/nop", pci_nop);
+    qtest_add_func("/virtio/net/pci/hotplug", hotplug);
+    qtest_add_func("/virtio/net/pci/iothread", iothread);
+    qtest_add_func("/virtio/net/pci/iothread-invalid", iothread_invalid);
+    qtest_add_func("/virtio/net/pci/rx-coalesce", rx_coalesce);
+    qtest_add_func("/virtio/net/pci/rx-coalesce-flows", rx_coalesce_flows);
+    qtest_add_func("/virtio/net/pci/rx-coalesce-large", rx_coalesce_large);
+    qtest_add_func("/virtio/net/pci/tx-segment", tx_segment);
+    qtest_add_func("/virtio/net/pci/tx-csum", tx_csum);
 
-    return ret;
+    return g_test_run();
 }